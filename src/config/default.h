@@ -40,9 +40,78 @@
  * 
  * 0x10 => RIPEMD_160
  * 0x20 => SHA1
+ * 0x30 => BLAKE3
+ * 0x40 => XXH3_128
  * 
  * Valid algorithm constants are defined in synctory.h
  */
 #define _SYNCTORY_DEFAULT_CHECKSUM       0x10
 
+
+/*
+ * Default Number of Threads
+ * 
+ * Relevant for diff creation
+ */
+#define _SYNCTORY_DEFAULT_THREADS        1U
+
+
+/*
+ * Default Memory Budget (in bytes, 0 => unlimited)
+ * 
+ * Relevant for diff creation
+ */
+#define _SYNCTORY_DEFAULT_MEMORY_BUDGET  0U
+
+
+/*
+ * Default Write Buffer Size (in bytes)
+ * 
+ * Relevant for fingerprint and diff creation
+ */
+#define _SYNCTORY_DEFAULT_WRITE_BUFFER   0x40000U
+
+
+/*
+ * Default Diff Format
+ * 
+ * Relevant for diff creation
+ * 
+ * 0x20 => plain
+ * 0x21 => compact
+ * 
+ * Valid format constants are defined in synctory.h
+ */
+#define _SYNCTORY_DEFAULT_DIFF_FORMAT    0x20
+
+
+/*
+ * Default Codec for Raw Data
+ * 
+ * Relevant for diff creation
+ * 
+ * 0x00 => none
+ * 0x01 => zlib
+ * 0x02 => lzma
+ * 
+ * Valid codec constants are defined in synctory.h
+ */
+#define _SYNCTORY_DEFAULT_CODEC          0x00
+
+
+/*
+ * Default Compression Level (0 - 9)
+ * 
+ * Relevant for diff creation
+ */
+#define _SYNCTORY_DEFAULT_CODEC_LEVEL    6U
+
+
+/*
+ * Default Table of Contents Stride (in bytes, 0 => no table of contents)
+ * 
+ * Relevant for diff creation
+ */
+#define _SYNCTORY_DEFAULT_TOC_STRIDE     0U
+
 #endif /* __LIBSYNCTORY_DEFAULT_H */
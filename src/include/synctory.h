@@ -30,14 +30,91 @@
  * verification purposes. Since the strong checksum also becomes part of the
  * fingerprint, it is recommended to find a balance between collision safety,
  * runtime performance and fingerprint size.
+ * 
+ * BLAKE3 is a cryptographic hash considerably faster than RIPEMD-160 and
+ * SHA-1. XXH3-128 is faster still, but not collision resistant against
+ * deliberately crafted input; it should only be used if the files to be
+ * synchronized come from a trusted source.
  */
 typedef enum
 {
     synctory_algo_rmd160      = 0x10,
-    synctory_algo_sha1        = 0x20
+    synctory_algo_sha1        = 0x20,
+    synctory_algo_blake3      = 0x30,
+    synctory_algo_xxh128      = 0x40
 } synctory_algo_t;
 
 
+/**
+ * Available diff formats
+ * 
+ * The plain format stores every record header with fixed size fields. The
+ * compact format stores lengths as variable-length integers and chunk
+ * indices as differences to the preceding match, which makes diffs with
+ * many records considerably smaller. synctory_synth reads both formats.
+ */
+typedef enum
+{
+    synctory_diff_plain       = 0x20,
+    synctory_diff_compact     = 0x21
+} synctory_diff_format_t;
+
+
+/**
+ * Available codecs for the raw data of diffs
+ * 
+ * Raw data (the bytes of the source file not found in the fingerprint) is
+ * compressed in independent frames of up to 1 MiB. Frames which do not get
+ * smaller are stored uncompressed. Codecs not compiled into libsynctory
+ * make diff and synth operations fail with ENOTSUP.
+ */
+typedef enum
+{
+    synctory_codec_none       = 0x00,
+    synctory_codec_zlib       = 0x01,
+    synctory_codec_lzma       = 0x02
+} synctory_codec_t;
+
+
+/**
+ * Statistics of the most recent diff operation
+ * 
+ * filter_hits          Number of source windows whose weak checksum passed the
+ *                      pre-filter and had to be looked up in the fingerprint
+ *                      index.
+ * 
+ * filter_misses        Number of source windows rejected by the pre-filter
+ *                      without touching the fingerprint index.
+ * 
+ * index_misses         Number of filter hits which turned out not to be part
+ *                      of the fingerprint index (false positives of the filter).
+ * 
+ * predict_hits         Number of windows following a match which matched the
+ *                      next chunk of the fingerprint, sparing the index lookup.
+ * 
+ * predict_misses       Number of windows following a match for which the
+ *                      prediction failed and the index had to be consulted.
+ * 
+ * source_passes        Number of times the source file has been scanned;
+ *                      only filled in by synctory_diff_auto.
+ * 
+ * peak_rss             Peak resident set size of the process in bytes, as
+ *                      reported by the operating system after the diff; only
+ *                      filled in by synctory_diff_auto, and 0 on platforms
+ *                      unable to report it.
+ */
+typedef struct
+{
+    uint64_t filter_hits;
+    uint64_t filter_misses;
+    uint64_t index_misses;
+    uint64_t predict_hits;
+    uint64_t predict_misses;
+    uint64_t source_passes;
+    uint64_t peak_rss;
+} synctory_stats_t;
+
+
 /**
  * The libsynctory context object
  * 
@@ -54,14 +131,70 @@ typedef enum
  *                      option has no effect, since the algorithm used to generate
  *                      a fingerprint is detected automatically from the fingerprint
  *                      header information.
+ * 
+ * threads              The number of threads synctory_fingerprint may use to
+ *                      checksum the chunks of the file, synctory_diff_ctx may use
+ *                      to scan the source file concurrently, and
+ *                      synctory_synth_parallel may use to write the
+ *                      synthesized file. 0 and 1 both
+ *                      select the single-threaded operation. The results do
+ *                      not depend on this option.
+ * 
+ * memory_budget        The amount of memory in bytes synctory_diff_auto may
+ *                      use for the fingerprint index and its buffers; 0 means
+ *                      no limit. With a budget set, the diff functions read
+ *                      source files instead of mapping them into memory.
+ * 
+ * write_buffer         The size in bytes of the buffer collecting the output
+ *                      of fingerprint and diff creation before it is written.
+ *                      Values below 4 KiB are raised to 4 KiB.
+ * 
+ * diff_format          The format of the diff files created; see
+ *                      synctory_diff_format_t. Defaults to synctory_diff_plain,
+ *                      which older versions of libsynctory can read as well.
+ * 
+ * codec                The codec compressing the raw data of diff files;
+ *                      see synctory_codec_t. Compressed diffs can only be
+ *                      read by versions of libsynctory supporting the codec.
+ * 
+ * codec_level          The compression level, from 0 (fastest) to 9 (best
+ *                      compression). Higher values are treated as 9.
+ * 
+ * toc_stride           If not 0, diff files end with a table of contents
+ *                      pointing into the diff about every toc_stride bytes
+ *                      of the synthesized file, which lets synctory_synth_range
+ *                      start close to the requested bytes instead of at the
+ *                      beginning of the diff. Diffs with a table of contents
+ *                      cannot be read by older versions of libsynctory.
+ * 
+ * stats                Statistics filled in by the diff operations; see
+ *                      synctory_stats_t. This member is not an option.
  */
 typedef struct
 {
     uint16_t chunk_size;
     synctory_algo_t checksum_algorithm;
+    unsigned int threads;
+    uint64_t memory_budget;
+    size_t write_buffer;
+    synctory_diff_format_t diff_format;
+    synctory_codec_t codec;
+    unsigned int codec_level;
+    uint64_t toc_stride;
+    synctory_stats_t stats;
 } synctory_ctx_t;
 
 
+/**
+ * A fingerprint loaded into memory
+ * 
+ * This opaque handle holds the lookup index built from a fingerprint file,
+ * so the fingerprint can be used for several diffs without being read again
+ * each time (see synctory_fpindex_load).
+ */
+typedef struct synctory_fpindex_s synctory_fpindex_t;
+
+
 /**
  * Get library version information.
  * 
@@ -145,6 +278,17 @@ extern int synctory_fingerprint(synctory_ctx_t *ctx, int source_fd, int dest_fd,
 extern int synctory_diff(int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file);
 
 
+/**
+ * Create a diff file configured by a context object.
+ * 
+ * This function operates in the same way as synctory_diff, using the diff
+ * options of the context object (threads, write buffer, diff format, codec
+ * and table of contents), and stores statistics about the diff operation in
+ * it. A NULL pointer can be provided instead to use the defaults.
+ */
+extern int synctory_diff_ctx(synctory_ctx_t *ctx, int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file);
+
+
 /**
  * Create a diff file using a low memory profile.
  * 
@@ -154,10 +298,122 @@ extern int synctory_diff(int source_fd, int dest_fd, int fingerprint_fd, const c
  * 
  * Therefore this function is useful to process extremely large fingerprint files.
  * It can also be used in environments with limited memory availability.
+ * 
+ * Instead of memory, this function uses a temporary file (see tmpfile(3)) of
+ * about the size of the fingerprint, holding a sorted copy of it.
  */
 extern int synctory_diff_lomem(int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file);
 
 
+/**
+ * Create a diff file using a low memory profile, configured by a context
+ * object.
+ * 
+ * This function relates to synctory_diff_lomem like synctory_diff_ctx
+ * relates to synctory_diff.
+ */
+extern int synctory_diff_lomem_ctx(synctory_ctx_t *ctx, int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file);
+
+
+/**
+ * Create a diff file within a memory budget.
+ * 
+ * This function operates in the same way as synctory_diff, and creates the
+ * same diff, but chooses its strategy according to the memory budget of the
+ * context. If the index of the fingerprint fits into the budget, the diff is
+ * created like by synctory_diff. Otherwise, the fingerprint is split by weak
+ * checksum into slices whose index fits into the budget, and the source file
+ * is scanned once per slice. If even that is not possible within the budget,
+ * the diff is created like by synctory_diff_lomem.
+ * 
+ * The number of source file passes and the peak resident set size of the
+ * process are reported in the statistics of the context.
+ */
+extern int synctory_diff_auto(synctory_ctx_t *ctx, int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file);
+
+
+/**
+ * Load a fingerprint into memory.
+ * 
+ * The fingerprint can be provided either as file descriptor or as path
+ * string, following the same rules as for synctory_diff. On success, a
+ * handle to the loaded fingerprint is stored in fpindex; it can then be
+ * used with synctory_diff_with_index as often as required, and has to be
+ * released with synctory_fpindex_free.
+ * 
+ * A loaded fingerprint is never modified by the diff operations, so the
+ * same handle can be used by several threads at once.
+ */
+extern int synctory_fpindex_load(synctory_fpindex_t **fpindex, int fingerprint_fd, const char *fingerprint_file);
+
+
+/**
+ * Store the index of a loaded fingerprint in a sidecar file.
+ * 
+ * The sidecar holds the index of the fingerprint in the form it takes in
+ * memory, so it can later be loaded with synctory_fpindex_map at little
+ * more than the cost of mapping a file. The destination can be provided
+ * either as file descriptor or as path string, following the same rules
+ * as for synctory_diff.
+ * 
+ * The sidecar only remains valid as long as the fingerprint file it was
+ * created for keeps its size and modification time. It is also bound to
+ * the byte order of the platform it was written on.
+ */
+extern int synctory_fpindex_save(const synctory_fpindex_t *fpindex, int index_fd, const char *index_file);
+
+
+/**
+ * Load a fingerprint into memory from its index sidecar.
+ * 
+ * This function yields the same handle as synctory_fpindex_load, but takes
+ * the index from a sidecar written by synctory_fpindex_save instead of
+ * building it. Both the fingerprint and the sidecar can be provided either
+ * as file descriptor or as path string, following the same rules as for
+ * synctory_diff.
+ * 
+ * If the sidecar does not belong to the given fingerprint any more (e. g.
+ * because the fingerprint has been recreated since), ESTALE is returned,
+ * and no handle is created. EINVAL indicates a damaged sidecar. In both
+ * cases, the fingerprint can still be loaded by synctory_fpindex_load.
+ */
+extern int synctory_fpindex_map(synctory_fpindex_t **fpindex, int fingerprint_fd, int index_fd, const char *fingerprint_file, const char *index_file);
+
+
+/**
+ * Create a diff file based on a fingerprint loaded into memory.
+ * 
+ * This function operates in the same way as synctory_diff, and creates the
+ * same diff; the fingerprint however is taken from a handle returned by
+ * synctory_fpindex_load instead of being read from a file.
+ */
+extern int synctory_diff_with_index(synctory_ctx_t *ctx, const synctory_fpindex_t *fpindex, int source_fd, int dest_fd, const char *source_file, const char *dest_file);
+
+
+/**
+ * Release a fingerprint loaded by synctory_fpindex_load.
+ * 
+ * The handle must not be in use by any diff operation anymore. A NULL
+ * pointer is accepted and ignored.
+ */
+extern void synctory_fpindex_free(synctory_fpindex_t *fpindex);
+
+
+/**
+ * Create a diff file using a pipeline of threads.
+ * 
+ * This function operates in the same way as synctory_diff, and creates the
+ * same diff. Reading the source file, looking up its contents in the
+ * fingerprint and writing the diff file are done by separate threads, so
+ * input and output overlap with the computation. This is useful when the
+ * files reside on storage with a high latency, e. g. network file systems.
+ * 
+ * On platforms without thread support, this function falls back to
+ * synctory_diff.
+ */
+extern int synctory_diff_pipelined(synctory_ctx_t *ctx, int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file);
+
+
 /**
  * Synthesize a file based on a diff and a source file.
  * 
@@ -181,7 +437,81 @@ extern int synctory_diff_lomem(int source_fd, int dest_fd, int fingerprint_fd, c
  * 
  * To skip one form of indication, simply provide a NULL pointer for path names,
  * or a negative integer (usually -1) for the file descriptor.
+ * 
+ * If the destination is a regular file, disk space for the synthesized file
+ * is reserved before writing (see fallocate(2)). If nothing follows the
+ * current position of the destination, blocks of 4 KiB zeros within the raw
+ * data of the diff are not written, but left as holes.
+ * 
+ * The destination and the diff may also be pipes or sockets; the diff is
+ * read from its current position then, which has to be its beginning.
  */
 extern int synctory_synth(int source_fd, int dest_fd, int diff_fd, const char *source_file, const char *dest_file, const char *diff_file);
 
+
+/**
+ * Synthesize a file based on a diff and a source file, using several threads.
+ * 
+ * This function operates in the same way as synctory_synth, and creates the
+ * same file. As the length of every record of the diff is known in advance,
+ * the place of each record in the synthesized file is computed first; the
+ * file is then split into ranges which are written concurrently by up to
+ * the number of threads given in the context. This makes synth scale with
+ * the number of cores on fast storage.
+ * 
+ * The synthesized file is written starting at offset 0 of the destination.
+ * If the destination does not support positional writes (e. g. a pipe), or
+ * if a single thread is requested, this function falls back to
+ * synctory_synth. A NULL pointer can be provided instead of a context
+ * object to use the defaults.
+ */
+extern int synctory_synth_parallel(synctory_ctx_t *ctx, int source_fd, int dest_fd, int diff_fd, const char *source_file, const char *dest_file, const char *diff_file);
+
+
+/**
+ * Synthesize a file in place, based on a diff.
+ * 
+ * This function turns the file f1 into f2 (see synctory_synth) without
+ * writing a new file: bytes which keep their place are not touched, bytes
+ * which move are copied within the file, and only the raw data of the
+ * diff is written in addition. Finally, the file is cut or extended to
+ * the size of f2. This saves both the space and most of the writes of a
+ * full copy when only small parts of a large file have changed.
+ * 
+ * Copies are ordered so that no byte is overwritten before it has been
+ * read. Where copies depend on each other cyclically (e. g. when two
+ * blocks swap places), the bytes of one of them are buffered first, in
+ * memory or, beyond 64 MiB, in a temporary file (see tmpfile(3)).
+ * 
+ * This function takes two arguments:
+ * 
+ *   basis file  => path or descriptor of file f1, opened for reading and writing
+ *   diff        => path or descriptor of diff between f1 and f2
+ * 
+ * Both arguments can be provided either as file descriptor or as path
+ * string, following the same rules as for synctory_synth. The diff has to
+ * be seekable, as it is read twice. The diff is checked before the basis
+ * file is modified; if the function fails afterwards (e. g. on an I/O
+ * error or corrupt compressed data), the basis file is left in an
+ * undefined state.
+ */
+extern int synctory_synth_inplace(int basis_fd, int diff_fd, const char *basis_file, const char *diff_file);
+
+
+/**
+ * Synthesize a part of a file based on a diff and a source file.
+ * 
+ * This function writes the len bytes of the file f2 (see synctory_synth)
+ * starting at offset to the destination, at its current position. The
+ * arguments are the same as for synctory_synth. If the range exceeds the
+ * size of f2, ERANGE is returned.
+ * 
+ * Diffs created with a table of contents (see toc_stride) are entered close
+ * to the requested bytes, so the effort depends on len and the stride
+ * rather than on the position of the range. Without a table of contents,
+ * the records in front of the range are read as well, but neither copied
+ * nor decompressed. Either way, the diff has to be seekable.
+ */
+extern int synctory_synth_range(int source_fd, int dest_fd, int diff_fd, const char *source_file, const char *dest_file, const char *diff_file, uint64_t offset, uint64_t len);
+
 #endif /* __LIBSYNCTORY_H */
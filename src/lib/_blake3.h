@@ -0,0 +1,60 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __LIBSYNCTORY_BLAKE3_H_
+#define __LIBSYNCTORY_BLAKE3_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * Size of a BLAKE3 digest as stored in fingerprints
+ */
+#define _SYNCTORY_BLAKE3_BYTES      32U
+
+/**
+ * Size of a message block, and of a chunk, the leaves of the hash tree
+ */
+#define _SYNCTORY_BLAKE3_BLOCK      64U
+#define _SYNCTORY_BLAKE3_CHUNK      1024U
+
+/**
+ * Domain separation flags of the compression function
+ */
+#define _SYNCTORY_BLAKE3_CHUNK_START    0x01U
+#define _SYNCTORY_BLAKE3_CHUNK_END      0x02U
+#define _SYNCTORY_BLAKE3_PARENT         0x04U
+#define _SYNCTORY_BLAKE3_ROOT           0x08U
+
+/**
+ * Depth of the stack of chaining values; enough for 2^54 chunks
+ */
+#define _SYNCTORY_BLAKE3_MAXDEPTH   54U
+
+/**
+ * Implementations of the rounds, see _synctory_blake3_select
+ */
+#define _SYNCTORY_BLAKE3_AUTO       0
+#define _SYNCTORY_BLAKE3_PORTABLE   1
+#define _SYNCTORY_BLAKE3_SSE41      2
+
+int _synctory_blake3_select(int rounds);
+int _synctory_blake3_checksum(void const *stream, size_t len, unsigned char *result);
+
+#endif /* __LIBSYNCTORY_BLAKE3_H_ */
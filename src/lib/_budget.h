@@ -0,0 +1,81 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __LIBSYNCTORY_BUDGET_H_
+#define __LIBSYNCTORY_BUDGET_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <synctory.h>
+
+#include "_file64.h"
+
+
+/**
+ * Number of histogram buckets used to split the fingerprint into slices;
+ * each bucket covers a range of weak checksums sharing their upper 16 bits.
+ */
+#define _SYNCTORY_BUDGET_BUCKETS    0x10000U
+
+/**
+ * Upper limit for the number of slices, i. e. source file passes. If the
+ * budget would require more, the low memory diff is used instead.
+ */
+#define _SYNCTORY_BUDGET_MAXSLICES  64U
+
+/**
+ * Size of the buffers holding the matches of a slice
+ */
+#define _SYNCTORY_BUDGET_BUFSIZE    0x10000U
+
+/**
+ * Size of the scanner buffer used for the passes over the source file
+ */
+#define _SYNCTORY_BUDGET_SCANSIZE   0x40000U
+
+
+/**
+ * A run of consecutive source positions whose windows all match the same
+ * chunk (which only happens if these windows are identical)
+ */
+typedef struct
+{
+    uint64_t offset;            /* first source position of the run     */
+    uint32_t chunk;             /* index of the matching chunk          */
+    uint32_t run;               /* number of positions                  */
+} _synctory_budget_match_t;
+
+/**
+ * A slice of the fingerprint, covering all chunks with weak checksums
+ * inside [lo, hi]. The matches found for the slice are stored in a
+ * temporary file.
+ */
+typedef struct
+{
+    uint32_t lo;                /* lowest weak checksum of the slice    */
+    uint32_t hi;                /* highest weak checksum of the slice   */
+    uint64_t entries;           /* number of chunks in the slice        */
+    uint64_t first;             /* first match record of the slice      */
+    uint64_t count;             /* number of match records              */
+} _synctory_budget_slice_t;
+
+int _synctory_budget_diff(synctory_ctx_t *ctx, int fdfinger, int fdsource, int fddiff);
+uint64_t _synctory_budget_peak_rss(void);
+
+#endif /* __LIBSYNCTORY_BUDGET_H_ */
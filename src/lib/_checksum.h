@@ -58,11 +58,56 @@ typedef struct
  */
 #define _synctory_checksum_digest(sum) (((sum)->s2 << 16) | ((sum)->s1 & 0xffff))
 
+/**
+ * Maximum number of window positions rolled over in one go
+ */
+#define _SYNCTORY_CHECKSUM_BATCH 256U
+
+/**
+ * Weak checksum digests of the windows following a given one, computed
+ * ahead of the scan by _synctory_checksum_batch_fill
+ */
+typedef struct
+{
+    uint32_t digest[_SYNCTORY_CHECKSUM_BATCH];
+    size_t next;        /* index of the next digest to hand out */
+    size_t count;       /* number of digests computed */
+} _synctory_checksum_batch_t;
+
+/**
+ * Macro to discard the digests of a batch, needed whenever the scan does
+ * not move on to the next window (e. g. after a match)
+ */
+#define _synctory_checksum_batch_reset(batch) { \
+    (batch)->next=(batch)->count=0; \
+}
+
+/**
+ * Macro to shift forward the checksum by one byte, yielding the digest of
+ * the new window. window points to the new window, out is the byte just
+ * left behind, and available is the number of bytes readable at window.
+ */
+#define _synctory_checksum_batch_next(batch,sum,out,window,available) \
+    (((batch)->next < (batch)->count) ? (batch)->digest[(batch)->next++] : \
+    _synctory_checksum_batch_fill((batch), (sum), (out), (window), (available)))
+
+/**
+ * Vector kernels of the weak checksum, see _synctory_checksum_select
+ */
+#define _SYNCTORY_CHECKSUM_AUTO     0
+#define _SYNCTORY_CHECKSUM_SCALAR   1
+#define _SYNCTORY_CHECKSUM_SSE41    2
+#define _SYNCTORY_CHECKSUM_AVX2     3
+
+int _synctory_checksum_select(int kernel);
 uint32_t _synctory_weak_checksum(void const *stream, size_t len);
 int _synctory_checksum_update(_synctory_checksum_t *checksum, void const *stream, size_t len);
+void _synctory_checksum_roll(_synctory_checksum_t *checksum, unsigned char const *window, size_t n, uint32_t *digest);
+uint32_t _synctory_checksum_batch_fill(_synctory_checksum_batch_t *batch, _synctory_checksum_t *checksum, unsigned char out, unsigned char const *window, size_t available);
 int _synctory_strong_checksum(void const *stream, size_t len, unsigned char *result, synctory_algo_t algo);
 int _synctory_rmd160_checksum(void const *stream, size_t len, unsigned char *result);
 int _synctory_sha1_checksum(void const *stream, size_t len, unsigned char *result);
+int _synctory_xxh128_checksum(void const *stream, size_t len, unsigned char *result);
 int _synctory_strong_checksum_compare(const unsigned char *cs1, const unsigned char *cs2, size_t len);
 int _synctory_strong_checksum_size(synctory_algo_t algo);
 
@@ -0,0 +1,87 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __LIBSYNCTORY_CODEC_H_
+#define __LIBSYNCTORY_CODEC_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LZMA_H
+#include <lzma.h>
+#endif
+
+
+/**
+ * Codec identifiers, as recorded in the diff file header
+ */
+#define _SYNCTORY_CODEC_NONE        0x00U
+#define _SYNCTORY_CODEC_ZLIB        0x01U
+#define _SYNCTORY_CODEC_LZMA        0x02U
+
+/**
+ * Highest compression level; levels are recorded in four bits
+ */
+#define _SYNCTORY_CODEC_MAXLEVEL    9U
+
+/**
+ * Raw data is compressed in frames of at most this many bytes, each of
+ * them decodable on its own
+ */
+#define _SYNCTORY_CODEC_FRAME       0x100000U
+
+/**
+ * Frames shorter than this are not worth compressing
+ */
+#define _SYNCTORY_CODEC_MINFRAME    0x40U
+
+
+/**
+ * Compressor or decompressor state of one of the codecs. The state is
+ * kept from frame to frame, so its memory is only allocated once.
+ */
+typedef struct
+{
+    uint8_t id;                 /* codec identifier                     */
+    uint8_t level;              /* compression level                    */
+    int decode;                 /* decompressor instead of compressor   */
+    int ready;                  /* the codec library state is set up    */
+#ifdef HAVE_ZLIB_H
+    z_stream zs;
+#endif
+#ifdef HAVE_LZMA_H
+    lzma_stream ls;
+    lzma_options_lzma options;
+    lzma_filter filter[2];
+#endif
+} _synctory_codec_t;
+
+int _synctory_codec_available(uint8_t id);
+int _synctory_codec_init(_synctory_codec_t *codec, uint8_t id, uint8_t level, int decode);
+int _synctory_codec_compress(_synctory_codec_t *codec, const unsigned char *data, size_t len, unsigned char *packed, size_t *size);
+int _synctory_codec_reset(_synctory_codec_t *codec);
+int _synctory_codec_decode(_synctory_codec_t *codec, const unsigned char *in, size_t inlen, size_t *consumed, unsigned char *out, size_t outlen, size_t *produced, int *end);
+void _synctory_codec_free(_synctory_codec_t *codec);
+
+#endif /* __LIBSYNCTORY_CODEC_H_ */
@@ -18,6 +18,30 @@
 #ifndef __LIBSYNCTORY_DIFF_H_
 #define __LIBSYNCTORY_DIFF_H_
 
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <synctory.h>
+
+#include "config.h"
+
+#include "_codec.h"
+#include "_fheader.h"
+#include "_file64.h"
+#include "_index.h"
+#include "_writer.h"
+
+
+/**
+ * Threads are only used when positional reads are available, since the
+ * segments of the source file are read concurrently through one descriptor.
+ */
+#if defined(HAVE_PTHREAD_H) && (defined(HAVE_PREAD_F) || defined(HAVE_PREAD64_F))
+#define _SYNCTORY_DIFF_THREADS
+#endif
+
+
 /**
  * Synctory diff file block type definition for a known chunk.
  */
@@ -28,17 +52,217 @@
  */
 #define _SYNCTORY_DIFF_BTYPE_RAW    0x20U
 
+/**
+ * Synctory diff file block type definition for a run of consecutive known
+ * chunks. The index of the first chunk is followed by the number of chunks.
+ */
+#define _SYNCTORY_DIFF_BTYPE_RANGE  0x30U
+
+/**
+ * Synctory diff file block type definition for raw data compressed into a
+ * frame (see codec.c). The size of the raw data is followed by the size of
+ * the frame.
+ */
+#define _SYNCTORY_DIFF_BTYPE_FRAME  0x40U
+
+/**
+ * Synctory diff file block type definition for the table of contents,
+ * which ends the records of a diff (see _synctory_diff_out_flush).
+ */
+#define _SYNCTORY_DIFF_BTYPE_TOC    0x50U
+
+/**
+ * Size of the fields of the table of contents: the record type and four
+ * totals in front of the entries, three values per entry, and the offset of
+ * the table at the end of the diff file
+ */
+#define _SYNCTORY_DIFF_TOC_HEAD     33U
+#define _SYNCTORY_DIFF_TOC_ENTRY    24U
+#define _SYNCTORY_DIFF_TOC_TAIL     8U
+
+/**
+ * Largest encoding of a 64 bit integer as variable-length integer, and of
+ * a record header of a compact diff (type, chunk index delta and count)
+ */
+#define _SYNCTORY_DIFF_VARINT_BYTES 10U
+#define _SYNCTORY_DIFF_RECORD_BYTES (1U + 2U * _SYNCTORY_DIFF_VARINT_BYTES)
+
+/**
+ * Chunk indices of a compact diff are stored as signed difference to the
+ * chunk following the previous match, mapped to unsigned integers so that
+ * small differences of either sign get small encodings (zigzag encoding).
+ * All arithmetic is modulo 2^64.
+ */
+#define _synctory_diff_zigzag(u)    (((u) << 1) ^ ((uint64_t)0 - ((u) >> 63)))
+#define _synctory_diff_unzigzag(z)  (((z) >> 1) ^ ((uint64_t)0 - ((z) & 1U)))
+
+
+/**
+ * Size of the source file segments scanned at once. In parallel mode, the
+ * remainder of the file is spread across the threads, but each segment is
+ * kept between _SYNCTORY_DIFF_MINSEGMENT and _SYNCTORY_DIFF_SEGMENT bytes.
+ */
+#define _SYNCTORY_DIFF_SEGMENT          0x2000000
+#define _SYNCTORY_DIFF_MINSEGMENT       0x10000
+
+/**
+ * Upper limit for the number of threads used for a diff
+ */
+#define _SYNCTORY_DIFF_MAXTHREADS       256U
+
+/**
+ * Read buffer size used when rescanning the start of a segment
+ */
+#define _SYNCTORY_DIFF_RESCAN_BUFSIZE   0x10000U
+
+/**
+ * Initial capacity of a segment's match list
+ */
+#define _SYNCTORY_DIFF_MATCHES          0x400U
+
+/**
+ * A chunk found in the source file
+ */
+typedef struct
+{
+    _synctory_off_t offset;     /* source offset of the matching window */
+    uint32_t chunk;             /* index of the fingerprint chunk       */
+} _synctory_diff_match_t;
+
+/**
+ * A segment of the source file, scanned for chunks of the fingerprint
+ */
+typedef struct _synctory_diff_segment_s
+{
+    const _synctory_index_t *index;         /* shared fingerprint index                 */
+    const _synctory_fheader_t *header;      /* diff header (chunk size and algorithm)   */
+    const struct _synctory_diff_segment_s *guide;   /* scan to merge with, or NULL      */
+    int fd;                                 /* source file descriptor                   */
+    const _synctory_file64_map_t *map;      /* source file mapping, or NULL             */
+    size_t bufsize;                         /* scanner buffer size                      */
+    _synctory_off_t start;                  /* position of the first window             */
+    _synctory_off_t end;                    /* scan stops at or behind this position    */
+    _synctory_off_t exit;                   /* position the scan stopped at             */
+    _synctory_off_t merge;                  /* position merged with the guide, or -1    */
+    _synctory_diff_match_t *match;          /* matches found, in ascending order        */
+    size_t count;                           /* number of matches                        */
+    size_t size;                            /* capacity of the match list               */
+    synctory_stats_t stats;                 /* lookup statistics                        */
+    int rval;                               /* result of the scan                       */
+} _synctory_diff_segment_t;
+
+/**
+ * An entry of the table of contents: the record written at offset of the
+ * diff file starts at output of the synthesized file
+ */
+typedef struct
+{
+    uint64_t output;            /* offset in the synthesized file       */
+    uint64_t offset;            /* offset of the record in the diff     */
+    uint64_t next;              /* chunk following the previous run     */
+} _synctory_diff_toc_entry_t;
+
+/**
+ * Output of a diff: the buffered writer, the run of consecutive chunks
+ * which has not been written yet, and the table of contents collected on
+ * the way
+ */
+typedef struct
+{
+    _synctory_writer_t writer;  /* buffered diff file writer            */
+    int compact;                /* write the compact record format      */
+    uint64_t first;             /* first chunk of the pending run       */
+    uint64_t count;             /* number of chunks in the pending run  */
+    uint64_t next;              /* chunk following the previous run     */
+    _synctory_codec_t codec;    /* compressor for raw data              */
+    unsigned char *frame;       /* raw data of a frame, or NULL if the
+                                   raw data is not compressed           */
+    unsigned char *packed;      /* compressed frame                     */
+    uint64_t chunksize;         /* output bytes per chunk               */
+    uint64_t position;          /* output offset of the next record     */
+    uint64_t records;           /* number of records written            */
+    uint64_t literal;           /* raw data bytes written               */
+    uint64_t stride;            /* table of contents stride, or 0       */
+    uint64_t mark;              /* next output offset needing an entry  */
+    _synctory_diff_toc_entry_t *toc;        /* table of contents        */
+    size_t entries;             /* number of entries                    */
+    size_t capacity;            /* capacity of the table                */
+} _synctory_diff_out_t;
+
+/**
+ * Encode value as variable-length integer of at least width bytes, and
+ * decode a variable-length integer from at most len bytes
+ */
+size_t _synctory_diff_varint_put(unsigned char *buffer, uint64_t value, size_t width);
+size_t _synctory_diff_varint_get(const unsigned char *buffer, size_t len, uint64_t *value);
+
+/**
+ * Fill in the header of a diff of a source file with filesize bytes,
+ * based on the fingerprint's header and the options of ctx
+ */
+void _synctory_diff_header_init(const synctory_ctx_t *ctx, const _synctory_fheader_t *finger, _synctory_off_t filesize, _synctory_fheader_t *header);
+
+/**
+ * Set up and release the output of a diff with the given header, and
+ * write everything pending
+ */
+int _synctory_diff_out_init(_synctory_diff_out_t *out, int fd, size_t size, const _synctory_fheader_t *header);
+int _synctory_diff_out_flush(_synctory_diff_out_t *out);
+void _synctory_diff_out_free(_synctory_diff_out_t *out);
+
+/**
+ * Account for a record written at offset of the diff file, producing
+ * length bytes of output (literal ones if literal is set). next is the
+ * chunk following the run in front of the record.
+ */
+int _synctory_diff_out_record(_synctory_diff_out_t *out, _synctory_off_t offset, uint64_t next, uint64_t length, int literal);
+
+/**
+ * Write the header of a diff file
+ */
+int _synctory_diff_write_header(_synctory_diff_out_t *out, const _synctory_fheader_t *header);
+
+/**
+ * Add a chunk of the fingerprint to the diff; runs of consecutive chunks
+ * are written as one range record
+ */
+int _synctory_diff_write_chunk(_synctory_diff_out_t *out, uint32_t chunk);
+
+/**
+ * Write the pending run of chunks, if any
+ */
+int _synctory_diff_write_run(_synctory_diff_out_t *out);
+
+/**
+ * Write len bytes of raw data as one frame; len must not exceed
+ * _SYNCTORY_CODEC_FRAME. Only used for diffs with compressed raw data.
+ */
+int _synctory_diff_write_frame(_synctory_diff_out_t *out, const unsigned char *data, size_t len);
+
+/**
+ * Write the bytes between lpos and curpos of the source file to the diff
+ * file as raw data record
+ */
+int _synctory_diff_write_raw_fd(_synctory_diff_out_t *out, int fdsource, _synctory_off_t lpos, _synctory_off_t curpos);
+
 /**
  * Create a binary diff based on the fingerprint read from the fdfinger
  * file handle, compared to the file content read from the fdsource file
  * handle and stored in the file designated by the fddiff file handle.
  */
-int _synctory_diff_create_fast(int fdfinger, int fdsource, int fddiff);
+int _synctory_diff_create_fast(synctory_ctx_t *ctx, int fdfinger, int fdsource, int fddiff);
+
+/**
+ * Create a binary diff based on a fingerprint loaded into memory before,
+ * compared to the file content read from the fdsource file handle and
+ * stored in the file designated by the fddiff file handle.
+ */
+int _synctory_diff_create_index(synctory_ctx_t *ctx, const synctory_fpindex_t *fpindex, int fdsource, int fddiff);
 
 /**
- * Create binary diff by using a low memory profile (slow!)
+ * Create binary diff by using a low memory profile
  */
-int _synctory_diff_create_fd(int fdfinger, int fdsource, int fddiff);
+int _synctory_diff_create_fd(synctory_ctx_t *ctx, int fdfinger, int fdsource, int fddiff);
 
 /**
  * Create a binary diff based on the fingerprint read from the file named
@@ -44,6 +44,13 @@
  */
 #define _SYNCTORY_FH_FINGERPRINT  0x10U
 #define _SYNCTORY_FH_DIFF         0x20U
+#define _SYNCTORY_FH_DIFF_COMPACT 0x21U
+
+/**
+ * Flag of the codec byte telling that a diff ends with a table of
+ * contents (see diff.c)
+ */
+#define _SYNCTORY_FH_TOC          0x80U
 
 /**
  * Generic synctory file header structure
@@ -57,6 +64,11 @@ typedef struct
     uint64_t filesize;
     uint16_t chunksize;
     synctory_algo_t algo;
+    uint8_t codec;
+    uint8_t level;
+    uint64_t toc;               /* table of contents stride of a diff, 0
+                                   if there is none; only its presence is
+                                   stored, so it reads back as 1         */
 } _synctory_fheader_t;
 
 
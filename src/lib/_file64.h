@@ -33,7 +33,26 @@
 #include "config.h"
 
 
-#define _SYNCTORY_FILE64_BUFSIZE 512
+/**
+ * Size of the buffer used by _synctory_file64_bytecopy where the kernel
+ * cannot copy on its own, and the largest amount copied by one system call
+ */
+#define _SYNCTORY_FILE64_BUFSIZE 0x40000
+#define _SYNCTORY_FILE64_MAXCOPY 0x40000000
+
+/**
+ * Defined if _synctory_file64_bytecopy can copy between regular files
+ * without passing the data through user space
+ */
+#if (defined HAVE_COPY_FILE_RANGE_F) || ((defined HAVE_SYS_SENDFILE_H) && (defined HAVE_SENDFILE_F) && (OFFT_SIZE == 8))
+#define _SYNCTORY_FILE64_KERNEL_COPY
+#endif
+
+/**
+ * Access pattern hints for memory mapped files
+ */
+#define _SYNCTORY_FILE64_MAP_NORMAL     0
+#define _SYNCTORY_FILE64_MAP_SEQUENTIAL 1
 
 /*
  * FIXME
@@ -61,10 +80,32 @@ typedef off64_t _synctory_off_t;
 #error "libsynctory only supports 64 bit file pointers!\n"
 #endif
 
+/**
+ * A read-only memory mapping of an entire file. data is NULL if the file
+ * is not mapped.
+ */
+typedef struct
+{
+    unsigned char *data;
+    _synctory_off_t size;
+} _synctory_file64_map_t;
+
 int _synctory_file64_open(const char *path, int oflag, ...);
 int _synctory_file64_close(int fd);
 _synctory_off_t _synctory_file64_seek(int fd, int64_t offset, int whence);
-_synctory_off_t _synctory_file64_bytecopy(int fdsource, int fddest, _synctory_off_t offset, _synctory_off_t bytes);
+ssize_t _synctory_file64_pread(int fd, void *buffer, size_t nbytes, _synctory_off_t offset);
+ssize_t _synctory_file64_pwrite(int fd, const void *buffer, size_t nbytes, _synctory_off_t offset);
+int _synctory_file64_readat(int fd, void *buffer, size_t nbytes, _synctory_off_t offset);
+int _synctory_file64_writeat(int fd, const void *buffer, size_t nbytes, _synctory_off_t offset);
+int _synctory_file64_write(int fd, const void *buffer, size_t nbytes);
+int _synctory_file64_fstat(int fd, _synctory_file64_stat_t *buf);
+int _synctory_file64_truncate(int fd, _synctory_off_t length);
+int _synctory_file64_allocate(int fd, _synctory_off_t offset, _synctory_off_t len);
+int _synctory_file64_punch(int fd, _synctory_off_t offset, _synctory_off_t len);
+int _synctory_file64_map(int fd, _synctory_file64_map_t *map, int advice);
+void _synctory_file64_unmap(_synctory_file64_map_t *map);
+int _synctory_file64_bytecopy(int fdsource, int fddest, _synctory_off_t offset, _synctory_off_t bytes);
+int _synctory_file64_copyat(int fdsource, _synctory_off_t offset, int fddest, _synctory_off_t destoffset, _synctory_off_t bytes);
 int _synctory_file64_get_fd(int *flag, int fd, const char *path, char mode);
 
 #endif /* __LIBSYNCTORY_FILE64_H */
@@ -24,6 +24,7 @@
 
 #include <synctory.h>
 
+#include "config.h"
 #include "default.h"
 
 #include "_fheader.h"
@@ -32,10 +33,28 @@
 
 
 /**
- * number of checksums to collect and buffer before writing them to 
- * the fingerprint file
+ * Threads are only used when positional reads are available, since the
+ * ranges of the source file are read concurrently through one descriptor.
  */
-#define _SYNCTORY_FINGERPRINT_WRITE_BUFFER 0x400U
+#if defined(HAVE_PTHREAD_H) && (defined(HAVE_PREAD_F) || defined(HAVE_PREAD64_F))
+#define _SYNCTORY_FINGERPRINT_THREADS
+#endif
+
+/**
+ * Upper limit for the number of threads used for a fingerprint
+ */
+#define _SYNCTORY_FINGERPRINT_MAXTHREADS    256U
+
+/**
+ * Number of chunks checksummed by the threads of a parallel fingerprint
+ * before their records are written
+ */
+#define _SYNCTORY_FINGERPRINT_BATCH         0x40000U
+
+/**
+ * Read buffer size of each thread, if the source file is not mapped
+ */
+#define _SYNCTORY_FINGERPRINT_READSIZE      0x100000U
 
 
 /**
@@ -57,6 +76,26 @@ typedef struct
     (ctx)->algo=(calgo); \
 }
 
+/**
+ * A range of whole chunks of the source file, checksummed by one thread of
+ * a parallel fingerprint. The records go to their final place in the
+ * output of the batch, so the batch is written in the order of the chunks.
+ */
+typedef struct
+{
+    int fd;                                 /* source file descriptor           */
+    const _synctory_file64_map_t *map;      /* source file mapping, or NULL     */
+    synctory_algo_t algo;                   /* strong checksum algorithm        */
+    uint16_t chunksize;                     /* size of the chunks               */
+    size_t sumsize;                         /* size of a strong checksum        */
+    _synctory_off_t start;                  /* first byte of the range          */
+    _synctory_off_t end;                    /* byte following the range         */
+    unsigned char *record;                  /* records of the range             */
+    unsigned char *buffer;                  /* read buffer, unless mapped       */
+    size_t bufsize;                         /* size of the read buffer          */
+    int rval;                               /* result of the range              */
+} _synctory_fingerprint_range_t;
+
 int _synctory_fingerprint_fetchheader_fd(int fd, _synctory_fheader_t *header);
 int _synctory_fingerprint_fetchheader_fn(const char *fpfile, _synctory_fheader_t *header);
 int _synctory_fingerprint_read_iter_fd(int fd, uint32_t *weaksum, unsigned char *strongsum, size_t len, _synctory_fingerprint_iterctx_t *ctx);
@@ -0,0 +1,155 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __LIBSYNCTORY_INDEX_H_
+#define __LIBSYNCTORY_INDEX_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <synctory.h>
+
+#include "_fheader.h"
+#include "_file64.h"
+
+
+/**
+ * Maximum load factor of the index table, expressed as the ratio
+ * _SYNCTORY_INDEX_LOAD_NUM / _SYNCTORY_INDEX_LOAD_DEN
+ */
+#define _SYNCTORY_INDEX_LOAD_NUM    3U
+#define _SYNCTORY_INDEX_LOAD_DEN    4U
+
+/**
+ * Minimum number of slots in the index table
+ */
+#define _SYNCTORY_INDEX_MINSLOTS    16U
+
+/**
+ * Number of fingerprint records read at once while building the index
+ */
+#define _SYNCTORY_INDEX_READ_RECORDS 0x8000U
+
+/**
+ * Marks chunks which are no candidates for match prediction
+ */
+#define _SYNCTORY_INDEX_NONE        UINT32_MAX
+
+/**
+ * Largest group of entries sharing a weak checksum whose members are
+ * still candidates for match prediction
+ */
+#define _SYNCTORY_INDEX_PREDICT_GROUP   8U
+
+/**
+ * Size of the weak checksum pre-filter: bits per index entry, and the
+ * lower and upper bounds of the filter size as log2 of its 64 bit words.
+ * The upper bound keeps the filter small enough to stay in the L2 cache.
+ */
+#define _SYNCTORY_INDEX_FILTER_BPE      16U
+#define _SYNCTORY_INDEX_FILTER_MINBITS  10U
+#define _SYNCTORY_INDEX_FILTER_MAXBITS  16U
+
+
+/**
+ * A slot of the index table. Each slot in use describes a group of
+ * entries sharing the same weak checksum; a slot is empty when its
+ * group has no entries.
+ */
+typedef struct
+{
+    uint32_t checksum;          /* weak checksum shared by the group    */
+    uint32_t count;             /* number of entries in the group       */
+    uint32_t first;             /* position of the first group entry    */
+} _synctory_index_slot_t;
+
+
+/**
+ * In-memory fingerprint index. All chunk records are stored in flat
+ * arrays, grouped by weak checksum (within a group, entries keep the
+ * order of the fingerprint). An open addressing hash table keyed on the
+ * weak checksum points to the groups. Table and arrays live in a single
+ * allocation, the arena.
+ */
+typedef struct
+{
+    void                   *arena;      /* single allocation for all arrays     */
+    uint64_t               *filter;     /* weak checksum pre-filter             */
+    unsigned int            fbits;      /* log2(filter words)                   */
+    _synctory_index_slot_t *slot;       /* hash table, linear probing           */
+    uint32_t               *weak;       /* weak checksum per entry              */
+    uint32_t               *chunk;      /* chunk index per entry                */
+    uint32_t               *position;   /* entry per chunk index, for prediction */
+    unsigned char          *strong;     /* strong checksum per entry            */
+    uint64_t                slots;      /* number of slots, always a power of 2 */
+    unsigned int            bits;       /* log2(slots)                          */
+    uint32_t                entries;    /* number of entries                    */
+    size_t                  sumsize;    /* size of a strong checksum            */
+} _synctory_index_t;
+
+
+/**
+ * Pointer to the strong checksum of entry j
+ */
+#define _synctory_index_strong(index,j) (&(index)->strong[(size_t)(j) * (index)->sumsize])
+
+/**
+ * The pre-filter is a blocked bloom filter: every weak checksum of the
+ * index sets two bits within one 64 bit word of the filter. If any of
+ * them is cleared, the checksum is definitely not part of the index, and
+ * probing the index table can be skipped. All bits are taken from the
+ * upper, well mixed half of the hash value.
+ */
+#define _synctory_index_filter_hash(checksum) ((uint64_t)(checksum) * UINT64_C(0xC2B2AE3D27D4EB4F))
+
+#define _synctory_index_filter_word(index,hash) ((hash) >> (64 - (index)->fbits))
+
+#define _synctory_index_filter_mask(index,hash) \
+    ((UINT64_C(1) << (((hash) >> (58 - (index)->fbits)) & 63)) | \
+     (UINT64_C(1) << (((hash) >> (52 - (index)->fbits)) & 63)))
+
+#define _synctory_index_filter(index,hash) \
+    (((index)->filter[_synctory_index_filter_word(index,hash)] & _synctory_index_filter_mask(index,hash)) == \
+     _synctory_index_filter_mask(index,hash))
+
+/**
+ * A fingerprint loaded into memory (see synctory_fpindex_load). Once
+ * loaded, it is only read, and can be shared by concurrent diffs.
+ */
+struct synctory_fpindex_s
+{
+    _synctory_fheader_t     header;     /* header of the fingerprint file       */
+    _synctory_index_t       index;      /* index of the fingerprint's chunks    */
+    uint64_t                fpsize;     /* size of the fingerprint file         */
+    int64_t                 fpmtime;    /* modification time of the fingerprint */
+    _synctory_file64_map_t  map;        /* index sidecar mapping, if any        */
+};
+
+int _synctory_index_geometry(_synctory_index_t *index, uint64_t entries, size_t sumsize, uint64_t *bytes);
+void _synctory_index_attach(_synctory_index_t *index, void *base);
+int _synctory_index_records(int fd, const _synctory_fheader_t *header, uint64_t *records);
+int _synctory_index_load_range_fd(_synctory_index_t *index, int fd, const _synctory_fheader_t *header, uint32_t lo, uint32_t hi, uint64_t entries);
+int _synctory_index_load_fd(_synctory_index_t *index, int fd, const _synctory_fheader_t *header);
+const _synctory_index_slot_t *_synctory_index_find(const _synctory_index_t *index, uint32_t checksum);
+int _synctory_index_predict(const _synctory_index_t *index, uint32_t chunk, uint32_t checksum, const unsigned char *window, size_t len, synctory_algo_t algo, unsigned char *strongsum);
+int _synctory_index_match(const _synctory_index_t *index, uint32_t checksum, const unsigned char *window, size_t len, synctory_algo_t algo, unsigned char *strongsum, synctory_stats_t *stats, uint32_t *chunk);
+void _synctory_index_free(_synctory_index_t *index);
+int _synctory_fpindex_load_fd(synctory_fpindex_t *fpindex, int fd);
+void _synctory_fpindex_free(synctory_fpindex_t *fpindex);
+
+#endif /* __LIBSYNCTORY_INDEX_H_ */
@@ -0,0 +1,88 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __LIBSYNCTORY_LOMEM_H_
+#define __LIBSYNCTORY_LOMEM_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <synctory.h>
+
+#include "_fheader.h"
+#include "_file64.h"
+#include "_index.h"
+
+
+/**
+ * Number of records sorted in memory at once when building the sorted
+ * copy of the fingerprint
+ */
+#define _SYNCTORY_LOMEM_RUN         0x10000U
+
+/**
+ * Number of sorted runs merged in one go, and the size of the read
+ * buffer used for each of them
+ */
+#define _SYNCTORY_LOMEM_FANIN       16U
+#define _SYNCTORY_LOMEM_MERGEBUF    0x10000U
+
+/**
+ * Minimum number of records per block of the sorted copy. Blocks are the
+ * unit of lookups; they grow with the fingerprint once the number of
+ * blocks would exceed _SYNCTORY_LOMEM_FENCES.
+ */
+#define _SYNCTORY_LOMEM_BLOCK       0x80U
+#define _SYNCTORY_LOMEM_FENCES      0x40000U
+
+/**
+ * Memory used to cache blocks of the sorted copy
+ */
+#define _SYNCTORY_LOMEM_CACHE       0x400000U
+
+
+/**
+ * Disk based fingerprint index of bounded size. The records of the
+ * fingerprint are kept in a temporary file, sorted by weak checksum and
+ * chunk index; the first weak checksum of each block of that file (the
+ * fences) and a pre-filter stay in memory. The pre-filter is the same as
+ * the one of the in-memory index, and is tested using the same macros.
+ */
+typedef struct
+{
+    FILE           *file;       /* sorted copy of the fingerprint       */
+    int             fd;         /* descriptor of the sorted copy        */
+    uint64_t       *filter;     /* weak checksum pre-filter             */
+    unsigned int    fbits;      /* log2(filter words)                   */
+    uint32_t       *fence;      /* first weak checksum of each block    */
+    uint64_t        blocks;     /* number of blocks                     */
+    uint32_t        blocksize;  /* number of records per block          */
+    uint32_t        entries;    /* number of records                    */
+    size_t          sumsize;    /* size of a strong checksum            */
+    size_t          recsize;    /* size of a record in the sorted copy  */
+    unsigned char  *cache;      /* cached blocks, direct mapped         */
+    uint64_t       *cached;     /* block held by each cache line        */
+    uint32_t        lines;      /* number of cache lines                */
+} _synctory_lomem_t;
+
+int _synctory_lomem_load_fd(_synctory_lomem_t *lomem, int fd, const _synctory_fheader_t *header);
+int _synctory_lomem_match(_synctory_lomem_t *lomem, uint32_t checksum, const unsigned char *window, size_t len, synctory_algo_t algo, unsigned char *strongsum, synctory_stats_t *stats, uint32_t *chunk);
+void _synctory_lomem_free(_synctory_lomem_t *lomem);
+
+#endif /* __LIBSYNCTORY_LOMEM_H_ */
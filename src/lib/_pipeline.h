@@ -0,0 +1,75 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __LIBSYNCTORY_PIPELINE_H_
+#define __LIBSYNCTORY_PIPELINE_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <synctory.h>
+
+#include "config.h"
+
+#include "_diff.h"
+#include "_file64.h"
+#include "_queue.h"
+
+
+/**
+ * The pipeline requires threads, the lock-free queue and positional
+ * reads and writes; otherwise the pipelined diff falls back to the fast
+ * diff.
+ */
+#if defined(_SYNCTORY_QUEUE_AVAILABLE) && (defined(HAVE_PREAD_F) || defined(HAVE_PREAD64_F))
+#define _SYNCTORY_PIPELINE_AVAILABLE
+#endif
+
+/**
+ * Number of window positions covered by one block of the source file.
+ * Each block holds one window more, so all windows starting inside the
+ * block are complete.
+ */
+#define _SYNCTORY_PIPELINE_BLOCKSIZE    0x100000U
+
+/**
+ * Number of blocks travelling through the pipeline; must be a power of 2
+ */
+#define _SYNCTORY_PIPELINE_DEPTH        8U
+
+
+/**
+ * A block of the source file travelling through the pipeline. The reader
+ * fills in the data, the matcher adds the matches found in the block, and
+ * the writer turns both into diff records.
+ */
+typedef struct
+{
+    unsigned char *data;            /* source bytes                             */
+    size_t len;                     /* number of valid bytes in data            */
+    size_t owned;                   /* number of window positions in the block  */
+    _synctory_off_t offset;         /* source offset of data[0]                 */
+    int last;                       /* last block of the source file            */
+    _synctory_diff_match_t *match;  /* matches starting inside the block        */
+    size_t count;                   /* number of matches                        */
+    size_t size;                    /* capacity of the match list               */
+} _synctory_pipeline_block_t;
+
+int _synctory_pipeline_diff(synctory_ctx_t *ctx, int fdfinger, int fdsource, int fddiff);
+
+#endif /* __LIBSYNCTORY_PIPELINE_H_ */
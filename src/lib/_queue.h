@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __LIBSYNCTORY_QUEUE_H_
+#define __LIBSYNCTORY_QUEUE_H_
+
+
+#include <stddef.h>
+
+#include "config.h"
+
+
+/**
+ * The queue relies on the atomic builtins of the compiler; without them,
+ * the pipelined operations fall back to their sequential counterparts.
+ */
+#if defined(HAVE_ATOMIC_BUILTINS) && defined(HAVE_PTHREAD_H)
+#define _SYNCTORY_QUEUE_AVAILABLE
+#endif
+
+/**
+ * Assumed size of a cache line; producer and consumer indices are kept
+ * on separate cache lines to avoid false sharing.
+ */
+#define _SYNCTORY_QUEUE_CACHELINE   64U
+
+/**
+ * Number of busy polls on an empty or full queue before the waiting
+ * thread yields the processor, and number of yields before it sleeps.
+ */
+#define _SYNCTORY_QUEUE_SPINS       128U
+#define _SYNCTORY_QUEUE_YIELDS      1024U
+
+
+/**
+ * Bounded lock-free queue for a single producer and a single consumer.
+ * The queue transports pointers; its capacity must be a power of 2.
+ * 
+ * All queues of a pipeline share one abort flag. Once it is set, blocked
+ * producers and consumers return instead of waiting any longer.
+ */
+typedef struct
+{
+    void          **slot;           /* ring buffer                          */
+    size_t          size;           /* capacity, a power of 2               */
+    volatile int   *abort;          /* shared abort flag                    */
+    char            pad0[_SYNCTORY_QUEUE_CACHELINE];
+    size_t          head;           /* next slot to pop, owned by consumer  */
+    char            pad1[_SYNCTORY_QUEUE_CACHELINE];
+    size_t          tail;           /* next slot to push, owned by producer */
+    char            pad2[_SYNCTORY_QUEUE_CACHELINE];
+} _synctory_queue_t;
+
+int _synctory_queue_init(_synctory_queue_t *queue, size_t size, volatile int *abort);
+int _synctory_queue_push(_synctory_queue_t *queue, void *item);
+void *_synctory_queue_pop(_synctory_queue_t *queue);
+void _synctory_queue_abort(_synctory_queue_t *queue);
+void _synctory_queue_free(_synctory_queue_t *queue);
+
+#endif /* __LIBSYNCTORY_QUEUE_H_ */
@@ -0,0 +1,80 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __LIBSYNCTORY_SCAN_H_
+#define __LIBSYNCTORY_SCAN_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "_file64.h"
+
+
+/**
+ * Size of the block buffer used to read the source file. The rolling
+ * window is moved across this buffer; the file is only accessed again
+ * once the window hits the end of the buffer.
+ */
+#define _SYNCTORY_SCAN_BUFSIZE 0x400000U
+
+
+/**
+ * Data type for the buffered sliding window scanner
+ */
+typedef struct
+{
+    int fd;                     /* source file descriptor               */
+    unsigned char *buffer;      /* block buffer                         */
+    size_t size;                /* capacity of the block buffer         */
+    size_t head;                /* buffer index of the window start     */
+    size_t tail;                /* number of valid bytes in the buffer  */
+    _synctory_off_t base;       /* source offset of buffer[0]           */
+    uint16_t window;            /* window size (the chunk size)         */
+    int eof;                    /* source file has been read entirely   */
+    int mapped;                 /* buffer is a mapping of the source    */
+} _synctory_scan_t;
+
+/**
+ * Number of bytes available from the window start to the end of the buffer
+ */
+#define _synctory_scan_available(scan) ((scan)->tail - (scan)->head)
+
+/**
+ * Pointer to the first byte of the current window
+ */
+#define _synctory_scan_window(scan) (&(scan)->buffer[(scan)->head])
+
+/**
+ * Source file offset of the current window
+ */
+#define _synctory_scan_offset(scan) ((scan)->base + (_synctory_off_t)(scan)->head)
+
+/**
+ * Move the window forward by n bytes. n must not exceed the number of
+ * available bytes.
+ */
+#define _synctory_scan_advance(scan,n) { \
+    (scan)->head += (n); \
+}
+
+int _synctory_scan_init(_synctory_scan_t *scan, int fd, _synctory_off_t offset, uint16_t window, size_t size);
+void _synctory_scan_init_map(_synctory_scan_t *scan, const _synctory_file64_map_t *map, _synctory_off_t offset, uint16_t window);
+int _synctory_scan_fill(_synctory_scan_t *scan);
+void _synctory_scan_free(_synctory_scan_t *scan);
+
+#endif /* __LIBSYNCTORY_SCAN_H_ */
@@ -0,0 +1,70 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __LIBSYNCTORY_SIDECAR_H_
+#define __LIBSYNCTORY_SIDECAR_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <synctory.h>
+
+#include "_index.h"
+
+
+/**
+ * Size of the sidecar header. The index arena follows right behind it;
+ * the size keeps the arena aligned for its 64 bit filter words.
+ */
+#define _SYNCTORY_SIDECAR_BYTES     64U
+
+/**
+ * Magic string identifying an index sidecar
+ */
+#define _SYNCTORY_SIDECAR_MAGIC     "SYNCTIDX"
+
+/**
+ * Version of the sidecar format. It has to be raised whenever the layout
+ * of the index arena changes, e. g. by changing the index tuning constants.
+ */
+#define _SYNCTORY_SIDECAR_VERSION   1U
+
+/**
+ * Byte order mark, stored in host byte order. The arena is stored in the
+ * byte order of the host which wrote it, and is only valid on hosts
+ * sharing that byte order.
+ */
+#define _SYNCTORY_SIDECAR_BOM       0x01020304U
+
+/**
+ * Offsets of the sidecar header fields. All fields except the byte order
+ * mark are stored in network byte order.
+ */
+#define _SYNCTORY_SIDECAR_OFF_MAGIC     0U      /* magic string, 8 bytes               */
+#define _SYNCTORY_SIDECAR_OFF_VERSION   8U      /* format version, 4 bytes             */
+#define _SYNCTORY_SIDECAR_OFF_BOM       12U     /* byte order mark, 4 bytes            */
+#define _SYNCTORY_SIDECAR_OFF_FHEADER   16U     /* fingerprint header, 24 bytes        */
+#define _SYNCTORY_SIDECAR_OFF_FPSIZE    40U     /* fingerprint file size, 8 bytes      */
+#define _SYNCTORY_SIDECAR_OFF_FPMTIME   48U     /* fingerprint modification, 8 bytes   */
+#define _SYNCTORY_SIDECAR_OFF_ENTRIES   56U     /* number of index entries, 4 bytes    */
+#define _SYNCTORY_SIDECAR_OFF_CHECKSUM  60U     /* weak checksum of the above, 4 bytes */
+
+int _synctory_sidecar_write_fd(const synctory_fpindex_t *fpindex, int fd);
+int _synctory_sidecar_load_fd(synctory_fpindex_t *fpindex, int fdfinger, int fd);
+
+#endif /* __LIBSYNCTORY_SIDECAR_H_ */
@@ -18,6 +18,70 @@
 #ifndef __LIBSYNCTORY_SYNTH_H_
 #define __LIBSYNCTORY_SYNTH_H_
 
+
+#include <stdint.h>
+
+#include <synctory.h>
+
+#include "config.h"
+
+
+/**
+ * Parallel synth needs threads and positional reads and writes, as all
+ * threads share the descriptors of the files involved
+ */
+#if defined(HAVE_PTHREAD_H) && (defined(HAVE_PREAD_F) || defined(HAVE_PREAD64_F)) && (defined(HAVE_PWRITE_F) || defined(HAVE_PWRITE64_F))
+#define _SYNCTORY_SYNTH_THREADS
+#endif
+
+/**
+ * Upper limit for the number of threads of a parallel synth
+ */
+#define _SYNCTORY_SYNTH_MAXTHREADS  256U
+
+/**
+ * Number of records a parallel synth places in the recent file before
+ * the threads write them
+ */
+#define _SYNCTORY_SYNTH_BATCH   0x10000U
+
+/**
+ * Size of the buffer the records of a diff file are read into
+ */
+#define _SYNCTORY_SYNTH_BUFSIZE 0x10000U
+
+/**
+ * Size of the blocks of zeros a synth turns into holes instead of writing
+ * them (the usual file system block size)
+ */
+#define _SYNCTORY_SYNTH_HOLE    0x1000U
+
+/**
+ * Number of copies an in-place synth allocates room for at first
+ */
+#define _SYNCTORY_SYNTH_MOVES   0x400U
+
+/**
+ * Size of the buffer used to move bytes to an overlapping place of the
+ * basis file
+ */
+#define _SYNCTORY_SYNTH_MOVEBUF 0x100000U
+
+/**
+ * Amount of memory holding the bytes of copies an in-place synth has to
+ * buffer to break cyclic dependencies; further bytes go to a temporary
+ * file
+ */
+#define _SYNCTORY_SYNTH_SPILLMEM 0x4000000U
+
+/**
+ * States of the copies of an in-place synth
+ */
+#define _SYNCTORY_SYNTH_MOVE_PENDING    0
+#define _SYNCTORY_SYNTH_MOVE_DONE       1
+#define _SYNCTORY_SYNTH_MOVE_MEMORY     2
+#define _SYNCTORY_SYNTH_MOVE_SPILLED    3
+
 /**
  * Synthesize recent file from the original file (sourcefile) and
  * the binary difference (diffile) between both. Store the result in
@@ -33,4 +97,26 @@ int _synctory_synth_create_fn(const char *sourcefile, const char *difffile, cons
  */
 int _synctory_synth_create_fd(int fdsource, int fddiff, int fddest);
 
+/**
+ * Turn the original file (accessed via the fdbasis file descriptor, which
+ * has to be opened for reading and writing) into the recent file, using
+ * the binary difference accessed via the fddiff file descriptor. Only the
+ * bytes which change places or come from the diff are written.
+ */
+int _synctory_synth_inplace_fd(int fdbasis, int fddiff);
+
+/**
+ * Synthesize the recent file like _synctory_synth_create_fd, using up to
+ * the number of threads given in the context
+ */
+int _synctory_synth_parallel_fd(const synctory_ctx_t *ctx, int fdsource, int fddiff, int fddest);
+
+/**
+ * Synthesize len bytes of the recent file starting at offset, and write
+ * them to the file designated by the fddest file descriptor at its current
+ * position. Diffs with a table of contents are read starting close to the
+ * requested bytes.
+ */
+int _synctory_synth_range_fd(int fdsource, int fddiff, int fddest, uint64_t offset, uint64_t len);
+
 #endif /* __LIBSYNCTORY_SYNTH_H_ */
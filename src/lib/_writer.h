@@ -0,0 +1,95 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __LIBSYNCTORY_WRITER_H_
+#define __LIBSYNCTORY_WRITER_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#include "_file64.h"
+
+
+/**
+ * Smallest buffer size accepted by the writer
+ */
+#define _SYNCTORY_WRITER_MINSIZE    0x1000U
+
+/**
+ * Number of pending segments flushed in one go
+ */
+#define _SYNCTORY_WRITER_SEGMENTS   64U
+
+/**
+ * Data referenced by the writer instead of being copied into its buffer
+ * must at least have this size
+ */
+#define _SYNCTORY_WRITER_MINREF     0x1000U
+
+
+/**
+ * A pending piece of output, either inside the writer's buffer or
+ * referenced by the writer
+ */
+typedef struct
+{
+    const unsigned char *data;
+    size_t len;
+} _synctory_writer_segment_t;
+
+/**
+ * Buffered writer for diff and fingerprint files. Small pieces of output
+ * (record headers, checksums, short literal runs) are collected in a
+ * buffer; large ones may be referenced in place. Everything pending is
+ * written with a single writev call whenever the buffer or the segment
+ * list runs full.
+ */
+typedef struct
+{
+    int fd;                     /* destination file descriptor          */
+    unsigned char *buffer;      /* collected output                     */
+    size_t size;                /* capacity of the buffer               */
+    size_t len;                 /* number of bytes used in the buffer   */
+    _synctory_writer_segment_t segment[_SYNCTORY_WRITER_SEGMENTS];
+    unsigned int segments;      /* number of pending segments           */
+    _synctory_off_t base;       /* file offset of the pending output    */
+    _synctory_off_t pending;    /* number of pending bytes              */
+} _synctory_writer_t;
+
+/**
+ * File offset the next byte handed to the writer will be written at
+ */
+#define _synctory_writer_tell(writer) ((writer)->base + (writer)->pending)
+
+int _synctory_writer_init(_synctory_writer_t *writer, int fd, size_t size);
+int _synctory_writer_stage(_synctory_writer_t *writer, size_t len, unsigned char **ptr);
+int _synctory_writer_put(_synctory_writer_t *writer, const void *data, size_t len);
+int _synctory_writer_ref(_synctory_writer_t *writer, const void *data, size_t len);
+int _synctory_writer_copy(_synctory_writer_t *writer, int fd, _synctory_off_t offset, _synctory_off_t len);
+int _synctory_writer_patch(_synctory_writer_t *writer, _synctory_off_t offset, const void *data, size_t len);
+int _synctory_writer_drop(_synctory_writer_t *writer, _synctory_off_t offset, size_t len);
+int _synctory_writer_flush(_synctory_writer_t *writer);
+void _synctory_writer_free(_synctory_writer_t *writer);
+
+#endif /* __LIBSYNCTORY_WRITER_H_ */
@@ -0,0 +1,358 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * BLAKE3 in its default hashing mode, producing 256 bit digests. The input
+ * is split into chunks of 1 KiB, each of which is compressed block by block
+ * into a chaining value. The chaining values are merged pairwise into the
+ * binary hash tree as soon as both children are complete, so the stack of
+ * pending chaining values never grows beyond the depth of the tree. The
+ * node ending up at the top is compressed once more with the root flag,
+ * yielding the digest.
+ * 
+ * On x86, the rounds of the compression function run on the rows of the
+ * state held in SSE registers if the processor supports SSE4.1.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "_blake3.h"
+
+#ifdef HAVE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+
+/**
+ * Initialisation vector, shared with SHA-256
+ */
+static const uint32_t __synctory_blake3_iv[8] = {
+    0x6A09E667U, 0xBB67AE85U, 0x3C6EF372U, 0xA54FF53AU,
+    0x510E527FU, 0x9B05688CU, 0x1F83D9ABU, 0x5BE0CD19U
+};
+
+/**
+ * Order of the message words in each of the 7 rounds
+ */
+static const uint8_t __synctory_blake3_schedule[7][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    {  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+    {  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+    { 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+    { 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+    {  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+    { 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 }
+};
+
+#define __synctory_blake3_rotr(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * The quarter round mixing a column or a diagonal of the state
+ */
+#define __synctory_blake3_g(v,a,b,c,d,x,y) { \
+    v[a] = v[a] + v[b] + (x); \
+    v[d] = __synctory_blake3_rotr(v[d] ^ v[a], 16); \
+    v[c] = v[c] + v[d]; \
+    v[b] = __synctory_blake3_rotr(v[b] ^ v[c], 12); \
+    v[a] = v[a] + v[b] + (y); \
+    v[d] = __synctory_blake3_rotr(v[d] ^ v[a], 8); \
+    v[c] = v[c] + v[d]; \
+    v[b] = __synctory_blake3_rotr(v[b] ^ v[c], 7); \
+}
+
+
+/**
+ * The rounds of the compression function, turning the chaining value cv
+ * and the message words m into the next chaining value
+ */
+typedef void (*__synctory_blake3_rounds_t)(uint32_t cv[8], const uint32_t m[16], uint64_t counter, uint32_t len, uint32_t flags);
+
+
+/**
+ * Portable implementation of the rounds
+ */
+static void
+__synctory_blake3_rounds_portable(uint32_t cv[8], const uint32_t m[16], uint64_t counter, uint32_t len, uint32_t flags)
+{
+    int i;
+    uint32_t v[16];
+    const uint8_t *s;
+    
+    for (i = 0; i < 8; i++)
+        v[i] = cv[i];
+    for (i = 0; i < 4; i++)
+        v[i + 8] = __synctory_blake3_iv[i];
+    v[12] = (uint32_t)counter;
+    v[13] = (uint32_t)(counter >> 32);
+    v[14] = len;
+    v[15] = flags;
+    
+    for (i = 0; i < 7; i++)
+    {
+        s = __synctory_blake3_schedule[i];
+        __synctory_blake3_g(v, 0, 4,  8, 12, m[s[0]],  m[s[1]]);
+        __synctory_blake3_g(v, 1, 5,  9, 13, m[s[2]],  m[s[3]]);
+        __synctory_blake3_g(v, 2, 6, 10, 14, m[s[4]],  m[s[5]]);
+        __synctory_blake3_g(v, 3, 7, 11, 15, m[s[6]],  m[s[7]]);
+        __synctory_blake3_g(v, 0, 5, 10, 15, m[s[8]],  m[s[9]]);
+        __synctory_blake3_g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        __synctory_blake3_g(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+        __synctory_blake3_g(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+    }
+    
+    for (i = 0; i < 8; i++)
+        cv[i] = v[i] ^ v[i + 8];
+}
+
+
+#ifdef HAVE_X86_DISPATCH
+/**
+ * Half of the quarter round on all four columns (or diagonals) at once;
+ * rot is the byte shuffle rotating by 16 or 8 bits, n the following shift
+ * (12 or 7 bits)
+ */
+#define __synctory_blake3_half(r0,r1,r2,r3,x,rot,n) { \
+    r0 = _mm_add_epi32(_mm_add_epi32(r0, r1), x); \
+    r3 = _mm_shuffle_epi8(_mm_xor_si128(r3, r0), rot); \
+    r2 = _mm_add_epi32(r2, r3); \
+    r1 = _mm_xor_si128(r1, r2); \
+    r1 = _mm_or_si128(_mm_srli_epi32(r1, n), _mm_slli_epi32(r1, 32 - n)); \
+}
+
+
+/**
+ * SSE4.1 implementation of the rounds, keeping each row of the state in a
+ * register. The diagonal steps rotate the rows so the diagonals line up.
+ */
+__attribute__((target("sse4.1")))
+static void
+__synctory_blake3_rounds_sse41(uint32_t cv[8], const uint32_t m[16], uint64_t counter, uint32_t len, uint32_t flags)
+{
+    int i;
+    const uint8_t *s;
+    const __m128i rot16 = _mm_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m128i rot8 = _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    __m128i r0 = _mm_loadu_si128((const __m128i *)&cv[0]);
+    __m128i r1 = _mm_loadu_si128((const __m128i *)&cv[4]);
+    __m128i r2 = _mm_loadu_si128((const __m128i *)&__synctory_blake3_iv[0]);
+    __m128i r3 = _mm_setr_epi32((int)(uint32_t)counter, (int)(uint32_t)(counter >> 32), (int)len, (int)flags);
+    
+    for (i = 0; i < 7; i++)
+    {
+        s = __synctory_blake3_schedule[i];
+        
+        /* columns */
+        __synctory_blake3_half(r0, r1, r2, r3, _mm_setr_epi32((int)m[s[0]], (int)m[s[2]], (int)m[s[4]], (int)m[s[6]]), rot16, 12);
+        __synctory_blake3_half(r0, r1, r2, r3, _mm_setr_epi32((int)m[s[1]], (int)m[s[3]], (int)m[s[5]], (int)m[s[7]]), rot8, 7);
+        
+        /* diagonals */
+        r1 = _mm_shuffle_epi32(r1, _MM_SHUFFLE(0, 3, 2, 1));
+        r2 = _mm_shuffle_epi32(r2, _MM_SHUFFLE(1, 0, 3, 2));
+        r3 = _mm_shuffle_epi32(r3, _MM_SHUFFLE(2, 1, 0, 3));
+        __synctory_blake3_half(r0, r1, r2, r3, _mm_setr_epi32((int)m[s[8]], (int)m[s[10]], (int)m[s[12]], (int)m[s[14]]), rot16, 12);
+        __synctory_blake3_half(r0, r1, r2, r3, _mm_setr_epi32((int)m[s[9]], (int)m[s[11]], (int)m[s[13]], (int)m[s[15]]), rot8, 7);
+        r1 = _mm_shuffle_epi32(r1, _MM_SHUFFLE(2, 1, 0, 3));
+        r2 = _mm_shuffle_epi32(r2, _MM_SHUFFLE(1, 0, 3, 2));
+        r3 = _mm_shuffle_epi32(r3, _MM_SHUFFLE(0, 3, 2, 1));
+    }
+    
+    _mm_storeu_si128((__m128i *)&cv[0], _mm_xor_si128(r0, r2));
+    _mm_storeu_si128((__m128i *)&cv[4], _mm_xor_si128(r1, r3));
+}
+#endif
+
+
+/**
+ * The implementation of the rounds suited to the processor
+ */
+static __synctory_blake3_rounds_t __synctory_blake3_rounds = __synctory_blake3_rounds_portable;
+
+
+#ifdef HAVE_X86_DISPATCH
+/**
+ * Pick the implementation of the rounds when the library is loaded
+ */
+__attribute__((constructor))
+static void
+__synctory_blake3_dispatch(void)
+{
+    (void)_synctory_blake3_select(_SYNCTORY_BLAKE3_AUTO);
+}
+#endif
+
+
+/**
+ * Switch to the given implementation of the rounds, one of the
+ * _SYNCTORY_BLAKE3_* constants; _SYNCTORY_BLAKE3_AUTO picks the best one
+ * the processor supports. Returns ENOTSUP if the implementation is not
+ * available. Meant for the tests; it must not be called while digests are
+ * being computed.
+ */
+int
+_synctory_blake3_select(int rounds)
+{
+#ifdef HAVE_X86_DISPATCH
+    __builtin_cpu_init();
+    if (((_SYNCTORY_BLAKE3_AUTO == rounds) || (_SYNCTORY_BLAKE3_SSE41 == rounds)) && __builtin_cpu_supports("sse4.1"))
+    {
+        __synctory_blake3_rounds = __synctory_blake3_rounds_sse41;
+        return 0;
+    }
+#endif
+    
+    if ((_SYNCTORY_BLAKE3_AUTO != rounds) && (_SYNCTORY_BLAKE3_PORTABLE != rounds))
+        return ENOTSUP;
+    __synctory_blake3_rounds = __synctory_blake3_rounds_portable;
+    return 0;
+}
+
+
+/**
+ * Compress a block of len bytes (zero padded to a full block) into the
+ * chaining value cv
+ */
+static void
+__synctory_blake3_compress(uint32_t cv[8], const unsigned char *block, size_t len, uint64_t counter, uint32_t flags)
+{
+    int i;
+    uint32_t m[16];
+    unsigned char padded[_SYNCTORY_BLAKE3_BLOCK];
+    
+    if (len < _SYNCTORY_BLAKE3_BLOCK)
+    {
+        memset(padded, 0, _SYNCTORY_BLAKE3_BLOCK);
+        memcpy(padded, block, len);
+        block = padded;
+    }
+    
+    /* message words are little endian */
+    for (i = 0; i < 16; i++)
+        m[i] = (uint32_t)block[4 * i] | ((uint32_t)block[4 * i + 1] << 8) | ((uint32_t)block[4 * i + 2] << 16) | ((uint32_t)block[4 * i + 3] << 24);
+    
+    __synctory_blake3_rounds(cv, m, counter, (uint32_t)len, flags);
+}
+
+
+/**
+ * Compress all blocks of a chunk but the last one into cv. The last block
+ * is left to the caller, since it is compressed with the root flag if the
+ * chunk is the only one. Returns the number of bytes remaining.
+ */
+static size_t
+__synctory_blake3_chunk(uint32_t cv[8], const unsigned char *chunk, size_t len, uint64_t counter, uint32_t *flags)
+{
+    size_t pos = 0;
+    
+    memcpy(cv, __synctory_blake3_iv, sizeof(__synctory_blake3_iv));
+    *flags = _SYNCTORY_BLAKE3_CHUNK_START;
+    while (len - pos > _SYNCTORY_BLAKE3_BLOCK)
+    {
+        __synctory_blake3_compress(cv, &chunk[pos], _SYNCTORY_BLAKE3_BLOCK, counter, *flags);
+        *flags = 0;
+        pos += _SYNCTORY_BLAKE3_BLOCK;
+    }
+    *flags |= _SYNCTORY_BLAKE3_CHUNK_END;
+    return len - pos;
+}
+
+
+/**
+ * Store a chaining value as 32 little endian bytes
+ */
+static void
+__synctory_blake3_store(unsigned char *out, const uint32_t cv[8])
+{
+    int i;
+    
+    for (i = 0; i < 8; i++)
+    {
+        out[4 * i] = (unsigned char)cv[i];
+        out[4 * i + 1] = (unsigned char)(cv[i] >> 8);
+        out[4 * i + 2] = (unsigned char)(cv[i] >> 16);
+        out[4 * i + 3] = (unsigned char)(cv[i] >> 24);
+    }
+}
+
+
+/**
+ * Calculate the BLAKE3 digest of len bytes
+ */
+int
+_synctory_blake3_checksum(void const *stream, size_t len, unsigned char *result)
+{
+    unsigned int depth = 0;
+    uint32_t flags;
+    uint32_t cv[8];
+    uint32_t stack[_SYNCTORY_BLAKE3_MAXDEPTH][8];
+    uint64_t counter = 0;
+    uint64_t merge;
+    size_t rest;
+    const unsigned char *message = (const unsigned char *)stream;
+    const unsigned char *last;
+    unsigned char node[_SYNCTORY_BLAKE3_BLOCK];
+    
+    /* all chunks but the last one become complete leaves of the tree */
+    while (len > _SYNCTORY_BLAKE3_CHUNK)
+    {
+        rest = __synctory_blake3_chunk(cv, message, _SYNCTORY_BLAKE3_CHUNK, counter, &flags);
+        __synctory_blake3_compress(cv, &message[_SYNCTORY_BLAKE3_CHUNK - rest], rest, counter, flags);
+        message += _SYNCTORY_BLAKE3_CHUNK;
+        len -= _SYNCTORY_BLAKE3_CHUNK;
+        counter++;
+        
+        /* each trailing zero bit of the chunk count completes a subtree */
+        for (merge = counter; 0 == (merge & 1U); merge >>= 1)
+        {
+            depth--;
+            __synctory_blake3_store(node, stack[depth]);
+            __synctory_blake3_store(&node[32], cv);
+            memcpy(cv, __synctory_blake3_iv, sizeof(cv));
+            __synctory_blake3_compress(cv, node, _SYNCTORY_BLAKE3_BLOCK, 0, _SYNCTORY_BLAKE3_PARENT);
+        }
+        memcpy(stack[depth++], cv, sizeof(cv));
+    }
+    
+    /*
+     * The last chunk, which may be empty, is merged with all pending
+     * subtrees. The final compression of the top node is done with the
+     * root flag.
+     */
+    rest = __synctory_blake3_chunk(cv, message, len, counter, &flags);
+    last = &message[len - rest];
+    while (depth > 0)
+    {
+        __synctory_blake3_compress(cv, last, rest, counter, flags);
+        depth--;
+        __synctory_blake3_store(node, stack[depth]);
+        __synctory_blake3_store(&node[32], cv);
+        memcpy(cv, __synctory_blake3_iv, sizeof(cv));
+        last = node;
+        rest = _SYNCTORY_BLAKE3_BLOCK;
+        counter = 0;
+        flags = _SYNCTORY_BLAKE3_PARENT;
+    }
+    
+    __synctory_blake3_compress(cv, last, rest, 0, flags | _SYNCTORY_BLAKE3_ROOT);
+    __synctory_blake3_store(result, cv);
+    return 0;
+}
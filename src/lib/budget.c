@@ -0,0 +1,563 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * A diff within a memory budget. The index of the fingerprint is estimated
+ * from its record count; if it fits into the budget, the fast diff is used.
+ *
+ * Otherwise, the fingerprint is split into slices by weak checksum. As all
+ * chunks sharing a weak checksum end up in the same slice, the chunk that
+ * matches a window of the source file (the first one carrying the window's
+ * checksums) can be determined by the slice of the window's weak checksum
+ * alone. The source file is scanned once per slice, with only the index of
+ * that slice in memory, and every position whose window matches a chunk of
+ * the slice is recorded in a temporary file. As the greedy diff never looks
+ * at more than the first matching position behind its current one, merging
+ * the positions of all slices in ascending order yields the same diff as
+ * the fast diff.
+ *
+ * If the budget does not even allow for a reasonable number of slices, the
+ * low memory diff is used.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <synctory.h>
+
+#include "config.h"
+#include "version.h"
+
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+#include "_budget.h"
+#include "_checksum.h"
+#include "_diff.h"
+#include "_endianess.h"
+#include "_fheader.h"
+#include "_file64.h"
+#include "_index.h"
+#include "_scan.h"
+
+
+/**
+ * Count the fingerprint records per histogram bucket
+ */
+static int
+__synctory_budget_histogram(int fd, uint64_t records, size_t sumsize, uint64_t *hist)
+{
+    int rval = 0;
+    size_t recsize = sizeof(uint32_t) + sumsize;
+    uint64_t e, n, k;
+    uint32_t checksum;
+    unsigned char *buffer;
+    
+    buffer = (unsigned char *)malloc(_SYNCTORY_INDEX_READ_RECORDS * recsize);
+    if (NULL == buffer)
+        return ((errno != 0) ? errno : ENOMEM);
+    
+    for (e = 0; (0 == rval) && (e < records); e += n)
+    {
+        n = records - e;
+        if (n > _SYNCTORY_INDEX_READ_RECORDS)
+            n = _SYNCTORY_INDEX_READ_RECORDS;
+        
+        rval = _synctory_file64_readat(fd, buffer, (size_t)n * recsize, (_synctory_off_t)_SYNCTORY_FH_BYTES + (_synctory_off_t)(e * recsize));
+        for (k = 0; (0 == rval) && (k < n); k++)
+        {
+            memcpy(&checksum, &buffer[k * recsize], sizeof(uint32_t));
+            hist[_synctory_ntoh32(checksum) >> 16]++;
+        }
+    }
+    
+    free(buffer);
+    return rval;
+}
+
+
+/**
+ * Split the fingerprint into slices whose index takes no more than
+ * available bytes, as far as the histogram resolution allows. Returns the
+ * number of slices, or 0 if more than _SYNCTORY_BUDGET_MAXSLICES would be
+ * required, or if their match buffers would not fit into the budget.
+ */
+static unsigned int
+__synctory_budget_slices(const uint64_t *hist, size_t sumsize, uint64_t available, uint64_t budget, _synctory_budget_slice_t *slice)
+{
+    unsigned int n = 0;
+    uint64_t b, bytes;
+    _synctory_index_t geometry;
+    
+    slice[0].lo = 0;
+    slice[0].entries = 0;
+    
+    for (b = 0; b < _SYNCTORY_BUDGET_BUCKETS; b++)
+    {
+        if ((slice[n].entries > 0) &&
+            ((0 != _synctory_index_geometry(&geometry, slice[n].entries + hist[b], sumsize, &bytes)) || (bytes > available)))
+        {
+            slice[n].hi = (uint32_t)((b << 16) - 1);
+            if (++n == _SYNCTORY_BUDGET_MAXSLICES)
+                return 0;
+            slice[n].lo = (uint32_t)(b << 16);
+            slice[n].entries = 0;
+        }
+        slice[n].entries += hist[b];
+    }
+    
+    slice[n].hi = UINT32_MAX;
+    n++;
+    
+    /* the matches of all slices are merged at once */
+    if ((uint64_t)n * _SYNCTORY_BUDGET_BUFSIZE > budget)
+        return 0;
+    return n;
+}
+
+
+/**
+ * Append a match record to the buffer, writing the buffer to the temporary
+ * file once it is full
+ */
+static int
+__synctory_budget_push(int fd, _synctory_budget_match_t *buffer, size_t *fill, const _synctory_budget_match_t *match)
+{
+    int rval = 0;
+    
+    buffer[(*fill)++] = *match;
+    if (*fill == _SYNCTORY_BUDGET_BUFSIZE / sizeof(_synctory_budget_match_t))
+    {
+        rval = _synctory_file64_write(fd, buffer, *fill * sizeof(_synctory_budget_match_t));
+        *fill = 0;
+    }
+    return rval;
+}
+
+
+/**
+ * Scan the whole source file for windows matching a chunk of the given
+ * slice, and append the matching positions to the temporary file. Unlike
+ * the greedy scan, every position is looked at; a window identical to its
+ * predecessor shares its predecessor's result, so long runs of a single
+ * repeated byte cost no lookups.
+ */
+static int
+__synctory_budget_scan(_synctory_budget_slice_t *slice, const _synctory_index_t *index, const _synctory_fheader_t *header, int fdsource, int fdtemp, synctory_stats_t *stats)
+{
+    int rval = 0;
+    int iflag = 1;
+    int have = 0;
+    int same;
+    size_t equal = 0;
+    uint32_t j = _SYNCTORY_INDEX_NONE;
+    uint32_t wsum;
+    uint64_t hash;
+    size_t fill = 0;
+    size_t rbytes;
+    uint16_t chunksize = header->chunksize;
+    _synctory_off_t curpos = 0;
+    _synctory_checksum_t weaksum;
+    _synctory_checksum_batch_t batch;
+    _synctory_scan_t scan;
+    _synctory_budget_match_t match;
+    _synctory_budget_match_t *buffer;
+    unsigned char *strongsum;
+    unsigned char *window;
+    unsigned char lchar = '\0';
+    unsigned char prev;
+    
+    buffer = (_synctory_budget_match_t *)malloc(_SYNCTORY_BUDGET_BUFSIZE);
+    strongsum = (unsigned char *)malloc(index->sumsize);
+    if ((NULL == buffer) || (NULL == strongsum))
+    {
+        free(buffer);
+        free(strongsum);
+        return ((errno != 0) ? errno : ENOMEM);
+    }
+    
+    rval = _synctory_scan_init(&scan, fdsource, 0, chunksize, _SYNCTORY_BUDGET_SCANSIZE);
+    if (rval)
+    {
+        free(buffer);
+        free(strongsum);
+        return rval;
+    }
+    
+    memset(&match, 0, sizeof(_synctory_budget_match_t));
+    
+    while (0 == rval)
+    {
+        /* make sure a complete window is available unless we're close to EOF */
+        if (_synctory_scan_available(&scan) < chunksize)
+        {
+            rval = _synctory_scan_fill(&scan);
+            if (rval)
+                break;
+        }
+        
+        rbytes = _synctory_scan_available(&scan);
+        if (rbytes > chunksize)
+            rbytes = chunksize;
+        if (0 == rbytes)
+            break;
+        window = _synctory_scan_window(&scan);
+        
+        /*
+         * Roll the weak checksum over full windows, calculate it otherwise.
+         * equal counts the bytes equal to the last one of the window; a
+         * window consisting of a single repeated byte is identical to its
+         * predecessor if that one does, too.
+         */
+        if (iflag || (rbytes < chunksize))
+        {
+            _synctory_checksum_init(&weaksum);
+            _synctory_checksum_update(&weaksum, window, rbytes);
+            _synctory_checksum_batch_reset(&batch);
+            wsum = _synctory_checksum_digest(&weaksum);
+            for (equal = 1; (equal < rbytes) && (window[rbytes - equal - 1] == window[rbytes - 1]); equal++);
+            same = 0;
+            iflag = 0;
+        }
+        else
+        {
+            wsum = _synctory_checksum_batch_next(&batch, &weaksum, lchar, window, _synctory_scan_available(&scan));
+            prev = (chunksize > 1) ? window[chunksize - 2] : lchar;
+            equal = (window[chunksize - 1] == prev) ? equal + 1 : 1;
+            same = (equal > chunksize);
+        }
+        
+        /* only windows whose weak checksum falls into the slice are looked up */
+        if (!same)
+        {
+            j = _SYNCTORY_INDEX_NONE;
+            if ((wsum >= slice->lo) && (wsum <= slice->hi))
+            {
+                hash = _synctory_index_filter_hash(wsum);
+                if (_synctory_index_filter(index, hash))
+                {
+                    stats->filter_hits++;
+                    _synctory_index_match(index, wsum, window, rbytes, header->algo, strongsum, stats, &j);
+                }
+                else
+                    stats->filter_misses++;
+            }
+        }
+        
+        if (_SYNCTORY_INDEX_NONE != j)
+        {
+            /* extend the current run, or start a new one */
+            if (have && (match.chunk == j) && ((_synctory_off_t)(match.offset + match.run) == curpos) && (match.run < UINT32_MAX))
+                match.run++;
+            else
+            {
+                if (have)
+                    rval = __synctory_budget_push(fdtemp, buffer, &fill, &match);
+                match.offset = (uint64_t)curpos;
+                match.chunk = j;
+                match.run = 1;
+                have = 1;
+                slice->count++;
+            }
+        }
+        
+        /* go one byte ahead */
+        lchar = window[0];
+        _synctory_scan_advance(&scan, 1);
+        curpos++;
+    }
+    
+    if ((0 == rval) && have)
+        rval = __synctory_budget_push(fdtemp, buffer, &fill, &match);
+    if ((0 == rval) && (fill > 0))
+        rval = _synctory_file64_write(fdtemp, buffer, fill * sizeof(_synctory_budget_match_t));
+    
+    _synctory_scan_free(&scan);
+    free(buffer);
+    free(strongsum);
+    return rval;
+}
+
+
+/**
+ * Merge the matches of all slices in ascending order of their offsets, and
+ * write the diff the greedy scan would have produced: the first matching
+ * position at or behind the current one becomes a chunk record, the bytes
+ * in between become raw data.
+ */
+static int
+__synctory_budget_walk(const _synctory_budget_slice_t *slice, unsigned int slices, int fdtemp, int fdsource, _synctory_diff_out_t *out, uint16_t chunksize, _synctory_off_t position)
+{
+    int rval = 0;
+    unsigned int i, best;
+    size_t per = _SYNCTORY_BUDGET_BUFSIZE / sizeof(_synctory_budget_match_t);
+    uint64_t n;
+    uint64_t *next, *fill;
+    size_t *head;
+    _synctory_budget_match_t *buffer, *match;
+    _synctory_off_t lpos = 0, x, end;
+    
+    buffer = (_synctory_budget_match_t *)malloc((size_t)slices * _SYNCTORY_BUDGET_BUFSIZE);
+    next = (uint64_t *)calloc(slices, sizeof(uint64_t));
+    fill = (uint64_t *)calloc(slices, sizeof(uint64_t));
+    head = (size_t *)calloc(slices, sizeof(size_t));
+    if ((NULL == buffer) || (NULL == next) || (NULL == fill) || (NULL == head))
+    {
+        free(buffer);
+        free(next);
+        free(fill);
+        free(head);
+        return ((errno != 0) ? errno : ENOMEM);
+    }
+    
+    while (0 == rval)
+    {
+        /* refill exhausted buffers, then pick the match with the lowest offset */
+        best = slices;
+        for (i = 0; (0 == rval) && (i < slices); i++)
+        {
+            if ((head[i] == fill[i]) && (next[i] < slice[i].count))
+            {
+                n = slice[i].count - next[i];
+                if (n > per)
+                    n = per;
+                rval = _synctory_file64_readat(fdtemp, &buffer[i * per], (size_t)n * sizeof(_synctory_budget_match_t), (_synctory_off_t)((slice[i].first + next[i]) * sizeof(_synctory_budget_match_t)));
+                next[i] += n;
+                fill[i] = n;
+                head[i] = 0;
+            }
+            if ((head[i] < fill[i]) && ((slices == best) || (buffer[i * per + head[i]].offset < buffer[best * per + head[best]].offset)))
+                best = i;
+        }
+        if (rval || (slices == best))
+            break;
+        
+        match = &buffer[best * per + head[best]];
+        head[best]++;
+        
+        /* every position of the run behind the last chunk starts another chunk */
+        end = (_synctory_off_t)(match->offset + match->run);
+        x = ((_synctory_off_t)match->offset > lpos) ? (_synctory_off_t)match->offset : lpos;
+        while ((0 == rval) && (x < end))
+        {
+            if (lpos < x)
+                rval = _synctory_diff_write_raw_fd(out, fdsource, lpos, x);
+            if (0 == rval)
+                rval = _synctory_diff_write_chunk(out, match->chunk);
+            
+            x = lpos = x + chunksize;
+        }
+    }
+    
+    /* any raw bytes left behind the last chunk? */
+    if ((0 == rval) && (lpos < position))
+        rval = _synctory_diff_write_raw_fd(out, fdsource, lpos, position);
+    
+    free(buffer);
+    free(next);
+    free(fill);
+    free(head);
+    return rval;
+}
+
+
+/**
+ * Create the diff slice by slice
+ */
+static int
+__synctory_budget_sliced(synctory_ctx_t *ctx, _synctory_budget_slice_t *slice, unsigned int slices, const _synctory_fheader_t *header, int fdfinger, int fdsource, int fddiff)
+{
+    int rval = 0;
+    int fdtemp = -1;
+    unsigned int i;
+    uint64_t first = 0;
+    FILE *temp;
+    _synctory_index_t index;
+    _synctory_fheader_t diff_header;
+    _synctory_off_t position;
+    _synctory_diff_out_t out;
+    synctory_stats_t stats;
+    
+    memset(&stats, 0, sizeof(synctory_stats_t));
+    
+    /* find out about the file size of the diff source file */
+    position = _synctory_file64_seek(fdsource, 0, SEEK_END);
+    if (position < 0)
+        return ((errno != 0) ? errno : -1);
+    
+    temp = tmpfile();
+    if (NULL == temp)
+        return ((errno != 0) ? errno : -1);
+    fdtemp = fileno(temp);
+    
+    /* scan the source file once per slice */
+    for (i = 0; (0 == rval) && (i < slices); i++)
+    {
+        slice[i].first = first;
+        slice[i].count = 0;
+        
+        rval = _synctory_index_load_range_fd(&index, fdfinger, header, slice[i].lo, slice[i].hi, slice[i].entries);
+        if (rval)
+            break;
+        
+        rval = __synctory_budget_scan(&slice[i], &index, header, fdsource, fdtemp, &stats);
+        _synctory_index_free(&index);
+        first += slice[i].count;
+    }
+    
+    /* collect information for the resulting diff file */
+    _synctory_diff_header_init(ctx, header, position, &diff_header);
+    
+    if ((0 == rval) && (0 != _synctory_file64_seek(fddiff, 0, SEEK_SET)))
+        rval = ((errno != 0) ? errno : -1);
+    if (0 == rval)
+    {
+        rval = _synctory_diff_out_init(&out, fddiff, ctx->write_buffer, &diff_header);
+        if (0 == rval)
+        {
+            rval = _synctory_diff_write_header(&out, &diff_header);
+            if (0 == rval)
+                rval = __synctory_budget_walk(slice, slices, fdtemp, fdsource, &out, header->chunksize, position);
+            if (0 == rval)
+                rval = _synctory_diff_out_flush(&out);
+            _synctory_diff_out_free(&out);
+        }
+    }
+    
+    fclose(temp);
+    
+    /* report statistics */
+    stats.source_passes = slices;
+    ctx->stats = stats;
+    return rval;
+}
+
+
+/**
+ * Create a diff file from a given fingerprint and a source file descriptor,
+ * using no more memory than ctx->memory_budget (if set) for the index of
+ * the fingerprint. The strategy is chosen from the number of fingerprint
+ * records: the fast diff if the whole index fits into the budget, a diff
+ * scanning the source once per slice of the fingerprint if the slices do,
+ * and the low memory diff otherwise.
+ */
+int
+_synctory_budget_diff(synctory_ctx_t *ctx, int fdfinger, int fdsource, int fddiff)
+{
+    int rval;
+    int sumsize;
+    unsigned int threads = 1;
+    unsigned int slices = 0;
+    uint64_t records, bytes, reserve;
+    uint64_t *hist;
+    unsigned char hbuf[_SYNCTORY_FH_BYTES];
+    _synctory_fheader_t header;
+    _synctory_index_t geometry;
+    _synctory_budget_slice_t slice[_SYNCTORY_BUDGET_MAXSLICES];
+    
+    rval = _synctory_file64_readat(fdfinger, hbuf, _SYNCTORY_FH_BYTES, 0);
+    if (rval)
+        return rval;
+    rval = _synctory_fh_getheader_bf(&header, hbuf, _SYNCTORY_FH_BYTES);
+    if (rval)
+        return rval;
+    if (header.type != _SYNCTORY_FH_FINGERPRINT)
+        return -1;
+    
+    sumsize = _synctory_strong_checksum_size(header.algo);
+    if (sumsize <= 0)
+        return EINVAL;
+    
+    rval = _synctory_index_records(fdfinger, &header, &records);
+    if (rval)
+        return rval;
+    rval = _synctory_index_geometry(&geometry, records, (size_t)sumsize, &bytes);
+    if (rval)
+        return rval;
+
+#ifdef _SYNCTORY_DIFF_THREADS
+    if (ctx->threads > 1)
+        threads = (ctx->threads > _SYNCTORY_DIFF_MAXTHREADS) ? _SYNCTORY_DIFF_MAXTHREADS : ctx->threads;
+#endif
+
+    /* does the whole index fit? */
+    if ((0 == ctx->memory_budget) || (bytes + (uint64_t)threads * _SYNCTORY_SCAN_BUFSIZE <= ctx->memory_budget))
+    {
+        rval = _synctory_diff_create_fast(ctx, fdfinger, fdsource, fddiff);
+        ctx->stats.source_passes = 1;
+        return rval;
+    }
+    
+    /*
+     * Memory needed besides the index of a slice: the fingerprint records
+     * are read while the index is built, the source file is scanned later.
+     */
+    reserve = (uint64_t)_SYNCTORY_INDEX_READ_RECORDS * (sizeof(uint32_t) + (size_t)sumsize);
+    if (reserve < (uint64_t)_SYNCTORY_BUDGET_SCANSIZE + _SYNCTORY_BUDGET_BUFSIZE)
+        reserve = (uint64_t)_SYNCTORY_BUDGET_SCANSIZE + _SYNCTORY_BUDGET_BUFSIZE;
+    
+    if ((ctx->memory_budget > reserve) && (ctx->memory_budget >= _SYNCTORY_BUDGET_BUCKETS * sizeof(uint64_t)))
+    {
+        hist = (uint64_t *)calloc(_SYNCTORY_BUDGET_BUCKETS, sizeof(uint64_t));
+        if (NULL == hist)
+            return ((errno != 0) ? errno : ENOMEM);
+        
+        rval = __synctory_budget_histogram(fdfinger, records, (size_t)sumsize, hist);
+        if (0 == rval)
+            slices = __synctory_budget_slices(hist, (size_t)sumsize, ctx->memory_budget - reserve, ctx->memory_budget, slice);
+        free(hist);
+        if (rval)
+            return rval;
+    }
+    
+    if (slices > 0)
+        return __synctory_budget_sliced(ctx, slice, slices, &header, fdfinger, fdsource, fddiff);
+    
+    /* not even the slices fit, fall back to the disk based index */
+    rval = _synctory_diff_create_fd(ctx, fdfinger, fdsource, fddiff);
+    ctx->stats.source_passes = 1;
+    return rval;
+}
+
+
+/**
+ * Peak resident set size of the calling process in bytes, or 0 if the
+ * platform does not tell
+ */
+uint64_t
+_synctory_budget_peak_rss(void)
+{
+#if defined(HAVE_SYS_RESOURCE_H) && defined(HAVE_GETRUSAGE_F)
+    struct rusage usage;
+    
+    if (0 != getrusage(RUSAGE_SELF, &usage))
+        return 0;
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024U;
+#endif
+#else
+    return 0;
+#endif
+}
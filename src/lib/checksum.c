@@ -19,6 +19,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <openssl/ripemd.h>
 #include <openssl/sha.h>
@@ -26,8 +27,296 @@
 
 #include <synctory.h>
 
+#include "config.h"
+
+#include "_blake3.h"
 #include "_checksum.h"
 
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+#ifdef HAVE_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+
+/*
+ * Vector kernels adding whole blocks of bytes to the parts a and b of the
+ * weak checksum. Each byte x adds x + 31 to a, and b accumulates a after
+ * each byte. For a block y[0] ... y[L-1], this means
+ * 
+ *   b += L * a + sum((L - k) * y[k]) + 31 * L * (L + 1) / 2
+ *   a += sum(y[k]) + 31 * L
+ * 
+ * All arithmetic is modulo 2^32, so the order of the additions does not
+ * matter, and the kernels produce exactly the results of the scalar code.
+ * They return the number of bytes processed, a multiple of the block size.
+ */
+typedef size_t (*__synctory_checksum_kernel_t)(unsigned char const *message, size_t len, uint32_t *a, uint32_t *b);
+
+/**
+ * The kernel suited to the processor, chosen when the library is loaded;
+ * NULL if there is none, which leaves all the work to the scalar code
+ */
+static __synctory_checksum_kernel_t __synctory_checksum_kernel = NULL;
+
+/*
+ * Vector kernels rolling the weak checksum over many window positions.
+ * Rolling from window k to window k + 1 adds d[k] = in[k] - out[k] to a
+ * and the new a minus count * (out[k] + 31) to b, so the values of a and
+ * b for consecutive windows are prefix sums, which are computed a vector
+ * at a time. They return the number of digests stored, a multiple of the
+ * vector width, and leave the checksum at the last window covered.
+ */
+typedef size_t (*__synctory_checksum_roller_t)(_synctory_checksum_t *checksum, unsigned char const *window, size_t n, uint32_t *digest);
+
+/**
+ * The rolling kernel suited to the processor; NULL if there is none
+ */
+static __synctory_checksum_roller_t __synctory_checksum_roller = NULL;
+
+
+#ifdef HAVE_X86_DISPATCH
+/**
+ * Add n blocks of width bytes to a and b, given the sum of their bytes,
+ * the sum of the byte sums of all blocks in front of each block (prefix),
+ * and the sum of their bytes weighted by their distance from the end of
+ * their block
+ */
+static void
+__synctory_checksum_fold(uint64_t n, uint32_t width, uint32_t sum, uint32_t prefix, uint32_t weighted, uint32_t *a, uint32_t *b)
+{
+    uint64_t pairs = (n & 1U) ? (n * ((n - 1) / 2)) : ((n / 2) * (n - 1));
+    uint32_t bytes = (uint32_t)n * width;
+    
+    *b += bytes * *a + width * prefix + weighted + 31U * ((uint32_t)n * (width * (width + 1) / 2) + width * width * (uint32_t)pairs);
+    *a += sum + 31U * bytes;
+}
+
+
+/**
+ * AVX2 kernel, working on blocks of 32 bytes
+ */
+__attribute__((target("avx2")))
+static size_t
+__synctory_checksum_avx2(unsigned char const *message, size_t len, uint32_t *a, uint32_t *b)
+{
+    size_t i;
+    size_t blocks = len / 32;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    __m256i data;
+    __m256i sum = zero;
+    __m256i prefix = zero;
+    __m256i weighted = zero;
+    __m128i s, p, w;
+    
+    for (i = 0; i < blocks; i++)
+    {
+        data = _mm256_loadu_si256((const __m256i *)&message[i * 32]);
+        prefix = _mm256_add_epi32(prefix, sum);
+        sum = _mm256_add_epi32(sum, _mm256_sad_epu8(data, zero));
+        weighted = _mm256_add_epi32(weighted, _mm256_madd_epi16(_mm256_maddubs_epi16(data, weights), ones));
+    }
+    
+    /* add up the lanes */
+    s = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    p = _mm_add_epi32(_mm256_castsi256_si128(prefix), _mm256_extracti128_si256(prefix, 1));
+    w = _mm_add_epi32(_mm256_castsi256_si128(weighted), _mm256_extracti128_si256(weighted, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    p = _mm_add_epi32(p, _mm_shuffle_epi32(p, 0x4e));
+    w = _mm_add_epi32(w, _mm_shuffle_epi32(w, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    p = _mm_add_epi32(p, _mm_shuffle_epi32(p, 0xb1));
+    w = _mm_add_epi32(w, _mm_shuffle_epi32(w, 0xb1));
+    
+    __synctory_checksum_fold(blocks, 32, (uint32_t)_mm_cvtsi128_si32(s), (uint32_t)_mm_cvtsi128_si32(p), (uint32_t)_mm_cvtsi128_si32(w), a, b);
+    return blocks * 32;
+}
+
+
+/**
+ * SSE4.1 kernel, working on blocks of 16 bytes
+ */
+__attribute__((target("sse4.1")))
+static size_t
+__synctory_checksum_sse41(unsigned char const *message, size_t len, uint32_t *a, uint32_t *b)
+{
+    size_t i;
+    size_t blocks = len / 16;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i weights = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i data;
+    __m128i sum = zero;
+    __m128i prefix = zero;
+    __m128i weighted = zero;
+    
+    for (i = 0; i < blocks; i++)
+    {
+        data = _mm_loadu_si128((const __m128i *)&message[i * 16]);
+        prefix = _mm_add_epi32(prefix, sum);
+        sum = _mm_add_epi32(sum, _mm_sad_epu8(data, zero));
+        weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_maddubs_epi16(data, weights), ones));
+    }
+    
+    /* add up the lanes */
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    prefix = _mm_add_epi32(prefix, _mm_shuffle_epi32(prefix, 0x4e));
+    weighted = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, 0x4e));
+    weighted = _mm_add_epi32(weighted, _mm_shuffle_epi32(weighted, 0xb1));
+    
+    /* the byte sums only occupy the lower half of each 64 bit lane */
+    __synctory_checksum_fold(blocks, 16, (uint32_t)_mm_extract_epi32(sum, 0), (uint32_t)_mm_extract_epi32(prefix, 0), (uint32_t)_mm_cvtsi128_si32(weighted), a, b);
+    return blocks * 16;
+}
+
+
+/**
+ * AVX2 rolling kernel, working on 8 windows at a time
+ */
+__attribute__((target("avx2")))
+static size_t
+__synctory_checksum_roll_avx2(_synctory_checksum_t *checksum, unsigned char const *window, size_t n, uint32_t *digest)
+{
+    size_t k;
+    size_t steps = n / 8;
+    const __m256i last = _mm256_set1_epi32(7);
+    const __m256i mask = _mm256_set1_epi32(0xffff);
+    const __m256i offs = _mm256_set1_epi32(31);
+    const __m256i count = _mm256_set1_epi32((int)checksum->count);
+    __m256i a = _mm256_set1_epi32((int)checksum->s1);
+    __m256i b = _mm256_set1_epi32((int)checksum->s2);
+    __m256i in, out, x;
+    
+    for (k = 0; k < steps; k++)
+    {
+        out = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&window[k * 8]));
+        in = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&window[k * 8 + checksum->count]));
+        
+        /* prefix sum of in - out on top of the a of the preceding window */
+        x = _mm256_sub_epi32(in, out);
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+        x = _mm256_add_epi32(x, _mm256_permute2x128_si256(_mm256_shuffle_epi32(x, 0xff), _mm256_shuffle_epi32(x, 0xff), 0x08));
+        a = _mm256_add_epi32(_mm256_permutevar8x32_epi32(a, last), x);
+        
+        /* same for b, adding a - count * (out + 31) */
+        x = _mm256_sub_epi32(a, _mm256_mullo_epi32(count, _mm256_add_epi32(out, offs)));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+        x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+        x = _mm256_add_epi32(x, _mm256_permute2x128_si256(_mm256_shuffle_epi32(x, 0xff), _mm256_shuffle_epi32(x, 0xff), 0x08));
+        b = _mm256_add_epi32(_mm256_permutevar8x32_epi32(b, last), x);
+        
+        _mm256_storeu_si256((__m256i *)&digest[k * 8], _mm256_or_si256(_mm256_slli_epi32(b, 16), _mm256_and_si256(a, mask)));
+    }
+    
+    if (steps > 0)
+    {
+        checksum->s1 = (uint32_t)_mm_extract_epi32(_mm256_extracti128_si256(a, 1), 3);
+        checksum->s2 = (uint32_t)_mm_extract_epi32(_mm256_extracti128_si256(b, 1), 3);
+    }
+    return steps * 8;
+}
+
+
+/**
+ * SSE4.1 rolling kernel, working on 4 windows at a time
+ */
+__attribute__((target("sse4.1")))
+static size_t
+__synctory_checksum_roll_sse41(_synctory_checksum_t *checksum, unsigned char const *window, size_t n, uint32_t *digest)
+{
+    size_t k;
+    size_t steps = n / 4;
+    int32_t bytes;
+    const __m128i mask = _mm_set1_epi32(0xffff);
+    const __m128i offs = _mm_set1_epi32(31);
+    const __m128i count = _mm_set1_epi32((int)checksum->count);
+    __m128i a = _mm_set1_epi32((int)checksum->s1);
+    __m128i b = _mm_set1_epi32((int)checksum->s2);
+    __m128i in, out, x;
+    
+    for (k = 0; k < steps; k++)
+    {
+        memcpy(&bytes, &window[k * 4], sizeof(int32_t));
+        out = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+        memcpy(&bytes, &window[k * 4 + checksum->count], sizeof(int32_t));
+        in = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes));
+        
+        /* prefix sum of in - out on top of the a of the preceding window */
+        x = _mm_sub_epi32(in, out);
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        a = _mm_add_epi32(_mm_shuffle_epi32(a, 0xff), x);
+        
+        /* same for b, adding a - count * (out + 31) */
+        x = _mm_sub_epi32(a, _mm_mullo_epi32(count, _mm_add_epi32(out, offs)));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        b = _mm_add_epi32(_mm_shuffle_epi32(b, 0xff), x);
+        
+        _mm_storeu_si128((__m128i *)&digest[k * 4], _mm_or_si128(_mm_slli_epi32(b, 16), _mm_and_si128(a, mask)));
+    }
+    
+    if (steps > 0)
+    {
+        checksum->s1 = (uint32_t)_mm_extract_epi32(a, 3);
+        checksum->s2 = (uint32_t)_mm_extract_epi32(b, 3);
+    }
+    return steps * 4;
+}
+
+
+/**
+ * Pick the kernel for the processor the library is loaded on
+ */
+__attribute__((constructor))
+static void
+__synctory_checksum_dispatch(void)
+{
+    (void)_synctory_checksum_select(_SYNCTORY_CHECKSUM_AUTO);
+}
+#endif
+
+
+/**
+ * Switch the weak checksum to the given kernel, one of the
+ * _SYNCTORY_CHECKSUM_* constants; _SYNCTORY_CHECKSUM_AUTO picks the best
+ * one the processor supports. Returns ENOTSUP if the kernel is not
+ * available. This lets the tests compare the kernels with each other; it
+ * must not be called while checksums are being computed.
+ */
+int
+_synctory_checksum_select(int kernel)
+{
+#ifdef HAVE_X86_DISPATCH
+    __builtin_cpu_init();
+    if (_SYNCTORY_CHECKSUM_AUTO == kernel)
+        kernel = __builtin_cpu_supports("avx2") ? _SYNCTORY_CHECKSUM_AVX2 : (__builtin_cpu_supports("sse4.1") ? _SYNCTORY_CHECKSUM_SSE41 : _SYNCTORY_CHECKSUM_SCALAR);
+    
+    if ((_SYNCTORY_CHECKSUM_AVX2 == kernel) && __builtin_cpu_supports("avx2"))
+    {
+        __synctory_checksum_kernel = __synctory_checksum_avx2;
+        __synctory_checksum_roller = __synctory_checksum_roll_avx2;
+        return 0;
+    }
+    if ((_SYNCTORY_CHECKSUM_SSE41 == kernel) && __builtin_cpu_supports("sse4.1"))
+    {
+        __synctory_checksum_kernel = __synctory_checksum_sse41;
+        __synctory_checksum_roller = __synctory_checksum_roll_sse41;
+        return 0;
+    }
+#endif
+    
+    if ((_SYNCTORY_CHECKSUM_AUTO != kernel) && (_SYNCTORY_CHECKSUM_SCALAR != kernel))
+        return ENOTSUP;
+    __synctory_checksum_kernel = NULL;
+    __synctory_checksum_roller = NULL;
+    return 0;
+}
+
 
 /**
  * This function implements the rolling checksum function as described by
@@ -49,11 +338,16 @@ _synctory_weak_checksum(void const *stream, size_t len)
     uint32_t a = 0, b = 0;
     unsigned char const *message = (unsigned char const *)stream;
     
+    /* leave the bulk of the work to the vector kernel, if there is one */
+    i = 0;
+    if (NULL != __synctory_checksum_kernel)
+        i = (int)__synctory_checksum_kernel(message, len, &a, &b);
+    
     /* work through the first n 4-byte blocks - this is cheaper than doing it byte by byte...
         int cast is necessary for the difference can become a negative number,
         otherwise buffers with a length < 4 bytes will provoke a segmentation fault
     */
-    for (i = 0; i < ((int)len - 4); i += 4)
+    for (; i < ((int)len - 4); i += 4)
     {
         b += 4 * (a + message[i]) + 3  * message[i+1] + 2 * message[i+2] + message[i+3] + 310;
         a += (message[i] + message[i+1] + message[i+2] + message[i+3] + 124); 
@@ -95,10 +389,18 @@ _synctory_checksum_update(_synctory_checksum_t *checksum, void const *stream, si
 {
     uint32_t a = checksum->s1;
     uint32_t b = checksum->s2;
+    size_t n;
     unsigned char const *message = (unsigned char const *)stream;
     
     checksum->count += len;
     
+    if (NULL != __synctory_checksum_kernel)
+    {
+        n = __synctory_checksum_kernel(message, len, &a, &b);
+        message += n;
+        len -= n;
+    }
+    
     /* work through the first n 16-byte blocks - this is cheaper than doing it byte by byte... */
     while (len >= 16)
     {
@@ -122,6 +424,55 @@ _synctory_checksum_update(_synctory_checksum_t *checksum, void const *stream, si
 }
 
 
+/**
+ * Roll the checksum of a full window starting at window forward by n
+ * bytes, storing the digests of the n following windows in digest. The
+ * checksum is left at the last of these windows; n + checksum->count
+ * bytes have to be readable at window.
+ */
+void
+_synctory_checksum_roll(_synctory_checksum_t *checksum, unsigned char const *window, size_t n, uint32_t *digest)
+{
+    size_t k = 0;
+    
+    if (NULL != __synctory_checksum_roller)
+        k = __synctory_checksum_roller(checksum, window, n, digest);
+    
+    for (; k < n; k++)
+    {
+        _synctory_checksum_rotate(checksum, window[k], window[k + checksum->count]);
+        digest[k] = _synctory_checksum_digest(checksum);
+    }
+}
+
+
+/**
+ * Shift forward the checksum by one byte and compute the digests of as
+ * many windows behind the new one as the available bytes permit. Returns
+ * the digest of the new window; the others are handed out one by one by
+ * _synctory_checksum_batch_next.
+ */
+uint32_t
+_synctory_checksum_batch_fill(_synctory_checksum_batch_t *batch, _synctory_checksum_t *checksum, unsigned char out, unsigned char const *window, size_t available)
+{
+    uint32_t digest;
+    size_t n = 0;
+    
+    _synctory_checksum_rotate(checksum, out, window[checksum->count - 1]);
+    digest = _synctory_checksum_digest(checksum);
+    
+    if (available > checksum->count)
+        n = available - checksum->count;
+    if (n > _SYNCTORY_CHECKSUM_BATCH)
+        n = _SYNCTORY_CHECKSUM_BATCH;
+    
+    _synctory_checksum_roll(checksum, window, n, batch->digest);
+    batch->next = 0;
+    batch->count = n;
+    return digest;
+}
+
+
 int
 _synctory_rmd160_checksum(void const *stream, size_t len, unsigned char *result)
 {
@@ -140,6 +491,17 @@ _synctory_sha1_checksum(void const *stream, size_t len, unsigned char *result)
 }
 
 
+/**
+ * XXH3-128 digest, stored in its canonical (big endian) representation
+ */
+int
+_synctory_xxh128_checksum(void const *stream, size_t len, unsigned char *result)
+{
+    XXH128_canonicalFromHash((XXH128_canonical_t *)result, XXH3_128bits(stream, len));
+    return 0;
+}
+
+
 int 
 _synctory_strong_checksum_size(synctory_algo_t algo)
 {
@@ -150,6 +512,10 @@ _synctory_strong_checksum_size(synctory_algo_t algo)
             break;
         case synctory_algo_sha1:
             return SHA_DIGEST_LENGTH;
+        case synctory_algo_blake3:
+            return _SYNCTORY_BLAKE3_BYTES;
+        case synctory_algo_xxh128:
+            return (int)sizeof(XXH128_canonical_t);
         default:
             return -1;
     }
@@ -176,6 +542,10 @@ _synctory_strong_checksum(void const *stream, size_t len, unsigned char *result,
         case synctory_algo_sha1:
             return _synctory_sha1_checksum(stream, len, result);
             break;
+        case synctory_algo_blake3:
+            return _synctory_blake3_checksum(stream, len, result);
+        case synctory_algo_xxh128:
+            return _synctory_xxh128_checksum(stream, len, result);
         default:
             return -1;
     }
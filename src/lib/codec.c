@@ -0,0 +1,302 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * Compression of the raw data inside diff files. Raw data is compressed in
+ * frames (see _SYNCTORY_CODEC_FRAME) which are independent from each other,
+ * so every frame can be decoded without the ones before it.
+ * 
+ *   zlib   every frame is a complete zlib stream
+ *   lzma   every frame is a raw LZMA2 stream; the filter options follow
+ *          from the compression level recorded in the diff header, with
+ *          the dictionary limited to the frame size
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+
+#include "_codec.h"
+
+
+/**
+ * Tell whether the codec identified by id has been compiled in
+ */
+int
+_synctory_codec_available(uint8_t id)
+{
+    switch (id)
+    {
+        case _SYNCTORY_CODEC_NONE:
+            return 1;
+#ifdef HAVE_ZLIB_H
+        case _SYNCTORY_CODEC_ZLIB:
+            return 1;
+#endif
+#ifdef HAVE_LZMA_H
+        case _SYNCTORY_CODEC_LZMA:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+
+/**
+ * Set up a compressor (or, if decode is set, a decompressor) for the codec
+ * identified by id. The codec library state is only created when the first
+ * frame comes along.
+ */
+int
+_synctory_codec_init(_synctory_codec_t *codec, uint8_t id, uint8_t level, int decode)
+{
+    memset(codec, 0, sizeof(_synctory_codec_t));
+    if (!_synctory_codec_available(id))
+        return ENOTSUP;
+    
+    codec->id = id;
+    codec->level = (level > _SYNCTORY_CODEC_MAXLEVEL) ? _SYNCTORY_CODEC_MAXLEVEL : level;
+    codec->decode = decode;
+    
+#ifdef HAVE_LZMA_H
+    if (_SYNCTORY_CODEC_LZMA == id)
+    {
+        if (lzma_lzma_preset(&codec->options, codec->level))
+            return EINVAL;
+        if (codec->options.dict_size > _SYNCTORY_CODEC_FRAME)
+            codec->options.dict_size = _SYNCTORY_CODEC_FRAME;
+        codec->filter[0].id = LZMA_FILTER_LZMA2;
+        codec->filter[0].options = &codec->options;
+        codec->filter[1].id = LZMA_VLI_UNKNOWN;
+        codec->filter[1].options = NULL;
+    }
+#endif
+    
+    return 0;
+}
+
+
+#ifdef HAVE_LZMA_H
+/**
+ * Start a new LZMA2 frame; liblzma reuses the memory of the previous one
+ */
+static int
+__synctory_codec_lzma_start(_synctory_codec_t *codec)
+{
+    lzma_ret ret;
+    
+    if (codec->decode)
+        ret = lzma_raw_decoder(&codec->ls, codec->filter);
+    else
+        ret = lzma_raw_encoder(&codec->ls, codec->filter);
+    
+    if (LZMA_OK == ret)
+    {
+        codec->ready = 1;
+        return 0;
+    }
+    return (LZMA_MEM_ERROR == ret) ? ENOMEM : EINVAL;
+}
+#endif
+
+
+/**
+ * Compress len bytes of data into one frame. On entry, size holds the
+ * capacity of packed; on return, the size of the frame. ENOSPC tells that
+ * the frame does not fit, in which case the data should be stored as is.
+ */
+int
+_synctory_codec_compress(_synctory_codec_t *codec, const unsigned char *data, size_t len, unsigned char *packed, size_t *size)
+{
+#ifdef HAVE_ZLIB_H
+    int zret;
+#endif
+#ifdef HAVE_LZMA_H
+    lzma_ret lret;
+    int rval;
+#endif
+    
+    switch (codec->id)
+    {
+#ifdef HAVE_ZLIB_H
+        case _SYNCTORY_CODEC_ZLIB:
+            if (!codec->ready)
+            {
+                if (Z_OK != deflateInit(&codec->zs, (int)codec->level))
+                    return ENOMEM;
+                codec->ready = 1;
+            }
+            else if (Z_OK != deflateReset(&codec->zs))
+                return EINVAL;
+            
+            codec->zs.next_in = (Bytef *)data;
+            codec->zs.avail_in = (uInt)len;
+            codec->zs.next_out = (Bytef *)packed;
+            codec->zs.avail_out = (uInt)*size;
+            zret = deflate(&codec->zs, Z_FINISH);
+            if (Z_STREAM_END == zret)
+            {
+                *size -= codec->zs.avail_out;
+                return 0;
+            }
+            return ((Z_OK == zret) || (Z_BUF_ERROR == zret)) ? ENOSPC : EINVAL;
+#endif
+        
+#ifdef HAVE_LZMA_H
+        case _SYNCTORY_CODEC_LZMA:
+            rval = __synctory_codec_lzma_start(codec);
+            if (rval)
+                return rval;
+            
+            codec->ls.next_in = data;
+            codec->ls.avail_in = len;
+            codec->ls.next_out = packed;
+            codec->ls.avail_out = *size;
+            lret = LZMA_OK;
+            while ((LZMA_OK == lret) && (codec->ls.avail_out > 0))
+                lret = lzma_code(&codec->ls, LZMA_FINISH);
+            
+            if (LZMA_STREAM_END == lret)
+            {
+                *size -= codec->ls.avail_out;
+                return 0;
+            }
+            return ((LZMA_OK == lret) || (LZMA_BUF_ERROR == lret)) ? ENOSPC : EINVAL;
+#endif
+        
+        default:
+            return ENOTSUP;
+    }
+}
+
+
+/**
+ * Prepare a decompressor for the next frame
+ */
+int
+_synctory_codec_reset(_synctory_codec_t *codec)
+{
+    switch (codec->id)
+    {
+#ifdef HAVE_ZLIB_H
+        case _SYNCTORY_CODEC_ZLIB:
+            if (codec->ready)
+                return (Z_OK == inflateReset(&codec->zs)) ? 0 : EINVAL;
+            if (Z_OK != inflateInit(&codec->zs))
+                return ENOMEM;
+            codec->ready = 1;
+            return 0;
+#endif
+        
+#ifdef HAVE_LZMA_H
+        case _SYNCTORY_CODEC_LZMA:
+            return __synctory_codec_lzma_start(codec);
+#endif
+        
+        default:
+            return ENOTSUP;
+    }
+}
+
+
+/**
+ * Decompress part of a frame: consume up to inlen bytes from in, and
+ * store up to outlen bytes in out. end is set once the frame is complete.
+ * Making no progress at all is not an error here; the caller has to tell
+ * whether more input is available.
+ */
+int
+_synctory_codec_decode(_synctory_codec_t *codec, const unsigned char *in, size_t inlen, size_t *consumed, unsigned char *out, size_t outlen, size_t *produced, int *end)
+{
+#ifdef HAVE_ZLIB_H
+    int zret;
+#endif
+#ifdef HAVE_LZMA_H
+    lzma_ret lret;
+#endif
+    
+    *end = 0;
+    switch (codec->id)
+    {
+#ifdef HAVE_ZLIB_H
+        case _SYNCTORY_CODEC_ZLIB:
+            codec->zs.next_in = (Bytef *)in;
+            codec->zs.avail_in = (uInt)inlen;
+            codec->zs.next_out = (Bytef *)out;
+            codec->zs.avail_out = (uInt)outlen;
+            zret = inflate(&codec->zs, Z_NO_FLUSH);
+            *consumed = inlen - codec->zs.avail_in;
+            *produced = outlen - codec->zs.avail_out;
+            if (Z_STREAM_END == zret)
+                *end = 1;
+            else if ((Z_OK != zret) && (Z_BUF_ERROR != zret))
+                return (Z_MEM_ERROR == zret) ? ENOMEM : EINVAL;
+            return 0;
+#endif
+        
+#ifdef HAVE_LZMA_H
+        case _SYNCTORY_CODEC_LZMA:
+            codec->ls.next_in = in;
+            codec->ls.avail_in = inlen;
+            codec->ls.next_out = out;
+            codec->ls.avail_out = outlen;
+            lret = lzma_code(&codec->ls, LZMA_RUN);
+            *consumed = inlen - codec->ls.avail_in;
+            *produced = outlen - codec->ls.avail_out;
+            if (LZMA_STREAM_END == lret)
+                *end = 1;
+            else if ((LZMA_OK != lret) && (LZMA_BUF_ERROR != lret))
+                return (LZMA_MEM_ERROR == lret) ? ENOMEM : EINVAL;
+            return 0;
+#endif
+        
+        default:
+            return ENOTSUP;
+    }
+}
+
+
+/**
+ * Release the codec library state
+ */
+void
+_synctory_codec_free(_synctory_codec_t *codec)
+{
+    if (!codec->ready)
+        return;
+    
+#ifdef HAVE_ZLIB_H
+    if (_SYNCTORY_CODEC_ZLIB == codec->id)
+    {
+        if (codec->decode)
+            inflateEnd(&codec->zs);
+        else
+            deflateEnd(&codec->zs);
+    }
+#endif
+#ifdef HAVE_LZMA_H
+    if (_SYNCTORY_CODEC_LZMA == codec->id)
+        lzma_end(&codec->ls);
+#endif
+    
+    codec->ready = 0;
+}
@@ -19,7 +19,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <synctory.h>
+
+#include "config.h"
 #include "version.h"
 
 #include "_checksum.h"
@@ -28,73 +33,528 @@
 #include "_fingerprint.h"
 #include "_fheader.h"
 #include "_file64.h"
-#include "_tree.h"
+#include "_index.h"
+#include "_lomem.h"
+#include "_scan.h"
+
+#ifdef _SYNCTORY_DIFF_THREADS
+#include <pthread.h>
+#endif
+
+
+/**
+ * Encode value as variable-length integer: seven bits per byte, least
+ * significant group first, with the high bit set on all bytes but the last.
+ * The encoding is padded with redundant groups to at least width bytes
+ * (at most _SYNCTORY_DIFF_VARINT_BYTES). Returns the number of bytes used.
+ */
+size_t
+_synctory_diff_varint_put(unsigned char *buffer, uint64_t value, size_t width)
+{
+    size_t i = 0;
+    
+    while ((value >= 0x80U) || (i + 1 < width))
+    {
+        buffer[i++] = (unsigned char)((value & 0x7FU) | 0x80U);
+        value >>= 7;
+    }
+    buffer[i++] = (unsigned char)value;
+    return i;
+}
 
-TREE_DEFINE(_tree_node_s, linkage)
 
+/**
+ * Decode a variable-length integer from the first len bytes of buffer.
+ * Returns the number of bytes consumed, or 0 if the encoding is incomplete
+ * or does not fit into 64 bits.
+ */
+size_t
+_synctory_diff_varint_get(const unsigned char *buffer, size_t len, uint64_t *value)
+{
+    size_t i;
+    uint64_t result = 0;
+    
+    for (i = 0; (i < len) && (i < _SYNCTORY_DIFF_VARINT_BYTES); i++)
+    {
+        /* the last group only holds the most significant bit */
+        if ((_SYNCTORY_DIFF_VARINT_BYTES - 1 == i) && (buffer[i] > 1U))
+            return 0;
+        result |= ((uint64_t)(buffer[i] & 0x7FU)) << (7 * i);
+        if (0 == (buffer[i] & 0x80U))
+        {
+            *value = result;
+            return i + 1;
+        }
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Fill in the header of a diff file. The diff inherits chunk size and
+ * checksum algorithm from the fingerprint; file type, codec and level are
+ * chosen by the context.
+ */
 void
-__tree_node_delete(_tree_node_t *node, void *tree)
+_synctory_diff_header_init(const synctory_ctx_t *ctx, const _synctory_fheader_t *finger, _synctory_off_t filesize, _synctory_fheader_t *header)
 {
-    int i;
-    TREE_REMOVE((_tree_t *)tree, _tree_node_s, linkage, node);
-    for (i = 0; i < node->payloads; i++)
-        free(node->payload[i].strong_checksum);
-    free(node->payload);
-    free(node);
+    header->algo = finger->algo;
+    header->chunksize = finger->chunksize;
+    header->filesize = (uint64_t)filesize;
+    header->type = (synctory_diff_compact == ctx->diff_format) ? _SYNCTORY_FH_DIFF_COMPACT : _SYNCTORY_FH_DIFF;
+    header->version = _SYNCTORY_VERSION_NUM;
+    header->codec = (uint8_t)ctx->codec;
+    header->level = (uint8_t)((ctx->codec_level > _SYNCTORY_CODEC_MAXLEVEL) ? _SYNCTORY_CODEC_MAXLEVEL : ctx->codec_level);
+    header->toc = ctx->toc_stride;
+    
+    /* without compression, there is no level */
+    if (synctory_codec_none == ctx->codec)
+        header->level = 0;
 }
 
 
+/**
+ * Set up the output of a diff written to fd. The record format and the
+ * compression of raw data follow the diff header. On failure, everything
+ * set up so far is released again, so _synctory_diff_out_free may still
+ * be called, but need not be.
+ */
+int
+_synctory_diff_out_init(_synctory_diff_out_t *out, int fd, size_t size, const _synctory_fheader_t *header)
+{
+    int rval;
+    
+    out->compact = (_SYNCTORY_FH_DIFF_COMPACT == header->type);
+    out->first = 0;
+    out->count = 0;
+    out->next = 0;
+    out->frame = NULL;
+    out->packed = NULL;
+    out->chunksize = header->chunksize;
+    out->position = 0;
+    out->records = 0;
+    out->literal = 0;
+    out->stride = header->toc;
+    out->mark = 0;
+    out->toc = NULL;
+    out->entries = 0;
+    out->capacity = 0;
+    out->writer.buffer = NULL;
+    
+    rval = _synctory_codec_init(&out->codec, header->codec, header->level, 0);
+    if ((0 == rval) && (_SYNCTORY_CODEC_NONE != header->codec))
+    {
+        out->frame = (unsigned char *)malloc(_SYNCTORY_CODEC_FRAME);
+        out->packed = (unsigned char *)malloc(_SYNCTORY_CODEC_FRAME);
+        if ((NULL == out->frame) || (NULL == out->packed))
+            rval = ((errno != 0) ? errno : ENOMEM);
+    }
+    
+    if (0 == rval)
+        rval = _synctory_writer_init(&out->writer, fd, size);
+    
+    if (rval)
+        _synctory_diff_out_free(out);
+    return rval;
+}
+
 
 /**
- * Transfer bytes between lpos and curpos from fdsource to fddiff.
+ * Account for a record of the diff. Whenever the output of a record reaches
+ * the next multiple of the stride, the record gets an entry in the table of
+ * contents, so a reader looking for some output offset finds a record at
+ * most one stride (plus the length of a record) in front of it.
  */
 int
-__synctory_diff_flush_raw_fd(int fdsource, int fddest, _synctory_off_t lpos, _synctory_off_t curpos)
+_synctory_diff_out_record(_synctory_diff_out_t *out, _synctory_off_t offset, uint64_t next, uint64_t length, int literal)
 {
-    int rval = 0;
-    unsigned char wbuf[9];
+    size_t capacity;
+    _synctory_diff_toc_entry_t *toc;
     
-    /* prepare a raw chunk header inicating the size of the raw chunk */
-    wbuf[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_RAW;
-    *((uint64_t *)&wbuf[1]) = _synctory_hton64(curpos - lpos);
+    out->records++;
+    if (literal)
+        out->literal += length;
     
-    /* write the raw chunk header to the diff result file */
-    if (write(fddest, wbuf, 9) != 9)
-        return ((errno != 0) ? errno : -1);
+    if ((out->stride > 0) && (out->position + length > out->mark))
+    {
+        if (out->entries == out->capacity)
+        {
+            capacity = (out->capacity > 0) ? (out->capacity * 2) : 64;
+            toc = (_synctory_diff_toc_entry_t *)realloc(out->toc, capacity * sizeof(_synctory_diff_toc_entry_t));
+            if (NULL == toc)
+                return ((errno != 0) ? errno : ENOMEM);
+            out->toc = toc;
+            out->capacity = capacity;
+        }
+        out->toc[out->entries].output = out->position;
+        out->toc[out->entries].offset = (uint64_t)offset;
+        out->toc[out->entries].next = next;
+        out->entries++;
+        out->mark = ((out->position + length + out->stride - 1) / out->stride) * out->stride;
+    }
     
-    /* copy the raw byte chunk */
-    _synctory_file64_bytecopy(fdsource, fddest, lpos, curpos - lpos);
+    out->position += length;
+    return 0;
+}
+
+
+/**
+ * Write the header of a diff file.
+ */
+int
+_synctory_diff_write_header(_synctory_diff_out_t *out, const _synctory_fheader_t *header)
+{
+    int rval;
+    unsigned char *wbuf;
+    _synctory_fheader_t fh = *header;
+    
+    rval = _synctory_writer_stage(&out->writer, _SYNCTORY_FH_BYTES, &wbuf);
+    if (rval)
+        return rval;
+    return _synctory_fh_setheader_bf(&fh, wbuf, _SYNCTORY_FH_BYTES);
+}
+
+
+/**
+ * Write the pending run of consecutive chunks, as a chunk record if it
+ * consists of a single chunk, and as a range record otherwise.
+ * 
+ * In a compact diff, the record type is followed by the zigzag encoded
+ * difference between the first chunk of the run and the chunk following
+ * the previous run, and, for ranges, by the number of chunks, all of them
+ * as variable-length integers.
+ */
+int
+_synctory_diff_write_run(_synctory_diff_out_t *out)
+{
+    int rval;
+    unsigned char *wbuf;
+    unsigned char record[_SYNCTORY_DIFF_RECORD_BYTES];
+    size_t len = 1;
+    uint64_t u64;
+    
+    if (0 == out->count)
+        return 0;
+    
+    rval = _synctory_diff_out_record(out, _synctory_writer_tell(&out->writer), out->next, out->count * out->chunksize, 0);
+    if (rval)
+        return rval;
+    
+    if (out->compact)
+    {
+        record[0] = (unsigned char)((1 == out->count) ? _SYNCTORY_DIFF_BTYPE_CHUNK : _SYNCTORY_DIFF_BTYPE_RANGE);
+        u64 = out->first - out->next;
+        len += _synctory_diff_varint_put(&record[len], _synctory_diff_zigzag(u64), 0);
+        if (out->count > 1)
+            len += _synctory_diff_varint_put(&record[len], out->count, 0);
+        out->next = out->first + out->count;
+        out->count = 0;
+        return _synctory_writer_put(&out->writer, record, len);
+    }
+    
+    if (1 == out->count)
+    {
+        rval = _synctory_writer_stage(&out->writer, 9, &wbuf);
+        if (rval)
+            return rval;
+        wbuf[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_CHUNK;
+    }
+    else
+    {
+        rval = _synctory_writer_stage(&out->writer, 17, &wbuf);
+        if (rval)
+            return rval;
+        wbuf[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_RANGE;
+        u64 = _synctory_hton64(out->count);
+        memcpy(&wbuf[9], &u64, sizeof(uint64_t));
+    }
+    u64 = _synctory_hton64(out->first);
+    memcpy(&wbuf[1], &u64, sizeof(uint64_t));
+    
+    out->count = 0;
+    return 0;
+}
+
+
+/**
+ * Add chunk to the diff. Chunks following each other in the source file
+ * and in the fingerprint are collected into a run, which is written once
+ * it cannot be continued anymore.
+ */
+int
+_synctory_diff_write_chunk(_synctory_diff_out_t *out, uint32_t chunk)
+{
+    int rval;
     
+    if ((out->count > 0) && ((uint64_t)chunk == out->first + out->count))
+    {
+        out->count++;
+        return 0;
+    }
+    
+    rval = _synctory_diff_write_run(out);
+    out->first = (uint64_t)chunk;
+    out->count = 1;
     return rval;
 }
 
 
+/**
+ * Prepare a raw chunk header indicating the size of the raw chunk.
+ */
+static int
+__synctory_diff_write_raw_header(_synctory_diff_out_t *out, _synctory_off_t lpos, _synctory_off_t curpos)
+{
+    int rval;
+    unsigned char *wbuf;
+    unsigned char record[1 + _SYNCTORY_DIFF_VARINT_BYTES];
+    uint64_t len = _synctory_hton64((uint64_t)(curpos - lpos));
+    
+    /* raw bytes end the current run of chunks */
+    rval = _synctory_diff_write_run(out);
+    if (0 == rval)
+        rval = _synctory_diff_out_record(out, _synctory_writer_tell(&out->writer), out->next, (uint64_t)(curpos - lpos), 1);
+    if (rval)
+        return rval;
+    
+    if (out->compact)
+    {
+        record[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_RAW;
+        return _synctory_writer_put(&out->writer, record, 1 + _synctory_diff_varint_put(&record[1], (uint64_t)(curpos - lpos), 0));
+    }
+    
+    rval = _synctory_writer_stage(&out->writer, 9, &wbuf);
+    if (rval)
+        return rval;
+    wbuf[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_RAW;
+    memcpy(&wbuf[1], &len, sizeof(uint64_t));
+    return 0;
+}
+
+
+/**
+ * Write a frame of raw data. If it does not get smaller by compression
+ * (or is too short to try), it is written as raw data record instead.
+ */
+int
+_synctory_diff_write_frame(_synctory_diff_out_t *out, const unsigned char *data, size_t len)
+{
+    int rval = ENOSPC;
+    unsigned char record[_SYNCTORY_DIFF_RECORD_BYTES];
+    size_t size = len - 1;
+    size_t n = 1;
+    uint64_t u64;
+    
+    if (len >= _SYNCTORY_CODEC_MINFRAME)
+        rval = _synctory_codec_compress(&out->codec, data, len, out->packed, &size);
+    if (ENOSPC == rval)
+    {
+        rval = __synctory_diff_write_raw_header(out, 0, (_synctory_off_t)len);
+        return rval ? rval : _synctory_writer_put(&out->writer, data, len);
+    }
+    if (0 == rval)
+        rval = _synctory_diff_write_run(out);
+    if (0 == rval)
+        rval = _synctory_diff_out_record(out, _synctory_writer_tell(&out->writer), out->next, (uint64_t)len, 1);
+    if (rval)
+        return rval;
+    
+    record[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_FRAME;
+    if (out->compact)
+    {
+        n += _synctory_diff_varint_put(&record[n], (uint64_t)len, 0);
+        n += _synctory_diff_varint_put(&record[n], (uint64_t)size, 0);
+    }
+    else
+    {
+        u64 = _synctory_hton64((uint64_t)len);
+        memcpy(&record[1], &u64, sizeof(uint64_t));
+        u64 = _synctory_hton64((uint64_t)size);
+        memcpy(&record[9], &u64, sizeof(uint64_t));
+        n = 17;
+    }
+    
+    rval = _synctory_writer_put(&out->writer, record, n);
+    return rval ? rval : _synctory_writer_put(&out->writer, out->packed, size);
+}
+
+
+/**
+ * Transfer bytes between lpos and curpos from fdsource to the diff.
+ */
+int
+_synctory_diff_write_raw_fd(_synctory_diff_out_t *out, int fdsource, _synctory_off_t lpos, _synctory_off_t curpos)
+{
+    int rval;
+    size_t n;
+    
+    /* compressed raw data is read frame by frame */
+    while ((NULL != out->frame) && (lpos < curpos))
+    {
+        n = ((curpos - lpos) > (_synctory_off_t)_SYNCTORY_CODEC_FRAME) ? _SYNCTORY_CODEC_FRAME : (size_t)(curpos - lpos);
+        rval = _synctory_file64_readat(fdsource, out->frame, n, lpos);
+        if (0 == rval)
+            rval = _synctory_diff_write_frame(out, out->frame, n);
+        if (rval)
+            return rval;
+        lpos += (_synctory_off_t)n;
+    }
+    if (NULL != out->frame)
+        return 0;
+    
+    rval = __synctory_diff_write_raw_header(out, lpos, curpos);
+    if (rval)
+        return rval;
+    
+    /* the raw bytes are read straight into the output buffer */
+    return _synctory_writer_copy(&out->writer, fdsource, lpos, curpos - lpos);
+}
+
+
+/**
+ * Transfer bytes between lpos and curpos from the mapped source to the diff.
+ * The mapping has to stay in place until the writer has been flushed.
+ */
+static int
+__synctory_diff_write_raw_map(_synctory_diff_out_t *out, const _synctory_file64_map_t *map, _synctory_off_t lpos, _synctory_off_t curpos)
+{
+    int rval;
+    size_t n;
+    
+    while ((NULL != out->frame) && (lpos < curpos))
+    {
+        n = ((curpos - lpos) > (_synctory_off_t)_SYNCTORY_CODEC_FRAME) ? _SYNCTORY_CODEC_FRAME : (size_t)(curpos - lpos);
+        rval = _synctory_diff_write_frame(out, &map->data[lpos], n);
+        if (rval)
+            return rval;
+        lpos += (_synctory_off_t)n;
+    }
+    if (NULL != out->frame)
+        return 0;
+    
+    rval = __synctory_diff_write_raw_header(out, lpos, curpos);
+    if (rval)
+        return rval;
+    return _synctory_writer_ref(&out->writer, &map->data[lpos], (size_t)(curpos - lpos));
+}
+
+
+/**
+ * Write the table of contents behind the last record. It starts with a
+ * record type of its own, followed by the stride, the number of records,
+ * the number of raw data bytes and the number of entries. Each entry holds
+ * an output offset, the diff offset of the record starting there, and the
+ * chunk following the run in front of that record (needed to decode chunk
+ * indices of a compact diff). The diff file ends with the offset of the
+ * table. All of them are 64 bit integers in network byte order.
+ */
+static int
+__synctory_diff_write_toc(_synctory_diff_out_t *out)
+{
+    int rval;
+    size_t i;
+    unsigned char *wbuf;
+    uint64_t u64[3];
+    uint64_t offset = (uint64_t)_synctory_writer_tell(&out->writer);
+    
+    rval = _synctory_writer_stage(&out->writer, _SYNCTORY_DIFF_TOC_HEAD, &wbuf);
+    if (rval)
+        return rval;
+    wbuf[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_TOC;
+    u64[0] = _synctory_hton64(out->stride);
+    memcpy(&wbuf[1], &u64[0], sizeof(uint64_t));
+    u64[0] = _synctory_hton64(out->records);
+    memcpy(&wbuf[9], &u64[0], sizeof(uint64_t));
+    u64[0] = _synctory_hton64(out->literal);
+    memcpy(&wbuf[17], &u64[0], sizeof(uint64_t));
+    u64[0] = _synctory_hton64((uint64_t)out->entries);
+    memcpy(&wbuf[25], &u64[0], sizeof(uint64_t));
+    
+    for (i = 0; i < out->entries; i++)
+    {
+        u64[0] = _synctory_hton64(out->toc[i].output);
+        u64[1] = _synctory_hton64(out->toc[i].offset);
+        u64[2] = _synctory_hton64(out->toc[i].next);
+        rval = _synctory_writer_put(&out->writer, u64, _SYNCTORY_DIFF_TOC_ENTRY);
+        if (rval)
+            return rval;
+    }
+    
+    u64[0] = _synctory_hton64(offset);
+    return _synctory_writer_put(&out->writer, u64, _SYNCTORY_DIFF_TOC_TAIL);
+}
+
+
+/**
+ * Write everything still pending to the diff file, followed by the table
+ * of contents if the diff has one.
+ */
+int
+_synctory_diff_out_flush(_synctory_diff_out_t *out)
+{
+    int rval;
+    
+    rval = _synctory_diff_write_run(out);
+    if ((0 == rval) && (out->stride > 0))
+        rval = __synctory_diff_write_toc(out);
+    if (rval)
+        return rval;
+    return _synctory_writer_flush(&out->writer);
+}
+
+
+/**
+ * Release the output of a diff; anything pending is discarded.
+ */
+void
+_synctory_diff_out_free(_synctory_diff_out_t *out)
+{
+    _synctory_writer_free(&out->writer);
+    _synctory_codec_free(&out->codec);
+    free(out->frame);
+    free(out->packed);
+    free(out->toc);
+    out->frame = NULL;
+    out->packed = NULL;
+    out->toc = NULL;
+}
+
+
 /**
  * Create a synctory diff file from a given fingerprint and a source file descriptor.
  * The fingerprint will be compared with the source file; recognized differences
  * will be written to the diff file descriptor in a libsynctory-readable format.
+ * 
+ * This implementation looks up the source windows in a sorted copy of the
+ * fingerprint on disk (see lomem.c), so its memory requirements do not depend
+ * on the size of the fingerprint. The source file is read by the scanner
+ * (see scan.c). The resulting diff is identical to the one created by
+ * _synctory_diff_create_fast.
  */
 int
-_synctory_diff_create_fd(int fdfinger, int fdsource, int fddiff)
+_synctory_diff_create_fd(synctory_ctx_t *ctx, int fdfinger, int fdsource, int fddiff)
 {
-    int kflag, rval = 0;
+    int rval = 0;
     int iflag = 1;
-    uint64_t index;
-    unsigned char hbuf[_SYNCTORY_FH_BYTES];
+    uint32_t j;
+    uint32_t wsum;
+    uint64_t hash;
+    unsigned char *strongsum;
     unsigned char *buffer;
-    unsigned char wbuf[9];
     unsigned char lchar = '\0';
     _synctory_fheader_t finger_header, diff_header;
     _synctory_off_t position;
     _synctory_off_t lpos, curpos;
     _synctory_checksum_t weaksum;
-    uint32_t wsum;
-    unsigned char *strongsum[2];
-    _synctory_fingerprint_iterctx_t ctx;
+    _synctory_checksum_batch_t batch;
+    _synctory_lomem_t lomem;
+    _synctory_scan_t scan;
+    _synctory_diff_out_t out;
+    synctory_stats_t stats;
     ssize_t rbytes;
     
-    /* initialize weak checksum structure */
-    _synctory_checksum_init(&weaksum);
+    memset(&stats, 0, sizeof(synctory_stats_t));
     
     /* try to read header from fingerprint file */
     rval = _synctory_fingerprint_fetchheader_fd(fdfinger, &finger_header);
@@ -111,33 +571,44 @@ _synctory_diff_create_fd(int fdfinger, int fdsource, int fddiff)
         return errno;
     
     /* collect information for the resulting diff file */
-    diff_header.algo = finger_header.algo;
-    diff_header.chunksize = finger_header.chunksize;
-    diff_header.filesize = (uint64_t)position;
-    diff_header.type = _SYNCTORY_FH_DIFF;
-    diff_header.version = _SYNCTORY_VERSION_NUM;
-    
-    /* generate the ready-to-write header inside a buffer */
-    rval = _synctory_fh_setheader_bf(&diff_header, hbuf, _SYNCTORY_FH_BYTES);
-    if (rval)
-        return rval;
+    _synctory_diff_header_init(ctx, &finger_header, position, &diff_header);
     
     /* make sure we're at the beginning of the result file */
     if (0 != _synctory_file64_seek(fddiff, 0, SEEK_SET))
         return errno;
     
-    /* try to write the header information into the result file */
-    rbytes = write(fddiff, hbuf, _SYNCTORY_FH_BYTES);
-    if (rbytes != _SYNCTORY_FH_BYTES)
+    /* sort the fingerprint into the disk based index */
+    rval = _synctory_lomem_load_fd(&lomem, fdfinger, &finger_header);
+    if (rval)
+        return rval;
+    
+    strongsum = (unsigned char *)malloc(lomem.sumsize);
+    if (NULL == strongsum)
+    {
+        _synctory_lomem_free(&lomem);
         return ((errno != 0) ? errno : -1);
+    }
+    
+    rval = _synctory_scan_init(&scan, fdsource, 0, diff_header.chunksize, _SYNCTORY_SCAN_BUFSIZE);
+    if (rval)
+    {
+        free(strongsum);
+        _synctory_lomem_free(&lomem);
+        return rval;
+    }
+    
+    rval = _synctory_diff_out_init(&out, fddiff, ctx->write_buffer, &diff_header);
+    if (rval)
+    {
+        _synctory_scan_free(&scan);
+        free(strongsum);
+        _synctory_lomem_free(&lomem);
+        return rval;
+    }
+    
+    /* the header goes first into the result file */
+    rval = _synctory_diff_write_header(&out, &diff_header);
     
-    /* initialize buffers */
-    buffer = (unsigned char *)malloc(diff_header.chunksize);
-    strongsum[0] = (unsigned char *)malloc(_synctory_strong_checksum_size(diff_header.algo));
-    strongsum[1] = (unsigned char *)malloc(_synctory_strong_checksum_size(diff_header.algo));
-    if ((NULL == buffer) || (NULL == strongsum[0]) || (NULL == strongsum[1]))
-        return errno;
-
     /*
      * initialize source file position pointers.
      * lpos points to the position after the last known chunk
@@ -145,339 +616,610 @@ _synctory_diff_create_fd(int fdfinger, int fdsource, int fddiff)
      */
     lpos = curpos = 0;
     
-    /* make sure we're at the beginning of the source file */
-    if (0 != _synctory_file64_seek(fdsource, curpos, SEEK_SET))
-        return errno;
-    
-    /* read chunks froms source file and process them */
-    while ((rbytes = read(fdsource, buffer, diff_header.chunksize)) > 0)
+    while (0 == rval)
     {
-        /* initialize helper variables */
-        kflag = 0;
-        index = 0;
-        _synctory_fingerprint_iterctx_init(&ctx, diff_header.chunksize, diff_header.algo);
-
+        /* make sure a complete window is available unless we're close to EOF */
+        if (_synctory_scan_available(&scan) < diff_header.chunksize)
+        {
+            rval = _synctory_scan_fill(&scan);
+            if (rval)
+                break;
+        }
+        
+        rbytes = (ssize_t)_synctory_scan_available(&scan);
+        if (rbytes > diff_header.chunksize)
+            rbytes = diff_header.chunksize;
+        if (0 == rbytes)
+            break;
+        buffer = _synctory_scan_window(&scan);
+        
         if (iflag || (rbytes < diff_header.chunksize))
         {
             _synctory_checksum_init(&weaksum);
             _synctory_checksum_update(&weaksum, buffer, rbytes);
+            _synctory_checksum_batch_reset(&batch);
+            wsum = _synctory_checksum_digest(&weaksum);
             iflag = 0;
         }
         else
-        {
-            _synctory_checksum_rotate(&weaksum, lchar, buffer[diff_header.chunksize - 1]);
-        }
+            wsum = _synctory_checksum_batch_next(&batch, &weaksum, lchar, buffer, _synctory_scan_available(&scan));
         
-        /* iterate over all chunk checksums in the fingerprint file */
-        while (0 == _synctory_fingerprint_read_iter_fd(fdfinger, &wsum, strongsum[0], _synctory_strong_checksum_size(diff_header.algo), &ctx))
+        /* most windows are rejected by the pre-filter, sparing the disk lookup */
+        hash = _synctory_index_filter_hash(wsum);
+        j = _SYNCTORY_INDEX_NONE;
+        if (_synctory_index_filter(&lomem, hash))
         {
-            /* check whether the weak sum matches */
-            if (wsum == _synctory_checksum_digest(&weaksum))
-            {
-                /* compute the strong checksum (only done when weak one already matched */
-                _synctory_strong_checksum(buffer, rbytes, strongsum[1], diff_header.algo);
-                
-                /* compare strong checksums */
-                if (0 == _synctory_strong_checksum_compare(strongsum[0], strongsum[1], _synctory_strong_checksum_size(diff_header.algo)))
-                {
-                    /* bingo! set kflag to true and exit loop */
-                    kflag = 1;
-                    break;
-                }
-            }
-                /* no match => increase index counter */
-                index++;
+            stats.filter_hits++;
+            rval = _synctory_lomem_match(&lomem, wsum, buffer, (size_t)rbytes, diff_header.algo, strongsum, &stats, &j);
+            if (rval)
+                break;
         }
-
-        if (kflag)
+        else
+            stats.filter_misses++;
+        
+        if (_SYNCTORY_INDEX_NONE != j)
         {
             /* first we need to check whether there are any unmatched bytes to save as "raw" */
             if (lpos != curpos)
-                __synctory_diff_flush_raw_fd(fdsource, fddiff, lpos, curpos);
+                rval = _synctory_diff_write_raw_fd(&out, fdsource, lpos, curpos);
             
             /* now take care of the identified chunk */
-            wbuf[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_CHUNK;
-            *((uint64_t *)&wbuf[1]) = _synctory_hton64(index);
-            if (write(fddiff, wbuf, 9) != 9)
-                return ((errno != 0) ? errno : -1);
+            if (0 == rval)
+                rval = _synctory_diff_write_chunk(&out, j);
+            if (rval)
+                break;
             
             /* continue after the identified chunk */
+            _synctory_scan_advance(&scan, rbytes);
             lpos = curpos = (curpos + diff_header.chunksize);
             iflag = 1;
         }
         else
         {
             /* go one byte ahead and try again */
-            curpos++;
             lchar = buffer[0];
+            _synctory_scan_advance(&scan, 1);
+            curpos++;
         }
-        if (curpos != _synctory_file64_seek(fdsource, curpos, SEEK_SET))
-            return errno;
-
     }
     
     /* any raw bytes left to flush down the toilet? */
-    if (lpos != curpos)
-        __synctory_diff_flush_raw_fd(fdsource, fddiff, lpos, curpos);
+    if ((0 == rval) && (lpos < position))
+        rval = _synctory_diff_write_raw_fd(&out, fdsource, lpos, position);
+    if (0 == rval)
+        rval = _synctory_diff_out_flush(&out);
     
+    /* report statistics */
+    ctx->stats = stats;
+    
+    _synctory_diff_out_free(&out);
+    _synctory_scan_free(&scan);
+    free(strongsum);
+    _synctory_lomem_free(&lomem);
     return rval;
 }
 
 
 /**
- * New implementation of synctory_diff which stores the fingerprint in an AVL
- * tree for faster lookups.
+ * Append a match to the match list of a segment
+ */
+static int
+__synctory_diff_segment_push(_synctory_diff_segment_t *segment, _synctory_off_t offset, uint32_t chunk)
+{
+    _synctory_diff_match_t *match;
+    size_t size;
+    
+    if (segment->count == segment->size)
+    {
+        size = (segment->size ? 2 * segment->size : _SYNCTORY_DIFF_MATCHES);
+        match = (_synctory_diff_match_t *)realloc(segment->match, size * sizeof(_synctory_diff_match_t));
+        if (NULL == match)
+            return ((errno != 0) ? errno : ENOMEM);
+        segment->match = match;
+        segment->size = size;
+    }
+    
+    segment->match[segment->count].offset = offset;
+    segment->match[segment->count].chunk = chunk;
+    segment->count++;
+    return 0;
+}
+
+
+/**
+ * Move the rolling window across one segment of the source file, starting
+ * at segment->start. The scan stops at the first window starting at or
+ * behind segment->end, or at the end of the source file; this position is
+ * stored in segment->exit.
  * 
- * @Warning 
- * This implementation has increased memory requirements, particularly when 
- * dealing with bigger fingerprint files!
+ * If a guide segment is given, the scan also stops as soon as the window
+ * reaches a position the guide's scan passed through as well: from there
+ * on, both scans are identical (see __synctory_diff_reconcile). This
+ * position is stored in segment->merge, which is -1 otherwise.
  */
-int
-_synctory_diff_create_fast(int fdfinger, int fdsource, int fddiff)
+static int
+__synctory_diff_scan(_synctory_diff_segment_t *segment)
 {
-    int                         rval = 0, status = 0;
+    int                         rval = 0;
     int                         iflag = 1;
-    int                         i;
-    uint64_t                    index = 0;
-    _synctory_fheader_t         finger_header, diff_header;
-    _synctory_off_t             position;
-    _synctory_off_t             lpos, curpos;
-    _synctory_checksum_t        weaksum;
-    _tree_t                     ftree = TREE_INITIALIZER(_tree_node_compare);
+    int                         kflag;
+    uint32_t                    j;
+    uint32_t                    predict = _SYNCTORY_INDEX_NONE;
     uint32_t                    wsum;
-    unsigned char              *strongsum1;
-    unsigned char              *strongsum2;
+    uint64_t                    hash;
+    size_t                      gi = 0;
+    size_t                      bufsize;
+    uint16_t                    chunksize = segment->header->chunksize;
+    const _synctory_index_t    *findex = segment->index;
+    const _synctory_diff_segment_t *guide = segment->guide;
+    _synctory_off_t             curpos = segment->start;
+    _synctory_checksum_t        weaksum;
+    _synctory_checksum_batch_t  batch;
+    _synctory_scan_t            scan;
+    unsigned char              *strongsum;
     unsigned char              *buffer;
-    unsigned char               hbuf[_SYNCTORY_FH_BYTES];
-    unsigned char               wbuf[9];
     unsigned char               lchar = '\0';
     ssize_t                     rbytes;
-    _synctory_fingerprint_iterctx_t ctx;
     
-    /*
-     * STEP 1
-     * 
-     * Check the given fingerprint file, identify its header etc.
-     */
-    
-    /* get file header from fingerprint file */
-    rval = _synctory_fh_getheader_fd(&finger_header, fdfinger);
-    if (rval)
-        return rval;
+    segment->merge = -1;
     
-    /* check whether the fingerprint file is acutally a fingerprint */
-    if (finger_header.type != _SYNCTORY_FH_FINGERPRINT)
-        return -1;
+    strongsum = (unsigned char *)malloc(findex->sumsize);
+    if (NULL == strongsum)
+        return ((errno != 0) ? errno : -1);
     
-    /*
-     * STEP 2
-     *
-     * Gerenate the AVL tree
-     */
+    /* no need to read ahead much further than the segment end */
+    bufsize = segment->bufsize;
+    if ((_synctory_off_t)bufsize > (segment->end - segment->start) + chunksize)
+        bufsize = (size_t)(segment->end - segment->start) + chunksize;
     
-    /* Initialize data structures */
-    _synctory_fingerprint_iterctx_init(&ctx, finger_header.chunksize, finger_header.algo);
-    strongsum1 = (unsigned char *)malloc(_synctory_strong_checksum_size(finger_header.algo));
-    strongsum2 = (unsigned char *)malloc(_synctory_strong_checksum_size(finger_header.algo));
-    if ((NULL == strongsum1) || (NULL == strongsum2))
+    if (NULL != segment->map)
+        _synctory_scan_init_map(&scan, segment->map, curpos, chunksize);
+    else
     {
-        free(strongsum1);
-        free(strongsum2);
-        return errno;
+        rval = _synctory_scan_init(&scan, segment->fd, curpos, chunksize, bufsize);
+        if (rval)
+        {
+            free(strongsum);
+            return rval;
+        }
     }
     
-    /* iterate over fingerprint file */
-    while (0 == _synctory_fingerprint_read_iter_fd(fdfinger, &wsum, strongsum1, _synctory_strong_checksum_size(finger_header.algo), &ctx))
+    while (curpos < segment->end)
     {
-        _tree_node_t *v = _tree_node_new(wsum);
-        _tree_node_t *vv = TREE_SEARCH(&ftree, v);
-        status = 0;
-        if (vv)
+        /* stop once the scan runs into the path of the guide */
+        if (NULL != guide)
         {
-            _tree_node_append_payload(vv, index, strongsum1, _synctory_strong_checksum_size(finger_header.algo), &status);
+            while ((gi < guide->count) && ((guide->match[gi].offset + chunksize) <= curpos))
+                gi++;
+            if ((curpos >= guide->start) && ((gi == guide->count) || (guide->match[gi].offset >= curpos)))
+            {
+                segment->merge = curpos;
+                break;
+            }
+        }
+        
+        /* make sure a complete window is available unless we're close to EOF */
+        if (_synctory_scan_available(&scan) < chunksize)
+        {
+            rval = _synctory_scan_fill(&scan);
+            if (rval)
+                break;
+        }
+        
+        rbytes = (ssize_t)_synctory_scan_available(&scan);
+        if (rbytes > chunksize)
+            rbytes = chunksize;
+        if (0 == rbytes)
+            break;
+        buffer = _synctory_scan_window(&scan);
+        
+        if (iflag || (rbytes < chunksize))
+        {
+            _synctory_checksum_init(&weaksum);
+            _synctory_checksum_update(&weaksum, buffer, rbytes);
+            _synctory_checksum_batch_reset(&batch);
+            wsum = _synctory_checksum_digest(&weaksum);
+            iflag = 0;
         }
         else
+            wsum = _synctory_checksum_batch_next(&batch, &weaksum, lchar, buffer, _synctory_scan_available(&scan));
+        
+        /* after a match, the following chunk is the most likely one to match next */
+        kflag = 0;
+        if (_SYNCTORY_INDEX_NONE != predict)
+        {
+            kflag = _synctory_index_predict(findex, predict, wsum, buffer, (size_t)rbytes, segment->header->algo, strongsum);
+            if (kflag)
+            {
+                segment->stats.predict_hits++;
+                j = predict;
+            }
+            else
+                segment->stats.predict_misses++;
+        }
+        
+        /* most windows are rejected by the pre-filter, sparing the index lookup */
+        if (!kflag)
+        {
+            hash = _synctory_index_filter_hash(wsum);
+            if (_synctory_index_filter(findex, hash))
+            {
+                segment->stats.filter_hits++;
+                kflag = _synctory_index_match(findex, wsum, buffer, (size_t)rbytes, segment->header->algo, strongsum, &segment->stats, &j);
+            }
+            else
+                segment->stats.filter_misses++;
+        }
+        
+        if (kflag)
         {
-            TREE_APPEND(&ftree, _tree_node_new(wsum));
-            _tree_node_t *vv = TREE_SEARCH(&ftree, v);
-            _tree_node_append_payload(vv, index, strongsum1, _synctory_strong_checksum_size(finger_header.algo), &status);
+            rval = __synctory_diff_segment_push(segment, curpos, j);
+            if (rval)
+                break;
+            
+            /* continue after the identified chunk */
+            predict = j + 1;
+            _synctory_scan_advance(&scan, rbytes);
+            curpos += chunksize;
+            iflag = 1;
         }
-        if (status)
+        else
         {
-            free(strongsum1);
-            free(strongsum2);
-            TREE_FWD_APPLY(&ftree, __tree_node_delete, &ftree);
-            return status;
+            /* go one byte ahead and try again */
+            predict = _SYNCTORY_INDEX_NONE;
+            lchar = buffer[0];
+            _synctory_scan_advance(&scan, 1);
+            curpos++;
         }
-        free(v);
-        index++;
     }
     
-     /* find out about the file size of the diff source file */
-    position = _synctory_file64_seek(fdsource, 0, SEEK_END);
-    if (position < 0)
-    {
-        free(strongsum1);
-        free(strongsum2);
-        TREE_FWD_APPLY(&ftree, __tree_node_delete, &ftree);
-        return errno;
-    }
+    segment->exit = curpos;
     
-    /* collect information for the resulting diff file */
-    diff_header.algo = finger_header.algo;
-    diff_header.chunksize = finger_header.chunksize;
-    diff_header.filesize = (uint64_t)position;
-    diff_header.type = _SYNCTORY_FH_DIFF;
-    diff_header.version = _SYNCTORY_VERSION_NUM;
-    
-    /* generate the ready-to-write header inside a buffer */
-    rval = _synctory_fh_setheader_bf(&diff_header, hbuf, _SYNCTORY_FH_BYTES);
+    free(strongsum);
+    _synctory_scan_free(&scan);
+    return rval;
+}
+
+
+#ifdef _SYNCTORY_DIFF_THREADS
+/**
+ * Thread entry point scanning a segment
+ */
+static void *
+__synctory_diff_worker(void *arg)
+{
+    _synctory_diff_segment_t *segment = (_synctory_diff_segment_t *)arg;
+    segment->rval = __synctory_diff_scan(segment);
+    return NULL;
+}
+#endif
+
+
+/**
+ * A segment scanned in parallel starts at a nominal boundary, while the
+ * single-threaded scan enters it at the exit position of the preceding
+ * segment, which may lie up to one chunk behind the boundary. Both scans
+ * only differ until they pass through a common position; from there on,
+ * they are identical, since a window's match only depends on its content.
+ * 
+ * The segment is therefore rescanned from the true entry position, guided
+ * by the parallel scan, until the two scans merge. Usually this happens
+ * within a few windows. The rescanned matches replace those found in front
+ * of the merge position.
+ */
+static int
+__synctory_diff_reconcile(_synctory_diff_segment_t *segment, _synctory_off_t entry)
+{
+    int rval;
+    size_t i, n;
+    _synctory_diff_segment_t rescan;
+    
+    memset(&rescan, 0, sizeof(_synctory_diff_segment_t));
+    rescan.index = segment->index;
+    rescan.header = segment->header;
+    rescan.fd = segment->fd;
+    rescan.map = segment->map;
+    rescan.start = entry;
+    rescan.end = segment->end;
+    rescan.bufsize = _SYNCTORY_DIFF_RESCAN_BUFSIZE;
+    rescan.guide = segment;
+    
+    rval = __synctory_diff_scan(&rescan);
     if (rval)
     {
-        free(strongsum1);
-        free(strongsum2);
-        TREE_FWD_APPLY(&ftree, __tree_node_delete, &ftree);
+        free(rescan.match);
         return rval;
     }
     
-    /* make sure we're at the beginning of the result file */
-    if (0 != _synctory_file64_seek(fddiff, 0, SEEK_SET))
+    segment->stats.filter_hits += rescan.stats.filter_hits;
+    segment->stats.filter_misses += rescan.stats.filter_misses;
+    segment->stats.index_misses += rescan.stats.index_misses;
+    segment->stats.predict_hits += rescan.stats.predict_hits;
+    segment->stats.predict_misses += rescan.stats.predict_misses;
+    
+    if (rescan.merge < 0)
     {
-        free(strongsum1);
-        free(strongsum2);
-        TREE_FWD_APPLY(&ftree, __tree_node_delete, &ftree);
-        return errno;
+        /* the scans never merged: the rescan replaces the segment */
+        free(segment->match);
+        segment->match = rescan.match;
+        segment->count = rescan.count;
+        segment->size = rescan.size;
+        segment->exit = rescan.exit;
+        return 0;
     }
     
-    /* try to write the header information into the result file */
-    rbytes = write(fddiff, hbuf, _SYNCTORY_FH_BYTES);
-    if (rbytes != _SYNCTORY_FH_BYTES)
+    /* keep the segment's matches behind the merge position */
+    for (i = 0; (i < segment->count) && (segment->match[i].offset < rescan.merge); i++);
+    n = segment->count - i;
+    if (0 == rescan.count)
     {
-        free(strongsum1);
-        free(strongsum2);
-        TREE_FWD_APPLY(&ftree, __tree_node_delete, &ftree);
-        return ((errno != 0) ? errno : -1);
+        if (n)
+            memmove(segment->match, &segment->match[i], n * sizeof(_synctory_diff_match_t));
+        segment->count = n;
+        free(rescan.match);
+        return 0;
     }
     
-    /* initialize buffers */
-    buffer = (unsigned char *)malloc(diff_header.chunksize);
-    if (NULL == buffer)
+    for (; i < segment->count; i++)
     {
-        free(strongsum1);
-        free(strongsum2);
-        free(buffer);
-        TREE_FWD_APPLY(&ftree, __tree_node_delete, &ftree);
-        return ((errno != 0) ? errno : -1);
+        rval = __synctory_diff_segment_push(&rescan, segment->match[i].offset, segment->match[i].chunk);
+        if (rval)
+        {
+            free(rescan.match);
+            return rval;
+        }
     }
+    free(segment->match);
+    segment->match = rescan.match;
+    segment->count = rescan.count;
+    segment->size = rescan.size;
+    return 0;
+}
+
+
+/**
+ * Write the matches of a segment to the diff, preceded by the unmatched
+ * bytes in front of them. lpos points to the position after the last
+ * written chunk.
+ */
+static int
+__synctory_diff_segment_write(const _synctory_diff_segment_t *segment, int fdsource, _synctory_diff_out_t *out, _synctory_off_t *lpos)
+{
+    int rval = 0;
+    size_t i;
     
-    /*
-     * initialize source file position pointers.
-     * lpos points to the position after the last known chunk
-     * curpos points to the current position.
-     */
-    lpos = curpos = 0;
+    for (i = 0; (0 == rval) && (i < segment->count); i++)
+    {
+        /* first we need to check whether there are any unmatched bytes to save as "raw" */
+        if (*lpos != segment->match[i].offset)
+        {
+            if (NULL != segment->map)
+                rval = __synctory_diff_write_raw_map(out, segment->map, *lpos, segment->match[i].offset);
+            else
+                rval = _synctory_diff_write_raw_fd(out, fdsource, *lpos, segment->match[i].offset);
+        }
+        
+        /* now take care of the identified chunk */
+        if (0 == rval)
+            rval = _synctory_diff_write_chunk(out, segment->match[i].chunk);
+        
+        *lpos = segment->match[i].offset + segment->header->chunksize;
+    }
     
-    /* make sure we're at the beginning of the source file */
-    if (0 != _synctory_file64_seek(fdsource, curpos, SEEK_SET))
+    return rval;
+}
+
+
+/**
+ * New implementation of synctory_diff which looks up the source windows in
+ * the hash index of a fingerprint (see index.c), built beforehand by
+ * _synctory_fpindex_load_fd. The index is only read, so several diffs may
+ * use the same index at once.
+ * 
+ * The source file is read in large blocks by the scanner (see scan.c); the
+ * rolling window is moved across the block buffer instead of seeking and
+ * re-reading the source for every byte.
+ * 
+ * The source file is processed in segments. If the context asks for more
+ * than one thread, up to that many consecutive segments are scanned
+ * concurrently against the shared index, and reconciled afterwards (see
+ * __synctory_diff_reconcile). The resulting diff is identical to the one
+ * created by a single thread.
+ * 
+ * @Warning 
+ * This implementation has increased memory requirements, particularly when 
+ * dealing with bigger fingerprint files!
+ */
+int
+_synctory_diff_create_index(synctory_ctx_t *ctx, const synctory_fpindex_t *fpindex, int fdsource, int fddiff)
+{
+    int                         rval = 0;
+    unsigned int                threads = 1;
+    unsigned int                i, n;
+    _synctory_fheader_t         diff_header;
+    _synctory_off_t             position;
+    _synctory_off_t             lpos, entry, seglen;
+    _synctory_diff_segment_t   *segment;
+    _synctory_file64_map_t      map;
+    _synctory_diff_out_t        out;
+    synctory_stats_t            stats;
+#ifdef _SYNCTORY_DIFF_THREADS
+    pthread_t                  *thread;
+    int                        *started;
+#endif
+    
+    memset(&stats, 0, sizeof(synctory_stats_t));
+    map.data = NULL;
+    map.size = 0;
+    
+    /* the output is released even if it has never been set up */
+    memset(&out, 0, sizeof(_synctory_diff_out_t));
+    
+#ifdef _SYNCTORY_DIFF_THREADS
+    if (ctx->threads > 1)
+        threads = (ctx->threads > _SYNCTORY_DIFF_MAXTHREADS) ? _SYNCTORY_DIFF_MAXTHREADS : ctx->threads;
+#endif
+    
+    segment = (_synctory_diff_segment_t *)calloc(threads, sizeof(_synctory_diff_segment_t));
+#ifdef _SYNCTORY_DIFF_THREADS
+    thread = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    started = (int *)calloc(threads, sizeof(int));
+    if ((NULL == segment) || (NULL == thread) || (NULL == started))
     {
-        free(strongsum1);
-        free(strongsum2);
-        free(buffer);
-        TREE_FWD_APPLY(&ftree, __tree_node_delete, &ftree);
-        return errno;
+        free(segment);
+        free(thread);
+        free(started);
+        return ((errno != 0) ? errno : -1);
     }
+#else
+    if (NULL == segment)
+    {
+        return ((errno != 0) ? errno : -1);
+    }
+#endif
+    
+     /* find out about the file size of the diff source file */
+    position = _synctory_file64_seek(fdsource, 0, SEEK_END);
+    if (position < 0)
+        rval = ((errno != 0) ? errno : -1);
     
-    /* read chunks froms source file and process them */
-    while ((rbytes = read(fdsource, buffer, diff_header.chunksize)) > 0)
+    /* collect information for the resulting diff file */
+    _synctory_diff_header_init(ctx, &fpindex->header, position, &diff_header);
+    
+    /* make sure we're at the beginning of the result file */
+    if ((0 == rval) && (0 != _synctory_file64_seek(fddiff, 0, SEEK_SET)))
+        rval = ((errno != 0) ? errno : -1);
+    
+    /* the header goes first into the result file */
+    if (0 == rval)
+        rval = _synctory_diff_out_init(&out, fddiff, ctx->write_buffer, &diff_header);
+    if (0 == rval)
+        rval = _synctory_diff_write_header(&out, &diff_header);
+    
+    /* walk the source file in memory if it can be mapped (and may be), read it otherwise */
+    if ((0 == rval) && (0 == ctx->memory_budget) && (0 == _synctory_file64_map(fdsource, &map, _SYNCTORY_FILE64_MAP_SEQUENTIAL)) && (map.size != position))
+        _synctory_file64_unmap(&map);
+    
+    /*
+     * Scan the source file, a batch of segments at a time. The first segment
+     * of a batch starts where the previous batch ended, so its scan is exact;
+     * all others are reconciled with their predecessor.
+     * lpos points to the position after the last known chunk,
+     * entry points to the start of the next batch.
+     */
+    lpos = entry = 0;
+    
+    while ((0 == rval) && (entry < position))
     {
-        if (iflag || (rbytes < diff_header.chunksize))
+        /* spread the rest of the file across the threads */
+        seglen = _SYNCTORY_DIFF_SEGMENT;
+        if (threads > 1)
         {
-            _synctory_checksum_init(&weaksum);
-            _synctory_checksum_update(&weaksum, buffer, rbytes);
-            iflag = 0;
+            seglen = (position - entry + threads - 1) / threads;
+            if (seglen > _SYNCTORY_DIFF_SEGMENT)
+                seglen = _SYNCTORY_DIFF_SEGMENT;
+            if (seglen < _SYNCTORY_DIFF_MINSEGMENT)
+                seglen = _SYNCTORY_DIFF_MINSEGMENT;
         }
-        else
+        
+        for (n = 0; (n < threads) && ((entry + (_synctory_off_t)n * seglen) < position); n++)
         {
-            _synctory_checksum_rotate(&weaksum, lchar, buffer[diff_header.chunksize - 1]);
+            segment[n].index = &fpindex->index;
+            segment[n].header = &diff_header;
+            segment[n].fd = fdsource;
+            segment[n].map = (NULL != map.data) ? &map : NULL;
+            segment[n].start = entry + (_synctory_off_t)n * seglen;
+            segment[n].end = segment[n].start + seglen;
+            if (segment[n].end > position)
+                segment[n].end = position;
+            segment[n].bufsize = _SYNCTORY_SCAN_BUFSIZE;
+            segment[n].guide = NULL;
+            segment[n].count = 0;
+            segment[n].rval = 0;
         }
         
-        _tree_node_t *w = _tree_node_new(_synctory_checksum_digest(&weaksum));
-        _tree_node_t *ww = TREE_SEARCH(&ftree, w);
-        free(w);
-        
-        if (ww)
+#ifdef _SYNCTORY_DIFF_THREADS
+        /* the first segment is scanned by the calling thread */
+        for (i = 1; i < n; i++)
+            started[i] = (0 == pthread_create(&thread[i], NULL, __synctory_diff_worker, &segment[i]));
+        segment[0].rval = __synctory_diff_scan(&segment[0]);
+        for (i = 1; i < n; i++)
         {
-            int kflag = 0;
-            for (i = 0; i < ww->payloads; i++)
-            {
-                _synctory_strong_checksum(buffer, rbytes, strongsum2, diff_header.algo);
-                
-                /* compare strong checksums */
-                if (0 == _synctory_strong_checksum_compare(ww->payload[i].strong_checksum, strongsum2, _synctory_strong_checksum_size(diff_header.algo)))
-                {
-                    /* bingo! set kflag to true and exit loop */
-                    kflag = 1;
-                    break;
-                }
-            }
-            if (kflag)
-            {
-                /* first we need to check whether there are any unmatched bytes to save as "raw" */
-                if (lpos != curpos)
-                    __synctory_diff_flush_raw_fd(fdsource, fddiff, lpos, curpos);
-                
-                /* now take care of the identified chunk */
-                wbuf[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_CHUNK;
-                *((uint64_t *)&wbuf[1]) = _synctory_hton64(ww->payload[i].position);
-                if (write(fddiff, wbuf, 9) != 9)
-                {
-                    free(strongsum1);
-                    free(strongsum2);
-                    free(buffer);
-                    TREE_FWD_APPLY(&ftree, __tree_node_delete, &ftree);
-                    return ((errno != 0) ? errno : -1);
-                }
-                
-                /* continue after the identified chunk */
-                lpos = curpos = (curpos + diff_header.chunksize);
-                iflag = 1;
-            }
+            if (started[i])
+                pthread_join(thread[i], NULL);
             else
-            {
-                /* go one byte ahead and try again */
-                curpos++;
-                lchar = buffer[0];
-            }
-            
-        }
-        else
-        {
-            /* go one byte ahead and try again */
-            curpos++;
-            lchar = buffer[0];
+                segment[i].rval = __synctory_diff_scan(&segment[i]);
         }
+#else
+        segment[0].rval = __synctory_diff_scan(&segment[0]);
+#endif
         
-        
-
-        if (curpos != _synctory_file64_seek(fdsource, curpos, SEEK_SET))
+        for (i = 0; (i < n) && (0 == rval); i++)
         {
-            free(strongsum1);
-            free(strongsum2);
-            free(buffer);
-            TREE_FWD_APPLY(&ftree, __tree_node_delete, &ftree);
-            return errno;
+            rval = segment[i].rval;
+            if ((0 == rval) && (i > 0))
+                rval = __synctory_diff_reconcile(&segment[i], segment[i - 1].exit);
+            if (0 == rval)
+                rval = __synctory_diff_segment_write(&segment[i], fdsource, &out, &lpos);
+            
+            stats.filter_hits += segment[i].stats.filter_hits;
+            stats.filter_misses += segment[i].stats.filter_misses;
+            stats.index_misses += segment[i].stats.index_misses;
+            stats.predict_hits += segment[i].stats.predict_hits;
+            stats.predict_misses += segment[i].stats.predict_misses;
+            memset(&segment[i].stats, 0, sizeof(synctory_stats_t));
         }
+        
+        entry = segment[n - 1].exit;
     }
     
      /* any raw bytes left to flush down the toilet? */
-    if (lpos != curpos)
-        __synctory_diff_flush_raw_fd(fdsource, fddiff, lpos, curpos);
-    
-    /* destroy structures and the tree */
-    free(strongsum1);
-    free(strongsum2);
-    free(buffer);
-    TREE_FWD_APPLY(&ftree, __tree_node_delete, &ftree);
+    if ((0 == rval) && (lpos < position))
+    {
+        if (NULL != map.data)
+            rval = __synctory_diff_write_raw_map(&out, &map, lpos, position);
+        else
+            rval = _synctory_diff_write_raw_fd(&out, fdsource, lpos, position);
+    }
+    
+    /* the output may still refer to the mapping */
+    if (0 == rval)
+        rval = _synctory_diff_out_flush(&out);
+    _synctory_diff_out_free(&out);
+    _synctory_file64_unmap(&map);
+    
+    /* report statistics */
+    ctx->stats = stats;
+    
+    /* destroy structures and the index */
+    for (i = 0; i < threads; i++)
+        free(segment[i].match);
+    free(segment);
+#ifdef _SYNCTORY_DIFF_THREADS
+    free(thread);
+    free(started);
+#endif
+    return rval;
+}
+
+
+/**
+ * Create a diff as _synctory_diff_create_index does, reading the fingerprint
+ * into a temporary index first.
+ */
+int
+_synctory_diff_create_fast(synctory_ctx_t *ctx, int fdfinger, int fdsource, int fddiff)
+{
+    int rval;
+    synctory_fpindex_t fpindex;
+    
+    rval = _synctory_fpindex_load_fd(&fpindex, fdfinger);
+    if (rval)
+        return rval;
+    
+    rval = _synctory_diff_create_index(ctx, &fpindex, fdsource, fddiff);
+    
+    _synctory_fpindex_free(&fpindex);
     return rval;
 }
 
@@ -492,6 +1234,7 @@ _synctory_diff_create_fn(const char *fingerprint, const char *sourcefile, const
 {
     int rval = 0;
     int fdfinger, fdsource, fddiff;
+    synctory_ctx_t ctx;
     
     /* open read-only file descriptor for fingerprint file */
     fdfinger = _synctory_file64_open(fingerprint, O_RDONLY);
@@ -508,7 +1251,8 @@ _synctory_diff_create_fn(const char *fingerprint, const char *sourcefile, const
     if (fddiff < 0)
         return errno;
     
-    rval = _synctory_diff_create_fd(fdfinger, fdsource, fddiff);
+    synctory_init(&ctx);
+    rval = _synctory_diff_create_fd(&ctx, fdfinger, fdsource, fddiff);
     
     _synctory_file64_close(fdfinger);
     _synctory_file64_close(fdsource);
@@ -42,7 +42,10 @@
  * Byte 12 - 19    Size of originating file (unsigned, network byte order)
  * Byte 20 - 21    Chunk size used on originating file (unsigned, network byte order)
  * Byte 22         Constant to identify weak and strong checksum combo being used here
- * Byte 23         Zero byte used as header terminator
+ * Byte 23         Codec compressing the raw data of a diff (bits 4 - 6) and
+ *                 its compression level (lower four bits); the highest bit is
+ *                 set if the diff ends with a table of contents. Zero for
+ *                 fingerprints and plain uncompressed diffs
  */
 
 
@@ -57,7 +60,7 @@ _synctory_fh_setheader_bf(_synctory_fheader_t *header, void *buffer, size_t len)
     uint64_t version = _synctory_hton64((uint64_t)_SYNCTORY_VERSION_NUM);
     uint64_t size = _synctory_hton64(header->filesize);
     uint16_t chunksize = _synctory_hton16(header->chunksize);
-    uint16_t algo = _synctory_hton16((((uint16_t)header->algo) << 8));
+    uint16_t algo = _synctory_hton16((uint16_t)((((uint16_t)header->algo) << 8) | ((header->codec & 0x07U) << 4) | (header->level & 0x0FU) | ((0 != header->toc) ? _SYNCTORY_FH_TOC : 0)));
     uint32_t ftype = _synctory_hton32(((uint32_t)_SYNCTORY_FH_IDENTIFIER) | ((uint32_t)header->type));
     int i = 0;
     
@@ -105,6 +108,9 @@ _synctory_fh_getheader_bf(_synctory_fheader_t *header, void *buffer, size_t len)
     header->filesize = _synctory_ntoh64(*((uint64_t*)&ptr[12]));
     header->chunksize = _synctory_ntoh16(*((uint16_t*)&ptr[20]));
     header->algo = (synctory_algo_t)ptr[22];
+    header->codec = (uint8_t)((ptr[23] >> 4) & 0x07U);
+    header->level = (uint8_t)(ptr[23] & 0x0FU);
+    header->toc = (ptr[23] & _SYNCTORY_FH_TOC) ? 1 : 0;
     
     return 0;
 }
@@ -113,7 +119,7 @@ _synctory_fh_getheader_bf(_synctory_fheader_t *header, void *buffer, size_t len)
 /**
  * Read a complete file header from a given file descriptor.
  * The header information is returned by storing it into the provided
- * file header structure.
+ * file header structure. A pipe or socket is read from where it stands.
  */
 int
 _synctory_fh_getheader_fd(_synctory_fheader_t *header, int fd)
@@ -121,7 +127,7 @@ _synctory_fh_getheader_fd(_synctory_fheader_t *header, int fd)
     unsigned char buffer[_SYNCTORY_FH_BYTES];
     ssize_t rbytes;
     
-    if (_synctory_file64_seek(fd, 0, SEEK_SET) < 0)
+    if ((_synctory_file64_seek(fd, 0, SEEK_SET) < 0) && (ESPIPE != errno))
         return errno;
     
     rbytes = read(fd, buffer, _SYNCTORY_FH_BYTES);
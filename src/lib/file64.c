@@ -47,10 +47,19 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "config.h"
 #include "_file64.h"
 
+#if (defined HAVE_SYS_MMAN_H) && (defined HAVE_MMAP_F)
+#include <sys/mman.h>
+#endif
+
+#if (defined HAVE_SYS_SENDFILE_H) && (defined HAVE_SENDFILE_F)
+#include <sys/sendfile.h>
+#endif
+
 
 int
 _synctory_file64_open(const char *path, int oflag, ...)
@@ -112,6 +121,8 @@ _synctory_file64_get_fd(int *flag, int fd, const char *path, char mode)
                 return _synctory_file64_open(path, O_RDONLY);
             else if ('w' == mode)
                 return _synctory_file64_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            else if ('u' == mode)
+                return _synctory_file64_open(path, O_RDWR);
             else
                 return -1;
         }
@@ -139,6 +150,287 @@ _synctory_file64_seek(int fd, int64_t offset, int whence)
 }
 
 
+/**
+ * Positional read which leaves the file pointer untouched where the
+ * platform allows it. Otherwise, the read is emulated by seek and read.
+ */
+ssize_t
+_synctory_file64_pread(int fd, void *buffer, size_t nbytes, _synctory_off_t offset)
+{
+#if (defined HAVE_PREAD_F) && ((OFFT_SIZE == 8) || (!defined HAVE_PREAD64_F))
+    return pread(fd, buffer, nbytes, (off_t)offset);
+#elif (defined HAVE_PREAD64_F) && (defined OFF64T_SIZE)
+    return pread64(fd, buffer, nbytes, (off64_t)offset);
+#else
+    if (offset != _synctory_file64_seek(fd, offset, SEEK_SET))
+        return -1;
+    return read(fd, buffer, nbytes);
+#endif
+}
+
+
+/**
+ * Positional write which leaves the file pointer untouched. Where the
+ * platform lacks it, the write is emulated by seek and write, and the
+ * file pointer is restored afterwards.
+ */
+ssize_t
+_synctory_file64_pwrite(int fd, const void *buffer, size_t nbytes, _synctory_off_t offset)
+{
+#if (defined HAVE_PWRITE_F) && ((OFFT_SIZE == 8) || (!defined HAVE_PWRITE64_F))
+    return pwrite(fd, buffer, nbytes, (off_t)offset);
+#elif (defined HAVE_PWRITE64_F) && (defined OFF64T_SIZE)
+    return pwrite64(fd, buffer, nbytes, (off64_t)offset);
+#else
+    ssize_t wbytes;
+    _synctory_off_t position = _synctory_file64_seek(fd, 0, SEEK_CUR);
+    
+    if ((position < 0) || (offset != _synctory_file64_seek(fd, offset, SEEK_SET)))
+        return -1;
+    wbytes = write(fd, buffer, nbytes);
+    if (position != _synctory_file64_seek(fd, position, SEEK_SET))
+        return -1;
+    return wbytes;
+#endif
+}
+
+
+/**
+ * Positional read of exactly nbytes, retrying after short or interrupted
+ * reads. Returns 0 on success, and -1 if the file ends prematurely.
+ */
+int
+_synctory_file64_readat(int fd, void *buffer, size_t nbytes, _synctory_off_t offset)
+{
+    unsigned char *ptr = (unsigned char *)buffer;
+    ssize_t rbytes;
+    
+    while (nbytes)
+    {
+        rbytes = _synctory_file64_pread(fd, ptr, nbytes, offset);
+        if (rbytes < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return ((errno != 0) ? errno : -1);
+        }
+        if (0 == rbytes)
+            return -1;
+        ptr += rbytes;
+        offset += rbytes;
+        nbytes -= (size_t)rbytes;
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Positional write of exactly nbytes, retrying after short or interrupted
+ * writes. Returns 0 on success.
+ */
+int
+_synctory_file64_writeat(int fd, const void *buffer, size_t nbytes, _synctory_off_t offset)
+{
+    const unsigned char *ptr = (const unsigned char *)buffer;
+    ssize_t wbytes;
+    
+    while (nbytes)
+    {
+        wbytes = _synctory_file64_pwrite(fd, ptr, nbytes, offset);
+        if (wbytes < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return ((errno != 0) ? errno : -1);
+        }
+        if (0 == wbytes)
+            return -1;
+        ptr += wbytes;
+        offset += wbytes;
+        nbytes -= (size_t)wbytes;
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Write the entire buffer, retrying after short or interrupted writes.
+ * Returns 0 on success.
+ */
+int
+_synctory_file64_write(int fd, const void *buffer, size_t nbytes)
+{
+    const unsigned char *ptr = (const unsigned char *)buffer;
+    ssize_t wbytes;
+    
+    while (nbytes)
+    {
+        wbytes = write(fd, ptr, nbytes);
+        if (wbytes < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return ((errno != 0) ? errno : -1);
+        }
+        if (0 == wbytes)
+            return -1;
+        ptr += wbytes;
+        nbytes -= (size_t)wbytes;
+    }
+    
+    return 0;
+}
+
+
+int
+_synctory_file64_fstat(int fd, _synctory_file64_stat_t *buf)
+{
+#if (defined HAVE_FSTAT64_F) && (defined HAVE_STAT64_R)
+    return fstat64(fd, buf);
+#else
+    return fstat(fd, buf);
+#endif
+}
+
+
+/**
+ * Cut off or extend the file to the given length; the file pointer is
+ * left untouched
+ */
+int
+_synctory_file64_truncate(int fd, _synctory_off_t length)
+{
+#if (OFFT_SIZE == 8) || (!defined HAVE_FTRUNCATE64_F)
+    if (0 != ftruncate(fd, (off_t)length))
+        return ((errno != 0) ? errno : -1);
+#elif (defined HAVE_FTRUNCATE64_F) && (defined OFF64T_SIZE)
+    if (0 != ftruncate64(fd, (off64_t)length))
+        return ((errno != 0) ? errno : -1);
+#endif
+    return 0;
+}
+
+
+/**
+ * Fallocate len bytes starting at offset with the given mode; ENOTSUP if
+ * there is no fallocate(2)
+ */
+static int
+__synctory_file64_fallocate(int fd, int mode, _synctory_off_t offset, _synctory_off_t len)
+{
+#if (defined HAVE_FALLOCATE_F) && ((OFFT_SIZE == 8) || (!defined HAVE_FALLOCATE64_F))
+    if (0 != fallocate(fd, mode, (off_t)offset, (off_t)len))
+        return ((errno != 0) ? errno : -1);
+    return 0;
+#elif (defined HAVE_FALLOCATE64_F) && (defined OFF64T_SIZE)
+    if (0 != fallocate64(fd, mode, (off64_t)offset, (off64_t)len))
+        return ((errno != 0) ? errno : -1);
+    return 0;
+#else
+    (void)fd;
+    (void)mode;
+    (void)offset;
+    (void)len;
+    return ENOTSUP;
+#endif
+}
+
+
+/**
+ * Reserve disk space for len bytes starting at offset, extending the file
+ * if necessary, without altering its contents. Writing the reserved range
+ * later on needs no further block allocations, so the file ends up in few
+ * extents. posix_fallocate(3) is not used on purpose, as it falls back to
+ * writing zeros where the file system cannot reserve space.
+ */
+int
+_synctory_file64_allocate(int fd, _synctory_off_t offset, _synctory_off_t len)
+{
+    if (len <= 0)
+        return 0;
+    return __synctory_file64_fallocate(fd, 0, offset, len);
+}
+
+
+/**
+ * Release the disk space of len bytes starting at offset, which read as
+ * zeros afterwards; the file size does not change
+ */
+int
+_synctory_file64_punch(int fd, _synctory_off_t offset, _synctory_off_t len)
+{
+    if (len <= 0)
+        return 0;
+#if (defined FALLOC_FL_PUNCH_HOLE) && (defined FALLOC_FL_KEEP_SIZE)
+    return __synctory_file64_fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+    (void)fd;
+    (void)offset;
+    return ENOTSUP;
+#endif
+}
+
+
+/**
+ * Map an entire regular file into memory for reading. On success, 0 is
+ * returned; otherwise map->data is NULL, and the caller is expected to
+ * fall back to reading the file. Files which are empty, not regular or
+ * too large for the address space are never mapped.
+ */
+int
+_synctory_file64_map(int fd, _synctory_file64_map_t *map, int advice)
+{
+#if (defined HAVE_SYS_MMAN_H) && (defined HAVE_MMAP_F)
+    _synctory_file64_stat_t st;
+    void *data;
+    
+    map->data = NULL;
+    map->size = 0;
+    
+    if (0 != _synctory_file64_fstat(fd, &st))
+        return ((errno != 0) ? errno : -1);
+    
+    if (!S_ISREG(st.st_mode) || (st.st_size <= 0) || ((uint64_t)st.st_size > (uint64_t)SIZE_MAX))
+        return EINVAL;
+    
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == data)
+        return ((errno != 0) ? errno : -1);
+    
+#if (defined HAVE_MADVISE_F) && (defined MADV_SEQUENTIAL)
+    if (_SYNCTORY_FILE64_MAP_SEQUENTIAL == advice)
+        madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#else
+    (void)advice;
+#endif
+    
+    map->data = (unsigned char *)data;
+    map->size = (_synctory_off_t)st.st_size;
+    return 0;
+#else
+    (void)fd;
+    (void)advice;
+    map->data = NULL;
+    map->size = 0;
+    return ENOTSUP;
+#endif
+}
+
+
+void
+_synctory_file64_unmap(_synctory_file64_map_t *map)
+{
+#if (defined HAVE_SYS_MMAN_H) && (defined HAVE_MMAP_F)
+    if (NULL != map->data)
+        munmap(map->data, (size_t)map->size);
+#endif
+    map->data = NULL;
+    map->size = 0;
+}
+
+
 int
 _synctory_file64_lstat(const char *file, _synctory_file64_stat_t *buf)
 {
@@ -150,28 +442,219 @@ _synctory_file64_lstat(const char *file, _synctory_file64_stat_t *buf)
 }
 
 
-_synctory_off_t
-_synctory_file64_bytecopy(int fdsource, int fddest, _synctory_off_t offset, _synctory_off_t bytes)
+/**
+ * Tell whether a copy engine failed because it does not support the file
+ * descriptors at hand, so the next engine has to be tried
+ */
+#define __synctory_file64_unsupported(e) \
+    ((EINVAL == (e)) || (EXDEV == (e)) || (ENOSYS == (e)) || (EOPNOTSUPP == (e)) || (ENOTSUP == (e)) || (EBADF == (e)) || (ESPIPE == (e)))
+
+
+/**
+ * Copy engines of _synctory_file64_copyat. Each of them copies as much as
+ * it can, updating offset and destoffset (unless they are negative) and
+ * bytes, and leaves the rest to the next engine. Only real errors are
+ * reported.
+ */
+static int
+__synctory_file64_copy_range(int fdsource, int fddest, _synctory_off_t *offset, _synctory_off_t *destoffset, _synctory_off_t *bytes)
 {
-    int rval = 0;
-    unsigned char buffer[_SYNCTORY_FILE64_BUFSIZE];
-    _synctory_off_t position;
+#ifdef HAVE_COPY_FILE_RANGE_F
+    loff_t position = (loff_t)*offset;
+    loff_t destposition = (loff_t)*destoffset;
+    ssize_t n;
     
-    /* seek to the start position of the source */
-    if (offset != _synctory_file64_seek(fdsource, offset, SEEK_SET))
-        return errno;
+    /* both sides have to be regular files */
+    while (*bytes > 0)
+    {
+        n = copy_file_range(fdsource, (*offset < 0) ? NULL : &position, fddest, (*destoffset < 0) ? NULL : &destposition, (*bytes > _SYNCTORY_FILE64_MAXCOPY) ? _SYNCTORY_FILE64_MAXCOPY : (size_t)*bytes, 0);
+        if (n < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return __synctory_file64_unsupported(errno) ? 0 : errno;
+        }
+        if (0 == n)
+            break;
+        *bytes -= (_synctory_off_t)n;
+        if (*offset >= 0)
+            *offset = (_synctory_off_t)position;
+        if (*destoffset >= 0)
+            *destoffset = (_synctory_off_t)destposition;
+    }
+#else
+    (void)fdsource;
+    (void)fddest;
+    (void)offset;
+    (void)destoffset;
+    (void)bytes;
+#endif
+    return 0;
+}
+
+
+static int
+__synctory_file64_copy_send(int fdsource, int fddest, _synctory_off_t *offset, _synctory_off_t *destoffset, _synctory_off_t *bytes)
+{
+#if (defined HAVE_SYS_SENDFILE_H) && (defined HAVE_SENDFILE_F) && (OFFT_SIZE == 8)
+    off_t position = (off_t)*offset;
+    ssize_t n;
     
-    /* transfer raw bytes to diff file */
-    for (position = 0; position < (bytes / _SYNCTORY_FILE64_BUFSIZE); position++)
+    /* sendfile always writes at the current position of the destination */
+    if (*destoffset >= 0)
+        return 0;
+    
+    /* the source has to be a regular file, the destination may be a pipe or socket */
+    while (*bytes > 0)
     {
-        read(fdsource, buffer, _SYNCTORY_FILE64_BUFSIZE);
-        rval += write(fddest, buffer, _SYNCTORY_FILE64_BUFSIZE);
+        n = sendfile(fddest, fdsource, (*offset < 0) ? NULL : &position, (*bytes > _SYNCTORY_FILE64_MAXCOPY) ? _SYNCTORY_FILE64_MAXCOPY : (size_t)*bytes);
+        if (n < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return __synctory_file64_unsupported(errno) ? 0 : errno;
+        }
+        if (0 == n)
+            break;
+        *bytes -= (_synctory_off_t)n;
+        if (*offset >= 0)
+            *offset = (_synctory_off_t)position;
     }
-    if ((bytes % _SYNCTORY_FILE64_BUFSIZE) != 0)
+#else
+    (void)fdsource;
+    (void)fddest;
+    (void)offset;
+    (void)destoffset;
+    (void)bytes;
+#endif
+    return 0;
+}
+
+
+static int
+__synctory_file64_copy_splice(int fdsource, int fddest, _synctory_off_t *offset, _synctory_off_t *destoffset, _synctory_off_t *bytes)
+{
+#ifdef HAVE_SPLICE_F
+    loff_t position = (loff_t)*offset;
+    loff_t destposition = (loff_t)*destoffset;
+    ssize_t n;
+    
+    /* one side has to be a pipe; this covers reading from a pipe */
+    while (*bytes > 0)
+    {
+        n = splice(fdsource, (*offset < 0) ? NULL : &position, fddest, (*destoffset < 0) ? NULL : &destposition, (*bytes > _SYNCTORY_FILE64_MAXCOPY) ? _SYNCTORY_FILE64_MAXCOPY : (size_t)*bytes, SPLICE_F_MOVE);
+        if (n < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return __synctory_file64_unsupported(errno) ? 0 : errno;
+        }
+        if (0 == n)
+            break;
+        *bytes -= (_synctory_off_t)n;
+        if (*offset >= 0)
+            *offset = (_synctory_off_t)position;
+        if (*destoffset >= 0)
+            *destoffset = (_synctory_off_t)destposition;
+    }
+#else
+    (void)fdsource;
+    (void)fddest;
+    (void)offset;
+    (void)destoffset;
+    (void)bytes;
+#endif
+    return 0;
+}
+
+
+static int
+__synctory_file64_copy_buffer(int fdsource, int fddest, _synctory_off_t *offset, _synctory_off_t *destoffset, _synctory_off_t *bytes)
+{
+    int rval = 0;
+    unsigned char *buffer;
+    size_t want;
+    ssize_t rbytes;
+    
+    want = (*bytes > _SYNCTORY_FILE64_BUFSIZE) ? _SYNCTORY_FILE64_BUFSIZE : (size_t)*bytes;
+    buffer = (unsigned char *)malloc(want);
+    if (NULL == buffer)
+        return ((errno != 0) ? errno : ENOMEM);
+    
+    while ((0 == rval) && (*bytes > 0))
     {
-        read(fdsource, buffer, bytes % _SYNCTORY_FILE64_BUFSIZE);
-        rval += write(fddest, buffer, bytes % _SYNCTORY_FILE64_BUFSIZE);
+        if ((_synctory_off_t)want > *bytes)
+            want = (size_t)*bytes;
+        if (*offset < 0)
+            rbytes = read(fdsource, buffer, want);
+        else
+            rbytes = _synctory_file64_pread(fdsource, buffer, want, *offset);
+        if (rbytes < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            rval = ((errno != 0) ? errno : -1);
+            break;
+        }
+        
+        /* the source ends before all bytes have been copied */
+        if (0 == rbytes)
+        {
+            rval = -1;
+            break;
+        }
+        
+        if (*destoffset < 0)
+            rval = _synctory_file64_write(fddest, buffer, (size_t)rbytes);
+        else
+            rval = _synctory_file64_writeat(fddest, buffer, (size_t)rbytes, *destoffset);
+        *bytes -= (_synctory_off_t)rbytes;
+        if (*offset >= 0)
+            *offset += (_synctory_off_t)rbytes;
+        if (*destoffset >= 0)
+            *destoffset += (_synctory_off_t)rbytes;
     }
     
+    free(buffer);
+    return rval;
+}
+
+
+/**
+ * Copy bytes bytes, starting at offset, from fdsource to the current
+ * position of fddest. With a negative offset, the bytes are taken from
+ * the current position of fdsource instead, which may be a pipe then;
+ * otherwise, the file pointer of fdsource is left untouched.
+ * 
+ * The kernel copies the data on its own where possible (copy_file_range,
+ * sendfile or splice); the remainder, if any, goes through a buffer.
+ * Returns 0 on success, and -1 if fdsource ends prematurely.
+ */
+int
+_synctory_file64_bytecopy(int fdsource, int fddest, _synctory_off_t offset, _synctory_off_t bytes)
+{
+    return _synctory_file64_copyat(fdsource, offset, fddest, -1, bytes);
+}
+
+
+/**
+ * Like _synctory_file64_bytecopy, but the bytes are written starting at
+ * destoffset of fddest, leaving its file pointer untouched, unless
+ * destoffset is negative. Positional copies do not interfere with each
+ * other, so several threads may copy into the same file at once.
+ */
+int
+_synctory_file64_copyat(int fdsource, _synctory_off_t offset, int fddest, _synctory_off_t destoffset, _synctory_off_t bytes)
+{
+    int rval;
+    
+    rval = __synctory_file64_copy_range(fdsource, fddest, &offset, &destoffset, &bytes);
+    if ((0 == rval) && (bytes > 0))
+        rval = __synctory_file64_copy_send(fdsource, fddest, &offset, &destoffset, &bytes);
+    if ((0 == rval) && (bytes > 0))
+        rval = __synctory_file64_copy_splice(fdsource, fddest, &offset, &destoffset, &bytes);
+    if ((0 == rval) && (bytes > 0))
+        rval = __synctory_file64_copy_buffer(fdsource, fddest, &offset, &destoffset, &bytes);
+    
     return rval;
 }
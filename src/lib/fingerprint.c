@@ -20,6 +20,8 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "version.h"
 
@@ -28,42 +30,214 @@
 #include "_endianess.h"
 #include "_fheader.h"
 #include "_file64.h"
+#include "_writer.h"
 
+#ifdef _SYNCTORY_FINGERPRINT_THREADS
+#include <pthread.h>
+#endif
+
+
+/**
+ * Checksum the chunks of a range, reading the source file with positional
+ * reads unless it is mapped
+ */
+static int
+__synctory_fingerprint_range(_synctory_fingerprint_range_t *range)
+{
+    int rval;
+    const unsigned char *data;
+    unsigned char *record = range->record;
+    _synctory_off_t position = range->start;
+    size_t len;
+    size_t n;
+    size_t i;
+    uint32_t weaksum;
+    
+    while (position < range->end)
+    {
+        if (NULL != range->map)
+        {
+            len = (size_t)(range->end - position);
+            data = &range->map->data[position];
+        }
+        else
+        {
+            /* the buffer holds whole chunks, so none is split between reads */
+            len = ((range->end - position) < (_synctory_off_t)range->bufsize) ? (size_t)(range->end - position) : range->bufsize;
+            rval = _synctory_file64_readat(range->fd, range->buffer, len, position);
+            if (rval)
+                return rval;
+            data = range->buffer;
+        }
+        
+        for (i = 0; i < len; i += n)
+        {
+            n = ((len - i) < range->chunksize) ? (len - i) : range->chunksize;
+            weaksum = _synctory_hton32(_synctory_weak_checksum(&data[i], n));
+            memcpy(record, &weaksum, sizeof(uint32_t));
+            _synctory_strong_checksum(&data[i], n, &record[sizeof(uint32_t)], range->algo);
+            record += sizeof(uint32_t) + range->sumsize;
+        }
+        position += (_synctory_off_t)len;
+    }
+    
+    return 0;
+}
+
+
+#ifdef _SYNCTORY_FINGERPRINT_THREADS
+/**
+ * Thread entry point checksumming a range
+ */
+static void *
+__synctory_fingerprint_worker(void *arg)
+{
+    _synctory_fingerprint_range_t *range = (_synctory_fingerprint_range_t *)arg;
+    range->rval = __synctory_fingerprint_range(range);
+    return NULL;
+}
+#endif
+
+
+/**
+ * Checksum the chunks of the source file with several threads. The file is
+ * processed in batches, each of which is split into one range of whole
+ * chunks per thread. The records of a batch are collected in one buffer,
+ * each at the place given by its chunk index, and then written at once, so
+ * the output does not differ from the one of a single thread.
+ */
+static int
+__synctory_fingerprint_parallel(synctory_ctx_t *ctx, int source, const _synctory_file64_map_t *map, _synctory_off_t filesize, size_t sumsize, unsigned int threads, _synctory_writer_t *writer)
+{
+    int rval = 0;
+    unsigned int i, n;
+    size_t recsize = sizeof(uint32_t) + sumsize;
+    uint64_t chunks;
+    uint64_t step;
+    _synctory_off_t batch;
+    _synctory_off_t entry;
+    _synctory_off_t end;
+    unsigned char *record;
+    _synctory_fingerprint_range_t *range;
+#ifdef _SYNCTORY_FINGERPRINT_THREADS
+    pthread_t *thread;
+    int *started;
+#endif
+    
+    batch = (_synctory_off_t)_SYNCTORY_FINGERPRINT_BATCH * ctx->chunk_size;
+    range = (_synctory_fingerprint_range_t *)calloc(threads, sizeof(_synctory_fingerprint_range_t));
+    record = (unsigned char *)malloc(_SYNCTORY_FINGERPRINT_BATCH * recsize);
+#ifdef _SYNCTORY_FINGERPRINT_THREADS
+    thread = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    started = (int *)calloc(threads, sizeof(int));
+    if ((NULL == range) || (NULL == record) || (NULL == thread) || (NULL == started))
+        rval = ((errno != 0) ? errno : -1);
+#else
+    if ((NULL == range) || (NULL == record))
+        rval = ((errno != 0) ? errno : -1);
+#endif
+    
+    for (i = 0; (0 == rval) && (i < threads); i++)
+    {
+        range[i].fd = source;
+        range[i].map = (NULL != map->data) ? map : NULL;
+        range[i].algo = ctx->checksum_algorithm;
+        range[i].chunksize = ctx->chunk_size;
+        range[i].sumsize = sumsize;
+        if (NULL != range[i].map)
+            continue;
+        range[i].bufsize = (_SYNCTORY_FINGERPRINT_READSIZE / ctx->chunk_size) * ctx->chunk_size;
+        if (0 == range[i].bufsize)
+            range[i].bufsize = ctx->chunk_size;
+        range[i].buffer = (unsigned char *)malloc(range[i].bufsize);
+        if (NULL == range[i].buffer)
+            rval = ((errno != 0) ? errno : ENOMEM);
+    }
+    
+    for (entry = 0; (0 == rval) && (entry < filesize); entry = end)
+    {
+        end = ((filesize - entry) < batch) ? filesize : (entry + batch);
+        
+        /* spread the chunks of the batch across the threads */
+        chunks = (uint64_t)((end - entry + ctx->chunk_size - 1) / ctx->chunk_size);
+        step = (chunks + threads - 1) / threads;
+        for (n = 0; (n < threads) && ((uint64_t)n * step < chunks); n++)
+        {
+            range[n].start = entry + (_synctory_off_t)((uint64_t)n * step * ctx->chunk_size);
+            range[n].end = range[n].start + (_synctory_off_t)(step * ctx->chunk_size);
+            if (range[n].end > end)
+                range[n].end = end;
+            range[n].record = &record[(size_t)((uint64_t)n * step) * recsize];
+            range[n].rval = 0;
+        }
+        
+#ifdef _SYNCTORY_FINGERPRINT_THREADS
+        /* the first range is checksummed by the calling thread */
+        for (i = 1; i < n; i++)
+            started[i] = (0 == pthread_create(&thread[i], NULL, __synctory_fingerprint_worker, &range[i]));
+        range[0].rval = __synctory_fingerprint_range(&range[0]);
+        for (i = 1; i < n; i++)
+        {
+            if (started[i])
+                pthread_join(thread[i], NULL);
+            else
+                range[i].rval = __synctory_fingerprint_range(&range[i]);
+        }
+#else
+        for (i = 0; i < n; i++)
+            range[i].rval = __synctory_fingerprint_range(&range[i]);
+#endif
+        
+        for (i = 0; (i < n) && (0 == rval); i++)
+            rval = range[i].rval;
+        
+        /* the records are referenced, so they have to be written before the next batch */
+        if (0 == rval)
+            rval = _synctory_writer_ref(writer, record, (size_t)chunks * recsize);
+        if (0 == rval)
+            rval = _synctory_writer_flush(writer);
+    }
+    
+    for (i = 0; (NULL != range) && (i < threads); i++)
+        free(range[i].buffer);
+    free(range);
+    free(record);
+#ifdef _SYNCTORY_FINGERPRINT_THREADS
+    free(thread);
+    free(started);
+#endif
+    return rval;
+}
 
 
 int
 _synctory_fingerprint_create_fd(synctory_ctx_t *ctx, int source, int dest)
 {
-    unsigned char header[_SYNCTORY_FH_BYTES];
     unsigned char *sourcebuffer = NULL;
-    unsigned char *destbuffer;
-    unsigned char *destptr = NULL;
+    unsigned char *chunk;
+    unsigned char *destptr;
     uint32_t weaksum;
-    int i;
+    size_t sumsize;
     ssize_t rbytes = 0;
     int rval = 0;
+    unsigned int threads = 1;
     _synctory_off_t position;
     _synctory_fheader_t fh;
-    unsigned int destbufsize;
+    _synctory_file64_map_t map;
+    _synctory_writer_t writer;
+    
+    if (_synctory_strong_checksum_size(ctx->checksum_algorithm) < 0)
+        return EINVAL;
     
     sourcebuffer = (unsigned char *)malloc(ctx->chunk_size);
     if (NULL == sourcebuffer)
         return errno;
-    
-    destbufsize = _SYNCTORY_FINGERPRINT_WRITE_BUFFER * (sizeof(uint32_t) + _synctory_strong_checksum_size(ctx->checksum_algorithm));
-    destbuffer = (unsigned char *)malloc(destbufsize);
-    if (NULL == destbuffer)
-    {
-        free(sourcebuffer);
-        return errno;
-    }
-    destptr = &destbuffer[0];
+    sumsize = (size_t)_synctory_strong_checksum_size(ctx->checksum_algorithm);
     
     position = _synctory_file64_seek(source, 0, SEEK_END);
     if (position < 0)
     {
         free(sourcebuffer);
-        free(destbuffer);
         return errno;
     }
     
@@ -72,83 +246,88 @@ _synctory_fingerprint_create_fd(synctory_ctx_t *ctx, int source, int dest)
     fh.chunksize = ctx->chunk_size;
     fh.algo = ctx->checksum_algorithm;
     fh.filesize = (uint64_t)position;
+    fh.codec = 0;
+    fh.level = 0;
+    fh.toc = 0;
     
-    rval = _synctory_fh_setheader_bf(&fh, header, _SYNCTORY_FH_BYTES);
-    if (rval)
+    position = _synctory_file64_seek(dest, 0, SEEK_SET);
+    if (position < 0)
     {
         free(sourcebuffer);
-        free(destbuffer);
-        return rval;
+        return errno;
     }
     
-    position = _synctory_file64_seek(dest, 0, SEEK_SET);
-    if (position < 0)
+    rval = _synctory_writer_init(&writer, dest, ctx->write_buffer);
+    if (rval)
     {
         free(sourcebuffer);
-        free(destbuffer);
-        return errno;
+        return rval;
     }
     
     /* Write header information into destination file */
-    rbytes = write(dest, &header[0], _SYNCTORY_FH_BYTES);
-    if (rbytes != _SYNCTORY_FH_BYTES)
+    rval = _synctory_writer_stage(&writer, _SYNCTORY_FH_BYTES, &destptr);
+    if (0 == rval)
+        rval = _synctory_fh_setheader_bf(&fh, destptr, _SYNCTORY_FH_BYTES);
+    if (rval)
     {
+        _synctory_writer_free(&writer);
         free(sourcebuffer);
-        free(destbuffer);
-        return -1;
+        return rval;
     }
     
     position = _synctory_file64_seek(source, 0, SEEK_SET);
     if (position < 0)
     {
+        _synctory_writer_free(&writer);
         free(sourcebuffer);
-        free(destbuffer);
         return errno;
     }
 	
-    /* read chunks from source file until EOF is reached */
-    while ((rbytes = read(source, sourcebuffer, ctx->chunk_size)) > 0)
+    /* checksum the chunks right inside the mapping if the source can be mapped */
+    if ((0 == _synctory_file64_map(source, &map, _SYNCTORY_FILE64_MAP_SEQUENTIAL)) && (map.size != (_synctory_off_t)fh.filesize))
+        _synctory_file64_unmap(&map);
+    
+#ifdef _SYNCTORY_FINGERPRINT_THREADS
+    if ((ctx->threads > 1) && (ctx->chunk_size > 0))
+        threads = (ctx->threads > _SYNCTORY_FINGERPRINT_MAXTHREADS) ? _SYNCTORY_FINGERPRINT_MAXTHREADS : ctx->threads;
+#endif
+    if (threads > 1)
+        rval = __synctory_fingerprint_parallel(ctx, source, &map, (_synctory_off_t)fh.filesize, sumsize, threads, &writer);
+    
+    /* process chunks from source file until EOF is reached (unless done in parallel) */
+    while ((0 == rval) && (threads < 2))
     {
-        weaksum = _synctory_hton32(_synctory_weak_checksum(sourcebuffer, rbytes));
-        for (i = 0; i < 4; ++i)
-        {
-            *destptr = *(((unsigned char *)&weaksum)+i);
-            destptr++;
-        }
-        _synctory_strong_checksum(sourcebuffer, rbytes, destptr, ctx->checksum_algorithm);
-        
-        if ((unsigned int)(destptr - &destbuffer[0]) >= (destbufsize - 1))
+        if (NULL != map.data)
         {
-            /* buffer needs being flushed */
-            rbytes = write(dest, &destbuffer[0], destbufsize);
-            if (rbytes != destbufsize)
-            {
-                free(sourcebuffer);
-                free(destbuffer);
-                return -1;
-            }
-            destptr = &destbuffer[0];
+            if (position >= map.size)
+                break;
+            chunk = &map.data[position];
+            rbytes = ((map.size - position) < ctx->chunk_size) ? (ssize_t)(map.size - position) : (ssize_t)ctx->chunk_size;
+            position += rbytes;
         }
-            else
+        else
         {
-            destptr += _synctory_strong_checksum_size(ctx->checksum_algorithm);
+            rbytes = read(source, sourcebuffer, ctx->chunk_size);
+            if (rbytes <= 0)
+                break;
+            chunk = sourcebuffer;
         }
+        
+        /* the checksums are calculated right inside the output buffer */
+        rval = _synctory_writer_stage(&writer, sizeof(uint32_t) + sumsize, &destptr);
+        if (rval)
+            break;
+        weaksum = _synctory_hton32(_synctory_weak_checksum(chunk, rbytes));
+        memcpy(destptr, &weaksum, sizeof(uint32_t));
+        _synctory_strong_checksum(chunk, rbytes, &destptr[sizeof(uint32_t)], ctx->checksum_algorithm);
     }
     
-    if ((unsigned int)(destptr - &destbuffer[0]) > 0)
-    {
-        /* buffer contains data and needs being flushed */
-        rbytes = write(dest, &destbuffer[0], (size_t)(destptr - &destbuffer[0]));
-        if (rbytes <= 0)
-        {
-            free(sourcebuffer);
-            free(destbuffer);
-            rval = -1;
-        }
-    }
+    if (0 == rval)
+        rval = _synctory_writer_flush(&writer);
     
+    _synctory_writer_free(&writer);
+    _synctory_file64_unmap(&map);
     free(sourcebuffer);
-    free(destbuffer);
     return rval;
 }
 
@@ -183,14 +362,23 @@ _synctory_fingerprint_create_fn(synctory_ctx_t *ctx, const char *sourcefile, con
 int 
 _synctory_fingerprint_fetchheader_fd(int fd, _synctory_fheader_t *header)
 {
-    return _synctory_fh_getheader_fd(header, fd);
+    int rval = _synctory_fh_getheader_fd(header, fd);
+    
+    /* fingerprints made with an unknown algorithm cannot be used */
+    if ((0 == rval) && (_synctory_strong_checksum_size(header->algo) < 0))
+        return EINVAL;
+    return rval;
 }
 
 
 int
 _synctory_fingerprint_fetchheader_fn(const char *fpfile, _synctory_fheader_t *header)
 {
-    return _synctory_fh_getheader_fn(header, fpfile);
+    int rval = _synctory_fh_getheader_fn(header, fpfile);
+    
+    if ((0 == rval) && (_synctory_strong_checksum_size(header->algo) < 0))
+        return EINVAL;
+    return rval;
 }
 
 
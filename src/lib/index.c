@@ -0,0 +1,500 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * The index maps the weak checksums of a fingerprint to the chunks carrying
+ * them. It is a flat open addressing hash table with linear probing, sized
+ * from the chunk count announced by the fingerprint header, so the whole
+ * table is allocated at once and a lookup usually touches a single cache
+ * line instead of chasing the pointers of a search tree.
+ *
+ * The chunk records themselves (weak checksum, chunk index and strong
+ * checksum) are stored in flat arrays, grouped by weak checksum. Table and
+ * arrays share one allocation, so building the index costs a single
+ * allocation and tearing it down a single free, no matter how many chunks
+ * the fingerprint holds.
+ *
+ * Most windows of a diff source do not match any chunk at all. A small
+ * bloom filter over the weak checksums (see _index.h) answers most of
+ * these lookups from the cache before the index table is touched.
+ *
+ * Unchanged regions of a file produce runs of consecutive chunks. After a
+ * match, the chunk following the matched one can be checked directly,
+ * without looking up the index table. The prediction must yield the same
+ * chunk as a lookup, which returns the first chunk carrying the checksums
+ * of a window; therefore only chunks whose checksums do not occur earlier
+ * in the fingerprint are predicted.
+ *
+ * The index is built in two passes over the fingerprint: the first one
+ * counts the entries of each weak checksum group, the second one stores
+ * the records at their final position inside their group.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "_checksum.h"
+#include "_endianess.h"
+#include "_fheader.h"
+#include "_file64.h"
+#include "_index.h"
+
+
+/**
+ * Spread the weak checksum across the table (multiplicative hashing);
+ * the upper bits of the product are the best mixed ones.
+ */
+#define __synctory_index_hash(index,checksum) \
+    ((uint64_t)(((uint64_t)(checksum) * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - (index)->bits)))
+
+
+/**
+ * Locate the slot for the given weak checksum; this is either the slot
+ * already carrying the checksum, or the empty slot where it belongs.
+ */
+static _synctory_index_slot_t *
+__synctory_index_probe(const _synctory_index_t *index, uint32_t checksum)
+{
+    uint64_t mask = index->slots - 1;
+    uint64_t i = __synctory_index_hash(index, checksum);
+    
+    while (index->slot[i].count && (index->slot[i].checksum != checksum))
+        i = (i + 1) & mask;
+    
+    return &index->slot[i];
+}
+
+
+/**
+ * Size the table and the pre-filter for the given number of entries; the
+ * number of bytes required for the arena is stored in bytes.
+ */
+int
+_synctory_index_geometry(_synctory_index_t *index, uint64_t entries, size_t sumsize, uint64_t *bytes)
+{
+    uint64_t slots = _SYNCTORY_INDEX_MINSLOTS;
+    unsigned int bits = 4;
+    unsigned int fbits = _SYNCTORY_INDEX_FILTER_MINBITS;
+    
+    if (entries >= UINT32_MAX)
+        return EFBIG;
+    
+    while ((slots * _SYNCTORY_INDEX_LOAD_NUM) < (entries * _SYNCTORY_INDEX_LOAD_DEN))
+    {
+        slots <<= 1;
+        bits++;
+    }
+    
+    while ((fbits < _SYNCTORY_INDEX_FILTER_MAXBITS) && ((UINT64_C(64) << fbits) < (entries * _SYNCTORY_INDEX_FILTER_BPE)))
+        fbits++;
+    
+    *bytes = (UINT64_C(1) << fbits) * sizeof(uint64_t) + slots * sizeof(_synctory_index_slot_t) + entries * (3 * sizeof(uint32_t) + sumsize);
+    if (*bytes > SIZE_MAX)
+        return EFBIG;
+    
+    index->arena = NULL;
+    index->slots = slots;
+    index->bits = bits;
+    index->fbits = fbits;
+    index->entries = (uint32_t)entries;
+    index->sumsize = sumsize;
+    return 0;
+}
+
+
+/**
+ * Distribute the arena starting at base among table and arrays. The
+ * geometry of the index must have been set up before.
+ */
+void
+_synctory_index_attach(_synctory_index_t *index, void *base)
+{
+    unsigned char *ptr = (unsigned char *)base;
+    
+    index->filter = (uint64_t *)ptr;
+    ptr += (UINT64_C(1) << index->fbits) * sizeof(uint64_t);
+    index->slot = (_synctory_index_slot_t *)ptr;
+    ptr += index->slots * sizeof(_synctory_index_slot_t);
+    index->weak = (uint32_t *)ptr;
+    ptr += (size_t)index->entries * sizeof(uint32_t);
+    index->chunk = (uint32_t *)ptr;
+    ptr += (size_t)index->entries * sizeof(uint32_t);
+    index->position = (uint32_t *)ptr;
+    ptr += (size_t)index->entries * sizeof(uint32_t);
+    index->strong = ptr;
+}
+
+
+/**
+ * Allocate the arena for the given number of entries and
+ * distribute it among table and arrays.
+ */
+static int
+__synctory_index_alloc(_synctory_index_t *index, uint64_t entries, size_t sumsize)
+{
+    int rval;
+    uint64_t bytes;
+    
+    rval = _synctory_index_geometry(index, entries, sumsize, &bytes);
+    if (rval)
+        return rval;
+    
+    index->arena = calloc(1, (size_t)bytes);
+    if (NULL == index->arena)
+        return ((errno != 0) ? errno : ENOMEM);
+    
+    _synctory_index_attach(index, index->arena);
+    return 0;
+}
+
+
+/**
+ * Run one pass over the first total records of the fingerprint. Pass 0
+ * counts the group sizes and fills the pre-filter, pass 1 stores the
+ * records inside their groups. Records whose weak checksum lies outside
+ * the range [lo, hi] are skipped.
+ */
+static int
+__synctory_index_pass(_synctory_index_t *index, int fd, unsigned char *buffer, uint32_t total, uint32_t lo, uint32_t hi, int pass)
+{
+    size_t recsize = sizeof(uint32_t) + index->sumsize;
+    uint32_t e = 0, j, k, records;
+    uint32_t checksum;
+    uint64_t hash;
+    ssize_t rbytes;
+    _synctory_index_slot_t *s;
+    unsigned char *rec;
+    
+    while (e < total)
+    {
+        records = total - e;
+        if (records > _SYNCTORY_INDEX_READ_RECORDS)
+            records = _SYNCTORY_INDEX_READ_RECORDS;
+        
+        rbytes = _synctory_file64_pread(fd, buffer, records * recsize, (_synctory_off_t)_SYNCTORY_FH_BYTES + (_synctory_off_t)e * (_synctory_off_t)recsize);
+        if (rbytes != (ssize_t)(records * recsize))
+            return ((rbytes < 0) && (errno != 0)) ? errno : -1;
+        
+        for (k = 0, rec = buffer; k < records; k++, e++, rec += recsize)
+        {
+            checksum = _synctory_ntoh32(*((uint32_t *)rec));
+            if ((checksum < lo) || (checksum > hi))
+                continue;
+            s = __synctory_index_probe(index, checksum);
+            if (0 == pass)
+            {
+                s->checksum = checksum;
+                s->count++;
+                hash = _synctory_index_filter_hash(checksum);
+                index->filter[_synctory_index_filter_word(index, hash)] |= _synctory_index_filter_mask(index, hash);
+            }
+            else
+            {
+                j = s->first++;
+                index->weak[j] = checksum;
+                index->chunk[j] = e;
+                memcpy(_synctory_index_strong(index, j), rec + sizeof(uint32_t), index->sumsize);
+            }
+        }
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Record the entry of each chunk which may be predicted: chunks in small
+ * groups whose strong checksum differs from those of all chunks in front
+ * of them inside the group. Groups are stored in chunk order.
+ */
+static void
+__synctory_index_positions(_synctory_index_t *index)
+{
+    uint64_t i;
+    uint32_t j, k;
+    const _synctory_index_slot_t *s;
+    
+    memset(index->position, 0xff, (size_t)index->entries * sizeof(uint32_t));
+    
+    for (i = 0; i < index->slots; i++)
+    {
+        s = &index->slot[i];
+        if ((0 == s->count) || (s->count > _SYNCTORY_INDEX_PREDICT_GROUP))
+            continue;
+        for (j = s->first; j < s->first + s->count; j++)
+        {
+            for (k = s->first; k < j; k++)
+                if (0 == memcmp(_synctory_index_strong(index, k), _synctory_index_strong(index, j), index->sumsize))
+                    break;
+            if (k == j)
+                index->position[index->chunk[j]] = j;
+        }
+    }
+}
+
+
+/**
+ * Count the records of the fingerprint read from the given file descriptor.
+ * The chunk count is announced by the header; a truncated fingerprint file
+ * however only yields the records actually present.
+ */
+int
+_synctory_index_records(int fd, const _synctory_fheader_t *header, uint64_t *records)
+{
+    int sumsize = _synctory_strong_checksum_size(header->algo);
+    uint64_t chunks;
+    _synctory_off_t fpsize;
+    
+    if ((sumsize <= 0) || (0 == header->chunksize))
+        return EINVAL;
+    
+    chunks = (header->filesize + header->chunksize - 1) / header->chunksize;
+    fpsize = _synctory_file64_seek(fd, 0, SEEK_END);
+    if (fpsize < (_synctory_off_t)_SYNCTORY_FH_BYTES)
+        return ((fpsize < 0) && (errno != 0)) ? errno : -1;
+    *records = (uint64_t)(fpsize - _SYNCTORY_FH_BYTES) / (sizeof(uint32_t) + (size_t)sumsize);
+    if (*records > chunks)
+        *records = chunks;
+    if (*records >= UINT32_MAX)
+        return EFBIG;
+    
+    return 0;
+}
+
+
+/**
+ * Build the index from those records of the fingerprint read from the
+ * given file descriptor whose weak checksum lies within [lo, hi]; entries
+ * is the number of these records. The header must have been read already.
+ * Chunks are only predicted (see _synctory_index_predict) by an index
+ * covering the whole fingerprint.
+ */
+int
+_synctory_index_load_range_fd(_synctory_index_t *index, int fd, const _synctory_fheader_t *header, uint32_t lo, uint32_t hi, uint64_t entries)
+{
+    int rval;
+    int sumsize = _synctory_strong_checksum_size(header->algo);
+    uint64_t records, i, first;
+    unsigned char *buffer;
+    
+    index->arena = NULL;
+    
+    rval = _synctory_index_records(fd, header, &records);
+    if (rval)
+        return rval;
+    if (entries > records)
+        return EINVAL;
+    
+    rval = __synctory_index_alloc(index, entries, (size_t)sumsize);
+    if (rval)
+        return rval;
+    
+    buffer = (unsigned char *)malloc(_SYNCTORY_INDEX_READ_RECORDS * (sizeof(uint32_t) + (size_t)sumsize));
+    if (NULL == buffer)
+    {
+        _synctory_index_free(index);
+        return ((errno != 0) ? errno : ENOMEM);
+    }
+    
+    /* count group sizes */
+    rval = __synctory_index_pass(index, fd, buffer, (uint32_t)records, lo, hi, 0);
+    if (rval)
+    {
+        free(buffer);
+        _synctory_index_free(index);
+        return rval;
+    }
+    
+    /* assign each group its range inside the arrays */
+    for (i = 0, first = 0; i < index->slots; i++)
+    {
+        index->slot[i].first = (uint32_t)first;
+        first += index->slot[i].count;
+    }
+    
+    /* the range must hold exactly the announced number of records */
+    if (first != entries)
+    {
+        free(buffer);
+        _synctory_index_free(index);
+        return EINVAL;
+    }
+    
+    /* store the records; this moves each group's first pointer to its end */
+    rval = __synctory_index_pass(index, fd, buffer, (uint32_t)records, lo, hi, 1);
+    free(buffer);
+    if (rval)
+    {
+        _synctory_index_free(index);
+        return rval;
+    }
+    
+    for (i = 0; i < index->slots; i++)
+        index->slot[i].first -= index->slot[i].count;
+    
+    if ((0 == lo) && (UINT32_MAX == hi))
+        __synctory_index_positions(index);
+    else
+        index->position = NULL;
+    return 0;
+}
+
+
+/**
+ * Build the index from the fingerprint read from the given file
+ * descriptor. The header must have been read already.
+ */
+int
+_synctory_index_load_fd(_synctory_index_t *index, int fd, const _synctory_fheader_t *header)
+{
+    int rval;
+    uint64_t records;
+    
+    index->arena = NULL;
+    
+    rval = _synctory_index_records(fd, header, &records);
+    if (rval)
+        return rval;
+    
+    return _synctory_index_load_range_fd(index, fd, header, 0, UINT32_MAX, records);
+}
+
+
+/**
+ * Find the group of entries carrying the given weak checksum. Returns
+ * NULL if no chunk of the fingerprint has this weak checksum.
+ */
+const _synctory_index_slot_t *
+_synctory_index_find(const _synctory_index_t *index, uint32_t checksum)
+{
+    const _synctory_index_slot_t *s = __synctory_index_probe(index, checksum);
+    return (s->count ? s : NULL);
+}
+
+
+/**
+ * Check whether the window of len bytes carrying the given weak checksum
+ * matches the given chunk, which has been predicted to follow the last
+ * match. The strong checksum is only computed (into strongsum) if the weak
+ * checksums agree. Returns 1 if the chunk matches, 0 otherwise; in the
+ * latter case, the window still needs to be looked up.
+ */
+int
+_synctory_index_predict(const _synctory_index_t *index, uint32_t chunk, uint32_t checksum, const unsigned char *window, size_t len, synctory_algo_t algo, unsigned char *strongsum)
+{
+    uint32_t j;
+    
+    if ((NULL == index->position) || (chunk >= index->entries))
+        return 0;
+    
+    j = index->position[chunk];
+    if ((_SYNCTORY_INDEX_NONE == j) || (index->weak[j] != checksum))
+        return 0;
+    
+    _synctory_strong_checksum(window, len, strongsum, algo);
+    return (0 == _synctory_strong_checksum_compare(_synctory_index_strong(index, j), strongsum, index->sumsize));
+}
+
+
+/**
+ * Look up the window of len bytes carrying the given weak checksum, which
+ * already passed the pre-filter. The strong checksum of the window is only
+ * computed (into strongsum) if the weak checksum is part of the index.
+ * Returns 1 and stores the index of the first matching chunk in chunk if
+ * a chunk matches, 0 otherwise. Filter false positives are counted in stats.
+ */
+int
+_synctory_index_match(const _synctory_index_t *index, uint32_t checksum, const unsigned char *window, size_t len, synctory_algo_t algo, unsigned char *strongsum, synctory_stats_t *stats, uint32_t *chunk)
+{
+    uint32_t j;
+    const _synctory_index_slot_t *s = __synctory_index_probe(index, checksum);
+    
+    if (0 == s->count)
+    {
+        stats->index_misses++;
+        return 0;
+    }
+    
+    _synctory_strong_checksum(window, len, strongsum, algo);
+    for (j = s->first; j < s->first + s->count; j++)
+    {
+        if (0 == _synctory_strong_checksum_compare(_synctory_index_strong(index, j), strongsum, index->sumsize))
+        {
+            *chunk = index->chunk[j];
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+
+void
+_synctory_index_free(_synctory_index_t *index)
+{
+    free(index->arena);
+    index->arena = NULL;
+    index->filter = NULL;
+    index->slot = NULL;
+    index->position = NULL;
+    index->slots = 0;
+    index->entries = 0;
+}
+
+
+/**
+ * Read the header of the fingerprint file descriptor fd and build the
+ * index of its chunks.
+ */
+int
+_synctory_fpindex_load_fd(synctory_fpindex_t *fpindex, int fd)
+{
+    int rval;
+    _synctory_file64_stat_t st;
+    
+    fpindex->index.arena = NULL;
+    fpindex->map.data = NULL;
+    fpindex->map.size = 0;
+    
+    /* identify the fingerprint file, see _synctory_sidecar_load_fd */
+    if (0 != _synctory_file64_fstat(fd, &st))
+        return ((errno != 0) ? errno : -1);
+    fpindex->fpsize = (uint64_t)st.st_size;
+    fpindex->fpmtime = (int64_t)st.st_mtime;
+    
+    rval = _synctory_fh_getheader_fd(&fpindex->header, fd);
+    if (rval)
+        return rval;
+    
+    /* check whether the fingerprint file is acutally a fingerprint */
+    if (fpindex->header.type != _SYNCTORY_FH_FINGERPRINT)
+        return -1;
+    
+    return _synctory_index_load_fd(&fpindex->index, fd, &fpindex->header);
+}
+
+
+void
+_synctory_fpindex_free(synctory_fpindex_t *fpindex)
+{
+    _synctory_index_free(&fpindex->index);
+    _synctory_file64_unmap(&fpindex->map);
+}
@@ -0,0 +1,498 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * The low memory index serves lookups from a sorted copy of the
+ * fingerprint kept in a temporary file, so its memory requirements do not
+ * depend on the size of the fingerprint.
+ *
+ * The copy is created by an external merge sort: the fingerprint is read
+ * in runs of _SYNCTORY_LOMEM_RUN records, each run is sorted in memory and
+ * appended to a temporary file, and up to _SYNCTORY_LOMEM_FANIN runs at a
+ * time are merged into a second temporary file until a single run is left.
+ * Records are sorted by weak checksum, and by chunk index within the same
+ * weak checksum, so the first record carrying the checksums of a window is
+ * the one with the lowest chunk index, just like with the in-memory index.
+ *
+ * A lookup first tests the pre-filter, then searches the fences for the
+ * block where the weak checksum's records start, and scans the block (and,
+ * rarely, its successors). Recently used blocks are cached.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "_checksum.h"
+#include "_endianess.h"
+#include "_fheader.h"
+#include "_file64.h"
+#include "_index.h"
+#include "_lomem.h"
+
+
+/**
+ * Weak checksum and chunk index of a record of the sorted copy
+ */
+#define __synctory_lomem_weak(rec,var) memcpy(&(var), (rec), sizeof(uint32_t))
+#define __synctory_lomem_chunk(rec,var) memcpy(&(var), (rec) + sizeof(uint32_t), sizeof(uint32_t))
+
+
+/**
+ * One sorted run taking part in a merge
+ */
+typedef struct
+{
+    uint64_t next;              /* next record to read from the file    */
+    uint64_t end;               /* end of the run                       */
+    unsigned char *buffer;      /* records read from the run            */
+    size_t pos;                 /* current record inside the buffer     */
+    size_t count;               /* number of records inside the buffer  */
+} __synctory_lomem_input_t;
+
+
+/**
+ * Order records by weak checksum, then by chunk index
+ */
+static int
+__synctory_lomem_compare(const void *a, const void *b)
+{
+    uint32_t wa, wb, ca, cb;
+    
+    __synctory_lomem_weak((const unsigned char *)a, wa);
+    __synctory_lomem_weak((const unsigned char *)b, wb);
+    if (wa != wb)
+        return (wa < wb) ? -1 : 1;
+    
+    __synctory_lomem_chunk((const unsigned char *)a, ca);
+    __synctory_lomem_chunk((const unsigned char *)b, cb);
+    return (ca < cb) ? -1 : (ca > cb);
+}
+
+
+/**
+ * Read the next records of a run into its buffer
+ */
+static int
+__synctory_lomem_input_fill(const _synctory_lomem_t *lomem, int fd, __synctory_lomem_input_t *input, size_t capacity)
+{
+    uint64_t n = input->end - input->next;
+    int rval;
+    
+    if (n > capacity)
+        n = capacity;
+    
+    rval = _synctory_file64_readat(fd, input->buffer, (size_t)n * lomem->recsize, (_synctory_off_t)(input->next * lomem->recsize));
+    if (rval)
+        return rval;
+    
+    input->next += n;
+    input->pos = 0;
+    input->count = (size_t)n;
+    return 0;
+}
+
+
+/**
+ * Merge groups of _SYNCTORY_LOMEM_FANIN consecutive runs of runlen
+ * records each from fdin into fdout
+ */
+static int
+__synctory_lomem_merge(const _synctory_lomem_t *lomem, int fdin, int fdout, uint64_t runlen, unsigned char *buffer)
+{
+    int rval = 0;
+    unsigned int i, n, best;
+    uint64_t group;
+    size_t capacity = _SYNCTORY_LOMEM_MERGEBUF / lomem->recsize;
+    size_t out = 0;
+    unsigned char *obuf = buffer + _SYNCTORY_LOMEM_FANIN * capacity * lomem->recsize;
+    unsigned char *rec;
+    __synctory_lomem_input_t input[_SYNCTORY_LOMEM_FANIN];
+    
+    if (0 != _synctory_file64_seek(fdout, 0, SEEK_SET))
+        return ((errno != 0) ? errno : -1);
+    
+    for (group = 0; (0 == rval) && (group < lomem->entries); group += runlen * _SYNCTORY_LOMEM_FANIN)
+    {
+        for (n = 0; (n < _SYNCTORY_LOMEM_FANIN) && ((group + n * runlen) < lomem->entries); n++)
+        {
+            input[n].next = group + n * runlen;
+            input[n].end = input[n].next + runlen;
+            if (input[n].end > lomem->entries)
+                input[n].end = lomem->entries;
+            input[n].buffer = buffer + n * capacity * lomem->recsize;
+            rval = __synctory_lomem_input_fill(lomem, fdin, &input[n], capacity);
+            if (rval)
+                return rval;
+        }
+        
+        for (;;)
+        {
+            /* pick the smallest head among the runs not yet exhausted */
+            best = n;
+            for (i = 0; i < n; i++)
+            {
+                if (input[i].pos == input[i].count)
+                    continue;
+                if ((best == n) || (__synctory_lomem_compare(&input[i].buffer[input[i].pos * lomem->recsize], &input[best].buffer[input[best].pos * lomem->recsize]) < 0))
+                    best = i;
+            }
+            if (best == n)
+                break;
+            
+            rec = &input[best].buffer[input[best].pos * lomem->recsize];
+            memcpy(&obuf[out * lomem->recsize], rec, lomem->recsize);
+            if (++out == capacity)
+            {
+                rval = _synctory_file64_write(fdout, obuf, out * lomem->recsize);
+                if (rval)
+                    return rval;
+                out = 0;
+            }
+            
+            if ((++input[best].pos == input[best].count) && (input[best].next < input[best].end))
+            {
+                rval = __synctory_lomem_input_fill(lomem, fdin, &input[best], capacity);
+                if (rval)
+                    return rval;
+            }
+        }
+    }
+    
+    if (out)
+        rval = _synctory_file64_write(fdout, obuf, out * lomem->recsize);
+    return rval;
+}
+
+
+/**
+ * Write the fingerprint records to the sorted copy as sorted runs, and set
+ * up the pre-filter on the way
+ */
+static int
+__synctory_lomem_runs(_synctory_lomem_t *lomem, int fd)
+{
+    int rval = 0;
+    uint32_t e, k, n, weak, idx;
+    size_t fprec = sizeof(uint32_t) + lomem->sumsize;
+    unsigned char *rbuf, *run, *rec;
+    uint64_t hash;
+    
+    rbuf = (unsigned char *)malloc(_SYNCTORY_LOMEM_RUN * fprec);
+    run = (unsigned char *)malloc(_SYNCTORY_LOMEM_RUN * lomem->recsize);
+    if ((NULL == rbuf) || (NULL == run))
+    {
+        free(rbuf);
+        free(run);
+        return ((errno != 0) ? errno : ENOMEM);
+    }
+    
+    for (e = 0; (0 == rval) && (e < lomem->entries); e += n)
+    {
+        n = lomem->entries - e;
+        if (n > _SYNCTORY_LOMEM_RUN)
+            n = _SYNCTORY_LOMEM_RUN;
+        
+        rval = _synctory_file64_readat(fd, rbuf, n * fprec, (_synctory_off_t)_SYNCTORY_FH_BYTES + (_synctory_off_t)e * (_synctory_off_t)fprec);
+        if (rval)
+            break;
+        
+        for (k = 0; k < n; k++)
+        {
+            rec = &run[k * lomem->recsize];
+            memcpy(&weak, &rbuf[k * fprec], sizeof(uint32_t));
+            weak = _synctory_ntoh32(weak);
+            idx = e + k;
+            memcpy(rec, &weak, sizeof(uint32_t));
+            memcpy(rec + sizeof(uint32_t), &idx, sizeof(uint32_t));
+            memcpy(rec + 2 * sizeof(uint32_t), &rbuf[k * fprec + sizeof(uint32_t)], lomem->sumsize);
+            
+            hash = _synctory_index_filter_hash(weak);
+            lomem->filter[_synctory_index_filter_word(lomem, hash)] |= _synctory_index_filter_mask(lomem, hash);
+        }
+        
+        qsort(run, n, lomem->recsize, __synctory_lomem_compare);
+        rval = _synctory_file64_write(lomem->fd, run, n * lomem->recsize);
+    }
+    
+    free(rbuf);
+    free(run);
+    return rval;
+}
+
+
+/**
+ * Merge the sorted runs until a single one is left, which becomes the
+ * sorted copy
+ */
+static int
+__synctory_lomem_sort(_synctory_lomem_t *lomem)
+{
+    int rval = 0;
+    uint64_t runlen = _SYNCTORY_LOMEM_RUN;
+    unsigned char *buffer;
+    FILE *other, *swap;
+    
+    if (lomem->entries <= runlen)
+        return 0;
+    
+    buffer = (unsigned char *)malloc((_SYNCTORY_LOMEM_FANIN + 1) * _SYNCTORY_LOMEM_MERGEBUF);
+    other = tmpfile();
+    if ((NULL == buffer) || (NULL == other))
+    {
+        rval = ((errno != 0) ? errno : -1);
+        free(buffer);
+        if (NULL != other)
+            fclose(other);
+        return rval;
+    }
+    
+    while ((0 == rval) && (runlen < lomem->entries))
+    {
+        rval = __synctory_lomem_merge(lomem, lomem->fd, fileno(other), runlen, buffer);
+        
+        /* the merged runs are the input of the next pass */
+        swap = lomem->file;
+        lomem->file = other;
+        lomem->fd = fileno(other);
+        other = swap;
+        runlen *= _SYNCTORY_LOMEM_FANIN;
+    }
+    
+    fclose(other);
+    free(buffer);
+    return rval;
+}
+
+
+/**
+ * Get a block of the sorted copy, from the cache if possible
+ */
+static int
+__synctory_lomem_block(_synctory_lomem_t *lomem, uint64_t block, unsigned char **ptr, uint32_t *count)
+{
+    int rval;
+    uint32_t line = (uint32_t)(block % lomem->lines);
+    uint64_t first = block * lomem->blocksize;
+    
+    *count = lomem->blocksize;
+    if (first + *count > lomem->entries)
+        *count = (uint32_t)(lomem->entries - first);
+    *ptr = &lomem->cache[(size_t)line * lomem->blocksize * lomem->recsize];
+
+    if (lomem->cached[line] != block)
+    {
+        rval = _synctory_file64_readat(lomem->fd, *ptr, (size_t)*count * lomem->recsize, (_synctory_off_t)(first * lomem->recsize));
+        if (rval)
+        {
+            lomem->cached[line] = UINT64_MAX;
+            return rval;
+        }
+        lomem->cached[line] = block;
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Build the low memory index from the fingerprint read from the given
+ * file descriptor. The header must have been read already.
+ */
+int
+_synctory_lomem_load_fd(_synctory_lomem_t *lomem, int fd, const _synctory_fheader_t *header)
+{
+    int rval;
+    int sumsize = _synctory_strong_checksum_size(header->algo);
+    uint64_t chunks, records, b, blocksize;
+    uint32_t line;
+    _synctory_off_t fpsize;
+    
+    memset(lomem, 0, sizeof(_synctory_lomem_t));
+    lomem->fd = -1;
+    
+    if ((sumsize <= 0) || (0 == header->chunksize))
+        return EINVAL;
+    
+    /*
+     * The chunk count is announced by the header; a truncated fingerprint
+     * file however only yields the records actually present.
+     */
+    chunks = (header->filesize + header->chunksize - 1) / header->chunksize;
+    fpsize = _synctory_file64_seek(fd, 0, SEEK_END);
+    if (fpsize < (_synctory_off_t)_SYNCTORY_FH_BYTES)
+        return ((fpsize < 0) && (errno != 0)) ? errno : -1;
+    records = (uint64_t)(fpsize - _SYNCTORY_FH_BYTES) / (sizeof(uint32_t) + (size_t)sumsize);
+    if (records < chunks)
+        chunks = records;
+    if (chunks >= UINT32_MAX)
+        return EFBIG;
+    
+    lomem->entries = (uint32_t)chunks;
+    lomem->sumsize = (size_t)sumsize;
+    lomem->recsize = 2 * sizeof(uint32_t) + (size_t)sumsize;
+    
+    /* the pre-filter is sized like the one of the in-memory index */
+    lomem->fbits = _SYNCTORY_INDEX_FILTER_MINBITS;
+    while ((lomem->fbits < _SYNCTORY_INDEX_FILTER_MAXBITS) && ((UINT64_C(64) << lomem->fbits) < (chunks * _SYNCTORY_INDEX_FILTER_BPE)))
+        lomem->fbits++;
+    
+    lomem->filter = (uint64_t *)calloc((size_t)1 << lomem->fbits, sizeof(uint64_t));
+    if (NULL == lomem->filter)
+        return ((errno != 0) ? errno : ENOMEM);
+    
+    if (0 == lomem->entries)
+        return 0;
+    
+    lomem->file = tmpfile();
+    if (NULL == lomem->file)
+    {
+        rval = ((errno != 0) ? errno : -1);
+        _synctory_lomem_free(lomem);
+        return rval;
+    }
+    lomem->fd = fileno(lomem->file);
+    
+    rval = __synctory_lomem_runs(lomem, fd);
+    if (0 == rval)
+        rval = __synctory_lomem_sort(lomem);
+    if (rval)
+    {
+        _synctory_lomem_free(lomem);
+        return rval;
+    }
+    
+    /* keep the number of fences bounded by growing the blocks instead */
+    blocksize = (lomem->entries + _SYNCTORY_LOMEM_FENCES - 1) / _SYNCTORY_LOMEM_FENCES;
+    if (blocksize < _SYNCTORY_LOMEM_BLOCK)
+        blocksize = _SYNCTORY_LOMEM_BLOCK;
+    lomem->blocksize = (uint32_t)blocksize;
+    lomem->blocks = (lomem->entries + blocksize - 1) / blocksize;
+    
+    lomem->lines = (uint32_t)(_SYNCTORY_LOMEM_CACHE / (blocksize * lomem->recsize));
+    if (0 == lomem->lines)
+        lomem->lines = 1;
+    
+    lomem->fence = (uint32_t *)malloc((size_t)lomem->blocks * sizeof(uint32_t));
+    lomem->cache = (unsigned char *)malloc((size_t)lomem->lines * lomem->blocksize * lomem->recsize);
+    lomem->cached = (uint64_t *)malloc((size_t)lomem->lines * sizeof(uint64_t));
+    if ((NULL == lomem->fence) || (NULL == lomem->cache) || (NULL == lomem->cached))
+    {
+        rval = ((errno != 0) ? errno : ENOMEM);
+        _synctory_lomem_free(lomem);
+        return rval;
+    }
+    
+    for (line = 0; line < lomem->lines; line++)
+        lomem->cached[line] = UINT64_MAX;
+    
+    for (b = 0; b < lomem->blocks; b++)
+    {
+        rval = _synctory_file64_readat(lomem->fd, &lomem->fence[b], sizeof(uint32_t), (_synctory_off_t)(b * blocksize * lomem->recsize));
+        if (rval)
+        {
+            _synctory_lomem_free(lomem);
+            return rval;
+        }
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Look up the window of len bytes carrying the given weak checksum, which
+ * has passed the pre-filter. The strong checksum of the window is only
+ * computed (into strongsum) if the weak checksum is found. On return,
+ * chunk holds the index of the first chunk matching the window, or
+ * _SYNCTORY_INDEX_NONE. Returns 0 on success.
+ */
+int
+_synctory_lomem_match(_synctory_lomem_t *lomem, uint32_t checksum, const unsigned char *window, size_t len, synctory_algo_t algo, unsigned char *strongsum, synctory_stats_t *stats, uint32_t *chunk)
+{
+    int rval;
+    int found = 0;
+    int past = 0;
+    uint64_t lo = 0, hi = lomem->blocks, mid, block;
+    uint32_t k, count, weak;
+    unsigned char *ptr, *rec;
+    
+    *chunk = _SYNCTORY_INDEX_NONE;
+
+    /* the records of the checksum start in the block before the first fence not below it */
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (lomem->fence[mid] < checksum)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    for (block = (lo > 0) ? lo - 1 : 0; (block < lomem->blocks) && !past; block++)
+    {
+        rval = __synctory_lomem_block(lomem, block, &ptr, &count);
+        if (rval)
+            return rval;
+        
+        for (k = 0; (k < count) && !past; k++)
+        {
+            rec = &ptr[(size_t)k * lomem->recsize];
+            __synctory_lomem_weak(rec, weak);
+            if (weak < checksum)
+                continue;
+            if (weak > checksum)
+            {
+                past = 1;
+                continue;
+            }
+            
+            if (!found)
+            {
+                _synctory_strong_checksum(window, len, strongsum, algo);
+                found = 1;
+            }
+            if (0 == _synctory_strong_checksum_compare(rec + 2 * sizeof(uint32_t), strongsum, lomem->sumsize))
+            {
+                __synctory_lomem_chunk(rec, *chunk);
+                return 0;
+            }
+        }
+    }
+    
+    if (!found)
+        stats->index_misses++;
+    return 0;
+}
+
+
+void
+_synctory_lomem_free(_synctory_lomem_t *lomem)
+{
+    if (NULL != lomem->file)
+        fclose(lomem->file);
+    free(lomem->filter);
+    free(lomem->fence);
+    free(lomem->cache);
+    free(lomem->cached);
+    memset(lomem, 0, sizeof(_synctory_lomem_t));
+    lomem->fd = -1;
+}
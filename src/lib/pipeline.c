@@ -0,0 +1,645 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * The pipelined diff splits the work of the fast diff into three stages,
+ * each running in its own thread:
+ * 
+ *   reader   reads the source file block by block, ahead of the matcher
+ *   matcher  moves the rolling window across the blocks and looks up the
+ *            fingerprint index
+ *   writer   turns matches and unmatched bytes into diff records
+ * 
+ * The stages are connected by bounded lock-free queues (see queue.c), and
+ * a fixed set of blocks circulates between them: reader -> matcher ->
+ * writer -> reader. This way, reading and writing overlap with the
+ * checksum work, which pays off on storage with high latency.
+ * 
+ * The writer does not know the length of a run of unmatched bytes before
+ * it ends, so it reserves room for the record header, streams the bytes
+ * behind it, and fills in the header once the run is complete. The result
+ * is identical to the diff created by synctory_diff, except in compact
+ * diffs with runs of unmatched bytes outgrowing the write buffer: their
+ * length has to be padded to the room reserved for it.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <synctory.h>
+
+#include "config.h"
+#include "version.h"
+
+#include "_checksum.h"
+#include "_diff.h"
+#include "_endianess.h"
+#include "_fheader.h"
+#include "_file64.h"
+#include "_index.h"
+#include "_pipeline.h"
+#include "_queue.h"
+#include "_writer.h"
+
+#ifdef _SYNCTORY_PIPELINE_AVAILABLE
+#include <pthread.h>
+#endif
+
+
+#ifdef _SYNCTORY_PIPELINE_AVAILABLE
+
+/**
+ * State shared by the stages of the pipeline
+ */
+typedef struct
+{
+    const _synctory_index_t *index;
+    const _synctory_fheader_t *header;
+    int fdsource;
+    int fddiff;
+    size_t wbufsize;
+    _synctory_off_t filesize;
+    _synctory_queue_t empty;        /* writer  -> reader    */
+    _synctory_queue_t filled;       /* reader  -> matcher   */
+    _synctory_queue_t matched;      /* matcher -> writer    */
+    volatile int abort;
+    int rval[3];
+    synctory_stats_t stats;
+} _synctory_pipeline_t;
+
+
+/**
+ * Output state of the writer stage
+ */
+typedef struct
+{
+    _synctory_diff_out_t diff;
+    int raw;                        /* a raw record is open                 */
+    _synctory_off_t rawhead;        /* diff offset of its record header     */
+    size_t headlen;                 /* bytes reserved for the header        */
+    uint64_t rawlen;                /* number of raw bytes written so far   */
+    int deferred;                   /* raw bytes are left in the source     */
+    int fdsource;                   /* source to read deferred bytes from   */
+    _synctory_off_t rawstart;       /* source offset of the raw record      */
+} _synctory_pipeline_out_t;
+
+
+/**
+ * Stop the whole pipeline after a stage failed
+ */
+static void
+__synctory_pipeline_fail(_synctory_pipeline_t *pipe, int stage, int rval)
+{
+    pipe->rval[stage] = rval;
+    _synctory_queue_abort(&pipe->empty);
+}
+
+
+/**
+ * Reader stage: fill empty blocks with the source file, one window
+ * longer than the positions they cover.
+ */
+static void *
+__synctory_pipeline_reader(void *arg)
+{
+    _synctory_pipeline_t *pipe = (_synctory_pipeline_t *)arg;
+    _synctory_pipeline_block_t *block;
+    _synctory_off_t offset = 0;
+    size_t want;
+    ssize_t rbytes;
+    int last;
+    
+    do
+    {
+        block = (_synctory_pipeline_block_t *)_synctory_queue_pop(&pipe->empty);
+        if (NULL == block)
+            return NULL;
+        
+        want = _SYNCTORY_PIPELINE_BLOCKSIZE + pipe->header->chunksize;
+        if ((_synctory_off_t)want > pipe->filesize - offset)
+            want = (size_t)(pipe->filesize - offset);
+        
+        /* short reads are retried until EOF */
+        block->len = 0;
+        while (block->len < want)
+        {
+            rbytes = _synctory_file64_pread(pipe->fdsource, &block->data[block->len], want - block->len, offset + (_synctory_off_t)block->len);
+            if (rbytes < 0)
+            {
+                if (EINTR == errno)
+                    continue;
+                __synctory_pipeline_fail(pipe, 0, ((errno != 0) ? errno : -1));
+                return NULL;
+            }
+            if (0 == rbytes)
+                break;
+            block->len += (size_t)rbytes;
+        }
+        
+        block->offset = offset;
+        block->owned = (block->len < _SYNCTORY_PIPELINE_BLOCKSIZE) ? block->len : _SYNCTORY_PIPELINE_BLOCKSIZE;
+        block->last = last = ((block->len < want) || ((offset + _SYNCTORY_PIPELINE_BLOCKSIZE) >= pipe->filesize));
+        block->count = 0;
+        
+        if (_synctory_queue_push(&pipe->filled, block))
+            return NULL;
+        
+        offset += _SYNCTORY_PIPELINE_BLOCKSIZE;
+    } while (!last);
+    
+    return NULL;
+}
+
+
+/**
+ * Append a match to the match list of a block
+ */
+static int
+__synctory_pipeline_block_push(_synctory_pipeline_block_t *block, _synctory_off_t offset, uint32_t chunk)
+{
+    _synctory_diff_match_t *match;
+    size_t size;
+    
+    if (block->count == block->size)
+    {
+        size = (block->size ? 2 * block->size : _SYNCTORY_DIFF_MATCHES);
+        match = (_synctory_diff_match_t *)realloc(block->match, size * sizeof(_synctory_diff_match_t));
+        if (NULL == match)
+            return ((errno != 0) ? errno : ENOMEM);
+        block->match = match;
+        block->size = size;
+    }
+    
+    block->match[block->count].offset = offset;
+    block->match[block->count].chunk = chunk;
+    block->count++;
+    return 0;
+}
+
+
+/**
+ * Matcher stage: move the rolling window across the blocks. A match may
+ * move the window into the next block; the checksum state carries over.
+ */
+static void *
+__synctory_pipeline_matcher(void *arg)
+{
+    _synctory_pipeline_t *pipe = (_synctory_pipeline_t *)arg;
+    _synctory_pipeline_block_t *block;
+    const _synctory_index_t *findex = pipe->index;
+    uint16_t chunksize = pipe->header->chunksize;
+    _synctory_off_t curpos = 0;
+    _synctory_off_t end;
+    _synctory_checksum_t weaksum;
+    _synctory_checksum_batch_t batch;
+    unsigned char *strongsum;
+    unsigned char *buffer;
+    unsigned char lchar = '\0';
+    uint32_t wsum, j;
+    uint32_t predict = _SYNCTORY_INDEX_NONE;
+    uint64_t hash;
+    size_t rbytes;
+    int iflag = 1;
+    int kflag, last, rval;
+    
+    strongsum = (unsigned char *)malloc(findex->sumsize);
+    if (NULL == strongsum)
+    {
+        __synctory_pipeline_fail(pipe, 1, ((errno != 0) ? errno : -1));
+        return NULL;
+    }
+    
+    do
+    {
+        block = (_synctory_pipeline_block_t *)_synctory_queue_pop(&pipe->filled);
+        if (NULL == block)
+            break;
+        
+        end = block->offset + (_synctory_off_t)block->owned;
+        while (curpos < end)
+        {
+            buffer = &block->data[curpos - block->offset];
+            rbytes = block->len - (size_t)(curpos - block->offset);
+            if (rbytes > chunksize)
+                rbytes = chunksize;
+            
+            if (iflag || (rbytes < chunksize))
+            {
+                _synctory_checksum_init(&weaksum);
+                _synctory_checksum_update(&weaksum, buffer, rbytes);
+                _synctory_checksum_batch_reset(&batch);
+                wsum = _synctory_checksum_digest(&weaksum);
+                iflag = 0;
+            }
+            else
+                wsum = _synctory_checksum_batch_next(&batch, &weaksum, lchar, buffer, block->len - (size_t)(curpos - block->offset));
+            
+            /* after a match, the following chunk is the most likely one to match next */
+            kflag = 0;
+            if (_SYNCTORY_INDEX_NONE != predict)
+            {
+                kflag = _synctory_index_predict(findex, predict, wsum, buffer, rbytes, pipe->header->algo, strongsum);
+                if (kflag)
+                {
+                    pipe->stats.predict_hits++;
+                    j = predict;
+                }
+                else
+                    pipe->stats.predict_misses++;
+            }
+            
+            /* most windows are rejected by the pre-filter, sparing the index lookup */
+            if (!kflag)
+            {
+                hash = _synctory_index_filter_hash(wsum);
+                if (_synctory_index_filter(findex, hash))
+                {
+                    pipe->stats.filter_hits++;
+                    kflag = _synctory_index_match(findex, wsum, buffer, rbytes, pipe->header->algo, strongsum, &pipe->stats, &j);
+                }
+                else
+                    pipe->stats.filter_misses++;
+            }
+            
+            if (kflag)
+            {
+                rval = __synctory_pipeline_block_push(block, curpos, j);
+                if (rval)
+                {
+                    __synctory_pipeline_fail(pipe, 1, rval);
+                    free(strongsum);
+                    return NULL;
+                }
+                
+                /* continue after the identified chunk */
+                predict = j + 1;
+                curpos += chunksize;
+                iflag = 1;
+            }
+            else
+            {
+                /* go one byte ahead and try again */
+                predict = _SYNCTORY_INDEX_NONE;
+                lchar = buffer[0];
+                curpos++;
+            }
+        }
+        
+        /* the block belongs to the writer once it has been passed on */
+        last = block->last;
+        if (_synctory_queue_push(&pipe->matched, block))
+            break;
+    } while (!last);
+    
+    free(strongsum);
+    return NULL;
+}
+
+
+/**
+ * Append unmatched bytes found at the given source offset, opening a raw
+ * record if none is open yet. The record header is only reserved; it is
+ * written when the record is closed. Compact diffs reserve room for the
+ * longest length encoding.
+ * 
+ * The length of a compact header has to be known before it is flushed.
+ * Once a record outgrows the output buffer, it is taken back and only
+ * counted from then on; closing it copies the bytes from the source.
+ * 
+ * Compressed raw data is collected frame by frame instead, and each frame
+ * is written once it is full.
+ */
+static int
+__synctory_pipeline_out_raw(_synctory_pipeline_out_t *out, _synctory_off_t offset, const unsigned char *data, size_t len)
+{
+    int rval;
+    unsigned char *head;
+    size_t n;
+    
+    if (0 == len)
+        return 0;
+    
+    while (NULL != out->diff.frame)
+    {
+        if (!out->raw)
+        {
+            out->raw = 1;
+            out->rawlen = 0;
+        }
+        n = _SYNCTORY_CODEC_FRAME - (size_t)out->rawlen;
+        if (n > len)
+            n = len;
+        memcpy(&out->diff.frame[out->rawlen], data, n);
+        out->rawlen += n;
+        data += n;
+        len -= n;
+        if (0 == len)
+            return 0;
+        
+        rval = _synctory_diff_write_frame(&out->diff, out->diff.frame, _SYNCTORY_CODEC_FRAME);
+        if (rval)
+            return rval;
+        out->rawlen = 0;
+    }
+    
+    if (!out->raw)
+    {
+        rval = _synctory_diff_write_run(&out->diff);
+        if (rval)
+            return rval;
+        out->rawhead = _synctory_writer_tell(&out->diff.writer);
+        out->headlen = out->diff.compact ? (1 + _SYNCTORY_DIFF_VARINT_BYTES) : 9;
+        rval = _synctory_writer_stage(&out->diff.writer, out->headlen, &head);
+        if (rval)
+            return rval;
+        out->raw = 1;
+        out->rawlen = 0;
+        out->rawstart = offset;
+        out->deferred = 0;
+    }
+    
+    if (!out->deferred && out->diff.compact && (out->diff.writer.len + len > out->diff.writer.size))
+    {
+        if (0 == _synctory_writer_drop(&out->diff.writer, out->rawhead, out->headlen + (size_t)out->rawlen))
+            out->deferred = 1;
+    }
+    
+    out->rawlen += len;
+    if (out->deferred)
+        return 0;
+    return _synctory_writer_put(&out->diff.writer, data, len);
+}
+
+
+/**
+ * Close an open raw record by filling in its header, either inside the
+ * output buffer or, if it has already been flushed, inside the diff file.
+ * A deferred record is written as a whole now.
+ * 
+ * The unused part of the room reserved for a compact header is dropped
+ * while it is still pending, so the record ends up the way the other diff
+ * functions write it. Only if that fails the length is padded to fill the
+ * room.
+ */
+static int
+__synctory_pipeline_out_close(_synctory_pipeline_out_t *out)
+{
+    int rval;
+    unsigned char wbuf[1 + _SYNCTORY_DIFF_VARINT_BYTES];
+    size_t n;
+    uint64_t len;
+    
+    if (!out->raw)
+        return 0;
+    out->raw = 0;
+    
+    if (NULL != out->diff.frame)
+        return (out->rawlen > 0) ? _synctory_diff_write_frame(&out->diff, out->diff.frame, (size_t)out->rawlen) : 0;
+    
+    if (out->deferred)
+    {
+        out->deferred = 0;
+        return _synctory_diff_write_raw_fd(&out->diff, out->fdsource, out->rawstart, out->rawstart + (_synctory_off_t)out->rawlen);
+    }
+    
+    rval = _synctory_diff_out_record(&out->diff, out->rawhead, out->diff.next, out->rawlen, 1);
+    if (rval)
+        return rval;
+    
+    if (out->diff.compact)
+    {
+        wbuf[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_RAW;
+        n = 1 + _synctory_diff_varint_put(&wbuf[1], out->rawlen, 0);
+        rval = _synctory_writer_drop(&out->diff.writer, out->rawhead + (_synctory_off_t)n, out->headlen - n);
+        if (EAGAIN == rval)
+            n = 1 + _synctory_diff_varint_put(&wbuf[1], out->rawlen, out->headlen - 1);
+        else if (rval)
+            return rval;
+        return _synctory_writer_patch(&out->diff.writer, out->rawhead, wbuf, n);
+    }
+    
+    len = _synctory_hton64(out->rawlen);
+    wbuf[0] = (unsigned char)_SYNCTORY_DIFF_BTYPE_RAW;
+    memcpy(&wbuf[1], &len, sizeof(uint64_t));
+    return _synctory_writer_patch(&out->diff.writer, out->rawhead, wbuf, 9);
+}
+
+
+/**
+ * Writer stage: write the matches of each block, preceded by the
+ * unmatched bytes in front of them, and hand the block back to the reader.
+ */
+static void *
+__synctory_pipeline_writer(void *arg)
+{
+    _synctory_pipeline_t *pipe = (_synctory_pipeline_t *)arg;
+    _synctory_pipeline_block_t *block;
+    _synctory_pipeline_out_t out;
+    _synctory_off_t lpos = 0;
+    _synctory_off_t from, end;
+    size_t i;
+    int last = 0;
+    int rval = 0;
+    
+    /* the diff header has been written already */
+    rval = _synctory_diff_out_init(&out.diff, pipe->fddiff, pipe->wbufsize, pipe->header);
+    if (rval)
+    {
+        __synctory_pipeline_fail(pipe, 2, rval);
+        return NULL;
+    }
+    out.raw = 0;
+    out.deferred = 0;
+    out.fdsource = pipe->fdsource;
+    
+    while ((0 == rval) && !last)
+    {
+        block = (_synctory_pipeline_block_t *)_synctory_queue_pop(&pipe->matched);
+        if (NULL == block)
+            break;
+        
+        end = block->offset + (_synctory_off_t)block->owned;
+        for (i = 0; (0 == rval) && (i < block->count); i++)
+        {
+            /* first we need to check whether there are any unmatched bytes to save as "raw" */
+            from = (lpos > block->offset) ? lpos : block->offset;
+            rval = __synctory_pipeline_out_raw(&out, from, &block->data[from - block->offset], (size_t)(block->match[i].offset - from));
+            if (0 == rval)
+                rval = __synctory_pipeline_out_close(&out);
+            
+            /* now take care of the identified chunk */
+            if (0 == rval)
+                rval = _synctory_diff_write_chunk(&out.diff, block->match[i].chunk);
+            
+            lpos = block->match[i].offset + pipe->header->chunksize;
+        }
+        
+        /* unmatched bytes up to the end of the block */
+        if ((0 == rval) && (lpos < end))
+        {
+            from = (lpos > block->offset) ? lpos : block->offset;
+            rval = __synctory_pipeline_out_raw(&out, from, &block->data[from - block->offset], (size_t)(end - from));
+        }
+        
+        last = block->last;
+        if ((0 == rval) && _synctory_queue_push(&pipe->empty, block))
+            break;
+    }
+    
+    if ((0 == rval) && last)
+    {
+        rval = __synctory_pipeline_out_close(&out);
+        if (0 == rval)
+            rval = _synctory_diff_out_flush(&out.diff);
+    }
+    
+    if (rval)
+        __synctory_pipeline_fail(pipe, 2, rval);
+    
+    _synctory_diff_out_free(&out.diff);
+    return NULL;
+}
+
+#endif /* _SYNCTORY_PIPELINE_AVAILABLE */
+
+
+/**
+ * Create a diff using the three-stage pipeline. The matcher stage runs in
+ * the calling thread. Without thread support, or if the stage threads
+ * cannot be started, the fast diff is created instead.
+ */
+int
+_synctory_pipeline_diff(synctory_ctx_t *ctx, int fdfinger, int fdsource, int fddiff)
+{
+#ifdef _SYNCTORY_PIPELINE_AVAILABLE
+    int                         rval = 0;
+    unsigned int                i;
+    int                         started[2] = {0, 0};
+    pthread_t                   thread[2];
+    _synctory_fheader_t         finger_header, diff_header;
+    _synctory_off_t             position;
+    _synctory_index_t           findex;
+    _synctory_pipeline_t        pipe;
+    _synctory_pipeline_block_t  block[_SYNCTORY_PIPELINE_DEPTH];
+    unsigned char               hbuf[_SYNCTORY_FH_BYTES];
+    
+    /* get file header from fingerprint file */
+    rval = _synctory_fh_getheader_fd(&finger_header, fdfinger);
+    if (rval)
+        return rval;
+    
+    /* check whether the fingerprint file is acutally a fingerprint */
+    if (finger_header.type != _SYNCTORY_FH_FINGERPRINT)
+        return -1;
+    
+    /* find out about the file size of the diff source file */
+    position = _synctory_file64_seek(fdsource, 0, SEEK_END);
+    if (position < 0)
+        return errno;
+    
+    /* collect information for the resulting diff file */
+    _synctory_diff_header_init(ctx, &finger_header, position, &diff_header);
+    
+    /* generate the ready-to-write header inside a buffer */
+    rval = _synctory_fh_setheader_bf(&diff_header, hbuf, _SYNCTORY_FH_BYTES);
+    if (rval)
+        return rval;
+    
+    /* read the fingerprint into the index */
+    rval = _synctory_index_load_fd(&findex, fdfinger, &finger_header);
+    if (rval)
+        return rval;
+    
+    /* write the header to the beginning of the result file */
+    if ((0 != _synctory_file64_seek(fddiff, 0, SEEK_SET)) || (_SYNCTORY_FH_BYTES != write(fddiff, hbuf, _SYNCTORY_FH_BYTES)))
+    {
+        _synctory_index_free(&findex);
+        return ((errno != 0) ? errno : -1);
+    }
+    
+    /* set up the pipeline */
+    memset(&pipe, 0, sizeof(_synctory_pipeline_t));
+    memset(block, 0, sizeof(block));
+    pipe.index = &findex;
+    pipe.header = &diff_header;
+    pipe.fdsource = fdsource;
+    pipe.fddiff = fddiff;
+    pipe.wbufsize = ctx->write_buffer;
+    pipe.filesize = position;
+    
+    rval = _synctory_queue_init(&pipe.empty, _SYNCTORY_PIPELINE_DEPTH, &pipe.abort);
+    if (0 == rval)
+        rval = _synctory_queue_init(&pipe.filled, _SYNCTORY_PIPELINE_DEPTH, &pipe.abort);
+    if (0 == rval)
+        rval = _synctory_queue_init(&pipe.matched, _SYNCTORY_PIPELINE_DEPTH, &pipe.abort);
+    
+    for (i = 0; (0 == rval) && (i < _SYNCTORY_PIPELINE_DEPTH); i++)
+    {
+        block[i].data = (unsigned char *)malloc(_SYNCTORY_PIPELINE_BLOCKSIZE + diff_header.chunksize);
+        if (NULL == block[i].data)
+            rval = ((errno != 0) ? errno : -1);
+        else
+            rval = _synctory_queue_push(&pipe.empty, &block[i]);
+    }
+    
+    /* start reader and writer, and run the matcher */
+    if (0 == rval)
+    {
+        started[0] = (0 == pthread_create(&thread[0], NULL, __synctory_pipeline_reader, &pipe));
+        started[1] = started[0] && (0 == pthread_create(&thread[1], NULL, __synctory_pipeline_writer, &pipe));
+        if (started[1])
+            __synctory_pipeline_matcher(&pipe);
+        else
+            _synctory_queue_abort(&pipe.empty);
+        
+        for (i = 0; i < 2; i++)
+            if (started[i])
+                pthread_join(thread[i], NULL);
+        
+        for (i = 0; (0 == rval) && (i < 3); i++)
+            rval = pipe.rval[i];
+    }
+    
+    for (i = 0; i < _SYNCTORY_PIPELINE_DEPTH; i++)
+    {
+        free(block[i].data);
+        free(block[i].match);
+    }
+    _synctory_queue_free(&pipe.empty);
+    _synctory_queue_free(&pipe.filled);
+    _synctory_queue_free(&pipe.matched);
+    _synctory_index_free(&findex);
+    
+    /* threads could not be started: do without them */
+    if ((0 == rval) && !started[1])
+        return _synctory_diff_create_fast(ctx, fdfinger, fdsource, fddiff);
+    
+    /* report statistics */
+    if (0 == rval)
+        ctx->stats = pipe.stats;
+    
+    return rval;
+#else
+    return _synctory_diff_create_fast(ctx, fdfinger, fdsource, fddiff);
+#endif
+}
@@ -0,0 +1,159 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * A bounded single producer, single consumer queue without locks. The
+ * producer only ever writes the tail index, the consumer only ever writes
+ * the head index; the acquire and release semantics of the accesses to
+ * these indices make the slot contents visible to the other side.
+ * 
+ * Threads waiting on a full or empty queue first poll, then yield the
+ * processor and finally sleep in short intervals, so a stalled pipeline
+ * stage does not burn a processor while waiting for I/O.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "config.h"
+
+#ifdef HAVE_SCHED_YIELD_F
+#include <sched.h>
+#endif
+
+#include "_queue.h"
+
+
+#ifdef _SYNCTORY_QUEUE_AVAILABLE
+
+/**
+ * Back off while waiting for the other side of the queue
+ */
+static void
+__synctory_queue_wait(unsigned int *spins)
+{
+    struct timespec ts;
+    
+    if (*spins < _SYNCTORY_QUEUE_SPINS)
+    {
+        (*spins)++;
+        return;
+    }
+    
+#ifdef HAVE_SCHED_YIELD_F
+    if (*spins < _SYNCTORY_QUEUE_SPINS + _SYNCTORY_QUEUE_YIELDS)
+    {
+        (*spins)++;
+        sched_yield();
+        return;
+    }
+#endif
+    
+    ts.tv_sec = 0;
+    ts.tv_nsec = 50000;
+    nanosleep(&ts, NULL);
+}
+
+
+int
+_synctory_queue_init(_synctory_queue_t *queue, size_t size, volatile int *abort)
+{
+    /* the index arithmetic requires a power of 2 */
+    if ((0 == size) || (size & (size - 1)))
+        return EINVAL;
+    
+    queue->slot = (void **)calloc(size, sizeof(void *));
+    if (NULL == queue->slot)
+        return ((errno != 0) ? errno : ENOMEM);
+    
+    queue->size = size;
+    queue->abort = abort;
+    queue->head = 0;
+    queue->tail = 0;
+    return 0;
+}
+
+
+/**
+ * Append an item, waiting while the queue is full. Returns ECANCELED if
+ * the pipeline has been aborted in the meantime.
+ */
+int
+_synctory_queue_push(_synctory_queue_t *queue, void *item)
+{
+    unsigned int spins = 0;
+    size_t tail = queue->tail;
+    
+    while ((tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) >= queue->size)
+    {
+        if (__atomic_load_n(queue->abort, __ATOMIC_ACQUIRE))
+            return ECANCELED;
+        __synctory_queue_wait(&spins);
+    }
+    
+    queue->slot[tail & (queue->size - 1)] = item;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/**
+ * Remove the oldest item, waiting while the queue is empty. Returns NULL
+ * if the pipeline has been aborted in the meantime.
+ */
+void *
+_synctory_queue_pop(_synctory_queue_t *queue)
+{
+    unsigned int spins = 0;
+    size_t head = queue->head;
+    void *item;
+    
+    while (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_load_n(queue->abort, __ATOMIC_ACQUIRE))
+            return NULL;
+        __synctory_queue_wait(&spins);
+    }
+    
+    item = queue->slot[head & (queue->size - 1)];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+
+/**
+ * Abort the pipeline the queue belongs to, waking up all of its stages
+ */
+void
+_synctory_queue_abort(_synctory_queue_t *queue)
+{
+    __atomic_store_n(queue->abort, 1, __ATOMIC_RELEASE);
+}
+
+
+void
+_synctory_queue_free(_synctory_queue_t *queue)
+{
+    free(queue->slot);
+    queue->slot = NULL;
+    queue->size = 0;
+}
+
+#endif /* _SYNCTORY_QUEUE_AVAILABLE */
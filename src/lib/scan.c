@@ -0,0 +1,138 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * The scanner moves a window of chunk size across a source file. Instead
+ * of reading every window separately, the source is read in large blocks
+ * into a buffer, and the window is moved across that buffer. When the
+ * window reaches the end of the buffer, the remaining bytes (less than one
+ * window) are moved to the front and the buffer is refilled behind them,
+ * so a window is always contiguous in memory.
+ * 
+ * If the source file is mapped into memory, the mapping itself serves
+ * as the buffer, and the window is moved across the mapping directly.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "_file64.h"
+#include "_scan.h"
+
+
+int
+_synctory_scan_init(_synctory_scan_t *scan, int fd, _synctory_off_t offset, uint16_t window, size_t size)
+{
+    /* the buffer must at least be able to hold one complete window */
+    if (size < window)
+        size = window;
+    
+    scan->buffer = (unsigned char *)malloc(size);
+    if (NULL == scan->buffer)
+        return ((errno != 0) ? errno : -1);
+    
+    scan->fd = fd;
+    scan->size = size;
+    scan->head = 0;
+    scan->tail = 0;
+    scan->base = offset;
+    scan->window = window;
+    scan->eof = 0;
+    scan->mapped = 0;
+    
+    return 0;
+}
+
+
+/**
+ * Initialize a scanner on a memory mapped source file. Such a scanner
+ * never needs to be refilled.
+ */
+void
+_synctory_scan_init_map(_synctory_scan_t *scan, const _synctory_file64_map_t *map, _synctory_off_t offset, uint16_t window)
+{
+    if (offset > map->size)
+        offset = map->size;
+    
+    scan->fd = -1;
+    scan->buffer = map->data;
+    scan->size = (size_t)map->size;
+    scan->head = (size_t)offset;
+    scan->tail = (size_t)map->size;
+    scan->base = 0;
+    scan->window = window;
+    scan->eof = 1;
+    scan->mapped = 1;
+}
+
+
+/**
+ * Refill the block buffer. Bytes between the window start and the end
+ * of the buffer are preserved; everything in front of the window start
+ * is dropped. Returns 0 on success (including EOF).
+ */
+int
+_synctory_scan_fill(_synctory_scan_t *scan)
+{
+    ssize_t rbytes;
+    size_t remain;
+    
+    if (scan->eof)
+        return 0;
+    
+    /* move the incomplete window to the front of the buffer */
+    remain = scan->tail - scan->head;
+    if (remain && scan->head)
+        memmove(scan->buffer, &scan->buffer[scan->head], remain);
+    scan->base += (_synctory_off_t)scan->head;
+    scan->head = 0;
+    scan->tail = remain;
+    
+    /* fill up the buffer; short reads are retried until EOF */
+    while (scan->tail < scan->size)
+    {
+        rbytes = _synctory_file64_pread(scan->fd, &scan->buffer[scan->tail], scan->size - scan->tail, scan->base + (_synctory_off_t)scan->tail);
+        if (rbytes < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return ((errno != 0) ? errno : -1);
+        }
+        if (0 == rbytes)
+        {
+            scan->eof = 1;
+            break;
+        }
+        scan->tail += (size_t)rbytes;
+    }
+    
+    return 0;
+}
+
+
+void
+_synctory_scan_free(_synctory_scan_t *scan)
+{
+    if (!scan->mapped)
+        free(scan->buffer);
+    scan->buffer = NULL;
+    scan->size = scan->head = scan->tail = 0;
+}
@@ -0,0 +1,218 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * The index sidecar is a file holding the index of a fingerprint exactly
+ * as it is laid out in memory (see index.c), preceded by a short header.
+ * Loading a fingerprint through its sidecar therefore comes down to mapping
+ * the file, instead of reading, hashing and grouping all of its records.
+ *
+ * A sidecar belongs to one particular fingerprint file. Its header records
+ * the fingerprint header, the size and the modification time of the
+ * fingerprint file; if any of them differs, the sidecar is stale and is
+ * rejected with ESTALE. The header itself is protected by a checksum.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "_checksum.h"
+#include "_endianess.h"
+#include "_fheader.h"
+#include "_file64.h"
+#include "_index.h"
+#include "_sidecar.h"
+
+
+/**
+ * Generate the sidecar header for the given index
+ */
+static int
+__synctory_sidecar_header(const synctory_fpindex_t *fpindex, unsigned char *buffer)
+{
+    int rval;
+    uint32_t u32;
+    uint64_t u64;
+    _synctory_fheader_t header = fpindex->header;
+    
+    memset(buffer, 0, _SYNCTORY_SIDECAR_BYTES);
+    memcpy(&buffer[_SYNCTORY_SIDECAR_OFF_MAGIC], _SYNCTORY_SIDECAR_MAGIC, 8);
+    
+    u32 = _synctory_hton32(_SYNCTORY_SIDECAR_VERSION);
+    memcpy(&buffer[_SYNCTORY_SIDECAR_OFF_VERSION], &u32, sizeof(uint32_t));
+    u32 = _SYNCTORY_SIDECAR_BOM;
+    memcpy(&buffer[_SYNCTORY_SIDECAR_OFF_BOM], &u32, sizeof(uint32_t));
+    
+    rval = _synctory_fh_setheader_bf(&header, &buffer[_SYNCTORY_SIDECAR_OFF_FHEADER], _SYNCTORY_FH_BYTES);
+    if (rval)
+        return rval;
+    
+    u64 = _synctory_hton64(fpindex->fpsize);
+    memcpy(&buffer[_SYNCTORY_SIDECAR_OFF_FPSIZE], &u64, sizeof(uint64_t));
+    u64 = _synctory_hton64((uint64_t)fpindex->fpmtime);
+    memcpy(&buffer[_SYNCTORY_SIDECAR_OFF_FPMTIME], &u64, sizeof(uint64_t));
+    u32 = _synctory_hton32(fpindex->index.entries);
+    memcpy(&buffer[_SYNCTORY_SIDECAR_OFF_ENTRIES], &u32, sizeof(uint32_t));
+    
+    u32 = _synctory_hton32(_synctory_weak_checksum(buffer, _SYNCTORY_SIDECAR_OFF_CHECKSUM));
+    memcpy(&buffer[_SYNCTORY_SIDECAR_OFF_CHECKSUM], &u32, sizeof(uint32_t));
+    return 0;
+}
+
+
+/**
+ * Write the index of a loaded fingerprint into the given file descriptor
+ */
+int
+_synctory_sidecar_write_fd(const synctory_fpindex_t *fpindex, int fd)
+{
+    int rval;
+    uint64_t bytes;
+    unsigned char hbuf[_SYNCTORY_SIDECAR_BYTES];
+    _synctory_index_t geometry;
+    
+    rval = _synctory_index_geometry(&geometry, fpindex->index.entries, fpindex->index.sumsize, &bytes);
+    if (rval)
+        return rval;
+    
+    rval = __synctory_sidecar_header(fpindex, hbuf);
+    if (rval)
+        return rval;
+    
+    if (0 != _synctory_file64_seek(fd, 0, SEEK_SET))
+        return ((errno != 0) ? errno : -1);
+    
+    rval = _synctory_file64_write(fd, hbuf, _SYNCTORY_SIDECAR_BYTES);
+    if (rval)
+        return rval;
+    
+    /* the filter marks the start of the arena */
+    return _synctory_file64_write(fd, fpindex->index.filter, (size_t)bytes);
+}
+
+
+/**
+ * Load the index of the fingerprint file fdfinger from the sidecar file fd.
+ * The sidecar is mapped into memory if possible, and read otherwise.
+ */
+int
+_synctory_sidecar_load_fd(synctory_fpindex_t *fpindex, int fdfinger, int fd)
+{
+    int rval;
+    int sumsize;
+    uint32_t u32;
+    uint64_t u64, bytes;
+    unsigned char hbuf[_SYNCTORY_SIDECAR_BYTES];
+    unsigned char fbuf[_SYNCTORY_FH_BYTES];
+    _synctory_file64_stat_t st;
+    
+    fpindex->index.arena = NULL;
+    fpindex->map.data = NULL;
+    fpindex->map.size = 0;
+    
+    /* identify the fingerprint file */
+    if (0 != _synctory_file64_fstat(fdfinger, &st))
+        return ((errno != 0) ? errno : -1);
+    fpindex->fpsize = (uint64_t)st.st_size;
+    fpindex->fpmtime = (int64_t)st.st_mtime;
+    
+    rval = _synctory_file64_readat(fdfinger, fbuf, _SYNCTORY_FH_BYTES, 0);
+    if (rval)
+        return rval;
+    rval = _synctory_fh_getheader_bf(&fpindex->header, fbuf, _SYNCTORY_FH_BYTES);
+    if (rval)
+        return rval;
+    if (fpindex->header.type != _SYNCTORY_FH_FINGERPRINT)
+        return -1;
+    
+    /* the sidecar holds the header as generated from its parsed form */
+    rval = _synctory_fh_setheader_bf(&fpindex->header, fbuf, _SYNCTORY_FH_BYTES);
+    if (rval)
+        return rval;
+    
+    /* check the sidecar header */
+    rval = _synctory_file64_readat(fd, hbuf, _SYNCTORY_SIDECAR_BYTES, 0);
+    if (rval)
+        return rval;
+    
+    if (0 != memcmp(&hbuf[_SYNCTORY_SIDECAR_OFF_MAGIC], _SYNCTORY_SIDECAR_MAGIC, 8))
+        return EINVAL;
+    
+    memcpy(&u32, &hbuf[_SYNCTORY_SIDECAR_OFF_CHECKSUM], sizeof(uint32_t));
+    if (_synctory_ntoh32(u32) != _synctory_weak_checksum(hbuf, _SYNCTORY_SIDECAR_OFF_CHECKSUM))
+        return EINVAL;
+    
+    memcpy(&u32, &hbuf[_SYNCTORY_SIDECAR_OFF_VERSION], sizeof(uint32_t));
+    if (_synctory_ntoh32(u32) != _SYNCTORY_SIDECAR_VERSION)
+        return ESTALE;
+    
+    memcpy(&u32, &hbuf[_SYNCTORY_SIDECAR_OFF_BOM], sizeof(uint32_t));
+    if (u32 != _SYNCTORY_SIDECAR_BOM)
+        return ESTALE;
+    
+    /* does the sidecar belong to this very fingerprint? */
+    if (0 != memcmp(&hbuf[_SYNCTORY_SIDECAR_OFF_FHEADER], fbuf, _SYNCTORY_FH_BYTES))
+        return ESTALE;
+    
+    memcpy(&u64, &hbuf[_SYNCTORY_SIDECAR_OFF_FPSIZE], sizeof(uint64_t));
+    if (_synctory_ntoh64(u64) != fpindex->fpsize)
+        return ESTALE;
+    
+    memcpy(&u64, &hbuf[_SYNCTORY_SIDECAR_OFF_FPMTIME], sizeof(uint64_t));
+    if ((int64_t)_synctory_ntoh64(u64) != fpindex->fpmtime)
+        return ESTALE;
+    
+    /* the size of the arena follows from the number of entries */
+    sumsize = _synctory_strong_checksum_size(fpindex->header.algo);
+    if (sumsize <= 0)
+        return EINVAL;
+    
+    memcpy(&u32, &hbuf[_SYNCTORY_SIDECAR_OFF_ENTRIES], sizeof(uint32_t));
+    rval = _synctory_index_geometry(&fpindex->index, _synctory_ntoh32(u32), (size_t)sumsize, &bytes);
+    if (rval)
+        return rval;
+    
+    if (0 != _synctory_file64_fstat(fd, &st))
+        return ((errno != 0) ? errno : -1);
+    if ((uint64_t)st.st_size != (uint64_t)_SYNCTORY_SIDECAR_BYTES + bytes)
+        return EINVAL;
+    
+    if (0 == _synctory_file64_map(fd, &fpindex->map, _SYNCTORY_FILE64_MAP_NORMAL))
+    {
+        _synctory_index_attach(&fpindex->index, fpindex->map.data + _SYNCTORY_SIDECAR_BYTES);
+        return 0;
+    }
+    
+    /* no mapping available, read the arena instead */
+    fpindex->index.arena = malloc((size_t)bytes);
+    if (NULL == fpindex->index.arena)
+        return ((errno != 0) ? errno : ENOMEM);
+    
+    rval = _synctory_file64_readat(fd, fpindex->index.arena, (size_t)bytes, _SYNCTORY_SIDECAR_BYTES);
+    if (rval)
+    {
+        _synctory_index_free(&fpindex->index);
+        return rval;
+    }
+    
+    _synctory_index_attach(&fpindex->index, fpindex->index.arena);
+    return 0;
+}
@@ -28,9 +28,13 @@
 #include "version.h"
 #include "default.h"
 
+#include "_budget.h"
 #include "_file64.h"
 #include "_fingerprint.h"
+#include "_index.h"
 #include "_diff.h"
+#include "_pipeline.h"
+#include "_sidecar.h"
 #include "_synth.h"
 
 
@@ -62,6 +66,14 @@ synctory_init(synctory_ctx_t *ctx)
 {
     ctx->checksum_algorithm = _SYNCTORY_DEFAULT_CHECKSUM;
     ctx->chunk_size = _SYNCTORY_DEFAULT_CHUNKSIZE;
+    ctx->threads = _SYNCTORY_DEFAULT_THREADS;
+    ctx->memory_budget = _SYNCTORY_DEFAULT_MEMORY_BUDGET;
+    ctx->write_buffer = _SYNCTORY_DEFAULT_WRITE_BUFFER;
+    ctx->diff_format = _SYNCTORY_DEFAULT_DIFF_FORMAT;
+    ctx->codec = _SYNCTORY_DEFAULT_CODEC;
+    ctx->codec_level = _SYNCTORY_DEFAULT_CODEC_LEVEL;
+    ctx->toc_stride = _SYNCTORY_DEFAULT_TOC_STRIDE;
+    memset(&ctx->stats, 0, sizeof(synctory_stats_t));
 }
 
 
@@ -83,13 +95,20 @@ synctory_fingerprint(synctory_ctx_t *ctx, int source_fd, int dest_fd, const char
         _synctory_file64_close(sfd);
     if (flag[1])
         _synctory_file64_close(dfd);
-
+    
     return rval;
 }
 
 
 extern int
 synctory_diff(int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file)
+{
+    return synctory_diff_ctx(NULL, source_fd, dest_fd, fingerprint_fd, source_file, dest_file, fingerprint_file);
+}
+
+
+extern int
+synctory_diff_ctx(synctory_ctx_t *ctx, int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file)
 {
     /* sfd = source file descriptor, dfd = destination file descriptor */
     int sfd = 0;
@@ -97,12 +116,19 @@ synctory_diff(int source_fd, int dest_fd, int fingerprint_fd, const char *source
     int ffd = 0;
     int flag[3] = {0, 0, 0};
     int rval = 0;
+    synctory_ctx_t dctx;
+    
+    if (NULL == ctx)
+    {
+        synctory_init(&dctx);
+        ctx = &dctx;
+    }
     
     sfd = _synctory_file64_get_fd(&flag[0], source_fd, source_file, 'r');
     dfd = _synctory_file64_get_fd(&flag[1], dest_fd, dest_file, 'w');
-    ffd = _synctory_file64_get_fd(&flag[0], fingerprint_fd, fingerprint_file, 'r');
+    ffd = _synctory_file64_get_fd(&flag[2], fingerprint_fd, fingerprint_file, 'r');
     
-    rval = _synctory_diff_create_fast(ffd, sfd, dfd);
+    rval = _synctory_diff_create_fast(ctx, ffd, sfd, dfd);
     
     if (flag[0])
         _synctory_file64_close(sfd);
@@ -110,13 +136,20 @@ synctory_diff(int source_fd, int dest_fd, int fingerprint_fd, const char *source
         _synctory_file64_close(dfd);
     if (flag[2])
         _synctory_file64_close(ffd);
-
+    
     return rval;
 }
 
 
 extern int
 synctory_diff_lomem(int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file)
+{
+    return synctory_diff_lomem_ctx(NULL, source_fd, dest_fd, fingerprint_fd, source_file, dest_file, fingerprint_file);
+}
+
+
+extern int
+synctory_diff_lomem_ctx(synctory_ctx_t *ctx, int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file)
 {
     /* sfd = source file descriptor, dfd = destination file descriptor */
     int sfd = 0;
@@ -124,12 +157,54 @@ synctory_diff_lomem(int source_fd, int dest_fd, int fingerprint_fd, const char *
     int ffd = 0;
     int flag[3] = {0, 0, 0};
     int rval = 0;
+    synctory_ctx_t dctx;
+    
+    if (NULL == ctx)
+    {
+        synctory_init(&dctx);
+        ctx = &dctx;
+    }
     
     sfd = _synctory_file64_get_fd(&flag[0], source_fd, source_file, 'r');
     dfd = _synctory_file64_get_fd(&flag[1], dest_fd, dest_file, 'w');
-    ffd = _synctory_file64_get_fd(&flag[0], fingerprint_fd, fingerprint_file, 'r');
+    ffd = _synctory_file64_get_fd(&flag[2], fingerprint_fd, fingerprint_file, 'r');
+    
+    rval = _synctory_diff_create_fd(ctx, ffd, sfd, dfd);
+    
+    if (flag[0])
+        _synctory_file64_close(sfd);
+    if (flag[1])
+        _synctory_file64_close(dfd);
+    if (flag[2])
+        _synctory_file64_close(ffd);
+    
+    return rval;
+}
+
+
+extern int
+synctory_diff_auto(synctory_ctx_t *ctx, int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file)
+{
+    /* sfd = source file descriptor, dfd = destination file descriptor */
+    int sfd = 0;
+    int dfd = 0;
+    int ffd = 0;
+    int flag[3] = {0, 0, 0};
+    int rval = 0;
+    synctory_ctx_t dctx;
+    
+    if (NULL == ctx)
+    {
+        synctory_init(&dctx);
+        ctx = &dctx;
+    }
+    
+    sfd = _synctory_file64_get_fd(&flag[0], source_fd, source_file, 'r');
+    dfd = _synctory_file64_get_fd(&flag[1], dest_fd, dest_file, 'w');
+    ffd = _synctory_file64_get_fd(&flag[2], fingerprint_fd, fingerprint_file, 'r');
     
-    rval = _synctory_diff_create_fd(ffd, sfd, dfd);
+    rval = _synctory_budget_diff(ctx, ffd, sfd, dfd);
+    ctx->stats.peak_rss = _synctory_budget_peak_rss();
     
     if (flag[0])
         _synctory_file64_close(sfd);
@@ -137,7 +212,176 @@ synctory_diff_lomem(int source_fd, int dest_fd, int fingerprint_fd, const char *
         _synctory_file64_close(dfd);
     if (flag[2])
         _synctory_file64_close(ffd);
+    
+    return rval;
+}
+
+
+extern int
+synctory_fpindex_load(synctory_fpindex_t **fpindex, int fingerprint_fd, const char *fingerprint_file)
+{
+    int ffd = 0;
+    int flag = 0;
+    int rval = 0;
+    synctory_fpindex_t *handle;
+    
+    *fpindex = NULL;
+    
+    handle = (synctory_fpindex_t *)malloc(sizeof(synctory_fpindex_t));
+    if (NULL == handle)
+        return ((errno != 0) ? errno : ENOMEM);
+    
+    ffd = _synctory_file64_get_fd(&flag, fingerprint_fd, fingerprint_file, 'r');
+    
+    rval = _synctory_fpindex_load_fd(handle, ffd);
+    
+    if (flag)
+        _synctory_file64_close(ffd);
+    
+    if (rval)
+    {
+        _synctory_fpindex_free(handle);
+        free(handle);
+        return rval;
+    }
+    
+    *fpindex = handle;
+    return 0;
+}
+
+
+extern int
+synctory_fpindex_save(const synctory_fpindex_t *fpindex, int index_fd, const char *index_file)
+{
+    int ifd = 0;
+    int flag = 0;
+    int rval = 0;
+    
+    if (NULL == fpindex)
+        return EINVAL;
+    
+    ifd = _synctory_file64_get_fd(&flag, index_fd, index_file, 'w');
+    
+    rval = _synctory_sidecar_write_fd(fpindex, ifd);
+    
+    if (flag)
+        _synctory_file64_close(ifd);
+    
+    return rval;
+}
+
+
+extern int
+synctory_fpindex_map(synctory_fpindex_t **fpindex, int fingerprint_fd, int index_fd, const char *fingerprint_file, const char *index_file)
+{
+    int ffd = 0;
+    int ifd = 0;
+    int flag[2] = {0, 0};
+    int rval = 0;
+    synctory_fpindex_t *handle;
+    
+    *fpindex = NULL;
+    
+    handle = (synctory_fpindex_t *)malloc(sizeof(synctory_fpindex_t));
+    if (NULL == handle)
+        return ((errno != 0) ? errno : ENOMEM);
+    
+    ffd = _synctory_file64_get_fd(&flag[0], fingerprint_fd, fingerprint_file, 'r');
+    ifd = _synctory_file64_get_fd(&flag[1], index_fd, index_file, 'r');
+    
+    rval = _synctory_sidecar_load_fd(handle, ffd, ifd);
+    
+    if (flag[0])
+        _synctory_file64_close(ffd);
+    if (flag[1])
+        _synctory_file64_close(ifd);
+    
+    if (rval)
+    {
+        _synctory_fpindex_free(handle);
+        free(handle);
+        return rval;
+    }
+    
+    *fpindex = handle;
+    return 0;
+}
+
+
+extern int
+synctory_diff_with_index(synctory_ctx_t *ctx, const synctory_fpindex_t *fpindex, int source_fd, int dest_fd, const char *source_file, const char *dest_file)
+{
+    /* sfd = source file descriptor, dfd = destination file descriptor */
+    int sfd = 0;
+    int dfd = 0;
+    int flag[2] = {0, 0};
+    int rval = 0;
+    synctory_ctx_t dctx;
+    
+    if (NULL == fpindex)
+        return EINVAL;
+    
+    if (NULL == ctx)
+    {
+        synctory_init(&dctx);
+        ctx = &dctx;
+    }
+    
+    sfd = _synctory_file64_get_fd(&flag[0], source_fd, source_file, 'r');
+    dfd = _synctory_file64_get_fd(&flag[1], dest_fd, dest_file, 'w');
+    
+    rval = _synctory_diff_create_index(ctx, fpindex, sfd, dfd);
+    
+    if (flag[0])
+        _synctory_file64_close(sfd);
+    if (flag[1])
+        _synctory_file64_close(dfd);
+    
+    return rval;
+}
+
+
+extern void
+synctory_fpindex_free(synctory_fpindex_t *fpindex)
+{
+    if (NULL == fpindex)
+        return;
+    
+    _synctory_fpindex_free(fpindex);
+    free(fpindex);
+}
 
+
+extern int
+synctory_diff_pipelined(synctory_ctx_t *ctx, int source_fd, int dest_fd, int fingerprint_fd, const char *source_file, const char *dest_file, const char *fingerprint_file)
+{
+    /* sfd = source file descriptor, dfd = destination file descriptor */
+    int sfd = 0;
+    int dfd = 0;
+    int ffd = 0;
+    int flag[3] = {0, 0, 0};
+    int rval = 0;
+    synctory_ctx_t dctx;
+    
+    if (NULL == ctx)
+    {
+        synctory_init(&dctx);
+        ctx = &dctx;
+    }
+    
+    sfd = _synctory_file64_get_fd(&flag[0], source_fd, source_file, 'r');
+    dfd = _synctory_file64_get_fd(&flag[1], dest_fd, dest_file, 'w');
+    ffd = _synctory_file64_get_fd(&flag[2], fingerprint_fd, fingerprint_file, 'r');
+    
+    rval = _synctory_pipeline_diff(ctx, ffd, sfd, dfd);
+    
+    if (flag[0])
+        _synctory_file64_close(sfd);
+    if (flag[1])
+        _synctory_file64_close(dfd);
+    if (flag[2])
+        _synctory_file64_close(ffd);
+    
     return rval;
 }
 
@@ -154,7 +398,7 @@ synctory_synth(int source_fd, int dest_fd, int diff_fd, const char *source_file,
     
     sfd = _synctory_file64_get_fd(&flag[0], source_fd, source_file, 'r');
     dfd = _synctory_file64_get_fd(&flag[1], dest_fd, dest_file, 'w');
-    ffd = _synctory_file64_get_fd(&flag[0], diff_fd, diff_file, 'r');
+    ffd = _synctory_file64_get_fd(&flag[2], diff_fd, diff_file, 'r');
     
     rval = _synctory_synth_create_fd(sfd, ffd, dfd);
     
@@ -164,6 +408,90 @@ synctory_synth(int source_fd, int dest_fd, int diff_fd, const char *source_file,
         _synctory_file64_close(dfd);
     if (flag[2])
         _synctory_file64_close(ffd);
+    
+    return rval;
+}
+
+
+extern int
+synctory_synth_parallel(synctory_ctx_t *ctx, int source_fd, int dest_fd, int diff_fd, const char *source_file, const char *dest_file, const char *diff_file)
+{
+    /* sfd = source file descriptor, dfd = destination file descriptor */
+    int sfd = 0;
+    int dfd = 0;
+    int ffd = 0;
+    int flag[3] = {0, 0, 0};
+    int rval = 0;
+    synctory_ctx_t dctx;
+    
+    if (NULL == ctx)
+    {
+        synctory_init(&dctx);
+        ctx = &dctx;
+    }
+    
+    sfd = _synctory_file64_get_fd(&flag[0], source_fd, source_file, 'r');
+    dfd = _synctory_file64_get_fd(&flag[1], dest_fd, dest_file, 'w');
+    ffd = _synctory_file64_get_fd(&flag[2], diff_fd, diff_file, 'r');
+    
+    rval = _synctory_synth_parallel_fd(ctx, sfd, ffd, dfd);
+    
+    if (flag[0])
+        _synctory_file64_close(sfd);
+    if (flag[1])
+        _synctory_file64_close(dfd);
+    if (flag[2])
+        _synctory_file64_close(ffd);
+    
+    return rval;
+}
+
+
+extern int
+synctory_synth_inplace(int basis_fd, int diff_fd, const char *basis_file, const char *diff_file)
+{
+    /* bfd = basis file descriptor, ffd = diff file descriptor */
+    int bfd = 0;
+    int ffd = 0;
+    int flag[2] = {0, 0};
+    int rval = 0;
+    
+    bfd = _synctory_file64_get_fd(&flag[0], basis_fd, basis_file, 'u');
+    ffd = _synctory_file64_get_fd(&flag[1], diff_fd, diff_file, 'r');
+    
+    rval = _synctory_synth_inplace_fd(bfd, ffd);
+    
+    if (flag[0])
+        _synctory_file64_close(bfd);
+    if (flag[1])
+        _synctory_file64_close(ffd);
+    
+    return rval;
+}
 
+
+extern int
+synctory_synth_range(int source_fd, int dest_fd, int diff_fd, const char *source_file, const char *dest_file, const char *diff_file, uint64_t offset, uint64_t len)
+{
+    /* sfd = source file descriptor, dfd = destination file descriptor */
+    int sfd = 0;
+    int dfd = 0;
+    int ffd = 0;
+    int flag[3] = {0, 0, 0};
+    int rval = 0;
+    
+    sfd = _synctory_file64_get_fd(&flag[0], source_fd, source_file, 'r');
+    dfd = _synctory_file64_get_fd(&flag[1], dest_fd, dest_file, 'w');
+    ffd = _synctory_file64_get_fd(&flag[2], diff_fd, diff_file, 'r');
+    
+    rval = _synctory_synth_range_fd(sfd, ffd, dfd, offset, len);
+    
+    if (flag[0])
+        _synctory_file64_close(sfd);
+    if (flag[1])
+        _synctory_file64_close(dfd);
+    if (flag[2])
+        _synctory_file64_close(ffd);
+    
     return rval;
 }
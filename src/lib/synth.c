@@ -17,54 +17,1650 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "_codec.h"
 #include "_diff.h"
 #include "_endianess.h"
 #include "_fheader.h"
 #include "_file64.h"
 #include "_synth.h"
 
+#ifdef _SYNCTORY_SYNTH_THREADS
+#include <pthread.h>
+#endif
 
+
+/**
+ * Records of a diff file, read through a buffer
+ */
+typedef struct
+{
+    int fd;                     /* diff file descriptor                 */
+    int compact;                /* records use the compact format       */
+    int toc;                    /* records end with a table of contents */
+    uint64_t next;              /* chunk following the previous match   */
+    _synctory_off_t offset;     /* diff file offset of the buffer (only
+                                   kept while raw data is skipped)      */
+    size_t pos;                 /* first unread byte of the buffer      */
+    size_t len;                 /* number of bytes in the buffer        */
+    unsigned char buffer[_SYNCTORY_SYNTH_BUFSIZE];
+} _synctory_synth_reader_t;
+
+/**
+ * A decoded record header
+ */
+typedef struct
+{
+    uint8_t type;               /* record type                          */
+    uint64_t index;             /* first chunk of chunk and range       */
+    uint64_t count;             /* number of chunks, or of raw bytes    */
+    uint64_t size;              /* size of a compressed frame           */
+} _synctory_synth_record_t;
+
+
+/**
+ * A copy of bytes from one place of the basis file to another, made by an
+ * in-place synth
+ */
+typedef struct
+{
+    uint64_t dst;               /* offset the bytes are copied to       */
+    uint64_t src;               /* offset the bytes are copied from     */
+    uint64_t len;               /* number of bytes                      */
+    uint64_t spill;             /* offset of the buffered bytes         */
+    uint32_t wait;              /* pending copies reading from dst      */
+    uint32_t state;             /* see _SYNCTORY_SYNTH_MOVE_*           */
+} _synctory_synth_move_t;
+
+/**
+ * The copies of an in-place synth, ordered by destination offset, and the
+ * bytes of the copies buffered to break cyclic dependencies
+ */
+typedef struct
+{
+    _synctory_synth_move_t *move;
+    uint64_t moves;             /* number of copies                     */
+    uint64_t capacity;          /* number of copies allocated           */
+    unsigned char *memory;      /* buffered bytes kept in memory        */
+    size_t used;                /* number of bytes used in memory       */
+    FILE *spill;                /* buffered bytes exceeding the memory  */
+    uint64_t spilled;           /* number of bytes in the spill file    */
+} _synctory_synth_plan_t;
+
+/**
+ * A copy of an in-place synth, ranked by its length
+ */
+typedef struct
+{
+    uint64_t len;               /* number of bytes copied               */
+    uint64_t index;             /* index of the copy in the plan        */
+} _synctory_synth_rank_t;
+
+
+/**
+ * A record of a diff, placed in the recent file by a parallel synth
+ */
+typedef struct
+{
+    uint64_t dst;               /* offset in the recent file            */
+    uint64_t src;               /* offset in the source or diff file    */
+    uint64_t len;               /* number of bytes written              */
+    uint64_t size;              /* size of a compressed frame           */
+    uint8_t type;               /* record type                          */
+} _synctory_synth_op_t;
+
+/**
+ * A worker of a parallel synth, writing a range of the recent file
+ */
+typedef struct
+{
+    int fdsource;               /* source file descriptor               */
+    int fddiff;                 /* diff file descriptor                 */
+    int fddest;                 /* destination file descriptor          */
+    const _synctory_synth_op_t *op;
+    size_t ops;                 /* number of records of the batch       */
+    uint64_t start;             /* first byte written by the worker     */
+    uint64_t end;               /* byte after the last one written      */
+    _synctory_codec_t codec;    /* decompressor of frames               */
+    unsigned char *inbuf;       /* compressed frame data                */
+    unsigned char *outbuf;      /* decompressed frame data              */
+    int rval;
+} _synctory_synth_worker_t;
+
+
+/**
+ * The file a synth writes to, at its current position
+ */
+typedef struct
+{
+    int fd;                     /* destination file descriptor          */
+    int sparse;                 /* zero blocks may be skipped           */
+    int reserved;               /* space has been reserved up front     */
+    _synctory_off_t position;   /* current destination offset           */
+    _synctory_off_t hole;       /* first byte of the pending hole       */
+    _synctory_off_t holelen;    /* number of bytes in the pending hole  */
+} _synctory_synth_dest_t;
+
+
+/**
+ * Make sure a complete record header is buffered, unless the diff file
+ * ends before
+ */
+static int
+__synctory_synth_fill(_synctory_synth_reader_t *reader)
+{
+    ssize_t rbytes;
+    
+    if (reader->len - reader->pos >= _SYNCTORY_DIFF_RECORD_BYTES)
+        return 0;
+    
+    memmove(reader->buffer, &reader->buffer[reader->pos], reader->len - reader->pos);
+    reader->offset += (_synctory_off_t)reader->pos;
+    reader->len -= reader->pos;
+    reader->pos = 0;
+    
+    while (reader->len < _SYNCTORY_SYNTH_BUFSIZE)
+    {
+        rbytes = read(reader->fd, &reader->buffer[reader->len], _SYNCTORY_SYNTH_BUFSIZE - reader->len);
+        if (rbytes < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return ((errno != 0) ? errno : -1);
+        }
+        if (0 == rbytes)
+            break;
+        reader->len += (size_t)rbytes;
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Tell whether another record follows; the records end with the diff file,
+ * or with the table of contents if the diff has one. rval receives the
+ * result of reading the diff file.
+ */
+static int
+__synctory_synth_more(_synctory_synth_reader_t *reader, int *rval)
+{
+    *rval = __synctory_synth_fill(reader);
+    if (*rval || (reader->pos == reader->len))
+        return 0;
+    return !(reader->toc && (_SYNCTORY_DIFF_BTYPE_TOC == reader->buffer[reader->pos]));
+}
+
+
+/**
+ * Position the reader at the first record of the diff file. A diff read
+ * from a pipe cannot be positioned; it is expected right behind the
+ * header then.
+ */
+static int
+__synctory_synth_rewind(_synctory_synth_reader_t *reader, const _synctory_fheader_t *header)
+{
+    if ((_synctory_file64_seek(reader->fd, _SYNCTORY_FH_BYTES, SEEK_SET) != _SYNCTORY_FH_BYTES) && (ESPIPE != errno))
+        return ((errno != 0) ? errno : -1);
+    
+    reader->compact = (_SYNCTORY_FH_DIFF_COMPACT == header->type);
+    reader->toc = (0 != header->toc);
+    reader->next = 0;
+    reader->offset = _SYNCTORY_FH_BYTES;
+    reader->pos = 0;
+    reader->len = 0;
+    return 0;
+}
+
+
+/**
+ * Skip the given number of bytes following a record header; diffsize is
+ * the size of the diff file, which must not be exceeded
+ */
+static int
+__synctory_synth_skip(_synctory_synth_reader_t *reader, uint64_t bytes, _synctory_off_t diffsize)
+{
+    _synctory_off_t position;
+    size_t avail = reader->len - reader->pos;
+    
+    if ((uint64_t)avail >= bytes)
+    {
+        reader->pos += (size_t)bytes;
+        return 0;
+    }
+    
+    /* what is not buffered yet is skipped by moving the file pointer */
+    bytes -= avail;
+    if (bytes > (uint64_t)diffsize)
+        return -1;
+    position = _synctory_file64_seek(reader->fd, (int64_t)bytes, SEEK_CUR);
+    if (position < 0)
+        return errno;
+    if (position > diffsize)
+        return -1;
+    
+    reader->offset = position;
+    reader->pos = 0;
+    reader->len = 0;
+    return 0;
+}
+
+
+/**
+ * Decode the next record header
+ */
+static int
+__synctory_synth_record(_synctory_synth_reader_t *reader, _synctory_synth_record_t *record)
+{
+    const unsigned char *ptr = &reader->buffer[reader->pos];
+    size_t avail = reader->len - reader->pos;
+    size_t used = 1;
+    size_t n = 1;
+    uint64_t u64;
+    
+    record->type = ptr[0];
+    record->count = 1;
+    record->size = 0;
+    
+    if (!reader->compact)
+    {
+        /* fixed size records, with a second field for ranges and frames */
+        used = ((_SYNCTORY_DIFF_BTYPE_RANGE == record->type) || (_SYNCTORY_DIFF_BTYPE_FRAME == record->type)) ? 17 : 9;
+        if (avail < used)
+            return -1;
+        memcpy(&u64, &ptr[1], sizeof(uint64_t));
+        record->index = _synctory_ntoh64(u64);
+        memcpy(&u64, &ptr[used - 8], sizeof(uint64_t));
+        u64 = _synctory_ntoh64(u64);
+        
+        if (_SYNCTORY_DIFF_BTYPE_RAW == record->type)
+            record->count = record->index;
+        else if (_SYNCTORY_DIFF_BTYPE_RANGE == record->type)
+            record->count = u64;
+        else if (_SYNCTORY_DIFF_BTYPE_FRAME == record->type)
+        {
+            record->count = record->index;
+            record->size = u64;
+        }
+        reader->pos += used;
+        return 0;
+    }
+    
+    switch (record->type)
+    {
+        case _SYNCTORY_DIFF_BTYPE_RAW:
+            n = _synctory_diff_varint_get(&ptr[used], avail - used, &record->count);
+            used += n;
+            break;
+        
+        case _SYNCTORY_DIFF_BTYPE_FRAME:
+            n = _synctory_diff_varint_get(&ptr[used], avail - used, &record->count);
+            used += n;
+            if (n > 0)
+            {
+                n = _synctory_diff_varint_get(&ptr[used], avail - used, &record->size);
+                used += n;
+            }
+            break;
+        
+        case _SYNCTORY_DIFF_BTYPE_CHUNK:
+        case _SYNCTORY_DIFF_BTYPE_RANGE:
+            n = _synctory_diff_varint_get(&ptr[used], avail - used, &u64);
+            used += n;
+            record->index = reader->next + _synctory_diff_unzigzag(u64);
+            if ((n > 0) && (_SYNCTORY_DIFF_BTYPE_RANGE == record->type))
+            {
+                n = _synctory_diff_varint_get(&ptr[used], avail - used, &record->count);
+                used += n;
+            }
+            reader->next = record->index + record->count;
+            break;
+        
+        default:
+            return -1;
+    }
+    
+    if (0 == n)
+        return -1;
+    reader->pos += used;
+    return 0;
+}
+
+
+/**
+ * Locate count chunks starting with chunk index inside the source file
+ */
+static int
+__synctory_synth_extent(_synctory_off_t srcsize, uint16_t chunksize, uint64_t index, uint64_t count, _synctory_off_t *offset, _synctory_off_t *len)
+{
+    uint64_t chunks;
+    
+    /* the last chunk of the source file may be shorter than the chunk size */
+    chunks = (0 == chunksize) ? 0 : ((uint64_t)srcsize + chunksize - 1) / chunksize;
+    if ((0 == count) || (index >= chunks) || (count > chunks - index))
+        return -1;
+    
+    *offset = (_synctory_off_t)(index * chunksize);
+    *len = (_synctory_off_t)(count * chunksize);
+    if (*len > srcsize - *offset)
+        *len = srcsize - *offset;
+    return 0;
+}
+
+
+/**
+ * Set up the destination of a synth writing size bytes to fd. If prepare
+ * is set and fd refers to a regular file, disk space for the whole output
+ * is reserved first, so the file does not get fragmented by the many
+ * appends to come. If nothing but the end of the file follows the current
+ * position, blocks of zeros need not be written at all; they become holes.
+ */
+static void
+__synctory_synth_dest_init(_synctory_synth_dest_t *dest, int fd, uint64_t size, int prepare)
+{
+    _synctory_file64_stat_t st;
+    
+    dest->fd = fd;
+    dest->sparse = 0;
+    dest->reserved = 0;
+    dest->position = 0;
+    dest->hole = 0;
+    dest->holelen = 0;
+    
+    if (!prepare || (0 != _synctory_file64_fstat(fd, &st)) || !S_ISREG(st.st_mode))
+        return;
+    dest->position = _synctory_file64_seek(fd, 0, SEEK_CUR);
+    if (dest->position < 0)
+    {
+        dest->position = 0;
+        return;
+    }
+    
+    dest->sparse = (dest->position >= (_synctory_off_t)st.st_size);
+    dest->reserved = (0 == _synctory_file64_allocate(fd, dest->position, (_synctory_off_t)size));
+}
+
+
+/**
+ * Tell whether len bytes are all zero
+ */
+static int
+__synctory_synth_zero(const unsigned char *data, size_t len)
+{
+    return ((0 == data[0]) && (0 == memcmp(data, &data[1], len - 1)));
+}
+
+
+/**
+ * Release the disk space reserved for the pending hole
+ */
+static int
+__synctory_synth_punch(_synctory_synth_dest_t *dest)
+{
+    int rval = 0;
+    
+    if (dest->reserved && (dest->holelen > 0))
+        rval = _synctory_file64_punch(dest->fd, dest->hole, dest->holelen);
+    dest->holelen = 0;
+    
+    /* without hole punching, the space stays reserved and reads as zeros */
+    return ((ENOTSUP == rval) || (EOPNOTSUPP == rval)) ? 0 : rval;
+}
+
+
+/**
+ * Write len bytes to the destination. In a sparse destination, blocks of
+ * _SYNCTORY_SYNTH_HOLE zeros (aligned to the file offset) are skipped;
+ * adjacent ones are collected into a hole released as a whole.
+ */
+static int
+__synctory_synth_put(_synctory_synth_dest_t *dest, const unsigned char *data, size_t len)
+{
+    int rval = 0;
+    int zero;
+    int run;
+    size_t n;
+    size_t step;
+    
+    if (!dest->sparse)
+    {
+        dest->position += (_synctory_off_t)len;
+        return _synctory_file64_write(dest->fd, data, len);
+    }
+    
+    while ((0 == rval) && (len > 0))
+    {
+        /* split off the longest piece of either whole zero blocks or other bytes */
+        run = -1;
+        for (n = 0; n < len; n += step)
+        {
+            step = _SYNCTORY_SYNTH_HOLE - (size_t)((dest->position + (_synctory_off_t)n) % _SYNCTORY_SYNTH_HOLE);
+            if (step > len - n)
+                step = len - n;
+            zero = (_SYNCTORY_SYNTH_HOLE == step) && __synctory_synth_zero(&data[n], step);
+            if (run < 0)
+                run = zero;
+            else if (zero != run)
+                break;
+        }
+        
+        if (!run)
+            rval = _synctory_file64_write(dest->fd, data, n);
+        else if (_synctory_file64_seek(dest->fd, (int64_t)n, SEEK_CUR) != dest->position + (_synctory_off_t)n)
+            rval = ((errno != 0) ? errno : -1);
+        else
+        {
+            if (dest->hole + dest->holelen != dest->position)
+                rval = __synctory_synth_punch(dest);
+            if (0 == dest->holelen)
+                dest->hole = dest->position;
+            dest->holelen += (_synctory_off_t)n;
+        }
+        
+        dest->position += (_synctory_off_t)n;
+        data += n;
+        len -= n;
+    }
+    
+    return rval;
+}
+
+
+/**
+ * Finish the output of a synth. A sparse destination is cut behind the
+ * last byte written, which also sets its size if it ends with a hole.
+ */
+static int
+__synctory_synth_dest_finish(_synctory_synth_dest_t *dest)
+{
+    int rval;
+    
+    if (!dest->sparse)
+        return 0;
+    rval = __synctory_synth_punch(dest);
+    return rval ? rval : _synctory_file64_truncate(dest->fd, dest->position);
+}
+
+
+/**
+ * Copy count chunks starting with chunk index from the source file to the
+ * destination file
+ */
+static int
+__synctory_synth_chunks(int fdsource, const _synctory_file64_map_t *map, _synctory_off_t srcsize, uint16_t chunksize, _synctory_synth_dest_t *dest, uint64_t index, uint64_t count)
+{
+    _synctory_off_t offset;
+    _synctory_off_t len;
+    
+    if (__synctory_synth_extent(srcsize, chunksize, index, count, &offset, &len))
+        return -1;
+    
+    dest->position += len;
+    if (NULL != map->data)
+        return _synctory_file64_write(dest->fd, &map->data[offset], (size_t)len);
+    return _synctory_file64_bytecopy(fdsource, dest->fd, offset, len);
+}
+
+
+/**
+ * Write count raw bytes following a record header to the destination
+ * file; they are taken from the buffer first, the rest straight from the
+ * diff file. Only for a sparse destination, the rest goes through the
+ * buffer as well, so blocks of zeros can be found.
+ */
+static int
+__synctory_synth_raw(_synctory_synth_reader_t *reader, _synctory_synth_dest_t *dest, uint64_t count)
+{
+    int rval = 0;
+    size_t n;
+    
+    while ((0 == rval) && (count > 0))
+    {
+        if (reader->pos == reader->len)
+        {
+            if (!dest->sparse)
+                break;
+            rval = __synctory_synth_fill(reader);
+            if ((0 == rval) && (reader->pos == reader->len))
+                rval = -1;
+            if (rval)
+                break;
+        }
+        
+        n = ((uint64_t)(reader->len - reader->pos) < count) ? (reader->len - reader->pos) : (size_t)count;
+        rval = __synctory_synth_put(dest, &reader->buffer[reader->pos], n);
+        reader->pos += n;
+        count -= n;
+    }
+    
+    if ((0 == rval) && (count > 0))
+    {
+        dest->position += (_synctory_off_t)count;
+        rval = _synctory_file64_bytecopy(reader->fd, dest->fd, -1, (_synctory_off_t)count);
+    }
+    return rval;
+}
+
+
+/**
+ * Decompress a frame of size bytes into len bytes of raw data, streaming
+ * it from the diff file to the destination file through outbuf. Only the
+ * bytes between from and to of the raw data are written; if to ends
+ * before the raw data, decompression stops there, leaving the reader
+ * inside the frame.
+ */
+static int
+__synctory_synth_frame(_synctory_synth_reader_t *reader, _synctory_codec_t *codec, _synctory_synth_dest_t *dest, uint64_t len, uint64_t size, unsigned char *outbuf, uint64_t from, uint64_t to)
+{
+    int rval;
+    int end = 0;
+    size_t inlen;
+    size_t consumed;
+    size_t produced;
+    uint64_t at = 0;
+    uint64_t lo;
+    uint64_t hi;
+    
+    rval = _synctory_codec_reset(codec);
+    while ((0 == rval) && !end)
+    {
+        if ((reader->pos == reader->len) && (size > 0))
+        {
+            rval = __synctory_synth_fill(reader);
+            if (rval)
+                break;
+        }
+        
+        inlen = reader->len - reader->pos;
+        if ((uint64_t)inlen > size)
+            inlen = (size_t)size;
+        rval = _synctory_codec_decode(codec, &reader->buffer[reader->pos], inlen, &consumed, outbuf, _SYNCTORY_SYNTH_BUFSIZE, &produced, &end);
+        if (rval)
+            break;
+        
+        /* no progress means the frame is truncated or corrupt */
+        if ((0 == consumed) && (0 == produced) && !end)
+            return -1;
+        reader->pos += consumed;
+        size -= consumed;
+        
+        if ((uint64_t)produced > len)
+            return -1;
+        len -= produced;
+        
+        lo = (at > from) ? at : from;
+        hi = (at + produced < to) ? (at + produced) : to;
+        if (lo < hi)
+            rval = __synctory_synth_put(dest, &outbuf[lo - at], (size_t)(hi - lo));
+        at += produced;
+        if ((len > 0) && (at >= to))
+            return rval;
+    }
+    
+    if ((0 == rval) && ((len > 0) || (size > 0)))
+        rval = -1;
+    return rval;
+}
+
+
+/**
+ * Synthesize the recent file from the source file and a diff. Both the
+ * original diff format and the compact one (see diff.c) are understood,
+ * with or without compressed raw data. The size of the recent file is
+ * known from the diff header, so its space is reserved before writing
+ * (see __synctory_synth_dest_init).
+ */
 int
 _synctory_synth_create_fd(int fdsource, int fddiff, int fddest)
 {
     int rval = 0;
     _synctory_fheader_t header;
-    uint8_t type;
-    uint64_t index;
-    unsigned char ibuf[9];
-    _synctory_off_t offset;
-    ssize_t rbytes;
+    _synctory_synth_reader_t reader;
+    _synctory_synth_record_t record;
+    _synctory_codec_t codec;
+    unsigned char *outbuf = NULL;
+    _synctory_off_t srcsize;
+    _synctory_file64_map_t map;
+    _synctory_synth_dest_t dest;
     
     /* try to read header from diff file */
     if ((rval = _synctory_fh_getheader_fd(&header, fddiff)) != 0)
         return rval;
+    if ((_SYNCTORY_FH_DIFF != header.type) && (_SYNCTORY_FH_DIFF_COMPACT != header.type))
+        return -1;
+    
+    /* compressed raw data needs a decompressor and a buffer to decompress into */
+    rval = _synctory_codec_init(&codec, header.codec, header.level, 1);
+    if (rval)
+        return rval;
+    if (_SYNCTORY_CODEC_NONE != header.codec)
+    {
+        outbuf = (unsigned char *)malloc(_SYNCTORY_SYNTH_BUFSIZE);
+        if (NULL == outbuf)
+            return ((errno != 0) ? errno : ENOMEM);
+    }
     
     /* position diff file pointer at beginning of data section */
-    if ((offset = _synctory_file64_seek(fddiff, _SYNCTORY_FH_BYTES, SEEK_SET)) != _SYNCTORY_FH_BYTES)
+    reader.fd = fddiff;
+    if ((rval = __synctory_synth_rewind(&reader, &header)) != 0)
+    {
+        _synctory_codec_free(&codec);
+        free(outbuf);
+        return rval;
+    }
+    
+    srcsize = _synctory_file64_seek(fdsource, 0, SEEK_END);
+    if (srcsize < 0)
+    {
+        rval = errno;
+        _synctory_codec_free(&codec);
+        free(outbuf);
+        return rval;
+    }
+    
+    /*
+     * chunks are copied by the kernel where possible; otherwise, they are
+     * written straight from the mapped source file if it can be mapped
+     */
+#ifdef _SYNCTORY_FILE64_KERNEL_COPY
+    map.data = NULL;
+    map.size = 0;
+#else
+    if ((0 == _synctory_file64_map(fdsource, &map, _SYNCTORY_FILE64_MAP_NORMAL)) && (map.size != srcsize))
+        _synctory_file64_unmap(&map);
+#endif
+    
+    __synctory_synth_dest_init(&dest, fddest, header.filesize, 1);
+    while ((0 == rval) && __synctory_synth_more(&reader, &rval))
+    {
+        rval = __synctory_synth_record(&reader, &record);
+        if (rval)
+            break;
+        
+        switch (record.type)
+        {
+            case _SYNCTORY_DIFF_BTYPE_CHUNK:
+            case _SYNCTORY_DIFF_BTYPE_RANGE:
+                rval = __synctory_synth_chunks(fdsource, &map, srcsize, header.chunksize, &dest, record.index, record.count);
+                break;
+            
+            case _SYNCTORY_DIFF_BTYPE_RAW:
+                rval = __synctory_synth_raw(&reader, &dest, record.count);
+                break;
+            
+            case _SYNCTORY_DIFF_BTYPE_FRAME:
+                rval = (NULL == outbuf) ? -1 : __synctory_synth_frame(&reader, &codec, &dest, record.count, record.size, outbuf, 0, record.count);
+                break;
+            
+            default:
+                rval = -1;
+                break;
+        }
+    }
+    
+    if (0 == rval)
+        rval = __synctory_synth_dest_finish(&dest);
+    
+    _synctory_file64_unmap(&map);
+    _synctory_codec_free(&codec);
+    free(outbuf);
+    return rval;
+}
+
+
+/**
+ * Order copies by length, then by position
+ */
+static int
+__synctory_synth_rank_cmp(const void *a, const void *b)
+{
+    const _synctory_synth_rank_t *x = (const _synctory_synth_rank_t *)a;
+    const _synctory_synth_rank_t *y = (const _synctory_synth_rank_t *)b;
+    
+    if (x->len != y->len)
+        return (x->len < y->len) ? -1 : 1;
+    if (x->index != y->index)
+        return (x->index < y->index) ? -1 : 1;
+    return 0;
+}
+
+
+/**
+ * Append a copy to the plan of an in-place synth. Bytes which are already
+ * in place are left out, and copies continuing the previous one are
+ * merged with it.
+ */
+static int
+__synctory_synth_plan_add(_synctory_synth_plan_t *plan, uint64_t dst, uint64_t src, uint64_t len)
+{
+    uint64_t capacity;
+    _synctory_synth_move_t *move;
+    
+    if (dst == src)
+        return 0;
+    
+    if (plan->moves > 0)
+    {
+        move = &plan->move[plan->moves - 1];
+        if ((move->dst + move->len == dst) && (move->src + move->len == src))
+        {
+            move->len += len;
+            return 0;
+        }
+    }
+    
+    if (plan->moves == plan->capacity)
+    {
+        capacity = (plan->capacity > 0) ? plan->capacity * 2 : _SYNCTORY_SYNTH_MOVES;
+        if (capacity > SIZE_MAX / sizeof(_synctory_synth_move_t))
+            return ENOMEM;
+        move = (_synctory_synth_move_t *)realloc(plan->move, (size_t)capacity * sizeof(_synctory_synth_move_t));
+        if (NULL == move)
+            return ((errno != 0) ? errno : ENOMEM);
+        plan->move = move;
+        plan->capacity = capacity;
+    }
+    
+    move = &plan->move[plan->moves++];
+    move->dst = dst;
+    move->src = src;
+    move->len = len;
+    move->spill = 0;
+    move->wait = 0;
+    move->state = _SYNCTORY_SYNTH_MOVE_PENDING;
+    return 0;
+}
+
+
+/**
+ * Collect the copies an in-place synth has to make, and check that the
+ * records of the diff are complete and describe a file of the size given
+ * in the diff header. Compressed frames are not decoded yet.
+ */
+static int
+__synctory_synth_plan(_synctory_synth_reader_t *reader, const _synctory_fheader_t *header, _synctory_off_t srcsize, _synctory_off_t diffsize, _synctory_synth_plan_t *plan)
+{
+    int rval;
+    uint64_t dst = 0;
+    _synctory_synth_record_t record;
+    _synctory_off_t offset;
+    _synctory_off_t len;
+    
+    while (__synctory_synth_more(reader, &rval))
+    {
+        rval = __synctory_synth_record(reader, &record);
+        if (rval)
+            return rval;
+        
+        switch (record.type)
+        {
+            case _SYNCTORY_DIFF_BTYPE_CHUNK:
+            case _SYNCTORY_DIFF_BTYPE_RANGE:
+                if (__synctory_synth_extent(srcsize, header->chunksize, record.index, record.count, &offset, &len))
+                    return -1;
+                rval = __synctory_synth_plan_add(plan, dst, (uint64_t)offset, (uint64_t)len);
+                dst += (uint64_t)len;
+                break;
+            
+            case _SYNCTORY_DIFF_BTYPE_RAW:
+                rval = __synctory_synth_skip(reader, record.count, diffsize);
+                dst += record.count;
+                break;
+            
+            case _SYNCTORY_DIFF_BTYPE_FRAME:
+                if (_SYNCTORY_CODEC_NONE == header->codec)
+                    return -1;
+                rval = __synctory_synth_skip(reader, record.size, diffsize);
+                dst += record.count;
+                break;
+            
+            default:
+                return -1;
+        }
+        
+        if (rval)
+            return rval;
+    }
+    
+    if ((0 == rval) && (dst != header->filesize))
+        rval = -1;
+    return rval;
+}
+
+
+/**
+ * Index of the first copy of the plan whose destination ends behind the
+ * given offset
+ */
+static uint64_t
+__synctory_synth_plan_find(const _synctory_synth_plan_t *plan, uint64_t offset)
+{
+    uint64_t lo = 0;
+    uint64_t hi = plan->moves;
+    uint64_t mid;
+    
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (plan->move[mid].dst + plan->move[mid].len <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    return lo;
+}
+
+
+/**
+ * Carry out a copy inside the basis file. A copy overlapping itself goes
+ * through buffer, front to back if the bytes move towards the beginning of
+ * the file and back to front otherwise, so no byte is overwritten before
+ * it has been read.
+ */
+static int
+__synctory_synth_move(int fd, const _synctory_synth_move_t *move, unsigned char *buffer)
+{
+    int rval;
+    uint64_t done;
+    uint64_t at;
+    size_t n;
+    
+    if ((move->dst + move->len <= move->src) || (move->src + move->len <= move->dst))
+    {
+        if (_synctory_file64_seek(fd, (int64_t)move->dst, SEEK_SET) != (_synctory_off_t)move->dst)
+            return ((errno != 0) ? errno : -1);
+        return _synctory_file64_bytecopy(fd, fd, (_synctory_off_t)move->src, (_synctory_off_t)move->len);
+    }
+    
+    for (done = 0; done < move->len; done += n)
+    {
+        n = (move->len - done > _SYNCTORY_SYNTH_MOVEBUF) ? _SYNCTORY_SYNTH_MOVEBUF : (size_t)(move->len - done);
+        at = (move->dst < move->src) ? done : move->len - done - n;
+        rval = _synctory_file64_readat(fd, buffer, n, (_synctory_off_t)(move->src + at));
+        if (0 == rval)
+            rval = _synctory_file64_writeat(fd, buffer, n, (_synctory_off_t)(move->dst + at));
+        if (rval)
+            return rval;
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Save the bytes a copy reads, so the copy can be finished after all
+ * others. They are kept in memory as long as it suffices, and go to a
+ * temporary file otherwise.
+ */
+static int
+__synctory_synth_buffer(int fd, _synctory_synth_plan_t *plan, _synctory_synth_move_t *move)
+{
+    int rval;
+    
+    if (NULL == plan->memory)
+        plan->memory = (unsigned char *)malloc(_SYNCTORY_SYNTH_SPILLMEM);
+    
+    if ((NULL != plan->memory) && (move->len <= (uint64_t)(_SYNCTORY_SYNTH_SPILLMEM - plan->used)))
+    {
+        rval = _synctory_file64_readat(fd, &plan->memory[plan->used], (size_t)move->len, (_synctory_off_t)move->src);
+        if (rval)
+            return rval;
+        move->spill = plan->used;
+        move->state = _SYNCTORY_SYNTH_MOVE_MEMORY;
+        plan->used += (size_t)move->len;
+        return 0;
+    }
+    
+    if (NULL == plan->spill)
+    {
+        plan->spill = tmpfile();
+        if (NULL == plan->spill)
+            return ((errno != 0) ? errno : -1);
+    }
+    
+    rval = _synctory_file64_bytecopy(fd, fileno(plan->spill), (_synctory_off_t)move->src, (_synctory_off_t)move->len);
+    if (rval)
+        return rval;
+    move->spill = plan->spilled;
+    move->state = _SYNCTORY_SYNTH_MOVE_SPILLED;
+    plan->spilled += move->len;
+    return 0;
+}
+
+
+/**
+ * Write the bytes saved by __synctory_synth_buffer to the destination of
+ * their copy
+ */
+static int
+__synctory_synth_unbuffer(int fd, const _synctory_synth_plan_t *plan, const _synctory_synth_move_t *move)
+{
+    if (_SYNCTORY_SYNTH_MOVE_MEMORY == move->state)
+        return _synctory_file64_writeat(fd, &plan->memory[move->spill], (size_t)move->len, (_synctory_off_t)move->dst);
+    
+    if (_synctory_file64_seek(fd, (int64_t)move->dst, SEEK_SET) != (_synctory_off_t)move->dst)
+        return ((errno != 0) ? errno : -1);
+    return _synctory_file64_bytecopy(fileno(plan->spill), fd, (_synctory_off_t)move->spill, (_synctory_off_t)move->len);
+}
+
+
+/**
+ * Carry out the copies of the plan. A copy waits for all other copies
+ * reading bytes it overwrites, so copies are made in topological order.
+ * If every pending copy waits for another one, the dependencies are
+ * cyclic; the shortest pending copy is then buffered, which frees the
+ * copies overwriting its source, and finished after all others.
+ */
+static int
+__synctory_synth_order(int fd, _synctory_synth_plan_t *plan)
+{
+    int rval = 0;
+    uint64_t i;
+    uint64_t j;
+    uint64_t head = 0;
+    uint64_t tail = 0;
+    uint64_t done = 0;
+    uint64_t cursor = 0;
+    uint64_t *queue;
+    unsigned char *buffer;
+    _synctory_synth_rank_t *rank;
+    _synctory_synth_move_t *move;
+    
+    if (0 == plan->moves)
+        return 0;
+    if (plan->moves > SIZE_MAX / sizeof(_synctory_synth_rank_t))
+        return ENOMEM;
+    
+    queue = (uint64_t *)malloc((size_t)plan->moves * sizeof(uint64_t));
+    rank = (_synctory_synth_rank_t *)malloc((size_t)plan->moves * sizeof(_synctory_synth_rank_t));
+    buffer = (unsigned char *)malloc(_SYNCTORY_SYNTH_MOVEBUF);
+    if ((NULL == queue) || (NULL == rank) || (NULL == buffer))
+    {
+        rval = ((errno != 0) ? errno : ENOMEM);
+        free(queue);
+        free(rank);
+        free(buffer);
+        return rval;
+    }
+    
+    /* count the other copies reading the destination of each copy */
+    for (i = 0; i < plan->moves; i++)
+    {
+        move = &plan->move[i];
+        for (j = __synctory_synth_plan_find(plan, move->src); (j < plan->moves) && (plan->move[j].dst < move->src + move->len); j++)
+        {
+            if (j != i)
+                plan->move[j].wait++;
+        }
+        rank[i].len = move->len;
+        rank[i].index = i;
+    }
+    qsort(rank, (size_t)plan->moves, sizeof(_synctory_synth_rank_t), __synctory_synth_rank_cmp);
+    
+    for (i = 0; i < plan->moves; i++)
+    {
+        if (0 == plan->move[i].wait)
+            queue[tail++] = i;
+    }
+    
+    while ((0 == rval) && (done < plan->moves))
+    {
+        if (head < tail)
+        {
+            i = queue[head++];
+            rval = __synctory_synth_move(fd, &plan->move[i], buffer);
+            plan->move[i].state = _SYNCTORY_SYNTH_MOVE_DONE;
+        }
+        else
+        {
+            while (_SYNCTORY_SYNTH_MOVE_PENDING != plan->move[rank[cursor].index].state)
+                cursor++;
+            i = rank[cursor].index;
+            rval = __synctory_synth_buffer(fd, plan, &plan->move[i]);
+        }
+        done++;
+        
+        /* the source of this copy may be overwritten now */
+        move = &plan->move[i];
+        for (j = __synctory_synth_plan_find(plan, move->src); (j < plan->moves) && (plan->move[j].dst < move->src + move->len); j++)
+        {
+            if ((j != i) && (_SYNCTORY_SYNTH_MOVE_PENDING == plan->move[j].state) && (0 == --plan->move[j].wait))
+                queue[tail++] = j;
+        }
+    }
+    
+    for (i = 0; (0 == rval) && (i < plan->moves); i++)
+    {
+        if (_SYNCTORY_SYNTH_MOVE_DONE != plan->move[i].state)
+            rval = __synctory_synth_unbuffer(fd, plan, &plan->move[i]);
+    }
+    
+    free(queue);
+    free(rank);
+    free(buffer);
+    return rval;
+}
+
+
+/**
+ * Update the basis file in place. First, the whole diff is checked and
+ * the copies within the basis file are collected; nothing is written if
+ * the diff turns out to be damaged (except for corrupt compressed data,
+ * which is only detected while decompressing it). Then the copies are
+ * made in an order that never overwrites bytes still to be read, and
+ * finally the raw data is written and the file is cut to its new size.
+ */
+int
+_synctory_synth_inplace_fd(int fdbasis, int fddiff)
+{
+    int rval = 0;
+    _synctory_fheader_t header;
+    _synctory_synth_reader_t reader;
+    _synctory_synth_record_t record;
+    _synctory_synth_plan_t plan;
+    _synctory_codec_t codec;
+    unsigned char *outbuf = NULL;
+    uint64_t dst = 0;
+    _synctory_off_t offset;
+    _synctory_off_t len;
+    _synctory_off_t srcsize;
+    _synctory_off_t diffsize;
+    _synctory_synth_dest_t dest;
+    
+    if ((rval = _synctory_fh_getheader_fd(&header, fddiff)) != 0)
+        return rval;
+    if ((_SYNCTORY_FH_DIFF != header.type) && (_SYNCTORY_FH_DIFF_COMPACT != header.type))
+        return -1;
+    
+    __synctory_synth_dest_init(&dest, fdbasis, 0, 0);
+    srcsize = _synctory_file64_seek(fdbasis, 0, SEEK_END);
+    diffsize = _synctory_file64_seek(fddiff, 0, SEEK_END);
+    if ((srcsize < 0) || (diffsize < 0))
         return errno;
     
-    while ((rbytes = read(fddiff, ibuf, 9)) == 9)
+    rval = _synctory_codec_init(&codec, header.codec, header.level, 1);
+    if (rval)
+        return rval;
+    if (_SYNCTORY_CODEC_NONE != header.codec)
     {
-        type = *((uint8_t *)&ibuf[0]);
-        index = _synctory_ntoh64(*((uint64_t *)&ibuf[1]));
+        outbuf = (unsigned char *)malloc(_SYNCTORY_SYNTH_BUFSIZE);
+        if (NULL == outbuf)
+        {
+            rval = ((errno != 0) ? errno : ENOMEM);
+            _synctory_codec_free(&codec);
+            return rval;
+        }
+    }
+    
+    memset(&plan, 0, sizeof(_synctory_synth_plan_t));
+    reader.fd = fddiff;
+    
+    rval = __synctory_synth_rewind(&reader, &header);
+    if (0 == rval)
+        rval = __synctory_synth_plan(&reader, &header, srcsize, diffsize, &plan);
+    if (0 == rval)
+        rval = __synctory_synth_order(fdbasis, &plan);
+    
+    free(plan.move);
+    free(plan.memory);
+    if (NULL != plan.spill)
+        fclose(plan.spill);
+    
+    /* nothing reads the places raw data goes to, so it comes last */
+    if (0 == rval)
+        rval = __synctory_synth_rewind(&reader, &header);
+    while ((0 == rval) && __synctory_synth_more(&reader, &rval))
+    {
+        rval = __synctory_synth_record(&reader, &record);
+        if (rval)
+            break;
         
-        switch (type)
+        if ((_SYNCTORY_DIFF_BTYPE_CHUNK == record.type) || (_SYNCTORY_DIFF_BTYPE_RANGE == record.type))
+        {
+            rval = __synctory_synth_extent(srcsize, header.chunksize, record.index, record.count, &offset, &len);
+            dst += (uint64_t)len;
+            continue;
+        }
+        
+        if (_synctory_file64_seek(fdbasis, (int64_t)dst, SEEK_SET) != (_synctory_off_t)dst)
+            rval = ((errno != 0) ? errno : -1);
+        else if (_SYNCTORY_DIFF_BTYPE_RAW == record.type)
+            rval = __synctory_synth_raw(&reader, &dest, record.count);
+        else
+            rval = __synctory_synth_frame(&reader, &codec, &dest, record.count, record.size, outbuf, 0, record.count);
+        dst += record.count;
+    }
+    
+    if (0 == rval)
+        rval = _synctory_file64_truncate(fdbasis, (_synctory_off_t)header.filesize);
+    
+    _synctory_codec_free(&codec);
+    free(outbuf);
+    return rval;
+}
+
+
+/**
+ * Collect the records of the next batch of a parallel synth, each with its
+ * place in the recent file; dst is the size of the recent file so far.
+ * Chunks continuing the previous ones are merged with them.
+ */
+static int
+__synctory_synth_collect(_synctory_synth_reader_t *reader, const _synctory_fheader_t *header, _synctory_off_t srcsize, _synctory_off_t diffsize, _synctory_synth_op_t *op, size_t *ops, uint64_t *dst)
+{
+    int rval;
+    _synctory_synth_record_t record;
+    _synctory_synth_op_t *o;
+    _synctory_off_t offset;
+    _synctory_off_t len;
+    
+    *ops = 0;
+    while ((*ops < _SYNCTORY_SYNTH_BATCH) && __synctory_synth_more(reader, &rval))
+    {
+        rval = __synctory_synth_record(reader, &record);
+        if (rval)
+            return rval;
+        
+        o = &op[*ops];
+        o->dst = *dst;
+        o->type = record.type;
+        o->size = 0;
+        
+        switch (record.type)
         {
             case _SYNCTORY_DIFF_BTYPE_CHUNK:
-                _synctory_file64_bytecopy(fdsource, fddest, index * header.chunksize, header.chunksize);
+            case _SYNCTORY_DIFF_BTYPE_RANGE:
+                if (__synctory_synth_extent(srcsize, header->chunksize, record.index, record.count, &offset, &len))
+                    return -1;
+                o->type = _SYNCTORY_DIFF_BTYPE_CHUNK;
+                o->src = (uint64_t)offset;
+                o->len = (uint64_t)len;
+                if ((*ops > 0) && (_SYNCTORY_DIFF_BTYPE_CHUNK == o[-1].type) && (o[-1].src + o[-1].len == o->src))
+                {
+                    o[-1].len += o->len;
+                    *dst += o->len;
+                    continue;
+                }
                 break;
-                    
+            
             case _SYNCTORY_DIFF_BTYPE_RAW:
-                _synctory_file64_bytecopy(fddiff, fddest, _synctory_file64_seek(fddiff, 0, SEEK_CUR), index);
+                o->src = (uint64_t)(reader->offset + (_synctory_off_t)reader->pos);
+                o->len = record.count;
+                rval = __synctory_synth_skip(reader, record.count, diffsize);
                 break;
-                    
+            
+            case _SYNCTORY_DIFF_BTYPE_FRAME:
+                if (_SYNCTORY_CODEC_NONE == header->codec)
+                    return -1;
+                o->src = (uint64_t)(reader->offset + (_synctory_off_t)reader->pos);
+                o->len = record.count;
+                o->size = record.size;
+                rval = __synctory_synth_skip(reader, record.size, diffsize);
+                break;
+            
             default:
                 return -1;
         }
+        
+        if (rval)
+            return rval;
+        *dst += o->len;
+        (*ops)++;
+    }
+    
+    return rval;
+}
+
+
+/**
+ * Decompress a frame into its place of the recent file, using positional
+ * reads and writes only
+ */
+static int
+__synctory_synth_frame_at(_synctory_synth_worker_t *worker, const _synctory_synth_op_t *op)
+{
+    int rval;
+    int end = 0;
+    uint64_t in = 0;
+    uint64_t out = 0;
+    size_t pos = 0;
+    size_t len = 0;
+    size_t consumed;
+    size_t produced;
+    
+    rval = _synctory_codec_reset(&worker->codec);
+    while ((0 == rval) && !end)
+    {
+        if ((pos == len) && (in < op->size))
+        {
+            len = (op->size - in > _SYNCTORY_SYNTH_BUFSIZE) ? _SYNCTORY_SYNTH_BUFSIZE : (size_t)(op->size - in);
+            rval = _synctory_file64_readat(worker->fddiff, worker->inbuf, len, (_synctory_off_t)(op->src + in));
+            if (rval)
+                break;
+            in += len;
+            pos = 0;
+        }
+        
+        rval = _synctory_codec_decode(&worker->codec, &worker->inbuf[pos], len - pos, &consumed, worker->outbuf, _SYNCTORY_SYNTH_BUFSIZE, &produced, &end);
+        if (rval)
+            break;
+        
+        /* no progress means the frame is truncated or corrupt */
+        if ((0 == consumed) && (0 == produced) && !end)
+            return -1;
+        pos += consumed;
+        
+        if ((uint64_t)produced > op->len - out)
+            return -1;
+        rval = _synctory_file64_writeat(worker->fddest, worker->outbuf, produced, (_synctory_off_t)(op->dst + out));
+        out += produced;
+    }
+    
+    if ((0 == rval) && ((out != op->len) || (in != op->size) || (pos != len)))
+        rval = -1;
+    return rval;
+}
+
+
+/**
+ * Write the range of the recent file assigned to a worker. Chunks and raw
+ * data are cut at the borders of the range; a frame is decompressed by the
+ * worker whose range it starts in.
+ */
+static int
+__synctory_synth_work(_synctory_synth_worker_t *worker)
+{
+    int rval = 0;
+    size_t lo = 0;
+    size_t hi = worker->ops;
+    size_t mid;
+    uint64_t from;
+    uint64_t to;
+    const _synctory_synth_op_t *op;
+    
+    /* find the first record ending behind the start of the range */
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (worker->op[mid].dst + worker->op[mid].len <= worker->start)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    
+    for (; (0 == rval) && (lo < worker->ops) && (worker->op[lo].dst < worker->end); lo++)
+    {
+        op = &worker->op[lo];
+        if (_SYNCTORY_DIFF_BTYPE_FRAME == op->type)
+        {
+            if (op->dst >= worker->start)
+                rval = __synctory_synth_frame_at(worker, op);
+            continue;
+        }
+        
+        from = (op->dst < worker->start) ? worker->start : op->dst;
+        to = (op->dst + op->len > worker->end) ? worker->end : op->dst + op->len;
+        rval = _synctory_file64_copyat((_SYNCTORY_DIFF_BTYPE_CHUNK == op->type) ? worker->fdsource : worker->fddiff, (_synctory_off_t)(op->src + (from - op->dst)), worker->fddest, (_synctory_off_t)from, (_synctory_off_t)(to - from));
+    }
+    
+    return rval;
+}
+
+
+#ifdef _SYNCTORY_SYNTH_THREADS
+static void *
+__synctory_synth_worker(void *arg)
+{
+    _synctory_synth_worker_t *worker = (_synctory_synth_worker_t *)arg;
+    
+    worker->rval = __synctory_synth_work(worker);
+    return NULL;
+}
+#endif
+
+
+/**
+ * Synthesize the recent file using several threads. A pass over a batch
+ * of records computes the place of each record in the recent file (the
+ * sum of the lengths of all records before); the recent file is then
+ * split into as many ranges as there are threads, which are written
+ * concurrently with positional reads and writes. The recent file is
+ * written starting at offset 0 of fddest.
+ * 
+ * With a single thread, or if fddest does not allow positional writes
+ * (e. g. a pipe), the recent file is synthesized by
+ * _synctory_synth_create_fd instead.
+ */
+int
+_synctory_synth_parallel_fd(const synctory_ctx_t *ctx, int fdsource, int fddiff, int fddest)
+{
+    int rval = 0;
+    unsigned int threads = 1;
+    unsigned int i;
+    _synctory_fheader_t header;
+    _synctory_synth_reader_t reader;
+    _synctory_synth_worker_t *worker;
+    _synctory_synth_op_t *op;
+    size_t ops;
+    uint64_t base;
+    uint64_t dst = 0;
+    uint64_t step;
+    _synctory_off_t srcsize;
+    _synctory_off_t diffsize;
+    _synctory_file64_stat_t st;
+#ifdef _SYNCTORY_SYNTH_THREADS
+    pthread_t *thread;
+    int *started;
+    
+    if (ctx->threads > 1)
+        threads = (ctx->threads > _SYNCTORY_SYNTH_MAXTHREADS) ? _SYNCTORY_SYNTH_MAXTHREADS : ctx->threads;
+#else
+    (void)ctx;
+#endif
+    
+    if ((threads < 2) || (_synctory_file64_seek(fddest, 0, SEEK_CUR) < 0))
+        return _synctory_synth_create_fd(fdsource, fddiff, fddest);
+    
+    if ((rval = _synctory_fh_getheader_fd(&header, fddiff)) != 0)
+        return rval;
+    if ((_SYNCTORY_FH_DIFF != header.type) && (_SYNCTORY_FH_DIFF_COMPACT != header.type))
+        return -1;
+    
+    srcsize = _synctory_file64_seek(fdsource, 0, SEEK_END);
+    diffsize = _synctory_file64_seek(fddiff, 0, SEEK_END);
+    if ((srcsize < 0) || (diffsize < 0))
+        return errno;
+    
+    /* the workers fill the file out of order, so its space is reserved first */
+    if ((0 == _synctory_file64_fstat(fddest, &st)) && S_ISREG(st.st_mode))
+        (void)_synctory_file64_allocate(fddest, 0, (_synctory_off_t)header.filesize);
+    
+    op = (_synctory_synth_op_t *)malloc(_SYNCTORY_SYNTH_BATCH * sizeof(_synctory_synth_op_t));
+    worker = (_synctory_synth_worker_t *)calloc(threads, sizeof(_synctory_synth_worker_t));
+#ifdef _SYNCTORY_SYNTH_THREADS
+    thread = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    started = (int *)calloc(threads, sizeof(int));
+    if ((NULL == op) || (NULL == worker) || (NULL == thread) || (NULL == started))
+    {
+        free(op);
+        free(worker);
+        free(thread);
+        free(started);
+        return ((errno != 0) ? errno : -1);
+    }
+#else
+    if ((NULL == op) || (NULL == worker))
+    {
+        free(op);
+        free(worker);
+        return ((errno != 0) ? errno : -1);
+    }
+#endif
+    
+    /* every worker decompresses frames on its own */
+    for (i = 0; i < threads; i++)
+    {
+        worker[i].fdsource = fdsource;
+        worker[i].fddiff = fddiff;
+        worker[i].fddest = fddest;
+        worker[i].op = op;
+        if (0 == rval)
+            rval = _synctory_codec_init(&worker[i].codec, header.codec, header.level, 1);
+        if ((0 == rval) && (_SYNCTORY_CODEC_NONE != header.codec))
+        {
+            worker[i].inbuf = (unsigned char *)malloc(_SYNCTORY_SYNTH_BUFSIZE);
+            worker[i].outbuf = (unsigned char *)malloc(_SYNCTORY_SYNTH_BUFSIZE);
+            if ((NULL == worker[i].inbuf) || (NULL == worker[i].outbuf))
+                rval = ((errno != 0) ? errno : ENOMEM);
+        }
+    }
+    
+    reader.fd = fddiff;
+    if (0 == rval)
+        rval = __synctory_synth_rewind(&reader, &header);
+    
+    while (0 == rval)
+    {
+        base = dst;
+        rval = __synctory_synth_collect(&reader, &header, srcsize, diffsize, op, &ops, &dst);
+        if ((0 != rval) || (0 == ops))
+            break;
+        
+        /* spread the output of the batch across the workers */
+        step = (dst - base + threads - 1) / threads;
+        for (i = 0; i < threads; i++)
+        {
+            worker[i].ops = ops;
+            worker[i].start = ((uint64_t)i * step < dst - base) ? base + (uint64_t)i * step : dst;
+            worker[i].end = ((uint64_t)(i + 1) * step < dst - base) ? base + (uint64_t)(i + 1) * step : dst;
+            worker[i].rval = 0;
+        }
+        
+#ifdef _SYNCTORY_SYNTH_THREADS
+        /* the first range is written by the calling thread */
+        for (i = 1; i < threads; i++)
+            started[i] = (0 == pthread_create(&thread[i], NULL, __synctory_synth_worker, &worker[i]));
+        worker[0].rval = __synctory_synth_work(&worker[0]);
+        for (i = 1; i < threads; i++)
+        {
+            if (started[i])
+                pthread_join(thread[i], NULL);
+            else
+                worker[i].rval = __synctory_synth_work(&worker[i]);
+        }
+#else
+        worker[0].rval = __synctory_synth_work(&worker[0]);
+#endif
+        
+        for (i = 0; (i < threads) && (0 == rval); i++)
+            rval = worker[i].rval;
+    }
+    
+    /* a diff ending early must not pass for the reserved file */
+    if ((0 == rval) && (dst != header.filesize))
+        rval = -1;
+    
+    for (i = 0; i < threads; i++)
+    {
+        _synctory_codec_free(&worker[i].codec);
+        free(worker[i].inbuf);
+        free(worker[i].outbuf);
+    }
+    free(op);
+    free(worker);
+#ifdef _SYNCTORY_SYNTH_THREADS
+    free(thread);
+    free(started);
+#endif
+    return rval;
+}
+
+
+/**
+ * Look up the table of contents at the end of the diff file for the last
+ * record starting at or in front of offset of the recent file, and move
+ * the reader there; output receives the offset of that record in the
+ * recent file. The reader is left alone if no such record is listed.
+ */
+static int
+__synctory_synth_toc_seek(_synctory_synth_reader_t *reader, _synctory_off_t diffsize, uint64_t offset, uint64_t *output)
+{
+    int rval;
+    unsigned char head[_SYNCTORY_DIFF_TOC_HEAD];
+    uint64_t entry[3];
+    uint64_t toc;
+    uint64_t entries;
+    uint64_t lo = 0;
+    uint64_t hi;
+    uint64_t mid;
+    
+    if (diffsize < (_synctory_off_t)(_SYNCTORY_FH_BYTES + _SYNCTORY_DIFF_TOC_HEAD + _SYNCTORY_DIFF_TOC_TAIL))
+        return -1;
+    rval = _synctory_file64_readat(reader->fd, &toc, sizeof(uint64_t), diffsize - _SYNCTORY_DIFF_TOC_TAIL);
+    if (rval)
+        return rval;
+    toc = _synctory_ntoh64(toc);
+    if ((toc < _SYNCTORY_FH_BYTES) || (toc > (uint64_t)diffsize - _SYNCTORY_DIFF_TOC_HEAD - _SYNCTORY_DIFF_TOC_TAIL))
+        return -1;
+    
+    rval = _synctory_file64_readat(reader->fd, head, _SYNCTORY_DIFF_TOC_HEAD, (_synctory_off_t)toc);
+    if (rval)
+        return rval;
+    memcpy(&entries, &head[25], sizeof(uint64_t));
+    entries = _synctory_ntoh64(entries);
+    if ((_SYNCTORY_DIFF_BTYPE_TOC != head[0]) || (entries != ((uint64_t)diffsize - toc - _SYNCTORY_DIFF_TOC_HEAD - _SYNCTORY_DIFF_TOC_TAIL) / _SYNCTORY_DIFF_TOC_ENTRY) || (0 != ((uint64_t)diffsize - toc - _SYNCTORY_DIFF_TOC_HEAD - _SYNCTORY_DIFF_TOC_TAIL) % _SYNCTORY_DIFF_TOC_ENTRY))
+        return -1;
+    
+    /* entries are ordered by their output offset */
+    hi = entries;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        rval = _synctory_file64_readat(reader->fd, entry, _SYNCTORY_DIFF_TOC_ENTRY, (_synctory_off_t)(toc + _SYNCTORY_DIFF_TOC_HEAD + mid * _SYNCTORY_DIFF_TOC_ENTRY));
+        if (rval)
+            return rval;
+        if (_synctory_ntoh64(entry[0]) <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    if (0 == lo)
+        return 0;
+    
+    rval = _synctory_file64_readat(reader->fd, entry, _SYNCTORY_DIFF_TOC_ENTRY, (_synctory_off_t)(toc + _SYNCTORY_DIFF_TOC_HEAD + (lo - 1) * _SYNCTORY_DIFF_TOC_ENTRY));
+    if (rval)
+        return rval;
+    entry[1] = _synctory_ntoh64(entry[1]);
+    if ((entry[1] < _SYNCTORY_FH_BYTES) || (entry[1] > toc))
+        return -1;
+    if (_synctory_file64_seek(reader->fd, (int64_t)entry[1], SEEK_SET) != (_synctory_off_t)entry[1])
+        return ((errno != 0) ? errno : -1);
+    
+    reader->next = _synctory_ntoh64(entry[2]);
+    reader->offset = (_synctory_off_t)entry[1];
+    reader->pos = 0;
+    reader->len = 0;
+    *output = _synctory_ntoh64(entry[0]);
+    return 0;
+}
+
+
+/**
+ * Synthesize len bytes of the recent file, starting at offset, and write
+ * them to the destination file at its current position. If the diff has a
+ * table of contents, the records in front of the region are skipped with
+ * its help; otherwise, they are read (but not decompressed) from the start.
+ */
+int
+_synctory_synth_range_fd(int fdsource, int fddiff, int fddest, uint64_t offset, uint64_t len)
+{
+    int rval = 0;
+    _synctory_fheader_t header;
+    _synctory_synth_reader_t reader;
+    _synctory_synth_record_t record;
+    _synctory_codec_t codec;
+    unsigned char *outbuf = NULL;
+    uint64_t pos = 0;
+    uint64_t end;
+    uint64_t from;
+    uint64_t to;
+    uint64_t count;
+    _synctory_off_t srcoff = 0;
+    _synctory_off_t srclen;
+    _synctory_off_t srcsize;
+    _synctory_off_t diffsize;
+    _synctory_synth_dest_t dest;
+    
+    if ((rval = _synctory_fh_getheader_fd(&header, fddiff)) != 0)
+        return rval;
+    if ((_SYNCTORY_FH_DIFF != header.type) && (_SYNCTORY_FH_DIFF_COMPACT != header.type))
+        return -1;
+    __synctory_synth_dest_init(&dest, fddest, 0, 0);
+    if ((offset > header.filesize) || (len > header.filesize - offset))
+        return ERANGE;
+    if (0 == len)
+        return 0;
+    end = offset + len;
+    
+    srcsize = _synctory_file64_seek(fdsource, 0, SEEK_END);
+    diffsize = _synctory_file64_seek(fddiff, 0, SEEK_END);
+    if ((srcsize < 0) || (diffsize < 0))
+        return errno;
+    
+    rval = _synctory_codec_init(&codec, header.codec, header.level, 1);
+    if (rval)
+        return rval;
+    if (_SYNCTORY_CODEC_NONE != header.codec)
+    {
+        outbuf = (unsigned char *)malloc(_SYNCTORY_SYNTH_BUFSIZE);
+        if (NULL == outbuf)
+        {
+            rval = ((errno != 0) ? errno : ENOMEM);
+            _synctory_codec_free(&codec);
+            return rval;
+        }
+    }
+    
+    reader.fd = fddiff;
+    rval = __synctory_synth_rewind(&reader, &header);
+    if ((0 == rval) && reader.toc)
+        rval = __synctory_synth_toc_seek(&reader, diffsize, offset, &pos);
+    
+    while ((0 == rval) && (pos < end) && __synctory_synth_more(&reader, &rval))
+    {
+        rval = __synctory_synth_record(&reader, &record);
+        if (rval)
+            break;
+        
+        count = record.count;
+        if ((_SYNCTORY_DIFF_BTYPE_CHUNK == record.type) || (_SYNCTORY_DIFF_BTYPE_RANGE == record.type))
+        {
+            rval = __synctory_synth_extent(srcsize, header.chunksize, record.index, record.count, &srcoff, &srclen);
+            count = (uint64_t)srclen;
+        }
+        else if ((_SYNCTORY_DIFF_BTYPE_FRAME == record.type) && (NULL == outbuf))
+            rval = -1;
+        else if ((_SYNCTORY_DIFF_BTYPE_RAW != record.type) && (_SYNCTORY_DIFF_BTYPE_FRAME != record.type))
+            rval = -1;
+        if (rval)
+            break;
+        
+        /* the part of the record inside the region, if any */
+        from = (pos > offset) ? pos : offset;
+        to = (pos + count < end) ? (pos + count) : end;
+        
+        if (_SYNCTORY_DIFF_BTYPE_RAW == record.type)
+        {
+            if (from < to)
+                rval = _synctory_file64_bytecopy(fddiff, fddest, reader.offset + (_synctory_off_t)(reader.pos + (from - pos)), (_synctory_off_t)(to - from));
+            if (0 == rval)
+                rval = __synctory_synth_skip(&reader, record.count, diffsize);
+        }
+        else if (_SYNCTORY_DIFF_BTYPE_FRAME == record.type)
+        {
+            if (from < to)
+                rval = __synctory_synth_frame(&reader, &codec, &dest, record.count, record.size, outbuf, from - pos, to - pos);
+            else
+                rval = __synctory_synth_skip(&reader, record.size, diffsize);
+        }
+        else if (from < to)
+            rval = _synctory_file64_bytecopy(fdsource, fddest, srcoff + (_synctory_off_t)(from - pos), (_synctory_off_t)(to - from));
+        
+        pos += count;
+    }
+    
+    /* the records have to cover the region */
+    if ((0 == rval) && (pos < end))
+        rval = -1;
     
+    _synctory_codec_free(&codec);
+    free(outbuf);
     return rval;
 }
 
@@ -0,0 +1,395 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/**
+ * The buffered writer turns the many small pieces of output created while
+ * writing a diff or a fingerprint (9 byte record headers, checksums, short
+ * runs of literal bytes) into few large writes. Pieces are either copied
+ * into the writer's buffer, or, if they are large and stay valid until the
+ * next flush (like literal bytes inside a mapping of the source file),
+ * referenced in place. Pending pieces are written with writev(2) where
+ * available.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#include "_file64.h"
+#include "_writer.h"
+
+
+/**
+ * Upper limit for the number of bytes written by a single flush, keeping
+ * the result of writev(2) representable
+ */
+#define __SYNCTORY_WRITER_MAXPENDING 0x40000000U
+
+/**
+ * Tell whether buffered output appended now would directly follow the
+ * given segment inside the buffer
+ */
+#define __synctory_writer_adjacent(writer,s) \
+    (((s)->data >= (writer)->buffer) && ((s)->data + (s)->len == &(writer)->buffer[(writer)->len]))
+
+
+/**
+ * Make room for len more bytes of output, len bytes of buffer space if
+ * inbuf is set, and one more segment
+ */
+static int
+__synctory_writer_room(_synctory_writer_t *writer, size_t len, int inbuf)
+{
+    const _synctory_writer_segment_t *last;
+    
+    if (inbuf && (len > writer->size - writer->len))
+        return _synctory_writer_flush(writer);
+    if ((writer->pending > 0) && ((uint64_t)writer->pending + len > __SYNCTORY_WRITER_MAXPENDING))
+        return _synctory_writer_flush(writer);
+    if (writer->segments < _SYNCTORY_WRITER_SEGMENTS)
+        return 0;
+    
+    /* buffered output next to the last buffered segment extends that segment */
+    last = &writer->segment[writer->segments - 1];
+    if (inbuf && __synctory_writer_adjacent(writer, last))
+        return 0;
+    return _synctory_writer_flush(writer);
+}
+
+
+/**
+ * Set up a writer for the given file descriptor. The output is written
+ * starting at the current file offset of fd.
+ */
+int
+_synctory_writer_init(_synctory_writer_t *writer, int fd, size_t size)
+{
+    if (size < _SYNCTORY_WRITER_MINSIZE)
+        size = _SYNCTORY_WRITER_MINSIZE;
+    
+    writer->buffer = (unsigned char *)malloc(size);
+    if (NULL == writer->buffer)
+        return ((errno != 0) ? errno : ENOMEM);
+    
+    writer->fd = fd;
+    writer->size = size;
+    writer->len = 0;
+    writer->segments = 0;
+    writer->pending = 0;
+    
+    /* the offset is only needed to patch output later on */
+    writer->base = _synctory_file64_seek(fd, 0, SEEK_CUR);
+    if (writer->base < 0)
+        writer->base = 0;
+    return 0;
+}
+
+
+/**
+ * Reserve len bytes of output inside the writer's buffer; ptr receives
+ * their address. The caller has to fill them in before handing the next
+ * piece of output to the writer. len must not exceed the buffer size.
+ */
+int
+_synctory_writer_stage(_synctory_writer_t *writer, size_t len, unsigned char **ptr)
+{
+    int rval;
+    _synctory_writer_segment_t *last;
+    
+    if (len > writer->size)
+        return EINVAL;
+    
+    rval = __synctory_writer_room(writer, len, 1);
+    if (rval)
+        return rval;
+    
+    *ptr = &writer->buffer[writer->len];
+    last = (writer->segments > 0) ? &writer->segment[writer->segments - 1] : NULL;
+    if ((NULL != last) && __synctory_writer_adjacent(writer, last))
+        last->len += len;
+    else
+    {
+        writer->segment[writer->segments].data = *ptr;
+        writer->segment[writer->segments].len = len;
+        writer->segments++;
+    }
+    
+    writer->len += len;
+    writer->pending += (_synctory_off_t)len;
+    return 0;
+}
+
+
+/**
+ * Copy len bytes of output into the writer's buffer
+ */
+int
+_synctory_writer_put(_synctory_writer_t *writer, const void *data, size_t len)
+{
+    int rval;
+    size_t n;
+    unsigned char *ptr;
+    const unsigned char *src = (const unsigned char *)data;
+    
+    while (len > 0)
+    {
+        n = (len > writer->size) ? writer->size : len;
+        rval = _synctory_writer_stage(writer, n, &ptr);
+        if (rval)
+            return rval;
+        memcpy(ptr, src, n);
+        src += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Hand len bytes of output to the writer without copying them, unless they
+ * are few. The data has to stay valid until the writer is flushed.
+ */
+int
+_synctory_writer_ref(_synctory_writer_t *writer, const void *data, size_t len)
+{
+    int rval;
+    size_t n;
+    const unsigned char *src = (const unsigned char *)data;
+    
+    if (len < _SYNCTORY_WRITER_MINREF)
+        return _synctory_writer_put(writer, data, len);
+    
+    while (len > 0)
+    {
+        n = (len > __SYNCTORY_WRITER_MAXPENDING) ? __SYNCTORY_WRITER_MAXPENDING : len;
+        rval = __synctory_writer_room(writer, n, 0);
+        if (rval)
+            return rval;
+        
+        writer->segment[writer->segments].data = src;
+        writer->segment[writer->segments].len = n;
+        writer->segments++;
+        writer->pending += (_synctory_off_t)n;
+        src += n;
+        len -= n;
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Read len bytes starting at offset from fd straight into the writer's
+ * buffer. Amounts exceeding the buffer are copied into the file by
+ * _synctory_file64_bytecopy instead, mostly without leaving the kernel.
+ */
+int
+_synctory_writer_copy(_synctory_writer_t *writer, int fd, _synctory_off_t offset, _synctory_off_t len)
+{
+    int rval;
+    size_t n;
+    unsigned char *ptr;
+    
+    if (len > (_synctory_off_t)writer->size)
+    {
+        rval = _synctory_writer_flush(writer);
+        if (0 == rval)
+            rval = _synctory_file64_bytecopy(fd, writer->fd, offset, len);
+        if (0 == rval)
+            writer->base += len;
+        return rval;
+    }
+    
+    while (len > 0)
+    {
+        if (writer->len == writer->size)
+        {
+            rval = _synctory_writer_flush(writer);
+            if (rval)
+                return rval;
+        }
+        
+        n = writer->size - writer->len;
+        if ((_synctory_off_t)n > len)
+            n = (size_t)len;
+        
+        rval = _synctory_writer_stage(writer, n, &ptr);
+        if (0 == rval)
+            rval = _synctory_file64_readat(fd, ptr, n, offset);
+        if (rval)
+            return rval;
+        
+        offset += (_synctory_off_t)n;
+        len -= (_synctory_off_t)n;
+    }
+    
+    return 0;
+}
+
+
+/**
+ * Overwrite len bytes of output at the given file offset, which have been
+ * reserved by _synctory_writer_stage before. If they are still pending, the
+ * buffer is updated; otherwise they are written into the file.
+ */
+int
+_synctory_writer_patch(_synctory_writer_t *writer, _synctory_off_t offset, const void *data, size_t len)
+{
+    unsigned int i;
+    _synctory_off_t position = writer->base;
+    _synctory_writer_segment_t *s;
+    
+    if (offset < writer->base)
+        return _synctory_file64_writeat(writer->fd, data, len, offset);
+    
+    for (i = 0; i < writer->segments; i++)
+    {
+        s = &writer->segment[i];
+        if ((offset >= position) && (offset + (_synctory_off_t)len <= position + (_synctory_off_t)s->len))
+        {
+            /* only output inside the buffer may be altered */
+            if ((s->data < writer->buffer) || (s->data >= &writer->buffer[writer->size]))
+                return EINVAL;
+            memcpy(&writer->buffer[(s->data - writer->buffer) + (offset - position)], data, len);
+            return 0;
+        }
+        position += (_synctory_off_t)s->len;
+    }
+    
+    return EINVAL;
+}
+
+
+/**
+ * Take back len bytes of output at the given file offset, which have been
+ * reserved by _synctory_writer_stage before; the rest of their segment
+ * moves up. This is only possible as long as they are pending, so EAGAIN
+ * tells the caller to patch them instead.
+ */
+int
+_synctory_writer_drop(_synctory_writer_t *writer, _synctory_off_t offset, size_t len)
+{
+    unsigned int i;
+    size_t head;
+    _synctory_off_t position = writer->base;
+    _synctory_writer_segment_t *s;
+    
+    if (offset < writer->base)
+        return EAGAIN;
+    
+    for (i = 0; i < writer->segments; i++)
+    {
+        s = &writer->segment[i];
+        if ((offset >= position) && (offset + (_synctory_off_t)len <= position + (_synctory_off_t)s->len))
+        {
+            if ((s->data < writer->buffer) || (s->data >= &writer->buffer[writer->size]))
+                return EINVAL;
+            
+            /* space freed at the end of the used buffer can be used again */
+            head = (size_t)(offset - position);
+            if (__synctory_writer_adjacent(writer, s))
+                writer->len -= len;
+            memmove(&writer->buffer[(s->data - writer->buffer) + head], &s->data[head + len], s->len - head - len);
+            s->len -= len;
+            writer->pending -= (_synctory_off_t)len;
+            return 0;
+        }
+        position += (_synctory_off_t)s->len;
+    }
+    
+    return EINVAL;
+}
+
+
+/**
+ * Write all pending output
+ */
+int
+_synctory_writer_flush(_synctory_writer_t *writer)
+{
+    unsigned int i;
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_WRITEV_F)
+    unsigned int n = writer->segments;
+    struct iovec iov[_SYNCTORY_WRITER_SEGMENTS];
+    ssize_t wbytes;
+    
+    for (i = 0; i < n; i++)
+    {
+        iov[i].iov_base = (void *)writer->segment[i].data;
+        iov[i].iov_len = writer->segment[i].len;
+    }
+    
+    i = 0;
+    while (i < n)
+    {
+        wbytes = writev(writer->fd, &iov[i], (int)(n - i));
+        if (wbytes < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            return ((errno != 0) ? errno : -1);
+        }
+        if (0 == wbytes)
+            return -1;
+        
+        /* skip what has been written, which may end inside a segment */
+        while ((i < n) && ((size_t)wbytes >= iov[i].iov_len))
+        {
+            wbytes -= (ssize_t)iov[i].iov_len;
+            i++;
+        }
+        if (i < n)
+        {
+            iov[i].iov_base = (unsigned char *)iov[i].iov_base + wbytes;
+            iov[i].iov_len -= (size_t)wbytes;
+        }
+    }
+#else
+    int rval;
+    
+    for (i = 0; i < writer->segments; i++)
+    {
+        rval = _synctory_file64_write(writer->fd, writer->segment[i].data, writer->segment[i].len);
+        if (rval)
+            return rval;
+    }
+#endif
+
+    writer->base += writer->pending;
+    writer->pending = 0;
+    writer->segments = 0;
+    writer->len = 0;
+    return 0;
+}
+
+
+/**
+ * Release the writer's buffer; pending output is discarded
+ */
+void
+_synctory_writer_free(_synctory_writer_t *writer)
+{
+    free(writer->buffer);
+    writer->buffer = NULL;
+}
@@ -16,6 +16,8 @@
 
 
 #include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
@@ -23,6 +25,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "helpers.h"
@@ -40,8 +43,35 @@ int hlp_path_clean(const char *source, char *dest, size_t size)
     char *resptr;
     size_t cbytes = (((size-1) < hlp_path_maxlen()) ? (size-1) : hlp_path_maxlen());
     
+    char dirbuf[PATH_MAX + 1] = { '\0' };
+    char *sep;
+    size_t len;
+    
     resptr = realpath(source, auxbuf);
     
+    /* 
+     * Unlike BSD, glibc refuses to resolve a path whose last component
+     * does not exist yet; resolve the parent directory instead.
+     */
+    if ((NULL == resptr) && (ENOENT == errno) && (strlen(source) <= PATH_MAX))
+    {
+        strcpy(dirbuf, source);
+        sep = strrchr(dirbuf, '/');
+        if ((NULL != sep) && (sep != dirbuf) && ('\0' != sep[1]))
+        {
+            sep[0] = '\0';
+            resptr = realpath(dirbuf, auxbuf);
+            len = strlen(auxbuf);
+            if ((NULL != resptr) && ((len + strlen(&sep[1]) + 1) <= PATH_MAX))
+            {
+                auxbuf[len] = '/';
+                strcpy(&auxbuf[len + 1], &sep[1]);
+            }
+            else
+                resptr = NULL;
+        }
+    }
+    
     if (NULL == resptr)
         return errno;
     
@@ -201,7 +231,11 @@ int hlp_file_randmod(const char *path, unsigned int mod_amount, off_t *positions
     }
     
     /* determine positions to change */
+#ifdef __GLIBC__
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+#else
     sranddev();
+#endif
     for (i = 0; i < mod_amount; i++)
     {
         /*
@@ -297,6 +331,67 @@ int hlp_file_bincompare(const char* file1, const char* file2)
 }
 
 
+/*
+ * Connect a file to a pipe, or to a socket if sock is set, served by a
+ * child process. If feed is set, the child writes the contents of the file
+ * into it and fd receives the end to read from; otherwise, the child
+ * writes everything arriving at the end returned in fd to the file.
+ */
+int hlp_pipe_open(const char *path, int feed, int sock, int *fd, pid_t *child)
+{
+    int end[2];
+    int file, from, to;
+    ssize_t rbytes;
+    unsigned char buffer[HLP_CHUNK_SIZE];
+    
+    if ((sock ? socketpair(AF_UNIX, SOCK_STREAM, 0, end) : pipe(end)) != 0)
+        return ((errno != 0) ? errno : -1);
+    
+    *child = fork();
+    if (*child < 0)
+    {
+        close(end[0]);
+        close(end[1]);
+        return ((errno != 0) ? errno : -1);
+    }
+    
+    if (0 == *child)
+    {
+        close(feed ? end[0] : end[1]);
+        file = feed ? open(path, O_RDONLY) : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file < 0)
+            _exit(1);
+        from = feed ? file : end[0];
+        to = feed ? end[1] : file;
+        while ((rbytes = read(from, &buffer[0], HLP_CHUNK_SIZE)) > 0)
+        {
+            if (write(to, &buffer[0], (size_t)rbytes) != rbytes)
+                _exit(1);
+        }
+        _exit((rbytes < 0) ? 1 : 0);
+    }
+    
+    close(feed ? end[1] : end[0]);
+    *fd = feed ? end[0] : end[1];
+    return 0;
+}
+
+
+/*
+ * Close the end of a pipe returned by hlp_pipe_open and wait for the
+ * child serving it, which has to have succeeded
+ */
+int hlp_pipe_close(int fd, pid_t child)
+{
+    int status;
+    
+    close(fd);
+    if (waitpid(child, &status, 0) < 0)
+        return ((errno != 0) ? errno : -1);
+    return (WIFEXITED(status) && (0 == WEXITSTATUS(status))) ? 0 : -1;
+}
+
+
 void hlp_report_error(int error_no)
 {
     if (error_no > 0)
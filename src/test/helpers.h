@@ -20,6 +20,7 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #define HLP_CHUNK_SIZE  5120
 
@@ -47,6 +48,9 @@ int     hlp_file_bytecopy(const char *source, const char *destination, off_t siz
 int     hlp_file_randmod(const char *path, unsigned int mod_amount, off_t *positions, unsigned char *orig_chars, unsigned char *mod_chars);
 int     hlp_file_bincompare(const char* file1, const char* file2);
 
+int     hlp_pipe_open(const char *path, int feed, int sock, int *fd, pid_t *child);
+int     hlp_pipe_close(int fd, pid_t child);
+
 void    hlp_report_error(int error_no);
 
 #endif /* __SYNCTORY_TEST_HELPERS_ */
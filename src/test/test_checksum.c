@@ -0,0 +1,349 @@
+/*-
+ * Copyright (c) 2011 Daemotron <mail@daemotron.net>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <synctory.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "_blake3.h"
+#include "_checksum.h"
+
+#include "tests.h"
+#include "helpers.h"
+
+
+#define __TEST_CS_MAXLEN        300U
+#define __TEST_CS_OFFSETS       32U
+#define __TEST_CS_REGION        (__TEST_CS_MAXLEN + __TEST_CS_OFFSETS)
+#define __TEST_CS_REGIONS       3U
+#define __TEST_CS_RESULTS       (__TEST_CS_REGIONS * __TEST_CS_OFFSETS * (__TEST_CS_MAXLEN + 1) * 3)
+#define __TEST_CS_SCAN_SIZE     0x3000U
+#define __TEST_CS_SCAN_SLACK    300U
+#define __TEST_CS_VECTOR_SIZE   102400U
+
+
+/*
+ * Known answers of the strong checksums for the first len bytes of a
+ * test pattern
+ */
+typedef struct
+{
+    size_t len;
+    const char *digest;
+} __test_cs_vector_t;
+
+/*
+ * From the official BLAKE3 test vectors, whose input repeats the bytes
+ * 0 to 250
+ */
+static const __test_cs_vector_t __test_cs_blake3[] =
+{
+    { 0,        "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+    { 1,        "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+    { 1023,     "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+    { 1024,     "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+    { 1025,     "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+    { 2048,     "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+    { 2049,     "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030" },
+    { 8193,     "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+    { 31744,    "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47" },
+    { 102400,   "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+    { 0,        NULL }
+};
+
+/*
+ * XXH3-128 digests in canonical form, for the pattern of the sanity check
+ * of xxHash; the lengths cover each of its code paths
+ */
+static const __test_cs_vector_t __test_cs_xxh128[] =
+{
+    { 0,        "99aa06d3014798d86001c324468d497f" },
+    { 1,        "a6cd5e9392000f6ac44bdff4074eecdb" },
+    { 3,        "20efc49ff02422ea54247382a8d6b94d" },
+    { 4,        "970d585ac632bf8e2e7d8d6876a39fe9" },
+    { 8,        "47a7f080d82bb45664c69cab4bb21dc5" },
+    { 9,        "564ef6078950d457ed7ccbc501eb7501" },
+    { 16,       "c68c368ecf8a9c05562980258a998629" },
+    { 17,       "955fa78643ed3669abbc12d11973d7db" },
+    { 128,      "39992220e045260aebb15e34a7fb5ab1" },
+    { 129,      "03815fc91f1b30b686c9e3bc8f0a3b5c" },
+    { 240,      "aa4202daa2769dc85c9aae94c8ebe5a0" },
+    { 241,      "99a80ecf0ecfc647c5a639ecd2030e5e" },
+    { 1024,     "0d30d24071c64c57dd85c9b5c1109c5c" },
+    { 1025,     "fd3ee4fe7f2954c6d870c0fa13211c6a" },
+    { 102400,   "58c06459b9bac15a7d39d3fb51f10d26" },
+    { 0,        NULL }
+};
+
+
+/*
+ * Compute the weak checksum of every length up to __TEST_CS_MAXLEN at
+ * every start offset up to __TEST_CS_OFFSETS within each region of buffer,
+ * both in one go and through a checksum structure
+ */
+static void __test_checksum_weak(const unsigned char *buffer, uint32_t *result)
+{
+    unsigned int region, offset, len;
+    const unsigned char *start;
+    _synctory_checksum_t sum;
+    
+    for (region = 0; region < __TEST_CS_REGIONS; region++)
+    {
+        for (offset = 0; offset < __TEST_CS_OFFSETS; offset++)
+        {
+            start = &buffer[region * __TEST_CS_REGION + offset];
+            for (len = 0; len <= __TEST_CS_MAXLEN; len++)
+            {
+                _synctory_checksum_init(&sum);
+                _synctory_checksum_update(&sum, start, len);
+                *result++ = _synctory_weak_checksum(start, len);
+                *result++ = sum.s1;
+                *result++ = sum.s2;
+            }
+        }
+    }
+}
+
+
+/*
+ * Scan data with a window of width bytes the way the diff does, taking
+ * the weak checksums from a batch, and compare each of them with the
+ * checksum rotated byte by byte. The bytes available behind the window
+ * vary, so many batches are cut short, and windows whose checksum happens
+ * to end in six zero bits are treated as a match: the scan jumps behind
+ * them and starts over with a fresh checksum and an empty batch.
+ */
+static int __test_checksum_scan(const unsigned char *data, size_t size, uint32_t width)
+{
+    _synctory_checksum_t sum, ref;
+    _synctory_checksum_batch_t batch;
+    size_t pos = 0;
+    size_t available;
+    uint32_t digest;
+    
+    _synctory_checksum_init(&sum);
+    _synctory_checksum_update(&sum, data, width);
+    ref = sum;
+    _synctory_checksum_batch_reset(&batch);
+    
+    while (pos + width < size)
+    {
+        if (0 == (_synctory_checksum_digest(&ref) & 0x3f))
+        {
+            pos += width;
+            if (pos + width > size)
+                break;
+            _synctory_checksum_init(&sum);
+            _synctory_checksum_update(&sum, &data[pos], width);
+            ref = sum;
+            _synctory_checksum_batch_reset(&batch);
+            continue;
+        }
+        
+        pos++;
+        _synctory_checksum_rotate(&ref, data[pos - 1], data[pos + width - 1]);
+        available = width + (pos * 7919U) % __TEST_CS_SCAN_SLACK;
+        if (available > size - pos)
+            available = size - pos;
+        digest = _synctory_checksum_batch_next(&batch, &sum, data[pos - 1], &data[pos], available);
+        if (digest != _synctory_checksum_digest(&ref))
+            return -1;
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Compare the strong checksums computed with algo with the known answers
+ */
+static int __test_checksum_vectors(synctory_algo_t algo, const __test_cs_vector_t *vector, const unsigned char *data)
+{
+    unsigned char result[64];
+    char hex[129];
+    int size = _synctory_strong_checksum_size(algo);
+    int i, rval;
+    
+    for (; NULL != vector->digest; vector++)
+    {
+        rval = _synctory_strong_checksum(data, vector->len, result, algo);
+        if (rval)
+            return rval;
+        for (i = 0; i < size; i++)
+            sprintf(&hex[2 * i], "%02x", result[i]);
+        if (0 != strcmp(hex, vector->digest))
+            return -1;
+    }
+    
+    return 0;
+}
+
+
+void test_checksum(const test_ctx_t *ctx, int *status)
+{
+    unsigned char buffer[__TEST_CS_REGIONS * __TEST_CS_REGION];
+    uint32_t *expect = NULL, *result = NULL;
+    unsigned char *scan = NULL;
+    unsigned char *pattern = NULL;
+    uint64_t gen;
+    uint32_t width[] = { 1, 2, 31, 512, 2048 };
+    int rval = 0;
+    int kernel;
+    unsigned int i;
+    FILE *rnd;
+    const char *name[] = { "", "scalar code", "SSE4.1 kernel", "AVX2 kernel" };
+    
+    expect = (uint32_t *)malloc(__TEST_CS_RESULTS * sizeof(uint32_t));
+    result = (uint32_t *)malloc(__TEST_CS_RESULTS * sizeof(uint32_t));
+    scan = (unsigned char *)malloc(__TEST_CS_SCAN_SIZE);
+    pattern = (unsigned char *)malloc(__TEST_CS_VECTOR_SIZE);
+    if ((NULL == expect) || (NULL == result) || (NULL == scan) || (NULL == pattern))
+    {
+        *status = ENOMEM;
+        free(expect);
+        free(result);
+        free(scan);
+        free(pattern);
+        return;
+    }
+    
+    /* random bytes, random bytes with the high bit set, and all bits set */
+    printf("  preparing checksum test data                                         ");
+    fflush(stdout);
+    rnd = fopen(ctx->random_device, "rb");
+    if ((NULL == rnd) || (fread(buffer, 1, 2 * __TEST_CS_REGION, rnd) != 2 * __TEST_CS_REGION))
+        rval = -1;
+    else if (fread(scan, 1, __TEST_CS_SCAN_SIZE, rnd) != __TEST_CS_SCAN_SIZE)
+        rval = -1;
+    if (NULL != rnd)
+        fclose(rnd);
+    for (i = __TEST_CS_REGION; i < 2 * __TEST_CS_REGION; i++)
+        buffer[i] |= 0x80;
+    memset(&buffer[2 * __TEST_CS_REGION], 0xff, __TEST_CS_REGION);
+    if (rval)
+        printf("failed\n");
+    else
+        printf("success\n");
+    
+    if (0 == rval)
+    {
+        printf("\n  computing weak checksums with the scalar code                        ");
+        fflush(stdout);
+        rval = _synctory_checksum_select(_SYNCTORY_CHECKSUM_SCALAR);
+        if (0 == rval)
+            __test_checksum_weak(buffer, expect);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    /* every vector kernel has to agree with the scalar code */
+    for (kernel = _SYNCTORY_CHECKSUM_SSE41; (0 == rval) && (kernel <= _SYNCTORY_CHECKSUM_AVX2); kernel++)
+    {
+        printf("\n  comparing %s weak checksum kernel with the scalar code           ", (_SYNCTORY_CHECKSUM_SSE41 == kernel) ? "SSE4.1" : "AVX2  ");
+        fflush(stdout);
+        rval = _synctory_checksum_select(kernel);
+        if (0 == rval)
+        {
+            __test_checksum_weak(buffer, result);
+            if (0 != memcmp(expect, result, __TEST_CS_RESULTS * sizeof(uint32_t)))
+                rval = -1;
+        }
+        if (ENOTSUP == rval)
+        {
+            printf("n/a\n");
+            rval = 0;
+        }
+        else if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    /* batches of checksums rolled ahead have to match single rotations */
+    for (kernel = _SYNCTORY_CHECKSUM_SCALAR; (0 == rval) && (kernel <= _SYNCTORY_CHECKSUM_AVX2); kernel++)
+    {
+        printf("\n  comparing batched and rotated weak checksums, %-14s         ", name[kernel]);
+        fflush(stdout);
+        rval = _synctory_checksum_select(kernel);
+        for (i = 0; (0 == rval) && (i < sizeof(width) / sizeof(width[0])); i++)
+            rval = __test_checksum_scan(scan, __TEST_CS_SCAN_SIZE, width[i]);
+        if (ENOTSUP == rval)
+        {
+            printf("n/a\n");
+            rval = 0;
+        }
+        else if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    _synctory_checksum_select(_SYNCTORY_CHECKSUM_AUTO);
+    
+    /* each implementation of the BLAKE3 rounds has to yield the known answers */
+    for (kernel = _SYNCTORY_BLAKE3_PORTABLE; (0 == rval) && (kernel <= _SYNCTORY_BLAKE3_SSE41); kernel++)
+    {
+        printf("\n  checking BLAKE3 test vectors, %-8s rounds                        ", (_SYNCTORY_BLAKE3_SSE41 == kernel) ? "SSE4.1" : "portable");
+        fflush(stdout);
+        for (i = 0; i < __TEST_CS_VECTOR_SIZE; i++)
+            pattern[i] = (unsigned char)(i % 251);
+        rval = _synctory_blake3_select(kernel);
+        if (0 == rval)
+            rval = __test_checksum_vectors(synctory_algo_blake3, __test_cs_blake3, pattern);
+        if (ENOTSUP == rval)
+        {
+            printf("n/a\n");
+            rval = 0;
+        }
+        else if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    _synctory_blake3_select(_SYNCTORY_BLAKE3_AUTO);
+    
+    if (0 == rval)
+    {
+        printf("\n  checking XXH3-128 test vectors                                       ");
+        fflush(stdout);
+        gen = 2654435761U;
+        for (i = 0; i < __TEST_CS_VECTOR_SIZE; i++)
+        {
+            pattern[i] = (unsigned char)(gen >> 56);
+            gen *= 11400714785074694797ULL;
+        }
+        rval = __test_checksum_vectors(synctory_algo_xxh128, __test_cs_xxh128, pattern);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    free(expect);
+    free(result);
+    free(scan);
+    free(pattern);
+    
+    *status = rval;
+}
@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <time.h>
 #include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
 
 #include "tests.h"
 #include "helpers.h"
@@ -33,14 +35,22 @@
 
 void test_diff(const test_ctx_t *ctx, int *status)
 {
-    char *filename_o = NULL, *filename_m = NULL, *filename_fp = NULL, *filename_df = NULL, *filename_dl = NULL;
+    char *filename_o = NULL, *filename_m = NULL, *filename_fp = NULL, *filename_df = NULL, *filename_dl = NULL, *filename_dt = NULL, *filename_dp = NULL, *filename_di = NULL, *filename_ix = NULL;
     hlp_progress_t pgctx;
     size_t fnamesize;
     size_t fnamesize_fp;
     size_t fnamesize_df;
     size_t fnamesize_dl;
+    size_t fnamesize_dt;
+    size_t fnamesize_dp;
+    size_t fnamesize_di;
+    size_t fnamesize_ix;
     int rval;
     synctory_ctx_t sctx;
+    synctory_fpindex_t *fpindex = NULL;
+    synctory_fpindex_t *fpmapped = NULL;
+    struct stat st;
+    struct utimbuf times;
     off_t modpos[5];
     unsigned char obytes[5];
     unsigned char mbytes[5];
@@ -52,14 +62,22 @@ void test_diff(const test_ctx_t *ctx, int *status)
     fnamesize_fp = strlen(ctx->workdir) + 19;
     fnamesize_df = strlen(ctx->workdir) + 26;
     fnamesize_dl = strlen(ctx->workdir) + 27;
+    fnamesize_dt = strlen(ctx->workdir) + 28;
+    fnamesize_dp = strlen(ctx->workdir) + 26;
+    fnamesize_di = strlen(ctx->workdir) + 27;
+    fnamesize_ix = strlen(ctx->workdir) + 23;
     
     filename_o = (char *)malloc(fnamesize);
     filename_m = (char *)malloc(fnamesize);
     filename_fp = (char *)malloc(fnamesize_fp);
     filename_df = (char *)malloc(fnamesize_df);
     filename_dl = (char *)malloc(fnamesize_dl);
+    filename_dt = (char *)malloc(fnamesize_dt);
+    filename_dp = (char *)malloc(fnamesize_dp);
+    filename_di = (char *)malloc(fnamesize_di);
+    filename_ix = (char *)malloc(fnamesize_ix);
     
-    if ((NULL == filename_o) || (NULL == filename_m) || (NULL == filename_fp) || (NULL == filename_df) || (NULL == filename_dl))
+    if ((NULL == filename_o) || (NULL == filename_m) || (NULL == filename_fp) || (NULL == filename_df) || (NULL == filename_dl) || (NULL == filename_dt) || (NULL == filename_dp) || (NULL == filename_di) || (NULL == filename_ix))
     {
         *status = errno;
         free(filename_o);
@@ -67,6 +85,10 @@ void test_diff(const test_ctx_t *ctx, int *status)
         free(filename_fp);
         free(filename_df);
         free(filename_dl);
+        free(filename_dt);
+        free(filename_dp);
+        free(filename_di);
+        free(filename_ix);
         return;
     }
     
@@ -75,6 +97,10 @@ void test_diff(const test_ctx_t *ctx, int *status)
     hlp_path_join(ctx->workdir, "test_diff.orig.fp", filename_fp, fnamesize_fp);
     hlp_path_join(ctx->workdir, "test_diff.modf.diff_fast", filename_df, fnamesize_df);
     hlp_path_join(ctx->workdir, "test_diff.modf.diff_lomem", filename_dl, fnamesize_dl);
+    hlp_path_join(ctx->workdir, "test_diff.modf.diff_thread", filename_dt, fnamesize_dt);
+    hlp_path_join(ctx->workdir, "test_diff.modf.diff_pipe", filename_dp, fnamesize_dp);
+    hlp_path_join(ctx->workdir, "test_diff.modf.diff_index", filename_di, fnamesize_di);
+    hlp_path_join(ctx->workdir, "test_diff.orig.fp.idx", filename_ix, fnamesize_ix);
     
      /* prepare test file */
     hlp_progress_init(&pgctx);
@@ -120,18 +146,22 @@ void test_diff(const test_ctx_t *ctx, int *status)
     printf("\n  generating fast diff from fingerprint and modified file              ");
     fflush(stdout);
     start = clock();
-    rval = synctory_diff(-1, -1, -1, filename_m, filename_df, filename_fp);
+    rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_df, filename_fp);
     stop = clock();
     if (rval)
         printf("failed\n");
     else
         printf("success\n");
     printf("  => consumed %.2f seconds of CPU time\n", (float)(stop-start) / CLOCKS_PER_SEC);
+    printf("  => pre-filter hits: %llu, misses: %llu, false positives: %llu\n",
+        (unsigned long long)sctx.stats.filter_hits, (unsigned long long)sctx.stats.filter_misses, (unsigned long long)sctx.stats.index_misses);
+    printf("  => predicted matches: %llu, failed predictions: %llu\n",
+        (unsigned long long)sctx.stats.predict_hits, (unsigned long long)sctx.stats.predict_misses);
     
     printf("\n  generating lomem diff from fingerprint and modified file             ");
     fflush(stdout);
     start = clock();
-    rval = synctory_diff_lomem(-1, -1, -1, filename_m, filename_dl, filename_fp);
+    rval = synctory_diff_lomem_ctx(&sctx, -1, -1, -1, filename_m, filename_dl, filename_fp);
     stop = clock();
     if (rval)
         printf("failed\n");
@@ -147,6 +177,207 @@ void test_diff(const test_ctx_t *ctx, int *status)
     else
         printf("success\n");
     
+    if (0 == rval)
+    {
+        printf("\n  generating fast diff using 4 threads                                 ");
+        fflush(stdout);
+        sctx.threads = 4;
+        start = clock();
+        rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_dt, filename_fp);
+        stop = clock();
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+        printf("  => consumed %.2f seconds of CPU time\n", (float)(stop-start) / CLOCKS_PER_SEC);
+    }
+    
+    if (0 == rval)
+    {
+        printf("\n  comparing single-threaded and multi-threaded diff files              ");
+        fflush(stdout);
+        rval = hlp_file_bincompare(filename_df, filename_dt);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    if (0 == rval)
+    {
+        printf("\n  generating pipelined diff                                            ");
+        fflush(stdout);
+        start = clock();
+        rval = synctory_diff_pipelined(&sctx, -1, -1, -1, filename_m, filename_dp, filename_fp);
+        stop = clock();
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+        printf("  => consumed %.2f seconds of CPU time\n", (float)(stop-start) / CLOCKS_PER_SEC);
+    }
+    
+    if (0 == rval)
+    {
+        printf("\n  comparing fast and pipelined diff files                              ");
+        fflush(stdout);
+        rval = hlp_file_bincompare(filename_df, filename_dp);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    if (0 == rval)
+    {
+        printf("\n  loading fingerprint into memory                                      ");
+        fflush(stdout);
+        rval = synctory_fpindex_load(&fpindex, -1, filename_fp);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    if (0 == rval)
+    {
+        printf("\n  generating diffs from the loaded fingerprint                         ");
+        fflush(stdout);
+        start = clock();
+        rval = synctory_diff_with_index(&sctx, fpindex, -1, -1, filename_m, filename_di);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_df, filename_di);
+        if (0 == rval)
+            rval = synctory_diff_with_index(NULL, fpindex, -1, -1, filename_m, filename_di);
+        stop = clock();
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+        printf("  => consumed %.2f seconds of CPU time\n", (float)(stop-start) / CLOCKS_PER_SEC);
+    }
+    
+    if (0 == rval)
+    {
+        printf("\n  comparing fast and loaded fingerprint diff files                     ");
+        fflush(stdout);
+        rval = hlp_file_bincompare(filename_df, filename_di);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    if (0 == rval)
+    {
+        printf("\n  storing the fingerprint index in a sidecar                           ");
+        fflush(stdout);
+        rval = synctory_fpindex_save(fpindex, -1, filename_ix);
+        if (0 == rval)
+            rval = synctory_fpindex_map(&fpmapped, -1, -1, filename_fp, filename_ix);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    if (0 == rval)
+    {
+        printf("\n  generating diff from the mapped sidecar                              ");
+        fflush(stdout);
+        start = clock();
+        rval = synctory_diff_with_index(&sctx, fpmapped, -1, -1, filename_m, filename_di);
+        stop = clock();
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_df, filename_di);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+        printf("  => consumed %.2f seconds of CPU time\n", (float)(stop-start) / CLOCKS_PER_SEC);
+    }
+    
+    synctory_fpindex_free(fpmapped);
+    fpmapped = NULL;
+    
+    /* a sidecar must not be used once its fingerprint has been modified */
+    if (0 == rval)
+    {
+        printf("\n  detecting a stale sidecar                                            ");
+        fflush(stdout);
+        rval = stat(filename_fp, &st);
+        if (0 == rval)
+        {
+            times.actime = st.st_atime;
+            times.modtime = st.st_mtime - 60;
+            rval = utime(filename_fp, &times);
+        }
+        if ((0 == rval) && (ESTALE != synctory_fpindex_map(&fpmapped, -1, -1, filename_fp, filename_ix)))
+            rval = -1;
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    synctory_fpindex_free(fpmapped);
+    synctory_fpindex_free(fpindex);
+    
+    /* a budget just above the fixed buffers forces the fingerprint into slices */
+    if (0 == rval)
+    {
+        printf("\n  generating diff within a memory budget of 784 KiB                    ");
+        fflush(stdout);
+        sctx.memory_budget = 0xc4000ULL;
+        start = clock();
+        rval = synctory_diff_auto(&sctx, -1, -1, -1, filename_m, filename_di, filename_fp);
+        stop = clock();
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_df, filename_di);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+        printf("  => consumed %.2f seconds of CPU time\n", (float)(stop-start) / CLOCKS_PER_SEC);
+        printf("  => source file passes: %llu, peak RSS: %llu KiB\n",
+            (unsigned long long)sctx.stats.source_passes, (unsigned long long)(sctx.stats.peak_rss / 1024));
+    }
+    
+    if (0 == rval)
+    {
+        printf("\n  generating diff within a memory budget too small for slices          ");
+        fflush(stdout);
+        sctx.memory_budget = 1;
+        rval = synctory_diff_auto(&sctx, -1, -1, -1, filename_m, filename_di, filename_fp);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_df, filename_di);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    /* a raw record longer than the output buffer must not end up padded */
+    if (0 == rval)
+    {
+        printf("\n  comparing compact diffs of a file the fingerprint does not match    ");
+        fflush(stdout);
+        rval = hlp_file_bytecopy(ctx->random_device, filename_m, __TEST_DF_SFILE_SIZE / 4, NULL);
+        sctx.memory_budget = 0;
+        sctx.write_buffer = 0x4000U;
+        sctx.diff_format = synctory_diff_compact;
+        if (0 == rval)
+            rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_df, filename_fp);
+        if (0 == rval)
+            rval = synctory_diff_pipelined(&sctx, -1, -1, -1, filename_m, filename_dp, filename_fp);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_df, filename_dp);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
     if (ctx->cleanup)
     {
         unlink(filename_o);
@@ -154,10 +385,18 @@ void test_diff(const test_ctx_t *ctx, int *status)
         unlink(filename_fp);
         unlink(filename_df);
         unlink(filename_dl);
+        unlink(filename_dt);
+        unlink(filename_dp);
+        unlink(filename_di);
+        unlink(filename_ix);
     }
     
     free(filename_df);
     free(filename_dl);
+    free(filename_dt);
+    free(filename_dp);
+    free(filename_di);
+    free(filename_ix);
     free(filename_fp);
     free(filename_m);
     free(filename_o);
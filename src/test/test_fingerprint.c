@@ -38,6 +38,7 @@ void test_fingerprint(const test_ctx_t *ctx, int *status)
     size_t fnamesize;
     size_t fnamesize_fp;
     int rval;
+    int prval = 0;
     synctory_ctx_t sctx;
     
     fnamesize = strlen(ctx->workdir) + 15;
@@ -108,6 +109,19 @@ void test_fingerprint(const test_ctx_t *ctx, int *status)
         printf("failed\n");
     else
         printf("success\n");
+    
+    /* the huge file's fingerprint is written later on, so its name is free yet */
+    printf("  generating fingerprint of big test file using 4 threads              ");
+    fflush(stdout);
+    sctx.threads = 4;
+    prval = synctory_fingerprint(&sctx, -1, -1, lfile, hfile_fp);
+    if (0 == prval)
+        prval = hlp_file_bincompare(lfile_fp, hfile_fp);
+    sctx.threads = 1;
+    if (prval)
+        printf("failed\n");
+    else
+        printf("success\n");
 
     printf("  generating fingerprint of huge test file                             ");
     fflush(stdout);
@@ -133,5 +147,5 @@ void test_fingerprint(const test_ctx_t *ctx, int *status)
     free(sfile_fp);
     free(lfile_fp);
     free(hfile_fp);
-    *status = 0;
+    *status = prval;
 }
@@ -21,13 +21,197 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "tests.h"
 #include "helpers.h"
 
 
 #define __TEST_DF_SFILE_SIZE    0x7d000ULL      /* 512 KiB      */
+#define __TEST_SY_PREFIX_SIZE   1000U
+#define __TEST_SY_TOC_STRIDE    0x4000U
+#define __TEST_SY_RANGE_OFFSET  0x3e123U
+#define __TEST_SY_RANGE_SIZE    0x9876U
+#define __TEST_SY_INSERT_SIZE   0x30000U
+#define __TEST_SY_ZERO_SIZE     0x20000U
+
+
+/*
+ * Write a new file made of a few bytes not found in source, followed by
+ * source rotated by a quarter of its size. The blocks of source changing
+ * places then depend on each other cyclically when synthesized in place.
+ */
+static int __test_synth_rotate(const char *source, const char *dest)
+{
+    unsigned char *buffer;
+    size_t quarter = (size_t)(__TEST_DF_SFILE_SIZE / 4);
+    int rval = 0;
+    FILE *in, *out;
+    
+    buffer = (unsigned char *)malloc((size_t)__TEST_DF_SFILE_SIZE);
+    if (NULL == buffer)
+        return ((errno != 0) ? errno : -1);
+    memset(buffer, 0x5a, __TEST_SY_PREFIX_SIZE);
+    
+    in = fopen(source, "rb");
+    out = fopen(dest, "wb");
+    if ((NULL == in) || (NULL == out))
+        rval = ((errno != 0) ? errno : -1);
+    else if ((fwrite(buffer, 1, __TEST_SY_PREFIX_SIZE, out) != __TEST_SY_PREFIX_SIZE) || (fread(buffer, 1, (size_t)__TEST_DF_SFILE_SIZE, in) != (size_t)__TEST_DF_SFILE_SIZE))
+        rval = -1;
+    else if ((fwrite(&buffer[quarter], 1, (size_t)__TEST_DF_SFILE_SIZE - quarter, out) != (size_t)__TEST_DF_SFILE_SIZE - quarter) || (fwrite(buffer, 1, quarter, out) != quarter))
+        rval = -1;
+    
+    if (NULL != in)
+        fclose(in);
+    if ((NULL != out) && (0 != fclose(out)) && (0 == rval))
+        rval = -1;
+    free(buffer);
+    return rval;
+}
+
+
+/*
+ * Compare the len bytes of file starting at offset with the contents of
+ * part, which has to be exactly len bytes long
+ */
+static int __test_synth_compare_range(const char *file, long offset, const char *part, size_t len)
+{
+    unsigned char *buffer;
+    int rval = 0;
+    FILE *in, *sub;
+    
+    buffer = (unsigned char *)malloc(2 * len + 1);
+    if (NULL == buffer)
+        return ((errno != 0) ? errno : -1);
+    
+    in = fopen(file, "rb");
+    sub = fopen(part, "rb");
+    if ((NULL == in) || (NULL == sub))
+        rval = ((errno != 0) ? errno : -1);
+    else if ((0 != fseek(in, offset, SEEK_SET)) || (fread(buffer, 1, len, in) != len))
+        rval = -1;
+    else if ((fread(&buffer[len], 1, len + 1, sub) != len) || (0 != memcmp(buffer, &buffer[len], len)))
+        rval = -1;
+    
+    if (NULL != in)
+        fclose(in);
+    if (NULL != sub)
+        fclose(sub);
+    free(buffer);
+    return rval;
+}
+
+
+/*
+ * Write a new file made of source with __TEST_SY_INSERT_SIZE bytes of noise
+ * inserted in the middle, so its diff holds a raw record larger than the
+ * buffer synth reads the diff with
+ */
+static int __test_synth_insert(const char *source, const char *noise, const char *dest)
+{
+    unsigned char *buffer;
+    size_t half = (size_t)(__TEST_DF_SFILE_SIZE / 2);
+    int rval = 0;
+    FILE *in, *rnd, *out;
+    
+    buffer = (unsigned char *)malloc((size_t)__TEST_DF_SFILE_SIZE + __TEST_SY_INSERT_SIZE);
+    if (NULL == buffer)
+        return ((errno != 0) ? errno : -1);
+    
+    in = fopen(source, "rb");
+    rnd = fopen(noise, "rb");
+    out = fopen(dest, "wb");
+    if ((NULL == in) || (NULL == rnd) || (NULL == out))
+        rval = ((errno != 0) ? errno : -1);
+    else if ((fread(buffer, 1, half, in) != half) || (fread(&buffer[half], 1, __TEST_SY_INSERT_SIZE, rnd) != __TEST_SY_INSERT_SIZE))
+        rval = -1;
+    else if (fread(&buffer[half + __TEST_SY_INSERT_SIZE], 1, (size_t)__TEST_DF_SFILE_SIZE - half, in) != (size_t)__TEST_DF_SFILE_SIZE - half)
+        rval = -1;
+    else if (fwrite(buffer, 1, (size_t)__TEST_DF_SFILE_SIZE + __TEST_SY_INSERT_SIZE, out) != (size_t)__TEST_DF_SFILE_SIZE + __TEST_SY_INSERT_SIZE)
+        rval = -1;
+    
+    if (NULL != in)
+        fclose(in);
+    if (NULL != rnd)
+        fclose(rnd);
+    if ((NULL != out) && (0 != fclose(out)) && (0 == rval))
+        rval = -1;
+    free(buffer);
+    return rval;
+}
+
+
+/*
+ * Write a new file made of source with __TEST_SY_ZERO_SIZE zero bytes in
+ * front of it, in its middle and behind it
+ */
+static int __test_synth_zeros(const char *source, const char *dest)
+{
+    unsigned char *buffer;
+    size_t half = (size_t)(__TEST_DF_SFILE_SIZE / 2);
+    size_t size = (size_t)__TEST_DF_SFILE_SIZE + 3 * __TEST_SY_ZERO_SIZE;
+    int rval = 0;
+    FILE *in, *out;
+    
+    buffer = (unsigned char *)calloc(1, size);
+    if (NULL == buffer)
+        return ((errno != 0) ? errno : -1);
+    
+    in = fopen(source, "rb");
+    out = fopen(dest, "wb");
+    if ((NULL == in) || (NULL == out))
+        rval = ((errno != 0) ? errno : -1);
+    else if (fread(&buffer[__TEST_SY_ZERO_SIZE], 1, half, in) != half)
+        rval = -1;
+    else if (fread(&buffer[2 * __TEST_SY_ZERO_SIZE + half], 1, (size_t)__TEST_DF_SFILE_SIZE - half, in) != (size_t)__TEST_DF_SFILE_SIZE - half)
+        rval = -1;
+    else if (fwrite(buffer, 1, size, out) != size)
+        rval = -1;
+    
+    if (NULL != in)
+        fclose(in);
+    if ((NULL != out) && (0 != fclose(out)) && (0 == rval))
+        rval = -1;
+    free(buffer);
+    return rval;
+}
+
+
+/*
+ * Synthesize into a pipe, or a socket if sock is set, which a child
+ * process drains into dest. If piped is set, the diff is fed through
+ * another one as well.
+ */
+static int __test_synth_piped(const char *source, const char *diff, const char *dest, int piped, int sock)
+{
+    int rval = 0;
+    int fddiff = -1;
+    int fddest;
+    pid_t feeder = -1;
+    pid_t drain;
+    
+    /* the feeder is started first, so it does not hold the other pipe open */
+    if (piped)
+        rval = hlp_pipe_open(diff, 1, sock, &fddiff, &feeder);
+    if (rval)
+        return rval;
+    rval = hlp_pipe_open(dest, 0, sock, &fddest, &drain);
+    if (rval)
+    {
+        hlp_pipe_close(fddiff, feeder);
+        return rval;
+    }
+    
+    rval = synctory_synth(-1, fddest, fddiff, source, NULL, piped ? NULL : diff);
+    if ((feeder > 0) && hlp_pipe_close(fddiff, feeder) && (0 == rval))
+        rval = -1;
+    if (hlp_pipe_close(fddest, drain) && (0 == rval))
+        rval = -1;
+    return rval;
+}
 
 
 void test_synth(const test_ctx_t *ctx, int *status)
@@ -38,7 +222,10 @@ void test_synth(const test_ctx_t *ctx, int *status)
     size_t fnamesize_fp;
     size_t fnamesize_df;
     int rval;
+    int codec;
+    int algo;
     synctory_ctx_t sctx;
+    struct stat st;
     off_t modpos[5];
     unsigned char obytes[5];
     unsigned char mbytes[5];
@@ -137,6 +324,198 @@ void test_synth(const test_ctx_t *ctx, int *status)
     else
         printf("success\n");
     
+    /* the compact diff format has to be understood as well */
+    if (0 == rval)
+    {
+        printf("\n  generating compact format diff from fingerprint and modified file    ");
+        fflush(stdout);
+        sctx.diff_format = synctory_diff_compact;
+        rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_df, filename_fp);
+        if (0 == rval)
+            rval = synctory_synth(-1, -1, -1, filename_o, filename_sy, filename_df);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    /* several threads have to synthesize the same file */
+    if (0 == rval)
+    {
+        printf("\n  synthesizing from diff using 4 threads                               ");
+        fflush(stdout);
+        sctx.threads = 4;
+        rval = synctory_synth_parallel(&sctx, -1, -1, -1, filename_o, filename_sy, filename_df);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    /* round trip with compressed raw data, for each codec compiled in */
+    for (codec = synctory_codec_zlib; (0 == rval) && (codec <= synctory_codec_lzma); codec++)
+    {
+        printf("\n  synthesizing from diff with %s compressed raw data                  ", (synctory_codec_zlib == codec) ? "zlib" : "lzma");
+        fflush(stdout);
+        sctx.diff_format = synctory_diff_compact;
+        sctx.codec = (synctory_codec_t)codec;
+        rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_df, filename_fp);
+        if (0 == rval)
+            rval = synctory_synth(-1, -1, -1, filename_o, filename_sy, filename_df);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (ENOTSUP == rval)
+        {
+            printf("n/a\n");
+            rval = 0;
+        }
+        else if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    /* in-place synth of a copy of the original file */
+    if (0 == rval)
+    {
+        printf("\n  synthesizing in place from diff and copy of original file            ");
+        fflush(stdout);
+        sctx.codec = synctory_codec_none;
+        rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_df, filename_fp);
+        if (0 == rval)
+            rval = hlp_file_bytecopy(filename_o, filename_sy, __TEST_DF_SFILE_SIZE, NULL);
+        if (0 == rval)
+            rval = synctory_synth_inplace(-1, -1, filename_sy, filename_df);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    /* blocks of the original file swapping places have to be buffered */
+    if (0 == rval)
+    {
+        printf("\n  synthesizing in place from diff with rotated and shifted blocks      ");
+        fflush(stdout);
+        rval = __test_synth_rotate(filename_o, filename_m);
+        if (0 == rval)
+            rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_df, filename_fp);
+        if (0 == rval)
+            rval = hlp_file_bytecopy(filename_o, filename_sy, __TEST_DF_SFILE_SIZE, NULL);
+        if (0 == rval)
+            rval = synctory_synth_inplace(-1, -1, filename_sy, filename_df);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    /* a part of the file, found through the table of contents of the diff */
+    if (0 == rval)
+    {
+        printf("\n  synthesizing a range from diff with table of contents                ");
+        fflush(stdout);
+        sctx.toc_stride = __TEST_SY_TOC_STRIDE;
+        rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_df, filename_fp);
+        if (0 == rval)
+            rval = synctory_synth_range(-1, -1, -1, filename_o, filename_sy, filename_df, __TEST_SY_RANGE_OFFSET, __TEST_SY_RANGE_SIZE);
+        if (0 == rval)
+            rval = __test_synth_compare_range(filename_m, (long)__TEST_SY_RANGE_OFFSET, filename_sy, __TEST_SY_RANGE_SIZE);
+        if (0 == rval)
+            rval = synctory_synth(-1, -1, -1, filename_o, filename_sy, filename_df);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    /* round trip with fingerprints using the fast strong checksum algorithms */
+    for (algo = synctory_algo_blake3; (0 == rval) && (algo <= synctory_algo_xxh128); algo += 0x10)
+    {
+        printf("\n  synthesizing from diff with %s fingerprint                     ", (synctory_algo_blake3 == algo) ? "BLAKE3  " : "XXH3-128");
+        fflush(stdout);
+        sctx.toc_stride = 0;
+        sctx.checksum_algorithm = (synctory_algo_t)algo;
+        rval = synctory_fingerprint(&sctx, -1, -1, filename_o, filename_fp);
+        if (0 == rval)
+            rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_df, filename_fp);
+        if (0 == rval)
+            rval = synctory_synth(-1, -1, -1, filename_o, filename_sy, filename_df);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
+    /* zero blocks of raw data are left as holes of the synthesized file */
+    if (0 == rval)
+    {
+        printf("\n  synthesizing a file with zero regions at start, middle and end       ");
+        fflush(stdout);
+        rval = __test_synth_zeros(filename_o, filename_m);
+        if (0 == rval)
+            rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_df, filename_fp);
+        if (0 == rval)
+            unlink(filename_sy);
+        if (0 == rval)
+            rval = synctory_synth(-1, -1, -1, filename_o, filename_sy, filename_df);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (0 == rval)
+            rval = stat(filename_sy, &st);
+        if ((0 == rval) && (st.st_size != (off_t)(__TEST_DF_SFILE_SIZE + 3 * __TEST_SY_ZERO_SIZE)))
+            rval = -1;
+        
+        /* at least a region's worth of space has to be saved */
+        if ((0 == rval) && ((off_t)st.st_blocks * 512 > st.st_size - (off_t)__TEST_SY_ZERO_SIZE))
+            rval = -1;
+        if (rval)
+            printf("failed\n");
+        else
+        {
+            printf("success\n");
+            printf("  => %lld of %lld bytes allocated\n", (long long)st.st_blocks * 512, (long long)st.st_size);
+        }
+    }
+    
+    /* the copy engines behind synth have to cope with pipes and sockets */
+    if (0 == rval)
+    {
+        printf("\n  synthesizing through pipes and sockets                               ");
+        fflush(stdout);
+        rval = __test_synth_insert(filename_o, ctx->random_device, filename_m);
+        if (0 == rval)
+            rval = synctory_diff_ctx(&sctx, -1, -1, -1, filename_m, filename_df, filename_fp);
+        if (0 == rval)
+            rval = __test_synth_piped(filename_o, filename_df, filename_sy, 0, 0);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (0 == rval)
+            rval = __test_synth_piped(filename_o, filename_df, filename_sy, 1, 0);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (0 == rval)
+            rval = __test_synth_piped(filename_o, filename_df, filename_sy, 1, 1);
+        if (0 == rval)
+            rval = hlp_file_bincompare(filename_m, filename_sy);
+        if (rval)
+            printf("failed\n");
+        else
+            printf("success\n");
+    }
+    
     if (ctx->cleanup)
     {
         unlink(filename_o);
@@ -33,6 +33,7 @@ void test_version(const test_ctx_t *ctx, int *status);
 void test_fingerprint(const test_ctx_t *ctx, int *status);
 void test_diff(const test_ctx_t *ctx, int *status);
 void test_synth(const test_ctx_t *ctx, int *status);
+void test_checksum(const test_ctx_t *ctx, int *status);
 void test_performance(const test_ctx_t *ctx, int *status);
 
 